@@ -0,0 +1,1024 @@
+#include "connection.h"
+#include "contentfilter.h"
+#include "framecompress.h"
+#include "history.h"
+#include "linescan.h"
+#include "searchindex.h"
+#include "session.h"
+#include "sharedring.h"
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <malloc.h>
+#include <memory>
+#include <new>
+#include <psapi.h>
+#include <random>
+
+// Heap bytes held by the whole process, counted in every replacement form of operator
+// new and delete below. The search index, content filter and snapshot code start threads
+// of their own, so the count is atomic. What is counted is the size the CRT reports for
+// each block, which is what the block really costs.
+static atomic<size_t> allocatedBytes(0);
+
+namespace {
+
+bool overAligned(size_t alignment) {
+    return alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+}
+
+void* countedAllocate(size_t size, size_t alignment) {
+    size = max<size_t>(size, 1);
+    void* block = overAligned(alignment) ? _aligned_malloc(size, alignment) : malloc(size);
+    if (block != nullptr) {
+        allocatedBytes.fetch_add(overAligned(alignment) ? _aligned_msize(block, alignment, 0) : _msize(block), memory_order_relaxed);
+    }
+    return block;
+}
+
+void* countedAllocateOrThrow(size_t size, size_t alignment) {
+    void* block = countedAllocate(size, alignment);
+    if (block == nullptr) {
+        throw bad_alloc();
+    }
+    return block;
+}
+
+void countedFree(void* block, size_t alignment) {
+    if (block == nullptr) {
+        return;
+    }
+    if (overAligned(alignment)) {
+        allocatedBytes.fetch_sub(_aligned_msize(block, alignment, 0), memory_order_relaxed);
+        _aligned_free(block);
+    } else {
+        allocatedBytes.fetch_sub(_msize(block), memory_order_relaxed);
+        free(block);
+    }
+}
+
+}
+
+void* operator new(size_t size) { return countedAllocateOrThrow(size, 0); }
+void* operator new[](size_t size) { return countedAllocateOrThrow(size, 0); }
+void* operator new(size_t size, const nothrow_t&) noexcept { return countedAllocate(size, 0); }
+void* operator new[](size_t size, const nothrow_t&) noexcept { return countedAllocate(size, 0); }
+void* operator new(size_t size, align_val_t alignment) { return countedAllocateOrThrow(size, static_cast<size_t>(alignment)); }
+void* operator new[](size_t size, align_val_t alignment) { return countedAllocateOrThrow(size, static_cast<size_t>(alignment)); }
+void* operator new(size_t size, align_val_t alignment, const nothrow_t&) noexcept { return countedAllocate(size, static_cast<size_t>(alignment)); }
+void* operator new[](size_t size, align_val_t alignment, const nothrow_t&) noexcept { return countedAllocate(size, static_cast<size_t>(alignment)); }
+
+void operator delete(void* pointer) noexcept { countedFree(pointer, 0); }
+void operator delete[](void* pointer) noexcept { countedFree(pointer, 0); }
+void operator delete(void* pointer, size_t) noexcept { countedFree(pointer, 0); }
+void operator delete[](void* pointer, size_t) noexcept { countedFree(pointer, 0); }
+void operator delete(void* pointer, const nothrow_t&) noexcept { countedFree(pointer, 0); }
+void operator delete[](void* pointer, const nothrow_t&) noexcept { countedFree(pointer, 0); }
+void operator delete(void* pointer, align_val_t alignment) noexcept { countedFree(pointer, static_cast<size_t>(alignment)); }
+void operator delete[](void* pointer, align_val_t alignment) noexcept { countedFree(pointer, static_cast<size_t>(alignment)); }
+void operator delete(void* pointer, size_t, align_val_t alignment) noexcept { countedFree(pointer, static_cast<size_t>(alignment)); }
+void operator delete[](void* pointer, size_t, align_val_t alignment) noexcept { countedFree(pointer, static_cast<size_t>(alignment)); }
+void operator delete(void* pointer, align_val_t alignment, const nothrow_t&) noexcept { countedFree(pointer, static_cast<size_t>(alignment)); }
+void operator delete[](void* pointer, align_val_t alignment, const nothrow_t&) noexcept { countedFree(pointer, static_cast<size_t>(alignment)); }
+
+const size_t IDLE_CONNECTION_TARGET_BYTES = 2048;
+
+size_t processPrivateBytes() {
+    PROCESS_MEMORY_COUNTERS_EX counters;
+    counters.cb = sizeof(counters);
+    GetProcessMemoryInfo(GetCurrentProcess(), reinterpret_cast<PROCESS_MEMORY_COUNTERS*>(&counters), sizeof(counters));
+    return counters.PrivateUsage;
+}
+
+double elapsedNanoseconds(chrono::steady_clock::time_point start) {
+    return static_cast<double>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+}
+
+// Stands in for the server's HandlingSocket, which the bench cannot link: the same
+// awaiters with the same locals live across them, so its frame is the size of the one
+// every connection owns while it waits for a line.
+SessionTask idleSessionMain(ConnectionTable& table, uint32_t index) {
+    while (table[index].phase == PHASE_CHAT) {
+        optional<string_view> frame = co_await readFrame(table, index);
+        if (!frame) {
+            break;
+        }
+        if (!co_await outputDrained(table, index)) {
+            break;
+        }
+    }
+}
+
+// Server-side user-space memory held by an idle, fully negotiated connection: the slab
+// record, its interned nickname, its session coroutine's frame and the poll entry the
+// event loop builds for it. Kernel socket buffers are not included.
+bool benchIdleConnectionFootprint(size_t connectionCount) {
+    size_t before = allocatedBytes.load();
+    {
+        ConnectionTable table;
+        for (size_t i = 0; i < connectionCount; ++i) {
+            uint32_t index = table.add(static_cast<SOCKET>(i + 1));
+            table[index].nicknameId = table.nicknames.intern("user" + to_string(i));
+            table[index].phase = PHASE_CHAT;
+            idleSessionMain(table, index);
+        }
+
+        // A burst of partial lines borrows buffers, then every connection goes idle again.
+        for (uint32_t i = 0; i < table.slotCount(); ++i) {
+            table[i].pendingInput = table.recvBuffers.acquire();
+        }
+        for (uint32_t i = 0; i < table.slotCount(); ++i) {
+            table.recvBuffers.release(table[i].pendingInput);
+            table[i].pendingInput = nullptr;
+        }
+
+        size_t pollEntryBytes = sizeof(WSAPOLLFD) + sizeof(uint32_t);
+        size_t heldBytes = allocatedBytes.load() - before + pollEntryBytes * connectionCount;
+        double perConnection = static_cast<double>(heldBytes) / connectionCount;
+
+        cout << "idle connection footprint: " << connectionCount << " connections, "
+             << heldBytes << " bytes, " << perConnection << " bytes/connection (target "
+             << IDLE_CONNECTION_TARGET_BYTES << ")" << endl;
+        for (uint32_t i = 0; i < table.slotCount(); ++i) {
+            table[i].session.destroy();
+        }
+        if (perConnection > IDLE_CONNECTION_TARGET_BYTES) {
+            cerr << "idle connection footprint is over target" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+struct ThreadSession {
+    mutex stateMutex;
+    condition_variable wake;
+    condition_variable handled;
+    bool pending = false;
+    bool stop = false;
+};
+
+// The old model: one thread per connection, parked in a blocking call until its
+// socket has data. Waking one is a cross-thread signal plus a context switch.
+void threadSessionMain(ThreadSession* session) {
+    unique_lock<mutex> lock(session->stateMutex);
+    while (true) {
+        session->wake.wait(lock, [session] { return session->pending || session->stop; });
+        if (session->stop) {
+            break;
+        }
+        session->pending = false;
+        session->handled.notify_one();
+    }
+}
+
+struct ParkedSession {
+    coroutine_handle<> handle;
+    bool stop;
+};
+
+struct ParkAwaiter {
+    ParkedSession& session;
+    bool await_ready() { return false; }
+    void await_suspend(coroutine_handle<> handle) { session.handle = handle; }
+    void await_resume() {}
+};
+
+// The event-loop model: one suspended coroutine per connection, resumed in place by
+// the loop thread when its socket is ready.
+SessionTask parkedSessionMain(ParkedSession& session) {
+    while (true) {
+        co_await ParkAwaiter{session};
+        if (session.stop) {
+            break;
+        }
+    }
+}
+
+void benchSessionModels(size_t sessionCount) {
+    const size_t wakeups = 10000;
+
+    {
+        size_t privateBefore = processPrivateBytes();
+        vector<unique_ptr<ThreadSession>> sessions;
+        vector<thread> threads;
+        for (size_t i = 0; i < sessionCount; ++i) {
+            sessions.emplace_back(new ThreadSession());
+            threads.emplace_back(threadSessionMain, sessions.back().get());
+        }
+        size_t privateAfter = processPrivateBytes();
+
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < wakeups; ++i) {
+            ThreadSession& session = *sessions[i % sessionCount];
+            unique_lock<mutex> lock(session.stateMutex);
+            session.pending = true;
+            session.wake.notify_one();
+            session.handled.wait(lock, [&session] { return !session.pending; });
+        }
+        double wakeNanoseconds = elapsedNanoseconds(start) / wakeups;
+
+        for (size_t i = 0; i < sessionCount; ++i) {
+            lock_guard<mutex> lock(sessions[i]->stateMutex);
+            sessions[i]->stop = true;
+            sessions[i]->wake.notify_one();
+        }
+        for (thread& worker : threads) {
+            worker.join();
+        }
+
+        cout << "thread-per-connection: " << sessionCount << " sessions, "
+             << static_cast<double>(privateAfter - privateBefore) / sessionCount << " private bytes/session, "
+             << wakeNanoseconds << " ns per wakeup" << endl;
+    }
+
+    {
+        size_t privateBefore = processPrivateBytes();
+        size_t allocatedBefore = allocatedBytes.load();
+        vector<ParkedSession> sessions(sessionCount);
+        for (size_t i = 0; i < sessionCount; ++i) {
+            sessions[i].stop = false;
+            parkedSessionMain(sessions[i]);
+        }
+        size_t privateAfter = processPrivateBytes();
+        size_t allocatedAfter = allocatedBytes.load();
+
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < wakeups; ++i) {
+            sessions[i % sessionCount].handle.resume();
+        }
+        double wakeNanoseconds = elapsedNanoseconds(start) / wakeups;
+
+        for (size_t i = 0; i < sessionCount; ++i) {
+            sessions[i].stop = true;
+            sessions[i].handle.resume();
+        }
+
+        cout << "coroutine sessions: " << sessionCount << " sessions, "
+             << static_cast<double>(privateAfter - privateBefore) / sessionCount << " private bytes/session ("
+             << static_cast<double>(allocatedAfter - allocatedBefore) / sessionCount << " heap), "
+             << wakeNanoseconds << " ns per wakeup" << endl;
+    }
+}
+
+// The server's trim before the line scanner, kept here as the baseline.
+string copyingTrim(const string& str) {
+    size_t first = str.find_first_not_of(" \n\r\t");
+    if (string::npos == first) {
+        return "";
+    }
+    size_t last = str.find_last_not_of(" \n\r\t");
+    return str.substr(first, (last - first + 1));
+}
+
+// Pipelined chat traffic: mostly short lines, a tail of long pastes up to the 1 KB
+// frame limit, some sent with "\r\n" and some padded with spaces or tabs.
+string makeChatTraffic(size_t lineCount) {
+    mt19937 random(8580);
+    uniform_int_distribution<int> percent(0, 99);
+    string traffic;
+    for (size_t i = 0; i < lineCount; ++i) {
+        int bucket = percent(random);
+        size_t length = bucket < 70 ? 8 + random() % 52 : bucket < 95 ? 60 + random() % 140 : 200 + random() % 800;
+        if (percent(random) < 10) {
+            traffic.append(1 + random() % 24, percent(random) < 50 ? ' ' : '\t');
+        }
+        for (size_t j = 0; j < length; ++j) {
+            traffic += j % 6 == 5 ? ' ' : static_cast<char>('a' + random() % 26);
+        }
+        if (percent(random) < 10) {
+            traffic.append(1 + random() % 24, ' ');
+        }
+        traffic += percent(random) < 30 ? "\r\n" : "\n";
+    }
+    return traffic;
+}
+
+bool benchLineScanning(size_t lineCount) {
+    string traffic = makeChatTraffic(lineCount);
+    const size_t rounds = 20;
+
+    size_t copyingChecksum = 0;
+    vector<string> copyingLines;
+    auto start = chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; ++round) {
+        size_t offset = 0;
+        size_t newline;
+        while ((newline = traffic.find('\n', offset)) != string::npos) {
+            string line = copyingTrim(traffic.substr(offset, newline - offset));
+            copyingChecksum += line.length();
+            if (round == 0) {
+                copyingLines.push_back(line);
+            }
+            offset = newline + 1;
+        }
+    }
+    double copyingNanoseconds = elapsedNanoseconds(start) / (rounds * lineCount);
+
+    size_t scannerChecksum = 0;
+    size_t mismatches = 0;
+    start = chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; ++round) {
+        LineScanner scanner(traffic.data(), traffic.length());
+        string_view line;
+        size_t lineIndex = 0;
+        while (scanner.next(line)) {
+            scannerChecksum += line.length();
+            if (round == 0 && (lineIndex >= copyingLines.size() || copyingLines[lineIndex] != line)) {
+                mismatches++;
+            }
+            lineIndex++;
+        }
+    }
+    double scannerNanoseconds = elapsedNanoseconds(start) / (rounds * lineCount);
+
+    double averageLength = static_cast<double>(traffic.length()) / lineCount;
+    cout << "line scanning: " << lineCount << " lines, " << averageLength << " bytes/line average" << endl;
+    cout << "  find + substr + trim: " << copyingNanoseconds << " ns/line, "
+         << averageLength / copyingNanoseconds * 1000 << " MB/s" << endl;
+    cout << "  LineScanner (" << LineScanInstructionSet() << "): " << scannerNanoseconds << " ns/line, "
+         << averageLength / scannerNanoseconds * 1000 << " MB/s" << endl;
+    if (mismatches != 0 || copyingChecksum != scannerChecksum) {
+        cerr << "line scanner disagrees with trim on " << mismatches << " lines" << endl;
+        return false;
+    }
+    return true;
+}
+
+struct LoopbackPair {
+    SOCKET sender;
+    SOCKET receiver;
+};
+
+// Connected, non-blocking loopback sockets: the sender plays the server's side of a
+// member connection and the receiver the client's. Stops early if the system runs
+// out of sockets; the caller benchmarks with however many it got.
+vector<LoopbackPair> openLoopbackPairs(size_t count) {
+    vector<LoopbackPair> pairs;
+    SOCKET listener = CreateTCPIPv4Socket();
+    sockaddr_in address = CreateIPv4Address("127.0.0.1", 0);
+    int addressSize = sizeof(address);
+    if (listener == INVALID_SOCKET ||
+        bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR ||
+        listen(listener, SOMAXCONN) == SOCKET_ERROR ||
+        getsockname(listener, reinterpret_cast<sockaddr*>(&address), &addressSize) == SOCKET_ERROR) {
+        cerr << "loopback listener failed with error: " << WSAGetLastError() << endl;
+        closesocket(listener);
+        return pairs;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        LoopbackPair pair;
+        pair.receiver = CreateTCPIPv4Socket();
+        if (pair.receiver == INVALID_SOCKET ||
+            connect(pair.receiver, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR) {
+            closesocket(pair.receiver);
+            break;
+        }
+        pair.sender = accept(listener, nullptr, nullptr);
+        if (pair.sender == INVALID_SOCKET) {
+            closesocket(pair.receiver);
+            break;
+        }
+
+        u_long nonBlocking = 1;
+        ioctlsocket(pair.sender, FIONBIO, &nonBlocking);
+        ioctlsocket(pair.receiver, FIONBIO, &nonBlocking);
+        pairs.push_back(pair);
+    }
+    closesocket(listener);
+    return pairs;
+}
+
+// One end of a local transport, as a co-located publisher would use it. Both calls block:
+// write until everything is in, read until something has arrived.
+class LocalChannelEnd {
+public:
+    virtual ~LocalChannelEnd() {}
+    virtual void write(const char* data, size_t length) = 0;
+    virtual size_t read(char* data, size_t capacity) = 0;
+};
+
+void waitForSocket(SOCKET socketFD, bool forWrite) {
+    fd_set ready;
+    FD_ZERO(&ready);
+    FD_SET(socketFD, &ready);
+    select(static_cast<int>(socketFD + 1), forWrite ? nullptr : &ready, forWrite ? &ready : nullptr, nullptr, nullptr);
+}
+
+class SocketChannelEnd : public LocalChannelEnd {
+public:
+    explicit SocketChannelEnd(SOCKET socketFD) : socketFD(socketFD) {}
+
+    void write(const char* data, size_t length) override {
+        while (length > 0) {
+            int bytesSent = send(socketFD, data, static_cast<int>(length), 0);
+            if (bytesSent == SOCKET_ERROR) {
+                waitForSocket(socketFD, true);
+                continue;
+            }
+            data += bytesSent;
+            length -= bytesSent;
+        }
+    }
+
+    size_t read(char* data, size_t capacity) override {
+        while (true) {
+            int bytesReceived = recv(socketFD, data, static_cast<int>(capacity), 0);
+            if (bytesReceived > 0) {
+                return bytesReceived;
+            }
+            if (bytesReceived == 0) {
+                return 0;
+            }
+            waitForSocket(socketFD, false);
+        }
+    }
+
+private:
+    SOCKET socketFD;
+};
+
+// The same waiting protocol as the server and engine use: arm, re-check, then sleep on
+// the doorbell socket; ring the other side only when its flag is up.
+class RingChannelEnd : public LocalChannelEnd {
+public:
+    RingChannelEnd(SharedRing& outbound, SharedRing& inbound, SOCKET doorbell)
+        : outbound(outbound), inbound(inbound), doorbell(doorbell) {}
+
+    void write(const char* data, size_t length) override {
+        while (length > 0) {
+            size_t written = outbound.write(data, length);
+            if (written != 0) {
+                if (outbound.takeConsumerWaiting()) {
+                    RingDoorbell(doorbell);
+                }
+                data += written;
+                length -= written;
+            } else if (!outbound.armProducer()) {
+                waitForSocket(doorbell, false);
+                DrainDoorbell(doorbell);
+            }
+        }
+    }
+
+    size_t read(char* data, size_t capacity) override {
+        while (true) {
+            size_t bytesReceived = inbound.read(data, capacity);
+            if (bytesReceived != 0) {
+                if (inbound.takeProducerWaiting()) {
+                    RingDoorbell(doorbell);
+                }
+                return bytesReceived;
+            }
+            if (!inbound.armConsumer()) {
+                waitForSocket(doorbell, false);
+                if (!DrainDoorbell(doorbell)) {
+                    return 0;
+                }
+            }
+        }
+    }
+
+private:
+    SharedRing& outbound;
+    SharedRing& inbound;
+    SOCKET doorbell;
+};
+
+// A connected AF_UNIX pair through a listener on a scratch path.
+bool openUnixPair(LoopbackPair& pair) {
+    SocketEndpoint endpoint;
+    endpoint.family = AF_UNIX;
+    endpoint.host = "chatbench-" + to_string(chrono::steady_clock::now().time_since_epoch().count()) + ".sock";
+    sockaddr_storage address;
+    int addressLength = CreateEndpointAddress(endpoint, address);
+
+    SOCKET listener = CreateStreamSocket(endpoint);
+    bool ok = listener != INVALID_SOCKET && addressLength != 0 &&
+              bind(listener, reinterpret_cast<const sockaddr*>(&address), addressLength) != SOCKET_ERROR &&
+              listen(listener, 1) != SOCKET_ERROR;
+    pair.receiver = ok ? CreateStreamSocket(endpoint) : INVALID_SOCKET;
+    ok = ok && pair.receiver != INVALID_SOCKET &&
+         connect(pair.receiver, reinterpret_cast<const sockaddr*>(&address), addressLength) != SOCKET_ERROR;
+    pair.sender = ok ? accept(listener, nullptr, nullptr) : INVALID_SOCKET;
+    ok = ok && pair.sender != INVALID_SOCKET;
+    closesocket(listener);
+    remove(endpoint.host.c_str());
+    if (!ok) {
+        cerr << "unix socket pair failed with error: " << WSAGetLastError() << endl;
+        return false;
+    }
+
+    u_long nonBlocking = 1;
+    ioctlsocket(pair.sender, FIONBIO, &nonBlocking);
+    ioctlsocket(pair.receiver, FIONBIO, &nonBlocking);
+    return true;
+}
+
+// A publisher streaming chat lines one way, and a request/reply ping-pong, with the
+// consumer on its own thread as the server would be.
+void benchLocalTransport(const char* name, LocalChannelEnd& client, LocalChannelEnd& server, size_t lineCount) {
+    const size_t lineSize = 64;
+    const size_t roundTrips = 20000;
+    string lines;
+    for (size_t i = 0; i < 256; ++i) {
+        lines += string(lineSize - 1, 'a' + i % 26) + "\n";
+    }
+
+    thread consumer([&server, lineCount] {
+        vector<char> buffer(64 * 1024);
+        size_t remaining = lineCount * lineSize;
+        while (remaining > 0) {
+            size_t bytesReceived = server.read(buffer.data(), buffer.size());
+            if (bytesReceived == 0) {
+                return;
+            }
+            remaining -= bytesReceived;
+        }
+    });
+    auto start = chrono::steady_clock::now();
+    for (size_t sent = 0; sent < lineCount; sent += 256) {
+        client.write(lines.data(), min<size_t>(256, lineCount - sent) * lineSize);
+    }
+    consumer.join();
+    double streamNanoseconds = elapsedNanoseconds(start);
+
+    thread echo([&server] {
+        char buffer[lineSize];
+        for (size_t i = 0; i < roundTrips; ++i) {
+            size_t received = 0;
+            while (received < lineSize) {
+                size_t bytesReceived = server.read(buffer + received, lineSize - received);
+                if (bytesReceived == 0) {
+                    return;
+                }
+                received += bytesReceived;
+            }
+            server.write(buffer, lineSize);
+        }
+    });
+    char reply[lineSize];
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < roundTrips; ++i) {
+        client.write(lines.data(), lineSize);
+        size_t received = 0;
+        while (received < lineSize) {
+            received += client.read(reply + received, lineSize - received);
+        }
+    }
+    double roundTripNanoseconds = elapsedNanoseconds(start) / roundTrips;
+    echo.join();
+
+    cout << "  " << name << ": " << lineCount / streamNanoseconds * 1000 << " M lines/s ("
+         << lineCount * lineSize / streamNanoseconds * 1000 << " MB/s) streaming, "
+         << roundTripNanoseconds / 1000 << " us per round trip" << endl;
+}
+
+void benchLocalTransports(size_t lineCount) {
+    cout << "local transports: " << lineCount << " lines of 64 bytes" << endl;
+
+    vector<LoopbackPair> tcp = openLoopbackPairs(1);
+    if (!tcp.empty()) {
+        BOOL noDelay = TRUE;
+        setsockopt(tcp[0].sender, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+        setsockopt(tcp[0].receiver, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+        SocketChannelEnd client(tcp[0].receiver);
+        SocketChannelEnd server(tcp[0].sender);
+        benchLocalTransport("loopback TCP", client, server, lineCount);
+        closesocket(tcp[0].sender);
+        closesocket(tcp[0].receiver);
+    }
+
+    LoopbackPair unixPair;
+    if (!openUnixPair(unixPair)) {
+        return;
+    }
+    {
+        SocketChannelEnd client(unixPair.receiver);
+        SocketChannelEnd server(unixPair.sender);
+        benchLocalTransport("unix socket", client, server, lineCount);
+    }
+
+    // The doorbells go over the unix pair, as they would for a client that connected
+    // through a unix socket listener.
+    SharedChannel clientChannel;
+    SharedChannel serverChannel;
+    string segmentName = MakeSharedChannelName();
+    const uint64_t nonce = 8580;
+    bool created = clientChannel.create(segmentName);
+    if (created) {
+        clientChannel.seal(nonce);
+    }
+    if (created && serverChannel.open(segmentName, nonce)) {
+        RingChannelEnd client(clientChannel.outbound(), clientChannel.inbound(), unixPair.receiver);
+        RingChannelEnd server(serverChannel.outbound(), serverChannel.inbound(), unixPair.sender);
+        benchLocalTransport("shared memory", client, server, lineCount);
+    } else {
+        cerr << "shared memory channel failed with error: " << GetLastError() << endl;
+    }
+    closesocket(unixPair.sender);
+    closesocket(unixPair.receiver);
+}
+
+// Words for the search benchmark: rank 0 is the most common. Drawing ranks log-uniformly
+// gives the long tail real chat has, where a few words are in most lines.
+string searchBenchWord(size_t rank) {
+    string word;
+    do {
+        word += static_cast<char>('a' + rank % 26);
+        rank /= 26;
+    } while (rank != 0);
+    return word + "x";
+}
+
+void timeSearch(SearchIndex& index, const string& label, const vector<string>& terms, size_t pages) {
+    const size_t rounds = 200;
+    double totalNanoseconds = 0;
+    double worstNanoseconds = 0;
+    size_t hitCount = 0;
+    for (size_t round = 0; round < rounds; ++round) {
+        uint64_t before = 0;
+        for (size_t page = 0; page < pages; ++page) {
+            vector<uint64_t> hits;
+            auto start = chrono::steady_clock::now();
+            before = index.search("bench", terms, before, SEARCH_PAGE_SIZE, hits);
+            double nanoseconds = elapsedNanoseconds(start);
+            totalNanoseconds += nanoseconds;
+            worstNanoseconds = max(worstNanoseconds, nanoseconds);
+            hitCount += round == 0 ? hits.size() : 0;
+            if (before == 0) {
+                break;
+            }
+        }
+    }
+    cout << "  " << label << ": " << hitCount << " results, " << totalNanoseconds / (rounds * pages) / 1000 << " us per page average, "
+         << worstNanoseconds / 1000 << " us worst" << endl;
+}
+
+void benchSearchIndex(size_t messageCount) {
+    const size_t vocabulary = 50000;
+    mt19937 random(8580);
+    uniform_real_distribution<double> spread(0.0, 1.0);
+    uniform_int_distribution<int> wordsPerLine(3, 14);
+
+    vector<string> lines(messageCount);
+    for (size_t i = 0; i < messageCount; ++i) {
+        lines[i] = "user" + to_string(i % 97) + ": ";
+        for (int w = wordsPerLine(random); w > 0; --w) {
+            lines[i] += searchBenchWord(static_cast<size_t>(pow(static_cast<double>(vocabulary), spread(random))) - 1) + " ";
+        }
+    }
+
+    // Handed over in batches of about what one busy event loop iteration would read.
+    SearchIndex index;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < messageCount; ++i) {
+        index.add("bench", i, lines[i], lines[i].find(':') + 2);
+        if (i % 1024 == 1023) {
+            index.publish();
+        }
+    }
+    double addNanoseconds = elapsedNanoseconds(start);
+    index.waitIdle();
+    double indexNanoseconds = elapsedNanoseconds(start);
+    lines.clear();
+    lines.shrink_to_fit();
+
+    // The first allocation after millions of frees pays for the allocator sorting them;
+    // one untimed search keeps that out of the query numbers.
+    vector<uint64_t> warmUp;
+    index.search("bench", { searchBenchWord(0) }, 0, SEARCH_PAGE_SIZE, warmUp);
+
+    cout << "search index: " << messageCount << " messages, " << index.bytesUsed() / (1024 * 1024) << " MB of posting lists" << endl;
+    cout << "  event loop cost " << addNanoseconds / messageCount << " ns/message, indexed at "
+         << messageCount / indexNanoseconds * 1000 << " M messages/s" << endl;
+    timeSearch(index, "common word", { searchBenchWord(0) }, 1);
+    timeSearch(index, "rare word", { searchBenchWord(20000) }, 1);
+    timeSearch(index, "two common words", { searchBenchWord(0), searchBenchWord(1) }, 1);
+    timeSearch(index, "common and rare word", { searchBenchWord(0), searchBenchWord(20000) }, 1);
+    timeSearch(index, "three mid-frequency words", { searchBenchWord(10), searchBenchWord(20), searchBenchWord(30) }, 1);
+    timeSearch(index, "two common words, 10 pages", { searchBenchWord(0), searchBenchWord(1) }, 10);
+}
+
+// Room history under a memory budget: lines go to 10,000 rooms, nine in ten of them to
+// the 100 busiest, so most rooms sit idle and end up on disk while the busy ones stay hot.
+void benchRoomHistory(size_t lineCount) {
+    const size_t roomCount = 10000;
+    const size_t busyRooms = 100;
+    const size_t budgetBytes = 16 * 1024 * 1024;
+    mt19937 random(8580);
+    uniform_int_distribution<int> percent(0, 99);
+    uniform_real_distribution<double> spread(0.0, 1.0);
+    uniform_int_distribution<int> wordsPerLine(3, 14);
+
+    vector<string> roomNames;
+    for (size_t r = 0; r < roomCount; ++r) {
+        roomNames.push_back("room" + to_string(r));
+    }
+    vector<uint32_t> lineRooms(lineCount);
+    vector<string> lines(lineCount);
+    size_t rawBytes = 0;
+    for (size_t i = 0; i < lineCount; ++i) {
+        lineRooms[i] = static_cast<uint32_t>(percent(random) < 90 ? random() % busyRooms : random() % roomCount);
+        lines[i] = "user" + to_string(random() % 500) + ":";
+        for (int w = wordsPerLine(random); w > 0; --w) {
+            lines[i] += " " + searchBenchWord(static_cast<size_t>(pow(50000.0, spread(random))) - 1);
+        }
+        rawBytes += lines[i].size();
+    }
+
+    HistoryStore store;
+    store.configure(".", budgetBytes);
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < lineCount; ++i) {
+        store.append(roomNames[lineRooms[i]], i, lines[i]);
+    }
+    double appendNanoseconds = elapsedNanoseconds(start) / lineCount;
+
+    cout << "room history: " << lineCount << " lines (" << rawBytes / (1024 * 1024) << " MB) in " << roomCount << " rooms, "
+         << budgetBytes / (1024 * 1024) << " MB budget" << endl;
+    cout << "  append: " << appendNanoseconds << " ns/line; " << store.hotBytes() / (1024 * 1024) << " MB hot, "
+         << store.coldBytes() / (1024 * 1024) << " MB compressed on disk" << endl;
+
+    const size_t rounds = 2000;
+    vector<HistoryLine> replay;
+    uint64_t coldReadsBefore = store.coldReads();
+    start = chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; ++round) {
+        replay.clear();
+        store.recent(roomNames[random() % busyRooms], DEFAULT_JOIN_HISTORY, replay);
+    }
+    cout << "  join replay, busy room: " << elapsedNanoseconds(start) / rounds / 1000 << " us, "
+         << store.coldReads() - coldReadsBefore << " cold blocks read" << endl;
+
+    coldReadsBefore = store.coldReads();
+    start = chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; ++round) {
+        replay.clear();
+        store.recent(roomNames[busyRooms + random() % (roomCount - busyRooms)], DEFAULT_JOIN_HISTORY, replay);
+    }
+    cout << "  join replay, idle room: " << elapsedNanoseconds(start) / rounds / 1000 << " us, "
+         << store.coldReads() - coldReadsBefore << " cold blocks read" << endl;
+
+    string line;
+    size_t found = 0;
+    coldReadsBefore = store.coldReads();
+    start = chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; ++round) {
+        size_t i = random() % (lineCount / 2);
+        found += store.find(roomNames[lineRooms[i]], i, line) && line == lines[i];
+    }
+    cout << "  lookup of an old line: " << elapsedNanoseconds(start) / rounds / 1000 << " us, "
+         << store.coldReads() - coldReadsBefore << " cold blocks read, " << found << "/" << rounds << " correct" << endl;
+}
+
+size_t varintLength(size_t value) {
+    size_t length = 1;
+    for (; value >= 0x80; value >>= 7) {
+        ++length;
+    }
+    return length;
+}
+
+// One kind of server output through CompressFrame at one threshold: the CPU a broadcast
+// costs the server once, however many members share the frame, what decoding costs each
+// client, and the bytes saved, with and without the dictionary.
+void timeFrameCompression(const string& label, const vector<string>& messages, size_t threshold) {
+    vector<string> frames(messages.size());
+    vector<const string*> compressed;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < messages.size(); ++i) {
+        if (messages[i].size() >= threshold && CompressFrame(messages[i], frames[i])) {
+            compressed.push_back(&frames[i]);
+        }
+    }
+    double compressNanoseconds = elapsedNanoseconds(start) / messages.size();
+
+    string lines;
+    size_t decodedCount = 0;
+    start = chrono::steady_clock::now();
+    for (const string* frame : compressed) {
+        size_t consumed;
+        lines.clear();
+        decodedCount += ReadCompressedFrame(*frame, consumed, lines) == COMPRESSED_FRAME_COMPLETE;
+    }
+    double decompressNanoseconds = compressed.empty() ? 0 : elapsedNanoseconds(start) / compressed.size();
+
+    size_t plainBytes = 0;
+    size_t wireBytes = 0;
+    size_t noDictionaryBytes = 0;
+    for (size_t i = 0; i < messages.size(); ++i) {
+        plainBytes += messages[i].size();
+        wireBytes += frames[i].empty() ? messages[i].size() : frames[i].size();
+        string block;
+        LzCompress(messages[i], block);
+        size_t frameBytes = 1 + varintLength(messages[i].size()) + varintLength(block.size()) + block.size();
+        noDictionaryBytes += messages[i].size() >= threshold ? min(frameBytes, messages[i].size()) : messages[i].size();
+    }
+
+    cout << "  " << label << ", threshold " << threshold << ": " << plainBytes / messages.size() << " bytes average, "
+         << compressed.size() * 100.0 / messages.size() << "% compressed, " << 100.0 - wireBytes * 100.0 / plainBytes << "% saved ("
+         << 100.0 - noDictionaryBytes * 100.0 / plainBytes << "% without the dictionary); " << compressNanoseconds
+         << " ns/message to compress, " << decompressNanoseconds << " ns/frame to decompress"
+         << (decodedCount == compressed.size() ? "" : ", DECODE FAILED") << endl;
+}
+
+// Compressed output for the kinds of line a server sends most. Chat text comes from the
+// synthetic search vocabulary, none of which is in the dictionary, so only the envelope
+// and the nickname have anything to match; real chat does better.
+void benchFrameCompression(size_t messageCount) {
+    mt19937 random(8580);
+    uniform_real_distribution<double> spread(0.0, 1.0);
+    uniform_int_distribution<int> wordsPerLine(3, 14);
+
+    vector<string> chatLines(messageCount);
+    vector<string> presenceLines(messageCount);
+    for (size_t i = 0; i < messageCount; ++i) {
+        string nickname = "user" + to_string(random() % 500);
+        chatLines[i] = "SEQ:" + to_string(i) + ":" + nickname + ":";
+        for (int w = wordsPerLine(random); w > 0; --w) {
+            chatLines[i] += " " + searchBenchWord(static_cast<size_t>(pow(50000.0, spread(random))) - 1);
+        }
+        chatLines[i] += "\n";
+        presenceLines[i] = "SEQ:" + to_string(i) + ":" + nickname + (i % 2 == 0 ? " has joined room 'room" : " has left room 'room") + to_string(random() % 100) + "'.\n";
+    }
+
+    // What a join sends besides ROOM_JOINED: the member list and the latest history.
+    size_t joinCount = max<size_t>(messageCount / 100, 1);
+    vector<string> userLists(joinCount);
+    vector<string> historyBatches(joinCount);
+    for (size_t i = 0; i < joinCount; ++i) {
+        userLists[i] = "USER_LIST:room" + to_string(i % 100) + ":";
+        for (size_t m = 0; m < 50; ++m) {
+            userLists[i] += (m == 0 ? "user" : ",user") + to_string(random() % 500);
+        }
+        userLists[i] += "\n";
+        for (size_t h = 0; h < DEFAULT_JOIN_HISTORY; ++h) {
+            const string& chat = chatLines[random() % messageCount];
+            historyBatches[i] += "HISTORY:room" + to_string(i % 100) + ":" + chat.substr(4);
+        }
+    }
+
+    cout << "frame compression (" << CHAT_COMPRESSION_CODEC << ", " << ChatDictionary().text().size() << "-byte dictionary):" << endl;
+    for (size_t threshold : { size_t(0), DEFAULT_COMPRESSION_THRESHOLD, size_t(80), size_t(120) }) {
+        timeFrameCompression("chat lines", chatLines, threshold);
+    }
+    timeFrameCompression("presence lines", presenceLines, DEFAULT_COMPRESSION_THRESHOLD);
+    timeFrameCompression("USER_LIST, 50 members", userLists, DEFAULT_COMPRESSION_THRESHOLD);
+    timeFrameCompression("join history batch", historyBatches, DEFAULT_COMPRESSION_THRESHOLD);
+}
+
+// Chat lines checked against a rules file of patternCount random terms and links, at
+// several sizes up to that count, next to the per-pattern find it replaces. One line in
+// a hundred carries a pattern.
+void benchContentFilter(size_t patternCount, size_t messageCount) {
+    if (patternCount == 0) {
+        return;
+    }
+    mt19937 random(8580);
+    uniform_real_distribution<double> spread(0.0, 1.0);
+    uniform_int_distribution<int> wordsPerLine(3, 14);
+    uniform_int_distribution<int> termLength(5, 12);
+
+    vector<string> terms(patternCount);
+    string rules;
+    for (size_t i = 0; i < patternCount; ++i) {
+        for (int c = termLength(random); c > 0; --c) {
+            terms[i] += static_cast<char>('a' + random() % 26);
+        }
+        if (i % 10 == 0) {
+            terms[i] = "http://" + terms[i] + ".example";
+        }
+        rules += (i % 10 < 6 ? "block " : i % 10 < 9 ? "mask " : "flag ") + terms[i] + "\n";
+    }
+
+    vector<string> lines(messageCount);
+    for (size_t i = 0; i < messageCount; ++i) {
+        for (int w = wordsPerLine(random); w > 0; --w) {
+            lines[i] += (lines[i].empty() ? "" : " ") + searchBenchWord(static_cast<size_t>(pow(50000.0, spread(random))) - 1);
+        }
+        if (i % 100 == 0) {
+            lines[i] += " " + terms[random() % patternCount];
+        }
+    }
+
+    cout << "content filter, " << messageCount << " chat lines:" << endl;
+    for (size_t count = min<size_t>(100, patternCount); ; count = min(count * 10, patternCount)) {
+        size_t rulesEnd = 0;
+        for (size_t i = 0; i < count; ++i) {
+            rulesEnd = rules.find('\n', rulesEnd) + 1;
+        }
+        ContentFilter filter;
+        string error;
+        auto start = chrono::steady_clock::now();
+        if (!filter.compile(string_view(rules).substr(0, rulesEnd), error)) {
+            cout << "  " << count << " patterns: COMPILE FAILED (" << error << ")" << endl;
+            return;
+        }
+        double compileMilliseconds = elapsedNanoseconds(start) / 1e6;
+
+        size_t blocked = 0;
+        size_t bytes = 0;
+        string text;
+        start = chrono::steady_clock::now();
+        for (const string& line : lines) {
+            text = line;
+            blocked += (filter.apply(text).actions & FILTER_BLOCK) != 0;
+            bytes += text.size();
+        }
+        double filterNanoseconds = elapsedNanoseconds(start) / messageCount;
+
+        // The per-pattern find, on as many lines as keep it to about as many searches.
+        size_t naiveCount = max<size_t>(messageCount / count, 1);
+        size_t naiveHits = 0;
+        start = chrono::steady_clock::now();
+        for (size_t i = 0; i < naiveCount; ++i) {
+            for (size_t t = 0; t < count; ++t) {
+                naiveHits += lines[i].find(terms[t]) != string::npos;
+            }
+        }
+        double naiveNanoseconds = elapsedNanoseconds(start) / naiveCount;
+
+        cout << "  " << count << " patterns: " << filter.stateCount() << " states, " << filter.tableBytes() / 1024 << " KB, compiled in "
+             << compileMilliseconds << " ms; " << filterNanoseconds << " ns/message (" << filterNanoseconds * messageCount / bytes
+             << " ns/byte), " << blocked << " blocked; per-pattern find: " << naiveNanoseconds << " ns/message, "
+             << naiveHits << " hits in " << naiveCount << " lines" << endl;
+        if (count == patternCount) {
+            break;
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    size_t connectionCount = 100000;
+    size_t sessionCount = 2000;
+    size_t lineCount = 100000;
+    size_t transportLines = 2000000;
+    size_t searchMessages = 2000000;
+    size_t historyLines = 2000000;
+    size_t compressionMessages = 200000;
+    size_t filterPatterns = 10000;
+    for (int i = 1; i < argc; ++i) {
+        string option = argv[i];
+        if (option == "--connections" && i + 1 < argc) {
+            connectionCount = strtoul(argv[++i], nullptr, 10);
+        } else if (option == "--sessions" && i + 1 < argc) {
+            sessionCount = strtoul(argv[++i], nullptr, 10);
+        } else if (option == "--lines" && i + 1 < argc) {
+            lineCount = strtoul(argv[++i], nullptr, 10);
+        } else if (option == "--transport-lines" && i + 1 < argc) {
+            transportLines = strtoul(argv[++i], nullptr, 10);
+        } else if (option == "--search-messages" && i + 1 < argc) {
+            searchMessages = strtoul(argv[++i], nullptr, 10);
+        } else if (option == "--history-lines" && i + 1 < argc) {
+            historyLines = strtoul(argv[++i], nullptr, 10);
+        } else if (option == "--compression-messages" && i + 1 < argc) {
+            compressionMessages = strtoul(argv[++i], nullptr, 10);
+        } else if (option == "--filter-patterns" && i + 1 < argc) {
+            filterPatterns = strtoul(argv[++i], nullptr, 10);
+        } else {
+            cerr << "Usage: ChatBench [--connections <idle connections>] [--sessions <sessions>] [--lines <lines to scan>]" << endl;
+            cerr << "                 [--transport-lines <lines>] [--search-messages <messages>] [--history-lines <lines>]" << endl;
+            cerr << "                 [--compression-messages <messages>] [--filter-patterns <patterns>]" << endl;
+            cerr << "                 (0 skips that benchmark)" << endl;
+            return 1;
+        }
+    }
+
+    WSADATA wsaData;
+    int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (iResult != 0) {
+        cerr << "WSAStartup failed: " << iResult << endl;
+        return 1;
+    }
+
+    bool ok = true;
+    if (connectionCount != 0) {
+        ok = benchIdleConnectionFootprint(connectionCount) && ok;
+    }
+    if (sessionCount != 0) {
+        benchSessionModels(sessionCount);
+    }
+    if (lineCount != 0) {
+        ok = benchLineScanning(lineCount) && ok;
+    }
+    if (transportLines != 0) {
+        benchLocalTransports(transportLines);
+    }
+    if (searchMessages != 0) {
+        benchSearchIndex(searchMessages);
+    }
+    if (historyLines != 0) {
+        benchRoomHistory(historyLines);
+    }
+    if (compressionMessages != 0) {
+        benchFrameCompression(compressionMessages);
+    }
+    if (filterPatterns != 0) {
+        benchContentFilter(filterPatterns, 200000);
+    }
+
+    WSACleanup();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,361 @@
+#include "capture.h"
+#include "linescan.h"
+#include "protocol.h"
+#include <chrono>
+#include <cstdlib>
+#include <unordered_map>
+
+typedef chrono::steady_clock::time_point TimePoint;
+
+const char* const REPLAY_USAGE =
+    "Usage: ChatReplay <capture file> [--server <ip | unix:path>] [--port <port>] [--fast | --speed <factor>]\n"
+    "                  [--probe-interval <ms>]";
+
+// While replaying, one connection at a time is sent a COMMAND:PROBE between captured
+// lines; the round trip is the latency the replayed load leaves for a user's command.
+const uint32_t DEFAULT_PROBE_INTERVAL_MS = 20;
+// After the last record, how long to wait for the server to finish answering.
+const int64_t LINGER_MS = 2000;
+// In --fast mode, records sent per pass before the loop looks at the sockets again.
+const size_t FAST_BATCH_RECORDS = 256;
+
+struct ReplayOptions {
+    string capturePath;
+    string serverIP = "127.0.0.1";
+    int port = 8580;
+    double speed = 1.0;  // 0: as fast as possible
+    uint32_t probeIntervalMs = DEFAULT_PROBE_INTERVAL_MS;
+};
+
+struct ReplayConnection {
+    SOCKET socketFD = INVALID_SOCKET;
+    string output;          // captured bytes the socket has not taken yet
+    string input;           // partial line from the server
+    bool atLineStart = true;  // the captured bytes sent so far end with a newline
+    bool chatting = false;    // the server accepted a nickname or resume
+    bool closeWhenSent = false;
+    bool sendShutdown = false;  // the captured DISCONNECT went out; reading what is left
+    string probeToken;
+    TimePoint probeSentAt;
+};
+
+struct ReplayStats {
+    uint64_t connects = 0;
+    uint64_t failedConnects = 0;
+    uint64_t bytesSent = 0;
+    uint64_t linesSent = 0;
+    uint64_t bytesReceived = 0;
+    uint64_t linesReceived = 0;
+    uint64_t serverClosed = 0;
+    vector<int64_t> probeMicroseconds;
+};
+
+bool parseReplayOptions(int argc, char* argv[], ReplayOptions& options) {
+    for (int i = 1; i < argc; ++i) {
+        string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (option == "--server" && hasValue) {
+            options.serverIP = argv[++i];
+        } else if (option == "--port" && hasValue) {
+            options.port = atoi(argv[++i]);
+        } else if (option == "--fast") {
+            options.speed = 0;
+        } else if (option == "--speed" && hasValue) {
+            options.speed = atof(argv[++i]);
+        } else if (option == "--probe-interval" && hasValue) {
+            options.probeIntervalMs = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (options.capturePath.empty() && option.rfind("--", 0) != 0) {
+            options.capturePath = option;
+        } else {
+            return false;
+        }
+    }
+    return !options.capturePath.empty() && options.speed >= 0;
+}
+
+SOCKET connectToServer(const ReplayOptions& options) {
+    SocketEndpoint endpoint = EndpointForHost(options.serverIP, options.port);
+    sockaddr_storage address;
+    int addressLength = CreateEndpointAddress(endpoint, address);
+    SOCKET socketFD = addressLength == 0 ? INVALID_SOCKET : CreateStreamSocket(endpoint);
+    if (socketFD == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+    if (connect(socketFD, reinterpret_cast<const sockaddr*>(&address), addressLength) == SOCKET_ERROR) {
+        closesocket(socketFD);
+        return INVALID_SOCKET;
+    }
+
+    u_long nonBlocking = 1;
+    ioctlsocket(socketFD, FIONBIO, &nonBlocking);
+    if (endpoint.family != AF_UNIX) {
+        BOOL noDelay = TRUE;
+        setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+    }
+    return socketFD;
+}
+
+void closeConnection(ReplayConnection& connection) {
+    closesocket(connection.socketFD);
+    connection.socketFD = INVALID_SOCKET;
+}
+
+// Returns false once the connection is finished with. A captured DISCONNECT becomes a
+// half close once the bytes before it are out, so the replies still arrive and count.
+bool flushConnection(ReplayConnection& connection, ReplayStats& stats) {
+    if (connection.sendShutdown) {
+        return true;
+    }
+    while (!connection.output.empty()) {
+        int bytesSent = send(connection.socketFD, connection.output.data(), static_cast<int>(connection.output.length()), 0);
+        if (bytesSent == SOCKET_ERROR) {
+            if (WSAGetLastError() == WSAEWOULDBLOCK) {
+                return true;
+            }
+            stats.serverClosed++;
+            closeConnection(connection);
+            return false;
+        }
+        stats.bytesSent += bytesSent;
+        connection.output.erase(0, bytesSent);
+    }
+    if (connection.closeWhenSent) {
+        shutdown(connection.socketFD, SD_SEND);
+        connection.sendShutdown = true;
+    }
+    return true;
+}
+
+bool readConnection(ReplayConnection& connection, ReplayStats& stats) {
+    char buffer[16384];
+    while (true) {
+        int bytesReceived = recv(connection.socketFD, buffer, sizeof(buffer), 0);
+        if (bytesReceived == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+            return true;
+        }
+        if (bytesReceived <= 0) {
+            stats.serverClosed += connection.sendShutdown ? 0 : 1;
+            closeConnection(connection);
+            return false;
+        }
+        stats.bytesReceived += bytesReceived;
+        connection.input.append(buffer, bytesReceived);
+
+        LineScanner scanner(connection.input.data(), connection.input.length());
+        string_view line;
+        while (scanner.next(line)) {
+            stats.linesReceived++;
+            Frame frame = classifyFrame(line);
+            if (frame.kind == FRAME_NICK_ACCEPTED || frame.kind == FRAME_RESUMED) {
+                connection.chatting = true;
+            } else if (frame.kind == FRAME_PROBE && !connection.probeToken.empty() && frame.payload == connection.probeToken) {
+                stats.probeMicroseconds.push_back(
+                    chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - connection.probeSentAt).count());
+                connection.probeToken.clear();
+            }
+        }
+        connection.input.erase(0, scanner.consumed());
+    }
+}
+
+void replayRecord(const CaptureRecord& record, const ReplayOptions& options, unordered_map<uint32_t, ReplayConnection>& connections,
+                  ReplayStats& stats) {
+    if (record.type == CAPTURE_CONNECT) {
+        ReplayConnection connection;
+        connection.socketFD = connectToServer(options);
+        if (connection.socketFD == INVALID_SOCKET) {
+            stats.failedConnects++;
+            return;
+        }
+        stats.connects++;
+        connections[record.stream] = connection;
+        return;
+    }
+
+    auto it = connections.find(record.stream);
+    if (it == connections.end()) {
+        return;
+    }
+    ReplayConnection& connection = it->second;
+    if (record.type == CAPTURE_DISCONNECT) {
+        connection.closeWhenSent = true;
+    } else {
+        connection.output += record.data;
+        connection.atLineStart = !record.data.empty() && record.data.back() == '\n';
+        stats.linesSent += count(record.data.begin(), record.data.end(), '\n');
+    }
+    if (!flushConnection(connection, stats)) {
+        connections.erase(it);
+    }
+}
+
+// Probes go round the chatting connections, one outstanding at a time, and only
+// between whole captured lines so they never split one.
+void sendProbe(unordered_map<uint32_t, ReplayConnection>& connections, uint64_t& probeCounter, ReplayStats& stats) {
+    for (auto& [stream, connection] : connections) {
+        if (!connection.probeToken.empty()) {
+            return;
+        }
+    }
+    size_t skip = connections.empty() ? 0 : probeCounter % connections.size();
+    for (auto& [stream, connection] : connections) {
+        if (skip > 0) {
+            --skip;
+            continue;
+        }
+        if (!connection.chatting || !connection.atLineStart || connection.closeWhenSent) {
+            continue;
+        }
+        connection.probeToken = "replay-" + to_string(++probeCounter);
+        connection.output += "COMMAND:PROBE:" + connection.probeToken + "\n";
+        connection.probeSentAt = chrono::steady_clock::now();
+        flushConnection(connection, stats);
+        return;
+    }
+    probeCounter++;
+}
+
+int64_t percentile(const vector<int64_t>& sorted, double fraction) {
+    return sorted[static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5)];
+}
+
+int main(int argc, char* argv[]) {
+    ReplayOptions options;
+    if (!parseReplayOptions(argc, argv, options)) {
+        cerr << REPLAY_USAGE << endl;
+        return 1;
+    }
+
+    vector<CaptureRecord> records;
+    string error;
+    if (!ReadCaptureFile(options.capturePath, records, error)) {
+        cerr << "Cannot read capture '" << options.capturePath << "': " << error << endl;
+        return 1;
+    }
+    uint64_t capturedMicroseconds = records.empty() ? 0 : records.back().atMicroseconds;
+    cout << "Replaying " << records.size() << " records (" << capturedMicroseconds / 1000 << " ms captured) against "
+         << options.serverIP << ":" << options.port;
+    if (options.speed == 0) {
+        cout << " as fast as possible." << endl;
+    } else {
+        cout << " at " << options.speed << "x speed." << endl;
+    }
+
+    WSADATA wsaData;
+    int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (iResult != 0) {
+        cerr << "WSAStartup failed: " << iResult << endl;
+        return 1;
+    }
+
+    unordered_map<uint32_t, ReplayConnection> connections;
+    ReplayStats stats;
+    vector<WSAPOLLFD> pollFDs;
+    vector<uint32_t> pollStreams;
+    uint64_t probeCounter = 0;
+    size_t next = 0;
+    TimePoint started = chrono::steady_clock::now();
+    TimePoint nextProbeAt = started;
+    TimePoint finishedAt;
+    chrono::milliseconds probeInterval(options.probeIntervalMs);
+
+    while (true) {
+        TimePoint now = chrono::steady_clock::now();
+        size_t batch = 0;
+        while (next < records.size() && batch < FAST_BATCH_RECORDS) {
+            if (options.speed != 0) {
+                auto due = started + chrono::microseconds(static_cast<int64_t>(records[next].atMicroseconds / options.speed));
+                if (due > now) {
+                    break;
+                }
+            } else {
+                ++batch;
+            }
+            replayRecord(records[next++], options, connections, stats);
+        }
+        if (next == records.size() && finishedAt == TimePoint()) {
+            finishedAt = chrono::steady_clock::now();
+        }
+        if (options.probeIntervalMs != 0 && now >= nextProbeAt) {
+            sendProbe(connections, probeCounter, stats);
+            nextProbeAt = now + probeInterval;
+        }
+
+        if (finishedAt != TimePoint()) {
+            bool settled = true;
+            for (auto& [stream, connection] : connections) {
+                settled = settled && connection.output.empty() && connection.probeToken.empty();
+            }
+            if ((settled && now - finishedAt >= probeInterval) || now - finishedAt >= chrono::milliseconds(LINGER_MS)) {
+                break;
+            }
+        }
+
+        pollFDs.clear();
+        pollStreams.clear();
+        for (auto& [stream, connection] : connections) {
+            WSAPOLLFD entry;
+            entry.fd = connection.socketFD;
+            entry.events = POLLRDNORM | (connection.output.empty() ? 0 : POLLWRNORM);
+            entry.revents = 0;
+            pollFDs.push_back(entry);
+            pollStreams.push_back(stream);
+        }
+
+        int timeout = options.probeIntervalMs != 0 ? static_cast<int>(options.probeIntervalMs) : 100;
+        if (next < records.size()) {
+            if (options.speed == 0) {
+                timeout = 0;
+            } else {
+                auto due = started + chrono::microseconds(static_cast<int64_t>(records[next].atMicroseconds / options.speed));
+                auto untilDue = chrono::duration_cast<chrono::milliseconds>(due - now).count();
+                timeout = static_cast<int>(max<long long>(0, min<long long>(timeout, untilDue)));
+            }
+        }
+        if (pollFDs.empty()) {
+            if (timeout > 0) {
+                Sleep(timeout);
+            }
+            continue;
+        }
+        int ready = WSAPoll(pollFDs.data(), static_cast<ULONG>(pollFDs.size()), timeout);
+        if (ready == SOCKET_ERROR) {
+            cerr << "WSAPoll failed with error: " << WSAGetLastError() << endl;
+            break;
+        }
+        for (size_t k = 0; ready > 0 && k < pollFDs.size(); ++k) {
+            if (pollFDs[k].revents == 0) {
+                continue;
+            }
+            auto it = connections.find(pollStreams[k]);
+            bool open = true;
+            if (pollFDs[k].revents & (POLLRDNORM | POLLERR | POLLHUP)) {
+                open = readConnection(it->second, stats);
+            }
+            if (open && (pollFDs[k].revents & POLLWRNORM)) {
+                open = flushConnection(it->second, stats);
+            }
+            if (!open) {
+                connections.erase(it);
+            }
+        }
+    }
+
+    for (auto& [stream, connection] : connections) {
+        closeConnection(connection);
+    }
+    WSACleanup();
+
+    double seconds = chrono::duration<double>((finishedAt == TimePoint() ? chrono::steady_clock::now() : finishedAt) - started).count();
+    cout << "Replayed " << next << " of " << records.size() << " records in " << seconds * 1000 << " ms: " << stats.connects
+         << " connections (" << stats.failedConnects << " refused, " << stats.serverClosed << " closed by the server), "
+         << stats.linesSent << " lines sent (" << (seconds > 0 ? stats.linesSent / seconds : 0) << " lines/s, "
+         << stats.bytesSent << " bytes), " << stats.linesReceived << " lines received (" << stats.bytesReceived << " bytes)." << endl;
+    if (!stats.probeMicroseconds.empty()) {
+        vector<int64_t> sorted = stats.probeMicroseconds;
+        sort(sorted.begin(), sorted.end());
+        cout << "Command latency over " << sorted.size() << " probes: min " << sorted.front() << " us, p50 " << percentile(sorted, 0.50)
+             << " us, p99 " << percentile(sorted, 0.99) << " us, max " << sorted.back() << " us." << endl;
+    }
+    return stats.failedConnects == 0 ? 0 : 1;
+}
@@ -0,0 +1,691 @@
+#include "chatengine.h"
+#include "framecompress.h"
+#include "linescan.h"
+#include <cstdlib>
+
+const char* ClientStateName(ClientState state) {
+    switch (state) {
+        case CLIENT_DISCONNECTED: return "disconnected";
+        case CLIENT_AWAITING_PROMPT: return "awaiting_prompt";
+        case CLIENT_NEEDS_NICKNAME: return "needs_nickname";
+        case CLIENT_NICKNAME_SENT: return "nickname_sent";
+        case CLIENT_LOBBY: return "lobby";
+        case CLIENT_ROOM_REQUESTED: return "room_requested";
+        case CLIENT_IN_ROOM: return "in_room";
+        case CLIENT_LEAVING: return "leaving";
+        case CLIENT_RESUMING: return "resuming";
+    }
+    return "unknown";
+}
+
+// Protocol transitions, one per reply kind. Frames that do not move the state only go
+// to the listener.
+template <FrameKind Kind>
+struct EngineFrameHandler {
+    static void handle(ChatClientEngine& engine, const Frame& frame) {}
+};
+
+template <>
+struct EngineFrameHandler<FRAME_NICK_REQUIRED> {
+    static void handle(ChatClientEngine& engine, const Frame& frame) {
+        engine.handleNicknameRequired();
+    }
+};
+
+template <>
+struct EngineFrameHandler<FRAME_NICK_REJECTED> {
+    static void handle(ChatClientEngine& engine, const Frame& frame) {
+        engine.handleNicknameRejected();
+    }
+};
+
+template <>
+struct EngineFrameHandler<FRAME_NICK_ACCEPTED> {
+    static void handle(ChatClientEngine& engine, const Frame& frame) {
+        engine.handleNicknameAccepted();
+    }
+};
+
+template <>
+struct EngineFrameHandler<FRAME_SESSION> {
+    static void handle(ChatClientEngine& engine, const Frame& frame) {
+        engine.handleSession(frame.payload);
+    }
+};
+
+template <>
+struct EngineFrameHandler<FRAME_RESUMED> {
+    static void handle(ChatClientEngine& engine, const Frame& frame) {
+        engine.handleResumed(frame.payload);
+    }
+};
+
+template <>
+struct EngineFrameHandler<FRAME_RESUME_REJECTED> {
+    static void handle(ChatClientEngine& engine, const Frame& frame) {
+        engine.handleResumeRejected();
+    }
+};
+
+template <>
+struct EngineFrameHandler<FRAME_ROOM_JOINED> {
+    static void handle(ChatClientEngine& engine, const Frame& frame) {
+        engine.handleRoomJoined(frame.payload);
+    }
+};
+
+template <>
+struct EngineFrameHandler<FRAME_ROOM_LEFT> {
+    static void handle(ChatClientEngine& engine, const Frame& frame) {
+        engine.handleRoomLeft();
+    }
+};
+
+template <>
+struct EngineFrameHandler<FRAME_SERVER_BUSY> {
+    static void handle(ChatClientEngine& engine, const Frame& frame) {
+        engine.handleServerBusy(frame.payload);
+    }
+};
+
+template <>
+struct EngineFrameHandler<FRAME_SHM_NONCE> {
+    static void handle(ChatClientEngine& engine, const Frame& frame) {
+        engine.handleSharedNonce(frame.payload);
+    }
+};
+
+template <>
+struct EngineFrameHandler<FRAME_SHM_ATTACHED> {
+    static void handle(ChatClientEngine& engine, const Frame& frame) {
+        engine.handleSharedAttached();
+    }
+};
+
+template <>
+struct EngineFrameHandler<FRAME_COMPRESSING> {
+    static void handle(ChatClientEngine& engine, const Frame& frame) {
+        engine.handleCompressing();
+    }
+};
+
+template <>
+struct EngineFrameHandler<FRAME_SERVER_ERROR> {
+    static void handle(ChatClientEngine& engine, const Frame& frame) {
+        engine.handleError();
+    }
+};
+
+// How long a received room message may go unacknowledged, and how many may pile up
+// before an ack goes out regardless.
+const int64_t ACK_INTERVAL_MS = 250;
+const uint64_t ACK_BATCH_MESSAGES = 64;
+
+constexpr auto engineFrameHandlers = makeFrameDispatchTable<EngineFrameHandler>();
+
+ChatClientEngine::ChatClientEngine()
+    : socketFD(INVALID_SOCKET), serverPort(0), currentState(CLIENT_DISCONNECTED), stateBeforeRequest(CLIENT_DISCONNECTED),
+      listener(nullptr), nextSequence(0), ackedSequence(0), busyRetryMs(0), sharedMemoryWanted(false), shared(nullptr),
+      attachPending(false), promptDeferred(false), compressionWanted(false), compressPending(false), compressionActive(false) {}
+
+ChatClientEngine::~ChatClientEngine() {
+    close();
+}
+
+bool ChatClientEngine::connectTo(const string& host, int port) {
+    close();
+    serverIP = host;
+    serverPort = port;
+    acceptedNickname.clear();
+    currentRoomName.clear();
+    return openSocket();
+}
+
+bool ChatClientEngine::reconnect() {
+    closeSocket();
+    return openSocket();
+}
+
+bool ChatClientEngine::openSocket() {
+    SocketEndpoint endpoint = EndpointForHost(serverIP, serverPort);
+    sockaddr_storage address;
+    int addressLength = CreateEndpointAddress(endpoint, address);
+    if (addressLength == 0) {
+        cerr << "Invalid server address " << FormatEndpoint(endpoint) << endl;
+        return false;
+    }
+
+    socketFD = CreateStreamSocket(endpoint);
+    if (socketFD == INVALID_SOCKET) {
+        cerr << "socket failed with error: " << WSAGetLastError() << endl;
+        return false;
+    }
+
+    if (connect(socketFD, reinterpret_cast<const sockaddr*>(&address), addressLength) == SOCKET_ERROR) {
+        cerr << "connect failed with error: " << WSAGetLastError() << endl;
+        closesocket(socketFD);
+        socketFD = INVALID_SOCKET;
+        return false;
+    }
+
+    u_long nonBlocking = 1;
+    ioctlsocket(socketFD, FIONBIO, &nonBlocking);
+
+    // Requests are single short lines; Nagle would hold one back behind the ACK of the
+    // previous one and show up as a delayed-ACK stall in every round trip.
+    if (endpoint.family != AF_UNIX) {
+        BOOL noDelay = TRUE;
+        setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+    }
+
+    serverInput.clear();
+    busyRetryMs = 0;
+    setState(CLIENT_AWAITING_PROMPT);
+
+    if (sharedMemoryWanted) {
+        shared = new SharedChannel();
+        attachPending = true;
+        if (!shared->create(MakeSharedChannelName()) || !sendLine("SHM_OFFER")) {
+            cerr << "Shared memory is not available; staying on the socket." << endl;
+            delete shared;
+            shared = nullptr;
+            attachPending = false;
+        }
+    }
+    if (compressionWanted && shared == nullptr) {
+        compressPending = sendLine(string("COMPRESS ") + CHAT_COMPRESSION_CODEC);
+    }
+    return true;
+}
+
+void ChatClientEngine::close() {
+    if (socketFD != INVALID_SOCKET && currentState != CLIENT_DISCONNECTED && !resumeToken.empty()) {
+        sendLine("COMMAND:QUIT");
+    }
+    resumeToken.clear();
+    resetSequence();
+    closeSocket();
+}
+
+void ChatClientEngine::closeSocket() {
+    if (socketFD == INVALID_SOCKET) {
+        return;
+    }
+    shutdown(socketFD, SD_SEND);
+    closesocket(socketFD);
+    socketFD = INVALID_SOCKET;
+    currentState = CLIENT_DISCONNECTED;
+    delete shared;
+    shared = nullptr;
+    attachPending = false;
+    promptDeferred = false;
+    sharedOutput.clear();
+    compressPending = false;
+    compressionActive = false;
+}
+
+bool ChatClientEngine::onReadable() {
+    char buffer[1024];
+    if (currentState == CLIENT_DISCONNECTED) {
+        return false;
+    }
+    if (usingSharedMemory()) {
+        return readSharedRing();
+    }
+
+    while (socketFD != INVALID_SOCKET && currentState != CLIENT_DISCONNECTED) {
+        int bytesReceived = recv(socketFD, buffer, sizeof(buffer), 0);
+
+        if (bytesReceived == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+            break;
+        }
+        if (bytesReceived <= 0) {
+            if (bytesReceived == 0) {
+                disconnect("Server disconnected gracefully.");
+            } else {
+                disconnect("Server receive failed with error: " + to_string(WSAGetLastError()));
+            }
+            break;
+        }
+
+        serverInput.append(buffer, bytesReceived);
+        takeServerLines();
+        if (usingSharedMemory()) {
+            serverInput.clear();
+            return readSharedRing();
+        }
+    }
+    if (nextSequence - ackedSequence >= ACK_BATCH_MESSAGES) {
+        sendDueAck();
+    }
+    return currentState != CLIENT_DISCONNECTED;
+}
+
+// Ring mode. The socket readable means one or more doorbells: the server wrote to the
+// inbound ring, made room in the outbound one, or went away. Reading runs until the
+// ring is empty and the waiting flag is up, so the next write rings the doorbell again.
+bool ChatClientEngine::readSharedRing() {
+    bool serverOpen = DrainDoorbell(socketFD);
+    flushSharedOutput();
+
+    SharedRing& inbound = shared->inbound();
+    char buffer[16384];
+    while (shared != nullptr && currentState != CLIENT_DISCONNECTED) {
+        size_t bytesReceived = inbound.read(buffer, sizeof(buffer));
+        if (bytesReceived == 0) {
+            if (inbound.armConsumer()) {
+                continue;
+            }
+            break;
+        }
+        if (inbound.takeProducerWaiting()) {
+            RingDoorbell(socketFD);
+        }
+
+        serverInput.append(buffer, bytesReceived);
+        takeServerLines();
+    }
+    if (!serverOpen && currentState != CLIENT_DISCONNECTED) {
+        disconnect("Server disconnected gracefully.");
+    }
+    if (nextSequence - ackedSequence >= ACK_BATCH_MESSAGES) {
+        sendDueAck();
+    }
+    return currentState != CLIENT_DISCONNECTED;
+}
+
+// Lines the outbound ring had no room for wait here; the server rings the doorbell once
+// it has read enough, and readSharedRing() comes back to them.
+void ChatClientEngine::flushSharedOutput() {
+    SharedRing& outbound = shared->outbound();
+    while (!sharedOutput.empty()) {
+        size_t written = outbound.write(sharedOutput.data(), sharedOutput.length());
+        if (written != 0) {
+            sharedOutput.erase(0, written);
+            if (outbound.takeConsumerWaiting()) {
+                RingDoorbell(socketFD);
+            }
+            continue;
+        }
+        if (!outbound.armProducer()) {
+            break;
+        }
+    }
+}
+
+// Handles the complete lines at the front of serverInput and drops them from it. A line
+// starting with the compressed frame marker is a whole frame of lines instead. Stops
+// early when a line moves the connection onto shared memory, since what follows it on
+// the socket is not for the ring reader, or when the server goes away.
+void ChatClientEngine::takeServerLines() {
+    bool wasShared = usingSharedMemory();
+    size_t offset = 0;
+    while (offset < serverInput.length() && currentState != CLIENT_DISCONNECTED && usingSharedMemory() == wasShared) {
+        if (serverInput[offset] == COMPRESSED_FRAME_MARKER) {
+            size_t consumed = 0;
+            frameLines.clear();
+            CompressedFrameStatus status = ReadCompressedFrame(string_view(serverInput).substr(offset), consumed, frameLines);
+            if (status == COMPRESSED_FRAME_PARTIAL) {
+                break;
+            }
+            if (status == COMPRESSED_FRAME_INVALID) {
+                disconnect("Server sent a malformed compressed frame.");
+                return;
+            }
+            offset += consumed;
+            LineScanner scanner(frameLines.data(), frameLines.length());
+            string_view line;
+            while (scanner.next(line)) {
+                handleLine(line);
+            }
+            continue;
+        }
+
+        const char* begin = serverInput.data() + offset;
+        const char* newline = FindNewline(begin, serverInput.data() + serverInput.length());
+        if (newline == nullptr) {
+            break;
+        }
+        offset = static_cast<size_t>(newline + 1 - serverInput.data());
+        handleLine(TrimLine(string_view(begin, static_cast<size_t>(newline - begin))));
+    }
+    serverInput.erase(0, min(offset, serverInput.length()));
+}
+
+// Room messages come wrapped in a SEQ envelope. The engine keeps the sequence for acks
+// and a later resume, and hands the wrapped line on as if it had arrived by itself. The
+// first message after a room change is where acknowledgements for that room start.
+void ChatClientEngine::handleLine(string_view line) {
+    Frame envelope = classifyFrame(line);
+    if (envelope.kind == FRAME_SEQ) {
+        size_t colon = envelope.payload.find(':');
+        if (colon != string_view::npos) {
+            uint64_t sequence = strtoull(string(envelope.payload.substr(0, colon)).c_str(), nullptr, 10);
+            if (nextSequence == 0) {
+                ackedSequence = sequence;
+            }
+            if (nextSequence == ackedSequence) {
+                firstUnackedAt = chrono::steady_clock::now();
+            }
+            nextSequence = sequence + 1;
+            line = envelope.payload.substr(colon + 1);
+        }
+    }
+
+    string message(line);
+    Frame frame = classifyFrame(message);
+    if (listener != nullptr) {
+        listener->onFrame(frame, message);
+    }
+    engineFrameHandlers[frame.kind](*this, frame);
+}
+
+// Sequences restart with every room, so an ack never carries one room's position into
+// another. Anything unacknowledged from the old room no longer matters to the server.
+void ChatClientEngine::resetSequence() {
+    nextSequence = 0;
+    ackedSequence = 0;
+}
+
+uint32_t ChatClientEngine::msUntilAckDue() const {
+    if (nextSequence == ackedSequence) {
+        return NO_ACK_DUE;
+    }
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - firstUnackedAt).count();
+    return elapsed >= ACK_INTERVAL_MS ? 0 : static_cast<uint32_t>(ACK_INTERVAL_MS - elapsed);
+}
+
+// Acks are only sent while settled in a room or the lobby; during a room change the
+// server could apply one to the wrong room, and after a disconnect the resume carries
+// the position instead.
+void ChatClientEngine::sendDueAck() {
+    if (nextSequence == ackedSequence || (currentState != CLIENT_LOBBY && currentState != CLIENT_IN_ROOM)) {
+        return;
+    }
+    if (nextSequence - ackedSequence < ACK_BATCH_MESSAGES && msUntilAckDue() != 0) {
+        return;
+    }
+    if (sendLine("COMMAND:ACK:" + to_string(nextSequence))) {
+        ackedSequence = nextSequence;
+    }
+}
+
+bool ChatClientEngine::sendLine(const string& line) {
+    if (socketFD == INVALID_SOCKET) {
+        return false;
+    }
+
+    string data = line + "\n";
+    if (usingSharedMemory()) {
+        sharedOutput += data;
+        flushSharedOutput();
+        return true;
+    }
+
+    size_t sent = 0;
+    while (sent < data.length()) {
+        int bytesSent = send(socketFD, data.c_str() + sent, static_cast<int>(data.length() - sent), 0);
+        if (bytesSent == SOCKET_ERROR) {
+            int errorCode = WSAGetLastError();
+            if (errorCode != WSAEWOULDBLOCK) {
+                cerr << "send failed with error: " << errorCode << endl;
+                return false;
+            }
+            fd_set writable;
+            FD_ZERO(&writable);
+            FD_SET(socketFD, &writable);
+            select(static_cast<int>(socketFD + 1), nullptr, &writable, nullptr, nullptr);
+            continue;
+        }
+        sent += bytesSent;
+    }
+    return true;
+}
+
+bool ChatClientEngine::sendNickname(const string& name) {
+    if (currentState != CLIENT_NEEDS_NICKNAME || !sendLine("NICK " + name)) {
+        return false;
+    }
+    pendingNickname = name;
+    setState(CLIENT_NICKNAME_SENT);
+    return true;
+}
+
+bool ChatClientEngine::createRoom(const string& name, const string& memberCap, const string& topic) {
+    if ((currentState != CLIENT_LOBBY && currentState != CLIENT_IN_ROOM) ||
+        !sendLine("COMMAND:CREATE:" + name + ":" + memberCap + ":" + topic)) {
+        return false;
+    }
+    stateBeforeRequest = currentState;
+    setState(CLIENT_ROOM_REQUESTED);
+    return true;
+}
+
+bool ChatClientEngine::joinRoom(const string& name) {
+    if ((currentState != CLIENT_LOBBY && currentState != CLIENT_IN_ROOM) || !sendLine("COMMAND:JOIN:" + name)) {
+        return false;
+    }
+    stateBeforeRequest = currentState;
+    setState(CLIENT_ROOM_REQUESTED);
+    return true;
+}
+
+bool ChatClientEngine::leaveRoom() {
+    if (currentState != CLIENT_IN_ROOM || !sendLine("COMMAND:LEAVE")) {
+        return false;
+    }
+    setState(CLIENT_LEAVING);
+    return true;
+}
+
+bool ChatClientEngine::sendChat(const string& text) {
+    if (currentState != CLIENT_LOBBY && currentState != CLIENT_IN_ROOM) {
+        return false;
+    }
+    return sendLine(text);
+}
+
+bool ChatClientEngine::sendDirectMessage(const string& recipient, const string& text) {
+    if (currentState != CLIENT_LOBBY && currentState != CLIENT_IN_ROOM) {
+        return false;
+    }
+    return sendLine("COMMAND:MSG:" + recipient + ":" + text);
+}
+
+bool ChatClientEngine::setTopic(const string& topic) {
+    if (currentState != CLIENT_IN_ROOM) {
+        return false;
+    }
+    return sendLine("COMMAND:TOPIC:" + topic);
+}
+
+bool ChatClientEngine::requestRoomList() {
+    if (currentState != CLIENT_LOBBY && currentState != CLIENT_IN_ROOM) {
+        return false;
+    }
+    return sendLine("COMMAND:ROOMS");
+}
+
+bool ChatClientEngine::searchRoom(const string& terms, uint64_t before) {
+    if (currentState != CLIENT_IN_ROOM) {
+        return false;
+    }
+    return sendLine("COMMAND:SEARCH:" + roomName() + ":" + terms + (before == 0 ? string() : SEARCH_BEFORE_MARKER + to_string(before)));
+}
+
+bool ChatClientEngine::sendProbe(const string& token) {
+    if (currentState != CLIENT_LOBBY && currentState != CLIENT_IN_ROOM) {
+        return false;
+    }
+    return sendLine("COMMAND:PROBE:" + token);
+}
+
+void ChatClientEngine::handleNicknameRequired() {
+    if (currentState != CLIENT_AWAITING_PROMPT) {
+        return;
+    }
+    if (attachPending) {
+        promptDeferred = true;
+        return;
+    }
+    if (!resumeToken.empty() && sendLine("RESUME " + resumeToken + " " + to_string(nextSequence))) {
+        setState(CLIENT_RESUMING);
+    } else {
+        setState(CLIENT_NEEDS_NICKNAME);
+    }
+}
+
+void ChatClientEngine::handleNicknameRejected() {
+    if (currentState == CLIENT_NICKNAME_SENT) {
+        pendingNickname.clear();
+        setState(CLIENT_NEEDS_NICKNAME);
+    }
+}
+
+void ChatClientEngine::handleNicknameAccepted() {
+    if (currentState == CLIENT_NICKNAME_SENT) {
+        acceptedNickname = pendingNickname;
+        currentRoomName = LOBBY_ROOM_NAME;
+        resetSequence();
+        setState(CLIENT_LOBBY);
+    }
+}
+
+void ChatClientEngine::handleSession(string_view token) {
+    resumeToken = string(token);
+}
+
+void ChatClientEngine::handleResumed(string_view payload) {
+    if (currentState != CLIENT_RESUMING) {
+        return;
+    }
+    size_t colon = payload.find(':');
+    acceptedNickname = string(payload.substr(0, colon));
+    currentRoomName = colon == string_view::npos ? string(LOBBY_ROOM_NAME) : string(payload.substr(colon + 1));
+    setState(currentRoomName == LOBBY_ROOM_NAME ? CLIENT_LOBBY : CLIENT_IN_ROOM);
+}
+
+// The server no longer holds the session. Ask for the old nickname again, which lands
+// in the lobby if it is still free; the caller re-joins rooms from there.
+void ChatClientEngine::handleResumeRejected() {
+    if (currentState != CLIENT_RESUMING) {
+        return;
+    }
+    resumeToken.clear();
+    resetSequence();
+    if (!acceptedNickname.empty() && sendLine("NICK " + acceptedNickname)) {
+        pendingNickname = acceptedNickname;
+        setState(CLIENT_NICKNAME_SENT);
+    } else {
+        setState(CLIENT_NEEDS_NICKNAME);
+    }
+}
+
+void ChatClientEngine::handleRoomJoined(string_view name) {
+    currentRoomName = string(name);
+    resetSequence();
+    if (currentState == CLIENT_ROOM_REQUESTED || currentState == CLIENT_LOBBY) {
+        setState(CLIENT_IN_ROOM);
+    }
+}
+
+void ChatClientEngine::handleRoomLeft() {
+    currentRoomName = LOBBY_ROOM_NAME;
+    resetSequence();
+    if (currentState == CLIENT_LEAVING || currentState == CLIENT_IN_ROOM) {
+        setState(CLIENT_LOBBY);
+    }
+}
+
+// The server refused the connection and is about to close it. The session, if any, is
+// still held there; the owner should reconnect no sooner than retryAfterMs().
+void ChatClientEngine::handleServerBusy(string_view payload) {
+    size_t colon = payload.find(':');
+    uint32_t retrySeconds = static_cast<uint32_t>(strtoul(string(payload.substr(0, colon)).c_str(), nullptr, 10));
+    string reason = colon == string_view::npos ? "busy" : string(payload.substr(colon + 1));
+    busyRetryMs = retrySeconds * 1000;
+    disconnect("Server refused the connection (" + reason + "); retry after " + to_string(retrySeconds) + " s.");
+}
+
+// The nonce proves to the server that the segment SHM_ATTACH names was made for this
+// connection.
+void ChatClientEngine::handleSharedNonce(string_view payload) {
+    if (!attachPending) {
+        return;
+    }
+    uint64_t nonce = strtoull(string(payload).c_str(), nullptr, 16);
+    shared->seal(nonce);
+    if (nonce == 0 || !sendLine("SHM_ATTACH " + shared->name())) {
+        handleError();
+    }
+}
+
+// From here on the socket only carries doorbells. The consumer flag goes up before
+// anything else so that the server's first write wakes the owner.
+void ChatClientEngine::handleSharedAttached() {
+    if (!attachPending) {
+        return;
+    }
+    attachPending = false;
+    shared->inbound().armConsumer();
+    if (promptDeferred) {
+        promptDeferred = false;
+        handleNicknameRequired();
+    }
+}
+
+void ChatClientEngine::handleCompressing() {
+    compressPending = false;
+    compressionActive = true;
+}
+
+void ChatClientEngine::handleError() {
+    if (attachPending) {
+        attachPending = false;
+        delete shared;
+        shared = nullptr;
+        if (promptDeferred) {
+            promptDeferred = false;
+            handleNicknameRequired();
+        }
+        return;
+    }
+    if (compressPending) {
+        compressPending = false;
+        return;
+    }
+    if (currentState == CLIENT_NICKNAME_SENT) {
+        pendingNickname.clear();
+        setState(CLIENT_NEEDS_NICKNAME);
+    } else if (currentState == CLIENT_ROOM_REQUESTED) {
+        setState(stateBeforeRequest);
+    }
+}
+
+void ChatClientEngine::setState(ClientState next) {
+    ClientState previous = currentState;
+    if (previous == next) {
+        return;
+    }
+    currentState = next;
+    if (listener != nullptr) {
+        listener->onStateChanged(previous, next);
+    }
+}
+
+void ChatClientEngine::disconnect(const string& reason) {
+    setState(CLIENT_DISCONNECTED);
+    if (listener != nullptr) {
+        listener->onDisconnected(reason);
+    }
+}
+
+ReconnectBackoff::ReconnectBackoff(uint32_t baseMs, uint32_t capMs, uint32_t maxAttempts)
+    : baseMs(baseMs), capMs(capMs), maxAttempts(maxAttempts), attemptCount(0), random(random_device()()) {}
+
+uint32_t ReconnectBackoff::nextDelayMs() {
+    uint64_t ceiling = static_cast<uint64_t>(baseMs) << min<uint32_t>(attemptCount, 20);
+    attemptCount++;
+    uniform_int_distribution<uint32_t> delay(0, static_cast<uint32_t>(min<uint64_t>(ceiling, capMs)));
+    return delay(random);
+}
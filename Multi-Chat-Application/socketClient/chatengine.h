@@ -0,0 +1,188 @@
+#ifndef SOCKETCLIENT_CHATENGINE_H
+#define SOCKETCLIENT_CHATENGINE_H
+
+#include "protocol.h"
+#include "sharedring.h"
+#include "socketutil.h"
+#include <chrono>
+#include <cstdint>
+#include <random>
+
+// Where a client is in the conversation with the server. Requests are only accepted in
+// the states that allow them, and replies only move the state along the edges below:
+//
+//   AWAITING_PROMPT --NICK_REQUIRED--> NEEDS_NICKNAME --sendNickname--> NICKNAME_SENT
+//   NICKNAME_SENT --NICK_ACCEPTED--> LOBBY, --NICK_REJECTED/ERROR--> NEEDS_NICKNAME
+//   LOBBY/IN_ROOM --createRoom/joinRoom--> ROOM_REQUESTED
+//   ROOM_REQUESTED --ROOM_JOINED--> IN_ROOM, --ERROR--> back where the request was made
+//   IN_ROOM --leaveRoom--> LEAVING --ROOM_LEFT--> LOBBY
+//   any state --server gone or SERVER_BUSY--> DISCONNECTED --reconnect--> AWAITING_PROMPT
+//   AWAITING_PROMPT --NICK_REQUIRED, holding a session--> RESUMING
+//   RESUMING --RESUMED--> LOBBY or IN_ROOM, --RESUME_REJECTED--> NICKNAME_SENT (old name)
+// A client attaching shared memory stays in AWAITING_PROMPT until SHM_ATTACHED or ERROR,
+// sending SHM_ATTACH once SHM_NONCE arrives.
+enum ClientState : uint8_t {
+    CLIENT_DISCONNECTED = 0,
+    CLIENT_AWAITING_PROMPT = 1,
+    CLIENT_NEEDS_NICKNAME = 2,
+    CLIENT_NICKNAME_SENT = 3,
+    CLIENT_LOBBY = 4,
+    CLIENT_ROOM_REQUESTED = 5,
+    CLIENT_IN_ROOM = 6,
+    CLIENT_LEAVING = 7,
+    CLIENT_RESUMING = 8
+};
+
+const char* ClientStateName(ClientState state);
+
+// Callbacks from ChatClientEngine. onFrame sees every line the server sends, already
+// classified, before any state change it causes is reported.
+class ChatClientListener {
+public:
+    virtual ~ChatClientListener() {}
+    virtual void onFrame(const Frame& frame, const string& line) {}
+    virtual void onStateChanged(ClientState previous, ClientState current) {}
+    virtual void onDisconnected(const string& reason) {}
+};
+
+// The client side of the chat protocol, without any I/O policy of its own: the owner
+// runs the event loop, waits for the socket to be readable and calls onReadable().
+// The interactive client, bots and the load generator all drive the same engine.
+class ChatClientEngine {
+public:
+    ChatClientEngine();
+    ~ChatClientEngine();
+
+    // Blocking connect, after which the socket is switched to non-blocking mode. host is
+    // an IPv4 or IPv6 address, or unix:<path> for a server on the same machine.
+    bool connectTo(const string& host, int port);
+    // Connects to the same server again and resumes the session if there is one to
+    // resume. The nickname, room and message position survive the dropped connection.
+    bool reconnect();
+    // Ends the session for good: the server is told to quit rather than hold it.
+    void close();
+    bool canResume() const { return !resumeToken.empty(); }
+    // Ask the server to move this connection onto shared-memory rings, from the next
+    // connect on. Only works with a server on the same machine; if the server cannot
+    // open the rings the connection carries on over the socket. The owner keeps
+    // waiting on socket(), which then only carries doorbells.
+    void setSharedMemory(bool enabled) { sharedMemoryWanted = enabled; }
+    bool usingSharedMemory() const { return shared != nullptr && !attachPending; }
+    // Ask the server to compress its output (framecompress.h), from the next connect on.
+    // Not asked for over shared memory. usingCompression() says whether it agreed.
+    void setCompression(bool enabled) { compressionWanted = enabled; }
+    bool usingCompression() const { return compressionActive; }
+    // Set when the server refused the last connection as busy: the least time to wait
+    // before the next attempt. 0 otherwise.
+    uint32_t retryAfterMs() const { return busyRetryMs; }
+
+    SOCKET socket() const { return socketFD; }
+    ClientState state() const { return currentState; }
+    const string& nickname() const { return acceptedNickname; }
+    const string& roomName() const { return currentRoomName; }
+    void setListener(ChatClientListener* newListener) { listener = newListener; }
+
+    // Reads everything the socket has and handles each complete line. Returns false
+    // once the server has gone away.
+    bool onReadable();
+
+    // Requests. Each returns false without sending if the current state does not
+    // allow it or the send fails.
+    bool sendNickname(const string& name);
+    bool createRoom(const string& name, const string& memberCap, const string& topic);
+    bool joinRoom(const string& name);
+    bool leaveRoom();
+    bool sendChat(const string& text);
+    bool sendDirectMessage(const string& recipient, const string& text);
+    bool setTopic(const string& topic);
+    bool requestRoomList();
+    // Searches the room the client is in. Results come back as SEARCH_RESULT frames and a
+    // SEARCH_END that says where the next page starts; before 0 asks for the newest matches.
+    bool searchRoom(const string& terms, uint64_t before = 0);
+    // The server echoes the token back in a PROBE frame.
+    bool sendProbe(const string& token);
+
+    // Raw protocol line, for tools that speak commands the engine has no helper for.
+    bool sendLine(const string& line);
+
+    // Room messages are acknowledged with one cumulative COMMAND:ACK per batch rather
+    // than one per message. onReadable() sends the ack when a batch fills up; the owner
+    // wakes up within msUntilAckDue() and calls sendDueAck() for the rest.
+    // NO_ACK_DUE means nothing is waiting to be acknowledged.
+    static constexpr uint32_t NO_ACK_DUE = UINT32_MAX;
+    uint32_t msUntilAckDue() const;
+    void sendDueAck();
+
+    // Called by the frame handlers in chatengine.cpp.
+    void handleNicknameRequired();
+    void handleNicknameRejected();
+    void handleNicknameAccepted();
+    void handleSession(string_view token);
+    void handleResumed(string_view payload);
+    void handleResumeRejected();
+    void handleRoomJoined(string_view name);
+    void handleRoomLeft();
+    void handleServerBusy(string_view payload);
+    void handleSharedNonce(string_view payload);
+    void handleSharedAttached();
+    void handleCompressing();
+    void handleError();
+
+private:
+    bool openSocket();
+    void closeSocket();
+    void handleLine(string_view line);
+    void takeServerLines();
+    void setState(ClientState next);
+    void disconnect(const string& reason);
+    void resetSequence();
+    bool readSharedRing();
+    void flushSharedOutput();
+
+    SOCKET socketFD;
+    string serverIP;
+    int serverPort;
+    ClientState currentState;
+    ClientState stateBeforeRequest;
+    ChatClientListener* listener;
+    string pendingNickname;
+    string acceptedNickname;
+    string currentRoomName;
+    string serverInput;
+    string resumeToken;
+    uint64_t nextSequence;
+    uint64_t ackedSequence;
+    chrono::steady_clock::time_point firstUnackedAt;
+    uint32_t busyRetryMs;
+    bool sharedMemoryWanted;
+    SharedChannel* shared;
+    bool attachPending;
+    bool promptDeferred;
+    string sharedOutput;
+    bool compressionWanted;
+    bool compressPending;
+    bool compressionActive;
+    string frameLines;
+};
+
+// Full-jitter exponential backoff for reconnects: attempt n waits a uniformly random
+// time up to min(cap, base * 2^n), so clients dropped together by a server restart
+// spread their reconnects out instead of all arriving at once.
+class ReconnectBackoff {
+public:
+    ReconnectBackoff(uint32_t baseMs = 250, uint32_t capMs = 30000, uint32_t maxAttempts = 10);
+
+    uint32_t nextDelayMs();
+    bool exhausted() const { return attemptCount >= maxAttempts; }
+    uint32_t attempts() const { return attemptCount; }
+    void reset() { attemptCount = 0; }
+
+private:
+    uint32_t baseMs;
+    uint32_t capMs;
+    uint32_t maxAttempts;
+    uint32_t attemptCount;
+    mt19937 random;
+};
+
+#endif //SOCKETCLIENT_CHATENGINE_H
@@ -1,265 +1,692 @@
+#include "chatengine.h"
+#include "headless.h"
+#include "protocol.h"
+#include "renderer.h"
 #include "socketutil.h"
+#include <chrono>
+#include <coroutine>
+#include <cstdlib>
+#include <ctime>
+#include <deque>
+#include <exception>
+#include <optional>
+
+// Fire-and-forget coroutine for the client's nickname -> room -> chat flow. It parks
+// on leaveState() and readLine() and is resumed by the event loop in main().
+struct ClientTask {
+    struct promise_type {
+        ClientTask get_return_object() { return ClientTask(); }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+};
+
+ChatClientEngine engine;
+bool serverClosed = false;
+bool inputClosed = false;
+bool clientFinished = false;
+
+coroutine_handle<> stateWaiter;
+ClientState awaitedState = CLIENT_DISCONNECTED;
+
+ReconnectBackoff reconnectBackoff;
+bool reconnectPending = false;
+chrono::steady_clock::time_point reconnectAt;
+
+deque<string> typedLines;
+coroutine_handle<> lineWaiter;
+string editLine;
+string promptText;
+bool isTypingPromptActive = false;
+
+// Used when stdin is redirected instead of attached to a console.
+mutex redirectedInputMutex;
+deque<string> redirectedLines;
+bool redirectedInputClosed = false;
+HANDLE redirectedInputEvent = nullptr;
+
+ConsoleRenderer renderer;
+
+// The last /search, so /more can ask for its next page.
+string lastSearchTerms;
+uint64_t nextSearchPage = 0;
+
+void renderFrame() {
+    renderer.render(isTypingPromptActive, promptText, editLine);
+}
 
-atomic<bool> nicknameAccepted(false);
-atomic<bool> awaitingNicknameInput(false);
-atomic<bool> roomJoined(false);
-atomic<bool> awaitingRoomSelection(false);
-atomic<bool> isTypingPromptActive(false);
-atomic<bool> isExitingApplication(false);
+// Sparse messages show up straight away; a burst is coalesced into the next frame,
+// which the event loop in main() paints when it is due.
+void printIncomingMessage(const string& message) {
+    renderer.post(message);
+    if (renderer.msUntilFrame() == 0) {
+        renderFrame();
+    }
+}
 
-mutex clientStateMutex;
-condition_variable clientStateCv;
+// States the engine only passes through while it reconnects and resumes the session.
+bool isReconnecting(ClientState state) {
+    return state == CLIENT_DISCONNECTED || state == CLIENT_AWAITING_PROMPT || state == CLIENT_RESUMING;
+}
 
-string currentRoomNumber = "";
+class StateAwaiter {
+public:
+    explicit StateAwaiter(ClientState state) : state(state) {}
 
-static mutex cout_mutex;
+    bool await_ready() { return serverClosed || (engine.state() != state && !isReconnecting(engine.state())); }
+    void await_suspend(coroutine_handle<> handle) {
+        stateWaiter = handle;
+        awaitedState = state;
+    }
+    ClientState await_resume() { return serverClosed ? CLIENT_DISCONNECTED : engine.state(); }
+
+private:
+    ClientState state;
+};
+
+// Waits until the engine moves out of the given state, typically one that is waiting
+// for the server to answer a request, and returns the state it moved to. A dropped
+// connection that is being resumed does not count as moving; the wait ends once the
+// session is back, or with CLIENT_DISCONNECTED when the client gives up on it.
+StateAwaiter leaveState(ClientState state) {
+    return StateAwaiter(state);
+}
 
-void printIncomingMessage(const string& message) {
-    lock_guard<mutex> lock(cout_mutex);
+class LineAwaiter {
+public:
+    explicit LineAwaiter(const string& prompt) : prompt(prompt) {}
 
-    if (isTypingPromptActive.load()) {
-        cout << "\r" << string(120, ' ') << "\r";
-        cout << message;
-        cout << "> " << flush;
-    } else {
-        cout << message;
+    bool await_ready() {
+        return !typedLines.empty() || inputClosed || serverClosed;
+    }
+
+    void await_suspend(coroutine_handle<> handle) {
+        lineWaiter = handle;
+        promptText = prompt;
+        isTypingPromptActive = true;
+        renderFrame();
+    }
+
+    optional<string> await_resume() {
+        isTypingPromptActive = false;
+        if (renderer.isDirty()) {
+            renderFrame();
+        }
+        if (typedLines.empty() || serverClosed) {
+            return nullopt;
+        }
+        string line = typedLines.front();
+        typedLines.pop_front();
+        return line;
+    }
+
+private:
+    string prompt;
+};
+
+// Shows the prompt and waits for the user to finish a line. Returns nullopt when
+// input ends or the server disconnects.
+LineAwaiter readLine(const string& prompt) {
+    return LineAwaiter(prompt);
+}
+
+void resumeWaiter(coroutine_handle<>& waiter) {
+    coroutine_handle<> handle = waiter;
+    waiter = nullptr;
+    if (handle) {
+        handle.resume();
     }
 }
 
-void receiveMessages(SOCKET serverSocketFD) {
-    char buffer[1024];
+template <FrameKind Kind>
+struct ServerFrameHandler {
+    static void handle(const Frame& frame, const string& line) {
+        printIncomingMessage(line + "\n");
+    }
+};
 
-    while (true) {
-        memset(buffer, 0, sizeof(buffer));
-        int bytesReceived = recv(serverSocketFD, buffer, sizeof(buffer) - 1, 0);
+template <>
+struct ServerFrameHandler<FRAME_NICK_REQUIRED> {
+    static void handle(const Frame& frame, const string& line) {}
+};
 
-        if (bytesReceived <= 0) {
-            if (bytesReceived == 0) {
-                printIncomingMessage("\nServer disconnected gracefully.\n");
-            } else {
-                printIncomingMessage("\nServer receive failed with error: " + to_string(WSAGetLastError()) + "\n");
-            }
-            isExitingApplication.store(true);
-            nicknameAccepted.store(true);
-            roomJoined.store(true);
-            awaitingNicknameInput.store(false);
-            awaitingRoomSelection.store(false);
-            clientStateCv.notify_all();
-            break;
-        }
+template <>
+struct ServerFrameHandler<FRAME_NICK_REJECTED> {
+    static void handle(const Frame& frame, const string& line) {
+        printIncomingMessage("Server: " + line + "\n");
+    }
+};
+
+template <>
+struct ServerFrameHandler<FRAME_NICK_ACCEPTED> {
+    static void handle(const Frame& frame, const string& line) {
+        printIncomingMessage("Nickname accepted! Proceeding to room selection...\n");
+    }
+};
+
+template <>
+struct ServerFrameHandler<FRAME_SESSION> {
+    static void handle(const Frame& frame, const string& line) {}
+};
+
+template <>
+struct ServerFrameHandler<FRAME_COMPRESSING> {
+    static void handle(const Frame& frame, const string& line) {}
+};
+
+template <>
+struct ServerFrameHandler<FRAME_RESUMED> {
+    static void handle(const Frame& frame, const string& line) {
+        size_t colon = frame.payload.find(':');
+        string roomName = colon == string_view::npos ? string() : string(frame.payload.substr(colon + 1));
+        string where = roomName.empty() || roomName == LOBBY_ROOM_NAME ? string("the lobby") : "room '" + roomName + "'";
+        printIncomingMessage("Reconnected. You are back in " + where + ".\n");
+    }
+};
+
+template <>
+struct ServerFrameHandler<FRAME_RESUME_REJECTED> {
+    static void handle(const Frame& frame, const string& line) {
+        printIncomingMessage("Server: " + line + " Signing in again as '" + engine.nickname() + "'.\n");
+    }
+};
+
+template <>
+struct ServerFrameHandler<FRAME_ROOM_JOINED> {
+    static void handle(const Frame& frame, const string& line) {
+        printIncomingMessage("Server: Successfully joined room '" + string(frame.payload) + "'.\n");
+    }
+};
+
+template <>
+struct ServerFrameHandler<FRAME_ROOM_LEFT> {
+    static void handle(const Frame& frame, const string& line) {
+        printIncomingMessage("Server: You have left room '" + string(frame.payload) + "'.\n");
+    }
+};
+
+// The disconnect that follows says why, and when the client will try again.
+template <>
+struct ServerFrameHandler<FRAME_SERVER_BUSY> {
+    static void handle(const Frame& frame, const string& line) {}
+};
+
+template <>
+struct ServerFrameHandler<FRAME_SERVER_ERROR> {
+    static void handle(const Frame& frame, const string& line) {
+        printIncomingMessage("Server Error: " + line + "\n");
+    }
+};
+
+void displayDirectMessage(const Frame& frame, const string& direction) {
+    size_t colon = frame.payload.find(':');
+    if (colon != string_view::npos) {
+        string peer = string(frame.payload.substr(0, colon));
+        string text = string(frame.payload.substr(colon + 1));
+        printIncomingMessage("[DM " + direction + " " + peer + "]: " + text + "\n");
+    }
+}
 
-        buffer[bytesReceived] = '\0';
-        string message = buffer;
-
-        if (message.rfind("NICK_REQUIRED", 0) == 0) {
-            printIncomingMessage("Server: Please enter your desired nickname: ");
-            awaitingNicknameInput.store(true);
-            clientStateCv.notify_all();
-        } else if (message.rfind("NICK_REJECTED", 0) == 0) {
-            printIncomingMessage("Server: " + message);
-            printIncomingMessage(" Please try another nickname: ");
-            awaitingNicknameInput.store(true);
-            clientStateCv.notify_all();
-        } else if (message.rfind("NICK_ACCEPTED", 0) == 0) {
-            printIncomingMessage("Nickname accepted! Proceeding to room selection...\n");
-            nicknameAccepted.store(true);
-            awaitingNicknameInput.store(false);
-            awaitingRoomSelection.store(true);
-            clientStateCv.notify_all();
-        } else if (message.rfind("ROOM_JOINED:", 0) == 0) {
-            currentRoomNumber = message.substr(message.find(":") + 1);
-            currentRoomNumber = currentRoomNumber.substr(0, currentRoomNumber.find("\n"));
-            printIncomingMessage("Server: Successfully joined room number '" + currentRoomNumber + "'.\n");
-            roomJoined.store(true);
-            awaitingRoomSelection.store(false);
-            clientStateCv.notify_all();
-        } else if (message.rfind("ROOM_LEFT:", 0) == 0) {
-            string leftRoomNum = message.substr(message.find(":") + 1);
-            leftRoomNum = leftRoomNum.substr(0, leftRoomNum.find("\n"));
-            printIncomingMessage("Server: You have left room number '" + leftRoomNum + "'.\n");
-            roomJoined.store(false);
-            awaitingRoomSelection.store(true);
-            clientStateCv.notify_all();
+template <>
+struct ServerFrameHandler<FRAME_DM_FROM> {
+    static void handle(const Frame& frame, const string& line) {
+        displayDirectMessage(frame, "from");
+    }
+};
+
+template <>
+struct ServerFrameHandler<FRAME_DM_SENT> {
+    static void handle(const Frame& frame, const string& line) {
+        displayDirectMessage(frame, "to");
+    }
+};
+
+template <>
+struct ServerFrameHandler<FRAME_USER_LIST> {
+    static void handle(const Frame& frame, const string& line) {
+        size_t colon = frame.payload.find(':');
+        if (colon != string_view::npos) {
+            string roomName = string(frame.payload.substr(0, colon));
+            string users = string(frame.payload.substr(colon + 1));
+            printIncomingMessage("--- Users in room '" + roomName + "': " + users + " ---\n");
         }
-        else if (message.rfind("ERROR:", 0) == 0) {
-            printIncomingMessage("Server Error: " + message);
-            if (!roomJoined.load()) {
-                awaitingRoomSelection.store(true);
-                clientStateCv.notify_all();
-            }
-        } else if (message.rfind("USER_LIST:", 0) == 0) {
-            size_t first_colon = message.find(":");
-            size_t second_colon = message.find(":", first_colon + 1);
-            if (first_colon != string::npos && second_colon != string::npos) {
-                string roomNum = message.substr(first_colon + 1, second_colon - (first_colon + 1));
-                string users = message.substr(second_colon + 1);
-                users = users.substr(0, users.find("\n"));
-                printIncomingMessage("--- Users in room number '" + roomNum + "': " + users + " ---\n");
+    }
+};
+
+template <>
+struct ServerFrameHandler<FRAME_ROOM_INFO> {
+    static void handle(const Frame& frame, const string& line) {
+        vector<string> fields;
+        size_t start = 0;
+        while (fields.size() < 4) {
+            size_t colon = frame.payload.find(':', start);
+            if (colon == string_view::npos) {
+                break;
             }
-        } else {
-            printIncomingMessage(message);
+            fields.push_back(string(frame.payload.substr(start, colon - start)));
+            start = colon + 1;
+        }
+        if (fields.size() == 4) {
+            string topic = string(frame.payload.substr(start));
+            time_t createdAt = static_cast<time_t>(stoll(fields[3]));
+            char createdAtText[32];
+            strftime(createdAtText, sizeof(createdAtText), "%Y-%m-%d %H:%M", localtime(&createdAt));
+            string members = fields[2] == "0" ? fields[1] : fields[1] + "/" + fields[2];
+            printIncomingMessage("--- Room '" + fields[0] + "' | topic: " + (topic.empty() ? "(none)" : topic) + " | members: " + members + " | created " + createdAtText + " ---\n");
         }
     }
-    shutdown(serverSocketFD, SD_SEND);
-    closesocket(serverSocketFD);
-}
+};
+
+template <>
+struct ServerFrameHandler<FRAME_TOPIC> {
+    static void handle(const Frame& frame, const string& line) {
+        size_t roomEnd = frame.payload.find(':');
+        size_t setterEnd = roomEnd == string_view::npos ? string_view::npos : frame.payload.find(':', roomEnd + 1);
+        if (setterEnd != string_view::npos) {
+            string setter = string(frame.payload.substr(roomEnd + 1, setterEnd - (roomEnd + 1)));
+            string topic = string(frame.payload.substr(setterEnd + 1));
+            printIncomingMessage("--- " + setter + " changed the topic to: " + topic + " ---\n");
+        }
+    }
+};
 
-int main() {
-    WSADATA wsaData;
-    int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
-    if (iResult != 0) {
-        cerr << "WSAStartup failed: " << iResult << endl;
-        return 1;
+template <>
+struct ServerFrameHandler<FRAME_ROOM_LIST> {
+    static void handle(const Frame& frame, const string& line) {
+        string roomList = string(frame.payload);
+        printIncomingMessage("--- Open rooms: " + (roomList.empty() ? string("(none)") : roomList) + " ---\n");
+    }
+};
+
+template <>
+struct ServerFrameHandler<FRAME_SEARCH_RESULT> {
+    static void handle(const Frame& frame, const string& line) {
+        size_t roomEnd = frame.payload.find(':');
+        size_t sequenceEnd = roomEnd == string_view::npos ? string_view::npos : frame.payload.find(':', roomEnd + 1);
+        if (sequenceEnd != string_view::npos) {
+            string sequence = string(frame.payload.substr(roomEnd + 1, sequenceEnd - (roomEnd + 1)));
+            printIncomingMessage("  #" + sequence + " " + string(frame.payload.substr(sequenceEnd + 1)) + "\n");
+        }
+    }
+};
+
+template <>
+struct ServerFrameHandler<FRAME_HISTORY> {
+    static void handle(const Frame& frame, const string& line) {
+        size_t roomEnd = frame.payload.find(':');
+        size_t sequenceEnd = roomEnd == string_view::npos ? string_view::npos : frame.payload.find(':', roomEnd + 1);
+        if (sequenceEnd != string_view::npos) {
+            printIncomingMessage("(earlier) " + string(frame.payload.substr(sequenceEnd + 1)) + "\n");
+        }
+    }
+};
+
+template <>
+struct ServerFrameHandler<FRAME_SEARCH_END> {
+    static void handle(const Frame& frame, const string& line) {
+        size_t roomEnd = frame.payload.find(':');
+        size_t countEnd = roomEnd == string_view::npos ? string_view::npos : frame.payload.find(':', roomEnd + 1);
+        if (countEnd == string_view::npos) {
+            return;
+        }
+        string count = string(frame.payload.substr(roomEnd + 1, countEnd - (roomEnd + 1)));
+        nextSearchPage = strtoull(string(frame.payload.substr(countEnd + 1)).c_str(), nullptr, 10);
+        printIncomingMessage("--- " + count + " matches" + (nextSearchPage != 0 ? string(", '/more' for older ones") : string()) + " ---\n");
     }
+};
 
-    SOCKET clientSocketFD = CreateTCPIPv4Socket();
-    if (clientSocketFD == INVALID_SOCKET) {
-        cerr << "socket failed with error: " << WSAGetLastError() << endl;
-        WSACleanup();
-        return 1;
+constexpr auto serverFrameHandlers = makeFrameDispatchTable<ServerFrameHandler>();
+
+// Renders what the engine receives and wakes the session coroutine when the protocol
+// state it is waiting on changes.
+class ConsoleListener : public ChatClientListener {
+public:
+    void onFrame(const Frame& frame, const string& line) override {
+        serverFrameHandlers[frame.kind](frame, line);
     }
 
-    sockaddr_in address = CreateIPv4Address("127.0.0.1", 8580);
+    void onStateChanged(ClientState previous, ClientState current) override {
+        if (current == CLIENT_LOBBY || current == CLIENT_IN_ROOM) {
+            reconnectBackoff.reset();
+        }
+        if (current != awaitedState && !isReconnecting(current)) {
+            resumeWaiter(stateWaiter);
+        }
+    }
 
-    int connection_status = connect(clientSocketFD, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
-    if (connection_status == SOCKET_ERROR) {
-        cerr << "connect failed with error: " << WSAGetLastError() << endl;
-        closesocket(clientSocketFD);
-        WSACleanup();
-        return 1;
+    void onDisconnected(const string& reason) override {
+        if (engine.canResume() && !reconnectBackoff.exhausted()) {
+            scheduleReconnect(reason);
+            return;
+        }
+        printIncomingMessage("\n" + reason + "\n");
+        giveUp();
     }
-    cout << "Connected to server. Waiting for nickname prompt...\n" << endl;
 
-    thread receiverThread(receiveMessages, clientSocketFD);
-    receiverThread.detach();
+    static void scheduleReconnect(const string& reason) {
+        uint32_t delayMs = max(reconnectBackoff.nextDelayMs(), engine.retryAfterMs());
+        printIncomingMessage("\n" + reason + " Reconnecting in " + to_string(delayMs) + " ms (attempt " + to_string(reconnectBackoff.attempts()) + ")...\n");
+        reconnectPending = true;
+        reconnectAt = chrono::steady_clock::now() + chrono::milliseconds(delayMs);
+    }
 
-    string input;
+    static void giveUp() {
+        serverClosed = true;
+        resumeWaiter(stateWaiter);
+        resumeWaiter(lineWaiter);
+    }
+};
 
-    while (!nicknameAccepted.load() && !isExitingApplication.load()) {
-        unique_lock<mutex> lock(clientStateMutex);
-        clientStateCv.wait(lock, []{ return awaitingNicknameInput.load() || nicknameAccepted.load() || isExitingApplication.load(); });
+void finishTypedLine() {
+    cout << "\n" << flush;
+    typedLines.push_back(editLine);
+    editLine.clear();
+    resumeWaiter(lineWaiter);
+}
 
-        if (isExitingApplication.load()) break;
+void handleConsoleInput(HANDLE consoleInput) {
+    INPUT_RECORD records[64];
+    DWORD recordCount = 0;
+    if (!ReadConsoleInputA(consoleInput, records, 64, &recordCount)) {
+        inputClosed = true;
+        resumeWaiter(lineWaiter);
+        return;
+    }
 
-        if (nicknameAccepted.load()) {
-            break;
+    for (DWORD i = 0; i < recordCount; ++i) {
+        if (records[i].EventType != KEY_EVENT || !records[i].Event.KeyEvent.bKeyDown) {
+            continue;
         }
+        char typed = records[i].Event.KeyEvent.uChar.AsciiChar;
+        for (WORD repeat = 0; repeat < records[i].Event.KeyEvent.wRepeatCount; ++repeat) {
+            if (typed == '\r') {
+                finishTypedLine();
+            } else if (typed == '\b') {
+                if (!editLine.empty()) {
+                    editLine.pop_back();
+                    cout << "\b \b" << flush;
+                }
+            } else if (static_cast<unsigned char>(typed) >= 32) {
+                editLine += typed;
+                cout << typed << flush;
+            }
+        }
+    }
+}
 
-        if (awaitingNicknameInput.load()) {
-            isTypingPromptActive.store(true);
-            getline(cin, input);
-            isTypingPromptActive.store(false);
+void readRedirectedInput() {
+    string line;
+    while (getline(cin, line)) {
+        lock_guard<mutex> lock(redirectedInputMutex);
+        redirectedLines.push_back(line);
+        SetEvent(redirectedInputEvent);
+    }
+    lock_guard<mutex> lock(redirectedInputMutex);
+    redirectedInputClosed = true;
+    SetEvent(redirectedInputEvent);
+}
 
-            string nickCommand = "NICK " + input + "\n";
-            send(clientSocketFD, nickCommand.c_str(), nickCommand.length(), 0);
-            awaitingNicknameInput.store(false);
-        }
+void handleRedirectedInput() {
+    deque<string> lines;
+    bool closed;
+    {
+        lock_guard<mutex> lock(redirectedInputMutex);
+        lines.swap(redirectedLines);
+        closed = redirectedInputClosed;
+    }
+    for (const string& line : lines) {
+        typedLines.push_back(line);
+        resumeWaiter(lineWaiter);
     }
+    if (closed) {
+        inputClosed = true;
+        resumeWaiter(lineWaiter);
+    }
+}
 
-    if (isExitingApplication.load()) {
-        cerr << "Exiting application due to server disconnect or user choice." << endl;
-        closesocket(clientSocketFD);
-        WSACleanup();
-        return 1;
+ClientTask runClient() {
+    ClientState state = co_await leaveState(CLIENT_AWAITING_PROMPT);
+    string prompt = "Server: Please enter your desired nickname: ";
+    while (state == CLIENT_NEEDS_NICKNAME) {
+        optional<string> nickname = co_await readLine(prompt);
+        if (!nickname || !engine.sendNickname(*nickname)) {
+            break;
+        }
+        state = co_await leaveState(CLIENT_NICKNAME_SENT);
+        prompt = " Please try another nickname: ";
     }
 
-room_selection_start: // Label for goto
-    while (!roomJoined.load() && !isExitingApplication.load()) {
-        unique_lock<mutex> lock(clientStateMutex);
-        clientStateCv.wait(lock, []{ return awaitingRoomSelection.load() || roomJoined.load() || isExitingApplication.load(); });
+    bool exiting = state != CLIENT_LOBBY;
+    while (!exiting) {
+        optional<string> choice = co_await readLine("\nDo you want to (1) Create a new room, (2) Join an existing room, or (3) Exit Application? (Enter 1, 2, or 3): ");
+        if (!choice || *choice == "3") {
+            exiting = true;
+            break;
+        }
+
+        optional<string> roomName;
+        optional<string> memberCap;
+        optional<string> topic;
+        if (*choice == "1") {
+            roomName = co_await readLine("Enter a name for your new room: ");
+            memberCap = co_await readLine("Maximum number of members (leave empty for no limit): ");
+            topic = co_await readLine("Room topic (optional): ");
+            if (!roomName || !memberCap || !topic) {
+                exiting = true;
+                break;
+            }
+        } else if (*choice == "2") {
+            engine.requestRoomList();
+            roomName = co_await readLine("Enter the name of the room you want to join: ");
+            if (!roomName) {
+                exiting = true;
+                break;
+            }
+        } else {
+            cout << "Invalid choice. Please enter 1, 2, or 3." << endl;
+            continue;
+        }
 
-        if (isExitingApplication.load()) break;
+        if (roomName->empty()) {
+            cout << "Room name cannot be empty. Please try again." << endl;
+            continue;
+        }
+        bool requested = *choice == "1" ? engine.createRoom(*roomName, *memberCap, *topic) : engine.joinRoom(*roomName);
+        if (!requested) {
+            if (serverClosed) {
+                exiting = true;
+                break;
+            }
+            cout << "Not connected to the server right now. Please try again in a moment." << endl;
+            continue;
+        }
 
-        if (roomJoined.load()) {
+        state = co_await leaveState(CLIENT_ROOM_REQUESTED);
+        if (state == CLIENT_DISCONNECTED) {
+            exiting = true;
             break;
         }
+        if (state != CLIENT_IN_ROOM) {
+            continue;
+        }
 
-        if (awaitingRoomSelection.load()) {
-            cout << "\nDo you want to (1) Create a new room, (2) Join an existing room, or (3) Exit Application? (Enter 1, 2, or 3): ";
-            isTypingPromptActive.store(true);
-            getline(cin, input);
-            isTypingPromptActive.store(false);
-
-            string roomNumberStr;
-            if (input == "1") {
-                cout << "Enter the number for your new room: ";
-                isTypingPromptActive.store(true);
-                getline(cin, roomNumberStr);
-                isTypingPromptActive.store(false);
-            } else if (input == "2") {
-                cout << "Enter the number of the room you want to join: ";
-                isTypingPromptActive.store(true);
-                getline(cin, roomNumberStr);
-                isTypingPromptActive.store(false);
-            } else if (input == "3") {
-                isExitingApplication.store(true);
+        printIncomingMessage("You are in room '" + engine.roomName() + "'. Start typing your messages (type 'exit' or 'quit' to leave, '/msg <nickname> <message>' to message one user, '/topic <text>' to set the room topic, '/history [count]' to see earlier messages, '/search <words>' to search the room):\n");
+
+        while (true) {
+            optional<string> input = co_await readLine("> ");
+            if (!input) {
+                exiting = true;
                 break;
             }
-            else {
-                cout << "Invalid choice. Please enter 1, 2, or 3." << endl;
-                awaitingRoomSelection.store(true);
+
+            if (*input == "exit" || *input == "quit") {
+                if (!engine.leaveRoom()) {
+                    exiting = true;
+                    break;
+                }
+                cout << "\nLeaving room... returning to room selection.\n";
+
+                state = co_await leaveState(CLIENT_LEAVING);
+                while (state == CLIENT_IN_ROOM && engine.leaveRoom()) {
+                    state = co_await leaveState(CLIENT_LEAVING);
+                }
+                exiting = state == CLIENT_DISCONNECTED;
+                break;
+            }
+
+            if (input->empty()) {
                 continue;
             }
+            if (engine.state() == CLIENT_LOBBY) {
+                printIncomingMessage("Your room could not be restored after reconnecting; returning to room selection.\n");
+                break;
+            }
 
-            if (roomNumberStr.empty() && !isExitingApplication.load()) {
-                cout << "Room number cannot be empty. Please try again." << endl;
-                awaitingRoomSelection.store(true);
+            if (*input == "/history" || input->rfind("/history ", 0) == 0) {
+                size_t count = input->length() > 9 ? strtoul(input->c_str() + 9, nullptr, 10) : 20;
+                renderer.showHistory(count);
                 continue;
             }
 
-            if (!isExitingApplication.load()) {
-                string joinCommand = "COMMAND:JOIN:" + roomNumberStr + "\n";
-                send(clientSocketFD, joinCommand.c_str(), joinCommand.length(), 0);
-                awaitingRoomSelection.store(false);
+            bool sent;
+            if (input->rfind("/msg ", 0) == 0) {
+                size_t nicknameEnd = input->find(' ', 5);
+                if (nicknameEnd == string::npos) {
+                    cout << "Usage: /msg <nickname> <message>" << endl;
+                    continue;
+                }
+                sent = engine.sendDirectMessage(input->substr(5, nicknameEnd - 5), input->substr(nicknameEnd + 1));
+            } else if (input->rfind("/topic ", 0) == 0) {
+                sent = engine.setTopic(input->substr(7));
+            } else if (input->rfind("/search ", 0) == 0) {
+                lastSearchTerms = input->substr(8);
+                nextSearchPage = 0;
+                sent = engine.searchRoom(lastSearchTerms);
+            } else if (*input == "/more") {
+                if (lastSearchTerms.empty() || nextSearchPage == 0) {
+                    cout << "No more search results." << endl;
+                    continue;
+                }
+                sent = engine.searchRoom(lastSearchTerms, nextSearchPage);
+            } else {
+                sent = engine.sendChat(*input);
+            }
+
+            if (!sent) {
+                if (serverClosed) {
+                    exiting = true;
+                    break;
+                }
+                printIncomingMessage("Not connected to the server right now; message not sent.\n");
             }
         }
     }
 
-    if (isExitingApplication.load()) {
-        cerr << "Exiting application." << endl;
+    clientFinished = true;
+}
+
+int main(int argc, char* argv[]) {
+    HeadlessOptions headlessOptions;
+    if (argc > 1 && !ParseHeadlessOptions(argc, argv, headlessOptions)) {
+        return 1;
+    }
+
+    WSADATA wsaData;
+    int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (iResult != 0) {
+        cerr << "WSAStartup failed: " << iResult << endl;
+        return 1;
+    }
+
+    if (argc > 1) {
+        int exitCode = RunHeadlessClient(headlessOptions);
         WSACleanup();
-        return 0;
+        return exitCode;
     }
 
-    printIncomingMessage("You are in room number '" + currentRoomNumber + "'. Start typing your messages (type 'exit' or 'quit' to leave):\n");
-    isTypingPromptActive.store(true);
-    cout << "> " << flush;
+    ConsoleListener listener;
+    engine.setListener(&listener);
+    engine.setCompression(true);
+    if (!engine.connectTo("127.0.0.1", 8580)) {
+        WSACleanup();
+        return 1;
+    }
+    cout << "Connected to server. Waiting for nickname prompt...\n" << endl;
 
-    while (getline(cin, input)) {
-        if (input == "exit" || input == "quit") {
-            string leaveCommand = "COMMAND:LEAVE\n";
-            send(clientSocketFD, leaveCommand.c_str(), leaveCommand.length(), 0);
+    WSAEVENT socketEvent = WSACreateEvent();
+    WSAEventSelect(engine.socket(), socketEvent, FD_READ | FD_CLOSE);
+
+    HANDLE inputHandle = GetStdHandle(STD_INPUT_HANDLE);
+    DWORD consoleMode = 0;
+    bool consoleInput = GetConsoleMode(inputHandle, &consoleMode) != 0;
+    if (!consoleInput) {
+        redirectedInputEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        inputHandle = redirectedInputEvent;
+        thread inputThread(readRedirectedInput);
+        inputThread.detach();
+    }
 
-            roomJoined.store(false);
-            awaitingRoomSelection.store(true);
-            isTypingPromptActive.store(false);
+    runClient();
 
-            cout << "\nLeaving room... returning to room selection.\n";
-            break;
+    while (!clientFinished) {
+        DWORD waitMs = INFINITE;
+        if (renderer.isDirty()) {
+            waitMs = renderer.msUntilFrame();
         }
-
-        if (input.empty()) {
-            cout << "> " << flush;
-            continue;
+        if (reconnectPending) {
+            auto remaining = chrono::duration_cast<chrono::milliseconds>(reconnectAt - chrono::steady_clock::now()).count();
+            waitMs = min(waitMs, static_cast<DWORD>(max<long long>(remaining, 0)));
+        }
+        if (engine.msUntilAckDue() != ChatClientEngine::NO_ACK_DUE) {
+            waitMs = min(waitMs, static_cast<DWORD>(engine.msUntilAckDue()));
         }
 
-        input += "\n";
+        HANDLE handles[2] = { socketEvent, inputHandle };
+        DWORD signaled = WaitForMultipleObjects(2, handles, FALSE, waitMs);
 
-        int send_status = send(clientSocketFD, input.c_str(), input.length(), 0);
-        if (send_status == SOCKET_ERROR) {
-            cerr << "send failed with error: " << WSAGetLastError() << endl;
+        if (signaled == WAIT_TIMEOUT) {
+            engine.sendDueAck();
+            if (renderer.isDirty() && renderer.msUntilFrame() == 0) {
+                renderFrame();
+            }
+            if (!reconnectPending || chrono::steady_clock::now() < reconnectAt) {
+                continue;
+            }
+            reconnectPending = false;
+            if (engine.reconnect()) {
+                WSAEventSelect(engine.socket(), socketEvent, FD_READ | FD_CLOSE);
+            } else if (!reconnectBackoff.exhausted()) {
+                ConsoleListener::scheduleReconnect("Reconnect failed.");
+            } else {
+                printIncomingMessage("Could not reconnect to the server.\n");
+                ConsoleListener::giveUp();
+            }
+        } else if (signaled == WAIT_OBJECT_0) {
+            WSANETWORKEVENTS networkEvents;
+            WSAEnumNetworkEvents(engine.socket(), socketEvent, &networkEvents);
+            engine.onReadable();
+        } else if (signaled == WAIT_OBJECT_0 + 1) {
+            if (consoleInput) {
+                handleConsoleInput(inputHandle);
+            } else {
+                handleRedirectedInput();
+            }
+        } else {
+            cerr << "WaitForMultipleObjects failed with error: " << GetLastError() << endl;
             break;
         }
-        cout << "> " << flush;
     }
 
-    if (!isExitingApplication.load()) {
-        goto room_selection_start;
+    if (serverClosed) {
+        cerr << "Exiting application due to server disconnect." << endl;
+    } else {
+        cerr << "Exiting application." << endl;
     }
 
-    isTypingPromptActive.store(false);
-    shutdown(clientSocketFD, SD_SEND);
-    closesocket(clientSocketFD);
+    WSACloseEvent(socketEvent);
+    engine.close();
     WSACleanup();
-    return 0;
-}
\ No newline at end of file
+    return serverClosed ? 1 : 0;
+}
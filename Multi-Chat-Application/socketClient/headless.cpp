@@ -0,0 +1,349 @@
+#include "headless.h"
+#include "chatengine.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+typedef chrono::steady_clock::time_point TimePoint;
+
+const char* const HEADLESS_USAGE =
+    "Usage: ChatClient --headless --nick <name> [--room <name> [--create <memberCap>] [--topic <text>]]\n"
+    "                  [--script <file> | --message <text>] [--count <lines>] [--rate <lines/s>]\n"
+    "                  [--probe-interval <ms>] [--duration <s>] [--server <ip | unix:path>] [--port <port>]\n"
+    "                  [--shared-memory] [--compress]";
+
+string jsonString(string_view text) {
+    string quoted = "\"";
+    for (char c : text) {
+        switch (c) {
+            case '"': quoted += "\\\""; break;
+            case '\\': quoted += "\\\\"; break;
+            case '\n': quoted += "\\n"; break;
+            case '\r': quoted += "\\r"; break;
+            case '\t': quoted += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    quoted += escaped;
+                } else {
+                    quoted += c;
+                }
+        }
+    }
+    return quoted + "\"";
+}
+
+int64_t wallClockMicroseconds() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+int64_t microsecondsBetween(TimePoint start, TimePoint end) {
+    return chrono::duration_cast<chrono::microseconds>(end - start).count();
+}
+
+// One JSON object per line: a wall-clock timestamp, the event name and any extra
+// fields, which the caller passes already formatted as ",\"name\":value" pairs.
+void emitEvent(const char* event, const string& fields) {
+    cout << "{\"ts_us\":" << wallClockMicroseconds() << ",\"event\":\"" << event << "\"" << fields << "}" << endl;
+}
+
+class HeadlessListener : public ChatClientListener {
+public:
+    void onFrame(const Frame& frame, const string& line) override {
+        TimePoint now = chrono::steady_clock::now();
+        if (frame.kind == FRAME_PROBE) {
+            uint64_t sequence = strtoull(string(frame.payload).c_str(), nullptr, 10);
+            auto pending = pendingProbes.find(sequence);
+            if (pending == pendingProbes.end()) {
+                return;
+            }
+            int64_t roundTrip = microsecondsBetween(pending->second, now);
+            pendingProbes.erase(pending);
+            roundTrips.push_back(roundTrip);
+            emitEvent("probe", ",\"seq\":" + to_string(sequence) + ",\"rtt_us\":" + to_string(roundTrip));
+            return;
+        }
+
+        if (frame.kind == FRAME_TEXT) {
+            receivedLines++;
+        }
+        string kind = frame.kind == FRAME_TEXT ? string("TEXT") : string(frameTag(frame.kind));
+        emitEvent("frame", ",\"kind\":" + jsonString(kind) + ",\"line\":" + jsonString(line));
+    }
+
+    void onStateChanged(ClientState previous, ClientState current) override {
+        emitEvent("state", ",\"from\":\"" + string(ClientStateName(previous)) + "\",\"to\":\"" + ClientStateName(current) + "\"");
+    }
+
+    // Probes still outstanding died with the connection; they count as unanswered.
+    void onDisconnected(const string& reason) override {
+        emitEvent("disconnected", ",\"reason\":" + jsonString(reason));
+        pendingProbes.clear();
+    }
+
+    map<uint64_t, TimePoint> pendingProbes;
+    vector<int64_t> roundTrips;
+    uint64_t receivedLines = 0;
+};
+
+bool loadScript(const string& path, vector<string>& script) {
+    ifstream file(path);
+    if (!file) {
+        return false;
+    }
+    string line;
+    while (getline(file, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            script.push_back(line);
+        }
+    }
+    return true;
+}
+
+bool ParseHeadlessOptions(int argc, char* argv[], HeadlessOptions& options) {
+    bool headless = false;
+    string scriptPath;
+    for (int i = 1; i < argc; ++i) {
+        string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (option == "--headless") {
+            headless = true;
+        } else if (option == "--nick" && hasValue) {
+            options.nickname = argv[++i];
+        } else if (option == "--room" && hasValue) {
+            options.roomName = argv[++i];
+        } else if (option == "--create" && hasValue) {
+            options.createMemberCap = argv[++i];
+        } else if (option == "--topic" && hasValue) {
+            options.topic = argv[++i];
+        } else if (option == "--script" && hasValue) {
+            scriptPath = argv[++i];
+        } else if (option == "--message" && hasValue) {
+            options.script.assign(1, argv[++i]);
+            options.repeatScript = true;
+        } else if (option == "--count" && hasValue) {
+            options.count = strtoull(argv[++i], nullptr, 10);
+        } else if (option == "--rate" && hasValue) {
+            options.rate = atof(argv[++i]);
+        } else if (option == "--probe-interval" && hasValue) {
+            options.probeIntervalMs = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (option == "--duration" && hasValue) {
+            options.durationSeconds = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (option == "--server" && hasValue) {
+            options.serverIP = argv[++i];
+        } else if (option == "--port" && hasValue) {
+            options.port = atoi(argv[++i]);
+        } else if (option == "--shared-memory") {
+            options.sharedMemory = true;
+        } else if (option == "--compress") {
+            options.compress = true;
+        } else {
+            cerr << HEADLESS_USAGE << endl;
+            return false;
+        }
+    }
+
+    if (!scriptPath.empty()) {
+        if (options.repeatScript) {
+            cerr << "--script and --message cannot be combined." << endl;
+            return false;
+        }
+        if (!loadScript(scriptPath, options.script)) {
+            cerr << "Cannot read script file '" << scriptPath << "'." << endl;
+            return false;
+        }
+        if (options.count == 0) {
+            options.count = options.script.size();
+        }
+    }
+    if (!headless || options.nickname.empty() || options.rate <= 0 ||
+        (!options.createMemberCap.empty() && options.roomName.empty())) {
+        cerr << HEADLESS_USAGE << endl;
+        return false;
+    }
+    return true;
+}
+
+int64_t percentile(const vector<int64_t>& sorted, double fraction) {
+    size_t index = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+void emitSummary(const HeadlessListener& listener, uint64_t linesSent, uint64_t probesSent, bool sharedMemory) {
+    string fields = string(",\"transport\":") + (sharedMemory ? "\"shared_memory\"" : "\"socket\"") + ",\"sent\":" + to_string(linesSent) + ",\"received\":" + to_string(listener.receivedLines) +
+                    ",\"probes_sent\":" + to_string(probesSent) + ",\"probes_answered\":" + to_string(listener.roundTrips.size());
+    if (!listener.roundTrips.empty()) {
+        vector<int64_t> sorted = listener.roundTrips;
+        sort(sorted.begin(), sorted.end());
+        fields += ",\"rtt_min_us\":" + to_string(sorted.front()) + ",\"rtt_p50_us\":" + to_string(percentile(sorted, 0.50)) +
+                  ",\"rtt_p99_us\":" + to_string(percentile(sorted, 0.99)) + ",\"rtt_max_us\":" + to_string(sorted.back());
+    }
+    emitEvent("summary", fields);
+}
+
+// The whole run is one WSAPoll loop on the server socket. The poll timeout is the time
+// to the next scheduled line or probe, so sends go out on schedule without a timer thread.
+// A dropped connection is resumed with backoff; the schedule carries on once it is back.
+int RunHeadlessClient(const HeadlessOptions& options) {
+    ChatClientEngine engine;
+    HeadlessListener listener;
+    engine.setListener(&listener);
+    engine.setSharedMemory(options.sharedMemory);
+    engine.setCompression(options.compress);
+
+    if (!engine.connectTo(options.serverIP, options.port)) {
+        emitEvent("error", ",\"reason\":\"connect failed\"");
+        return 1;
+    }
+    emitEvent("connected", ",\"server\":" + jsonString(options.serverIP + ":" + to_string(options.port)));
+
+    chrono::microseconds sendInterval(static_cast<int64_t>(1000000.0 / options.rate));
+    chrono::milliseconds probeInterval(options.probeIntervalMs);
+    TimePoint started = chrono::steady_clock::now();
+    TimePoint stopAt = started + chrono::seconds(options.durationSeconds);
+    TimePoint nextSend = started;
+    TimePoint nextProbe = started;
+    TimePoint lingerUntil = TimePoint::max();
+
+    bool nicknameSent = false;
+    bool roomRequested = false;
+    bool ready = false;
+    uint64_t linesSent = 0;
+    uint64_t probesSent = 0;
+    int exitCode = 0;
+    ReconnectBackoff backoff;
+
+    while (true) {
+        if (engine.state() == CLIENT_DISCONNECTED) {
+            if (!engine.canResume() || backoff.exhausted()) {
+                break;
+            }
+            uint32_t delayMs = max(backoff.nextDelayMs(), engine.retryAfterMs());
+            emitEvent("reconnecting", ",\"attempt\":" + to_string(backoff.attempts()) + ",\"delay_ms\":" + to_string(delayMs));
+            this_thread::sleep_for(chrono::milliseconds(delayMs));
+            engine.reconnect();
+            roomRequested = false;
+            continue;
+        }
+
+        TimePoint now = chrono::steady_clock::now();
+        bool inPlace = engine.state() == CLIENT_IN_ROOM || (engine.state() == CLIENT_LOBBY && options.roomName.empty());
+        if (inPlace) {
+            backoff.reset();
+        }
+
+        if (engine.state() == CLIENT_NEEDS_NICKNAME) {
+            if (nicknameSent) {
+                emitEvent("error", ",\"reason\":\"nickname rejected\"");
+                exitCode = 1;
+                break;
+            }
+            engine.sendNickname(options.nickname);
+            nicknameSent = true;
+        } else if (engine.state() == CLIENT_LOBBY && !options.roomName.empty()) {
+            if (roomRequested) {
+                emitEvent("error", ",\"reason\":" + jsonString("could not enter room '" + options.roomName + "'"));
+                exitCode = 1;
+                break;
+            }
+            if (options.createMemberCap.empty()) {
+                engine.joinRoom(options.roomName);
+            } else {
+                engine.createRoom(options.roomName, options.createMemberCap, options.topic);
+            }
+            roomRequested = true;
+        } else if (!ready && inPlace) {
+            ready = true;
+            if (!options.topic.empty() && options.createMemberCap.empty() && engine.state() == CLIENT_IN_ROOM) {
+                engine.setTopic(options.topic);
+            }
+            emitEvent("ready", ",\"room\":" + jsonString(engine.roomName()));
+            started = now;
+            stopAt = started + chrono::seconds(options.durationSeconds);
+            nextSend = now;
+            nextProbe = now;
+        }
+
+        if (ready && inPlace) {
+            bool scriptDone = !options.script.empty() && options.count != 0 && linesSent >= options.count;
+            bool timeUp = options.durationSeconds != 0 && now >= stopAt;
+            if ((scriptDone || timeUp) && lingerUntil == TimePoint::max()) {
+                lingerUntil = now + chrono::milliseconds(options.lingerMs);
+            }
+            if (lingerUntil != TimePoint::max() && (listener.pendingProbes.empty() || now >= lingerUntil)) {
+                break;
+            }
+
+            if (lingerUntil == TimePoint::max() && !options.script.empty() && now >= nextSend) {
+                const string& line = options.script[linesSent % options.script.size()];
+                if (engine.sendChat(line)) {
+                    emitEvent("sent", ",\"seq\":" + to_string(linesSent) + ",\"line\":" + jsonString(line));
+                    linesSent++;
+                }
+                nextSend += sendInterval;
+                if (nextSend < now) {
+                    nextSend = now;
+                }
+            }
+            if (lingerUntil == TimePoint::max() && options.probeIntervalMs != 0 && now >= nextProbe) {
+                listener.pendingProbes[probesSent] = chrono::steady_clock::now();
+                engine.sendProbe(to_string(probesSent));
+                probesSent++;
+                nextProbe += probeInterval;
+                if (nextProbe < now) {
+                    nextProbe = now;
+                }
+            }
+        }
+
+        TimePoint wakeAt = TimePoint::max();
+        if (ready && inPlace && lingerUntil == TimePoint::max()) {
+            if (!options.script.empty()) {
+                wakeAt = min(wakeAt, nextSend);
+            }
+            if (options.probeIntervalMs != 0) {
+                wakeAt = min(wakeAt, nextProbe);
+            }
+            if (options.durationSeconds != 0) {
+                wakeAt = min(wakeAt, stopAt);
+            }
+        } else if (ready && inPlace) {
+            wakeAt = lingerUntil;
+        }
+        int timeout = -1;
+        if (wakeAt != TimePoint::max()) {
+            int64_t waitMs = chrono::duration_cast<chrono::milliseconds>(wakeAt - chrono::steady_clock::now()).count();
+            timeout = static_cast<int>(max<int64_t>(waitMs, 0));
+        }
+        if (engine.msUntilAckDue() != ChatClientEngine::NO_ACK_DUE && (timeout < 0 || static_cast<uint32_t>(timeout) > engine.msUntilAckDue())) {
+            timeout = static_cast<int>(engine.msUntilAckDue());
+        }
+
+        WSAPOLLFD serverFD;
+        serverFD.fd = engine.socket();
+        serverFD.events = POLLRDNORM;
+        serverFD.revents = 0;
+        int polled = WSAPoll(&serverFD, 1, timeout);
+        if (polled == SOCKET_ERROR) {
+            emitEvent("error", ",\"reason\":" + jsonString("WSAPoll failed with error " + to_string(WSAGetLastError())));
+            exitCode = 1;
+            break;
+        }
+        if (polled > 0) {
+            engine.onReadable();
+        }
+        engine.sendDueAck();
+    }
+
+    if (engine.state() == CLIENT_DISCONNECTED && exitCode == 0) {
+        exitCode = 1;
+    }
+    emitSummary(listener, linesSent, probesSent, engine.usingSharedMemory());
+    engine.close();
+    return exitCode;
+}
@@ -0,0 +1,34 @@
+#ifndef SOCKETCLIENT_HEADLESS_H
+#define SOCKETCLIENT_HEADLESS_H
+
+#include "socketutil.h"
+#include <cstdint>
+
+// Non-interactive client for bots and latency canaries. Everything the interactive
+// client would ask for comes from the command line, and everything it would print is
+// written to stdout as one JSON object per line.
+struct HeadlessOptions {
+    string serverIP = "127.0.0.1";  // IPv4, IPv6 or unix:<path>
+    int port = 8580;
+    string nickname;
+    string roomName;              // empty: stay in the lobby
+    string createMemberCap;       // set: create roomName instead of joining it
+    string topic;
+    vector<string> script;        // lines to send, in order, wrapping around
+    bool repeatScript = false;    // --message: keep sending until --count or --duration
+    uint64_t count = 0;           // lines to send; 0 means the script once (or forever when repeating)
+    double rate = 1.0;            // lines per second
+    uint32_t probeIntervalMs = 1000;  // 0 disables probes
+    uint32_t durationSeconds = 0;     // 0: until the script is done, or forever with nothing to send
+    uint32_t lingerMs = 2000;         // how long to wait for outstanding probes at the end
+    bool sharedMemory = false;        // --shared-memory: talk to a local server through shared memory
+    bool compress = false;            // --compress: ask the server for compressed output
+};
+
+// Returns false and prints the usage line if the arguments do not describe a run.
+bool ParseHeadlessOptions(int argc, char* argv[], HeadlessOptions& options);
+
+// Runs one headless session to completion. Returns the process exit code.
+int RunHeadlessClient(const HeadlessOptions& options);
+
+#endif //SOCKETCLIENT_HEADLESS_H
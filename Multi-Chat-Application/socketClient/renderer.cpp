@@ -0,0 +1,47 @@
+#include "renderer.h"
+
+void ConsoleRenderer::post(const string& text) {
+    scrollback.push_back(text);
+    unrendered++;
+    if (scrollback.size() > MAX_SCROLLBACK_LINES) {
+        scrollback.pop_front();
+        unrendered = min(unrendered, scrollback.size());
+    }
+}
+
+uint32_t ConsoleRenderer::msUntilFrame() const {
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - lastFrame).count();
+    return elapsed >= RENDER_INTERVAL_MS ? 0 : static_cast<uint32_t>(RENDER_INTERVAL_MS - elapsed);
+}
+
+void ConsoleRenderer::render(bool showPrompt, const string& prompt, const string& editLine) {
+    string frame;
+    if (showPrompt) {
+        frame = "\r" + string(120, ' ') + "\r";
+    }
+
+    size_t shown = min(unrendered, MAX_LINES_PER_FRAME);
+    if (unrendered > shown) {
+        frame += "(" + to_string(unrendered - shown) + " messages not shown; type /history to see them)\n";
+    }
+    for (size_t i = scrollback.size() - shown; i < scrollback.size(); ++i) {
+        frame += scrollback[i];
+    }
+    if (showPrompt) {
+        frame += prompt + editLine;
+    }
+
+    cout << frame << flush;
+    unrendered = 0;
+    lastFrame = chrono::steady_clock::now();
+}
+
+void ConsoleRenderer::showHistory(size_t count) {
+    count = min(count, scrollback.size() - unrendered);
+    string history = "--- Last " + to_string(count) + " messages ---\n";
+    for (size_t i = scrollback.size() - unrendered - count; i < scrollback.size() - unrendered; ++i) {
+        history += scrollback[i];
+    }
+    history += "---\n";
+    cout << history << flush;
+}
@@ -0,0 +1,38 @@
+#ifndef SOCKETCLIENT_RENDERER_H
+#define SOCKETCLIENT_RENDERER_H
+
+#include "socketutil.h"
+#include <chrono>
+#include <cstdint>
+#include <deque>
+
+const uint32_t RENDER_INTERVAL_MS = 33;
+const size_t MAX_SCROLLBACK_LINES = 1000;
+const size_t MAX_LINES_PER_FRAME = 100;
+
+// Batches incoming messages and repaints the console at most once every
+// RENDER_INTERVAL_MS (about 30 Hz). A repaint clears the prompt line once, writes
+// everything that arrived since the previous one in a single write, and puts the prompt
+// and the user's half-typed input back. If more than MAX_LINES_PER_FRAME arrive in one
+// frame only the newest are written; the rest stay in the scrollback for /history, so
+// how fast messages are taken off the socket never depends on how fast the console is.
+class ConsoleRenderer {
+public:
+    ConsoleRenderer() : unrendered(0) {}
+
+    void post(const string& text);
+    bool isDirty() const { return unrendered != 0; }
+    // 0 once a repaint is due; only meaningful while isDirty().
+    uint32_t msUntilFrame() const;
+
+    void render(bool showPrompt, const string& prompt, const string& editLine);
+    // Writes the last count scrollback entries again, below whatever is on screen.
+    void showHistory(size_t count);
+
+private:
+    deque<string> scrollback;
+    size_t unrendered;
+    chrono::steady_clock::time_point lastFrame;
+};
+
+#endif //SOCKETCLIENT_RENDERER_H
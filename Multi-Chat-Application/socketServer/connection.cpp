@@ -0,0 +1,236 @@
+#include "connection.h"
+#include "linescan.h"
+
+uint32_t StringInterner::intern(const string& text) {
+    auto it = ids.find(text);
+    if (it != ids.end()) {
+        refCounts[it->second]++;
+        return it->second;
+    }
+
+    uint32_t id;
+    if (!freeIds.empty()) {
+        id = freeIds.back();
+        freeIds.pop_back();
+    } else {
+        id = static_cast<uint32_t>(strings.size());
+        strings.push_back(nullptr);
+        refCounts.push_back(0);
+    }
+
+    it = ids.emplace(text, id).first;
+    strings[id] = &it->first;
+    refCounts[id] = 1;
+    return id;
+}
+
+uint32_t StringInterner::find(const string& text) const {
+    auto it = ids.find(text);
+    return it == ids.end() ? INVALID_INDEX : it->second;
+}
+
+void StringInterner::release(uint32_t id) {
+    if (id >= strings.size() || strings[id] == nullptr) {
+        return;
+    }
+    if (--refCounts[id] == 0) {
+        ids.erase(*strings[id]);
+        strings[id] = nullptr;
+        freeIds.push_back(id);
+    }
+}
+
+const string& StringInterner::lookup(uint32_t id) const {
+    static const string empty;
+    if (id >= strings.size() || strings[id] == nullptr) {
+        return empty;
+    }
+    return *strings[id];
+}
+
+RecvBufferPool::~RecvBufferPool() {
+    for (RecvBuffer* buffer : freeBuffers) {
+        delete buffer;
+    }
+}
+
+RecvBuffer* RecvBufferPool::acquire() {
+    RecvBuffer* buffer;
+    if (!freeBuffers.empty()) {
+        buffer = freeBuffers.back();
+        freeBuffers.pop_back();
+    } else {
+        buffer = new RecvBuffer;
+    }
+    buffer->start = 0;
+    buffer->length = 0;
+    return buffer;
+}
+
+void RecvBufferPool::release(RecvBuffer* buffer) {
+    if (buffer == nullptr) {
+        return;
+    }
+    if (freeBuffers.size() < MAX_POOLED_RECV_BUFFERS) {
+        freeBuffers.push_back(buffer);
+    } else {
+        delete buffer;
+    }
+}
+
+bool HasBufferedLine(const Connection& connection) {
+    const RecvBuffer* buffer = connection.pendingInput;
+    if (buffer == nullptr || buffer->start == buffer->length) {
+        return false;
+    }
+    if (buffer->start == 0 && buffer->length == RECV_BUFFER_SIZE) {
+        return true;
+    }
+    const char* begin = buffer->data + buffer->start;
+    return FindNewline(begin, buffer->data + buffer->length) != nullptr;
+}
+
+bool TakeBufferedLine(Connection& connection, string_view& line) {
+    RecvBuffer* buffer = connection.pendingInput;
+    if (buffer == nullptr || buffer->start == buffer->length) {
+        return false;
+    }
+
+    size_t available = buffer->length - buffer->start;
+    LineScanner scanner(buffer->data + buffer->start, available);
+    if (scanner.next(line)) {
+        buffer->start += static_cast<uint32_t>(scanner.consumed());
+        return true;
+    }
+    if (buffer->start == 0 && buffer->length == RECV_BUFFER_SIZE) {
+        line = TrimLine(string_view(buffer->data, available));
+        buffer->start = buffer->length;
+        return true;
+    }
+    return false;
+}
+
+uint32_t ConnectionTable::add(SOCKET socketFD) {
+    uint32_t index;
+    if (!freeSlots.empty()) {
+        index = freeSlots.back();
+        freeSlots.pop_back();
+    } else {
+        index = static_cast<uint32_t>(slots.size());
+        slots.push_back(Connection());
+    }
+
+    Connection& connection = slots[index];
+    connection.socketFD = socketFD;
+    connection.roomCursor = 0;
+    connection.roomJoinSequence = 0;
+    connection.ackedSequence = 0;
+    connection.resumeToken = 0;
+    connection.sharedNonce = 0;
+    connection.nicknameId = INVALID_INDEX;
+    connection.roomId = 0;
+    connection.roomSlot = INVALID_INDEX;
+    connection.ringOffset = 0;
+    connection.outputOffset = 0;
+    connection.outputCut = 0;
+    connection.laneSent = 0;
+    connection.pendingInput = nullptr;
+    connection.pendingOutput = nullptr;
+    connection.shared = nullptr;
+    connection.probes = nullptr;
+    connection.session = nullptr;
+    connection.phase = PHASE_NICKNAME;
+    connection.waitingFor = WAIT_NONE;
+    connection.closing = false;
+    connection.admin = false;
+    connection.loopback = false;
+    connection.compressed = false;
+    connection.bulkTurn = false;
+    liveCount++;
+    return index;
+}
+
+void ConnectionTable::remove(uint32_t index) {
+    if (!isLive(index)) {
+        return;
+    }
+
+    Connection& connection = slots[index];
+    if (connection.nicknameId != INVALID_INDEX) {
+        nicknameOwners[connection.nicknameId] = INVALID_INDEX;
+        nicknames.release(connection.nicknameId);
+    }
+    recvBuffers.release(connection.pendingInput);
+    delete connection.pendingOutput;
+    delete connection.shared;
+    delete connection.probes;
+
+    connection.socketFD = INVALID_SOCKET;
+    connection.nicknameId = INVALID_INDEX;
+    connection.pendingInput = nullptr;
+    connection.pendingOutput = nullptr;
+    connection.shared = nullptr;
+    connection.probes = nullptr;
+    connection.session = nullptr;
+    connection.waitingFor = WAIT_NONE;
+    freeSlots.push_back(index);
+    liveCount--;
+}
+
+uint32_t ConnectionTable::setNickname(uint32_t index, const string& nickname) {
+    Connection& connection = slots[index];
+    if (connection.nicknameId != INVALID_INDEX) {
+        nicknameOwners[connection.nicknameId] = INVALID_INDEX;
+        nicknames.release(connection.nicknameId);
+    }
+
+    connection.nicknameId = nicknames.intern(nickname);
+    if (connection.nicknameId >= nicknameOwners.size()) {
+        nicknameOwners.resize(connection.nicknameId + 1, INVALID_INDEX);
+    }
+    nicknameOwners[connection.nicknameId] = index;
+    return connection.nicknameId;
+}
+
+uint32_t ConnectionTable::findByNickname(const string& nickname) const {
+    uint32_t nicknameId = nicknames.find(nickname);
+    if (nicknameId == INVALID_INDEX || nicknameId >= nicknameOwners.size()) {
+        return INVALID_INDEX;
+    }
+    return nicknameOwners[nicknameId];
+}
+
+const SharedMessage& ConnectionTable::sharedNickname(uint32_t nicknameId) {
+    if (nicknameId >= nicknameTexts.size()) {
+        nicknameTexts.resize(nicknameId + 1);
+    }
+    SharedMessage& text = nicknameTexts[nicknameId];
+    const string& nickname = nicknames.lookup(nicknameId);
+    if (!text || *text != nickname) {
+        text = make_shared<const string>(nickname);
+    }
+    return text;
+}
+
+uint32_t ConnectionTable::detachNickname(uint32_t index) {
+    Connection& connection = slots[index];
+    uint32_t nicknameId = connection.nicknameId;
+    if (nicknameId != INVALID_INDEX) {
+        nicknameOwners[nicknameId] = INVALID_INDEX;
+    }
+    connection.nicknameId = INVALID_INDEX;
+    return nicknameId;
+}
+
+void ConnectionTable::adoptNickname(uint32_t index, uint32_t nicknameId) {
+    Connection& connection = slots[index];
+    if (connection.nicknameId != INVALID_INDEX) {
+        nicknameOwners[connection.nicknameId] = INVALID_INDEX;
+        nicknames.release(connection.nicknameId);
+    }
+    connection.nicknameId = nicknameId;
+    if (nicknameId >= nicknameOwners.size()) {
+        nicknameOwners.resize(nicknameId + 1, INVALID_INDEX);
+    }
+    nicknameOwners[nicknameId] = index;
+}
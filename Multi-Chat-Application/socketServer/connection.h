@@ -0,0 +1,154 @@
+#ifndef SOCKETSERVER_CONNECTION_H
+#define SOCKETSERVER_CONNECTION_H
+
+#include "sharedring.h"
+#include "socketutil.h"
+#include <coroutine>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+
+const uint32_t INVALID_INDEX = 0xFFFFFFFFu;
+const size_t RECV_BUFFER_SIZE = 1024;
+const size_t MAX_POOLED_RECV_BUFFERS = 256;
+
+// A room message. The room ring holds one reference and snapshots being written hold
+// others, so the bytes outlive a ring slot being reused.
+typedef shared_ptr<const string> SharedMessage;
+
+// Maps each distinct string to a small integer id. The text is stored once, as the
+// key of the lookup table; ids are reused after the last reference is released.
+class StringInterner {
+public:
+    uint32_t intern(const string& text);
+    uint32_t find(const string& text) const;
+    void release(uint32_t id);
+    const string& lookup(uint32_t id) const;
+    size_t size() const { return ids.size(); }
+
+private:
+    unordered_map<string, uint32_t> ids;
+    vector<const string*> strings;
+    vector<uint32_t> refCounts;
+    vector<uint32_t> freeIds;
+};
+
+struct RecvBuffer {
+    uint32_t start;
+    uint32_t length;
+    char data[RECV_BUFFER_SIZE];
+};
+
+// Receive buffers are only held by connections that have a partial line pending.
+// Idle connections hand theirs back, so most of the population owns none.
+class RecvBufferPool {
+public:
+    ~RecvBufferPool();
+    RecvBuffer* acquire();
+    void release(RecvBuffer* buffer);
+    size_t pooledCount() const { return freeBuffers.size(); }
+
+private:
+    vector<RecvBuffer*> freeBuffers;
+};
+
+// PHASE_CLOSED: the session is over (quit, or detached for a later resume) and only
+// the socket is left to tear down.
+enum ConnectionPhase : uint8_t {
+    PHASE_NICKNAME = 0,
+    PHASE_CHAT = 1,
+    PHASE_CLOSED = 2
+};
+
+enum SessionWait : uint8_t {
+    WAIT_NONE = 0,
+    WAIT_FRAME = 1,
+    WAIT_DRAIN = 2
+};
+
+// A latency probe's echo, held back until the room messages published before the
+// probe have been sent.
+struct PendingProbe {
+    uint64_t sequence;
+    string echo;
+};
+
+struct Connection {
+    SOCKET socketFD;
+    uint64_t roomCursor;
+    uint64_t roomJoinSequence;
+    uint64_t ackedSequence;
+    uint64_t resumeToken;
+    uint64_t sharedNonce;  // handed out in SHM_NONCE; 0 until then
+    uint32_t nicknameId;
+    uint32_t roomId;
+    uint32_t roomSlot;
+    uint32_t ringOffset;
+    uint32_t outputOffset;
+    uint32_t outputCut;  // end of the pendingOutput being sent this turn, a frame boundary
+    uint32_t laneSent;  // bytes the current output lane has sent this turn
+    RecvBuffer* pendingInput;
+    string* pendingOutput;
+    SharedChannel* shared;  // set once the client attaches through shared memory
+    vector<PendingProbe>* probes;  // oldest first; null while none are held back
+    coroutine_handle<> session;
+    ConnectionPhase phase;
+    SessionWait waitingFor;
+    bool closing;
+    bool admin;  // accepted on an --admin-listen endpoint
+    bool loopback;  // accepted on a loopback or unix: listener; may attach shared memory
+    bool compressed;  // negotiated COMPRESS; long output goes out as compressed frames
+    bool bulkTurn;  // with both output lanes waiting, the room ring goes next
+};
+
+// Line framing over the connection's pending receive buffer. A full buffer without a
+// newline counts as one line, as the 1 KB reads always did. Lines come back trimmed,
+// as views into the buffer that stay valid until the next read into it.
+bool HasBufferedLine(const Connection& connection);
+bool TakeBufferedLine(Connection& connection, string_view& line);
+
+inline size_t PendingOutputBytes(const Connection& connection) {
+    return connection.pendingOutput == nullptr ? 0 : connection.pendingOutput->length() - connection.outputOffset;
+}
+
+// Slab of connection records. Slots are addressed by a stable index for the life of
+// the connection and recycled through a free list, so records stay contiguous.
+class ConnectionTable {
+public:
+    ConnectionTable() : liveCount(0) {}
+
+    uint32_t add(SOCKET socketFD);
+    void remove(uint32_t index);
+
+    Connection& operator[](uint32_t index) { return slots[index]; }
+    const Connection& operator[](uint32_t index) const { return slots[index]; }
+    bool isLive(uint32_t index) const { return index < slots.size() && slots[index].socketFD != INVALID_SOCKET; }
+
+    uint32_t slotCount() const { return static_cast<uint32_t>(slots.size()); }
+    size_t size() const { return liveCount; }
+
+    // Nickname -> connection index, so direct messages never scan the slab.
+    uint32_t setNickname(uint32_t index, const string& nickname);
+    uint32_t findByNickname(const string& nickname) const;
+    // The nickname an id stands for now, as a string room messages can keep after the id
+    // has been reused.
+    const SharedMessage& sharedNickname(uint32_t nicknameId);
+
+    // Moves a nickname between connections without releasing it: detachNickname keeps
+    // it reserved and returns its id, adoptNickname gives it to a resuming connection.
+    uint32_t detachNickname(uint32_t index);
+    void adoptNickname(uint32_t index, uint32_t nicknameId);
+
+    StringInterner nicknames;
+    RecvBufferPool recvBuffers;
+
+private:
+    vector<Connection> slots;
+    vector<uint32_t> freeSlots;
+    vector<uint32_t> nicknameOwners;
+    vector<SharedMessage> nicknameTexts;
+    size_t liveCount;
+};
+
+#endif //SOCKETSERVER_CONNECTION_H
@@ -0,0 +1,237 @@
+#include "contentfilter.h"
+#include "linescan.h"
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+const uint32_t MATCH_BIT = 0x80000000u;
+const uint32_t NO_STATE = UINT32_MAX;
+// Longer than any chat line the server accepts.
+const size_t MAX_PATTERN_LENGTH = 1024;
+
+char foldCase(char c) {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+}
+
+ContentFilter::ContentFilter() : stride(1) {
+    memset(byteClass, 0, sizeof(byteClass));
+}
+
+bool ContentFilter::compile(string_view rules, string& error) {
+    vector<string> parsedPatterns;
+    vector<uint8_t> parsedActions;
+    size_t lineNumber = 0;
+    while (!rules.empty()) {
+        size_t end = rules.find('\n');
+        string_view line = rules.substr(0, end);
+        rules = end == string_view::npos ? string_view() : rules.substr(end + 1);
+        lineNumber++;
+
+        line = TrimLine(line);
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        size_t space = line.find_first_of(" \t");
+        string_view action = line.substr(0, space);
+        string_view text = space == string_view::npos ? string_view() : TrimLine(line.substr(space + 1));
+        uint8_t actionBit = action == "block" ? FILTER_BLOCK : action == "mask" ? FILTER_MASK : action == "flag" ? FILTER_FLAG : 0;
+        if (actionBit == 0) {
+            error = "line " + to_string(lineNumber) + ": unknown action '" + string(action) + "'; use block, mask or flag";
+            return false;
+        }
+        if (text.empty() || text.size() > MAX_PATTERN_LENGTH) {
+            error = "line " + to_string(lineNumber) + ": pattern must be 1 to " + to_string(MAX_PATTERN_LENGTH) + " bytes";
+            return false;
+        }
+        string folded(text);
+        transform(folded.begin(), folded.end(), folded.begin(), foldCase);
+        parsedPatterns.push_back(move(folded));
+        parsedActions.push_back(actionBit);
+    }
+
+    uint8_t classes[256] = {};
+    uint32_t classCount = 1;
+    for (const string& text : parsedPatterns) {
+        for (char c : text) {
+            uint8_t byte = static_cast<uint8_t>(c);
+            if (classes[byte] == 0) {
+                classes[byte] = static_cast<uint8_t>(classCount++);
+            }
+        }
+    }
+    for (int c = 'A'; c <= 'Z'; ++c) {
+        classes[c] = classes[c - 'A' + 'a'];
+    }
+
+    // The trie, with transitions as state numbers for now.
+    vector<uint32_t> table(classCount, NO_STATE);
+    vector<StateOutput> stateOutputs(1, { NO_FILTER_PATTERN, NO_FILTER_PATTERN, 0, 0 });
+    size_t maxStates = MAX_FILTER_TABLE_BYTES / (classCount * sizeof(uint32_t) + sizeof(StateOutput));
+    for (uint32_t p = 0; p < parsedPatterns.size(); ++p) {
+        uint32_t state = 0;
+        for (char c : parsedPatterns[p]) {
+            size_t entry = state * classCount + classes[static_cast<uint8_t>(c)];
+            if (table[entry] == NO_STATE) {
+                if (stateOutputs.size() == maxStates) {
+                    error = "the rules need more than " + to_string(MAX_FILTER_TABLE_BYTES / (1024 * 1024)) + " MB of tables";
+                    return false;
+                }
+                table[entry] = static_cast<uint32_t>(stateOutputs.size());
+                stateOutputs.push_back({ NO_FILTER_PATTERN, NO_FILTER_PATTERN, 0, 0 });
+                table.resize(table.size() + classCount, NO_STATE);
+            }
+            state = table[entry];
+        }
+
+        StateOutput& output = stateOutputs[state];
+        output.actions |= parsedActions[p];
+        if (parsedActions[p] == FILTER_BLOCK && output.blockPattern == NO_FILTER_PATTERN) {
+            output.blockPattern = p;
+        } else if (parsedActions[p] == FILTER_FLAG && output.flagPattern == NO_FILTER_PATTERN) {
+            output.flagPattern = p;
+        } else if (parsedActions[p] == FILTER_MASK) {
+            output.maskLength = static_cast<uint16_t>(parsedPatterns[p].size());
+        }
+    }
+
+    // Breadth first, so a state's failure state is complete before the state is: missing
+    // transitions are taken from the failure state's row, and outputs are inherited
+    // from it.
+    vector<uint32_t> failure(stateOutputs.size(), 0);
+    vector<uint32_t> queue;
+    queue.reserve(stateOutputs.size());
+    for (uint32_t c = 0; c < classCount; ++c) {
+        if (table[c] == NO_STATE) {
+            table[c] = 0;
+        } else {
+            queue.push_back(table[c]);
+        }
+    }
+    for (size_t head = 0; head < queue.size(); ++head) {
+        uint32_t state = queue[head];
+        const StateOutput& inherited = stateOutputs[failure[state]];
+        StateOutput& output = stateOutputs[state];
+        output.actions |= inherited.actions;
+        if (output.blockPattern == NO_FILTER_PATTERN) {
+            output.blockPattern = inherited.blockPattern;
+        }
+        if (output.flagPattern == NO_FILTER_PATTERN) {
+            output.flagPattern = inherited.flagPattern;
+        }
+        output.maskLength = max(output.maskLength, inherited.maskLength);
+
+        for (uint32_t c = 0; c < classCount; ++c) {
+            uint32_t& next = table[state * classCount + c];
+            uint32_t fallback = table[failure[state] * classCount + c];
+            if (next == NO_STATE) {
+                next = fallback;
+            } else {
+                failure[next] = fallback;
+                queue.push_back(next);
+            }
+        }
+    }
+
+    for (uint32_t& next : table) {
+        next = next * classCount | (stateOutputs[next].actions != 0 ? MATCH_BIT : 0);
+    }
+
+    memcpy(byteClass, classes, sizeof(byteClass));
+    stride = classCount;
+    transitions = move(table);
+    outputs = move(stateOutputs);
+    patterns = move(parsedPatterns);
+    return true;
+}
+
+FilterVerdict ContentFilter::apply(string& text) const {
+    FilterVerdict verdict = { 0, NO_FILTER_PATTERN, NO_FILTER_PATTERN };
+    if (patterns.empty()) {
+        return verdict;
+    }
+
+    const uint32_t* table = transitions.data();
+    uint32_t state = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+        uint32_t next = table[state + byteClass[static_cast<uint8_t>(text[i])]];
+        state = next & ~MATCH_BIT;
+        if ((next & MATCH_BIT) == 0) {
+            continue;
+        }
+
+        const StateOutput& output = outputs[state / stride];
+        verdict.actions |= output.actions;
+        if (verdict.blockedBy == NO_FILTER_PATTERN) {
+            verdict.blockedBy = output.blockPattern;
+        }
+        if (verdict.flaggedBy == NO_FILTER_PATTERN) {
+            verdict.flaggedBy = output.flagPattern;
+        }
+        if (output.maskLength != 0) {
+            memset(&text[i + 1 - output.maskLength], '*', output.maskLength);
+        }
+    }
+    return verdict;
+}
+
+bool LoadContentFilterFile(const string& path, ContentFilter& filter, string& error) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        error = "cannot open";
+        return false;
+    }
+    string contents;
+    char chunk[64 * 1024];
+    size_t bytesRead;
+    while ((bytesRead = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        contents.append(chunk, bytesRead);
+    }
+    fclose(file);
+    return filter.compile(contents, error);
+}
+
+ContentFilterLoader::~ContentFilterLoader() {
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+bool ContentFilterLoader::start(const string& path) {
+    if (loading()) {
+        return false;
+    }
+    if (worker.joinable()) {
+        worker.join();
+    }
+
+    busy.store(true, memory_order_release);
+    finished = false;
+    worker = thread([this, path]() {
+        auto started = chrono::steady_clock::now();
+        unique_ptr<ContentFilter> filter = make_unique<ContentFilter>();
+        string error;
+        if (!LoadContentFilterFile(path, *filter, error)) {
+            filter.reset();
+        }
+        loaded = move(filter);
+        failure = move(error);
+        loadTime = chrono::steady_clock::now() - started;
+        finished = true;
+        busy.store(false, memory_order_release);
+    });
+    return true;
+}
+
+bool ContentFilterLoader::takeResult(unique_ptr<ContentFilter>& filter, string& error, chrono::steady_clock::duration& elapsed) {
+    if (loading() || !finished) {
+        return false;
+    }
+    finished = false;
+    filter = move(loaded);
+    error = failure;
+    elapsed = loadTime;
+    return true;
+}
@@ -0,0 +1,107 @@
+#ifndef SOCKETSERVER_CONTENTFILTER_H
+#define SOCKETSERVER_CONTENTFILTER_H
+
+#include "socketutil.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+// A rules file compiling to a bigger transition table than this is refused.
+const size_t MAX_FILTER_TABLE_BYTES = 256 * 1024 * 1024;
+
+// What a rule asks for when its pattern turns up in a message. FLAG delivers the
+// message and logs it, MASK overwrites the matched text with '*', BLOCK drops the
+// message and tells the sender. One message can set several.
+enum FilterAction : uint8_t {
+    FILTER_FLAG = 1,
+    FILTER_MASK = 2,
+    FILTER_BLOCK = 4
+};
+
+const uint32_t NO_FILTER_PATTERN = UINT32_MAX;
+
+struct FilterVerdict {
+    uint8_t actions;
+    uint32_t blockedBy;  // the first blocking pattern found, or NO_FILTER_PATTERN
+    uint32_t flaggedBy;  // the first flagging pattern found, or NO_FILTER_PATTERN
+};
+
+// Banned terms and links, matched as substrings without regard to ASCII case. Rules are
+// one per line, an action and the rest of the line as the pattern:
+//
+//   block buy followers now
+//   mask darn
+//   flag http://
+//
+// Blank lines and lines starting with '#' are skipped.
+//
+// The rules compile to an Aho-Corasick automaton flattened into a DFA, so a message is
+// checked in one pass of one table lookup per byte however many patterns there are.
+// Bytes that occur in no pattern share one input class, which keeps the table rows
+// short: a row has a column per distinct byte in the rules, not 256.
+class ContentFilter {
+public:
+    ContentFilter();
+
+    // False, with the line and reason, if a rule does not parse or the table would be
+    // too big. A failed compile leaves the filter as it was.
+    bool compile(string_view rules, string& error);
+
+    size_t patternCount() const { return patterns.size(); }
+    size_t stateCount() const { return outputs.size(); }
+    size_t tableBytes() const { return transitions.size() * sizeof(uint32_t) + outputs.size() * sizeof(StateOutput); }
+    const string& pattern(uint32_t index) const { return patterns[index]; }
+
+    // Scans text once. Masked matches are overwritten in place as they are found.
+    FilterVerdict apply(string& text) const;
+
+private:
+    // What is found on reaching a state: everything matched by the pattern ending there
+    // and by the patterns that are suffixes of it.
+    struct StateOutput {
+        uint32_t blockPattern;
+        uint32_t flagPattern;
+        uint16_t maskLength;  // of the longest masking pattern ending here
+        uint8_t actions;
+    };
+
+    uint8_t byteClass[256];
+    uint32_t stride;
+    // Row per state, column per byte class. Entries are the next state's row offset,
+    // with MATCH_BIT set when that state has an output.
+    vector<uint32_t> transitions;
+    vector<StateOutput> outputs;
+    vector<string> patterns;
+};
+
+// Reads and compiles a rules file.
+bool LoadContentFilterFile(const string& path, ContentFilter& filter, string& error);
+
+// Compiles the rules file on a background thread, so a reload of thousands of patterns
+// never holds up the event loop. The loop takes the finished filter and swaps it in
+// between messages; the filter in use is only ever touched by the loop. A reload asked
+// for while one is still compiling is refused rather than queued.
+class ContentFilterLoader {
+public:
+    ContentFilterLoader() : busy(false), finished(false) {}
+    ~ContentFilterLoader();
+
+    bool loading() const { return busy.load(memory_order_acquire); }
+    bool start(const string& path);
+
+    // Once per finished load: the new filter, or null with the reason it failed, and
+    // how long it took.
+    bool takeResult(unique_ptr<ContentFilter>& filter, string& error, chrono::steady_clock::duration& elapsed);
+
+private:
+    thread worker;
+    atomic<bool> busy;
+    bool finished;
+    unique_ptr<ContentFilter> loaded;
+    string failure;
+    chrono::steady_clock::duration loadTime;
+};
+
+#endif //SOCKETSERVER_CONTENTFILTER_H
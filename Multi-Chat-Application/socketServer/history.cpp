@@ -0,0 +1,301 @@
+#include "history.h"
+#include "lz.h"
+#include <algorithm>
+
+struct HistoryStore::HotBlock {
+    vector<uint64_t> sequences;
+    vector<uint32_t> ends;  // where each line ends in text
+    string text;
+    size_t accounted = 0;   // what this block adds to hotTotal
+    list<BlockRef>::iterator lruPosition;
+
+    string_view line(size_t i) const {
+        size_t start = i == 0 ? 0 : ends[i - 1];
+        return string_view(text).substr(start, ends[i] - start);
+    }
+};
+
+namespace {
+
+// What a hot line costs besides its text: its sequence and end offset.
+const size_t HOT_LINE_OVERHEAD = sizeof(uint64_t) + sizeof(uint32_t);
+
+void appendVarint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+bool readVarint(string_view in, size_t& offset, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && offset < in.size(); shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(in[offset++]);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+}
+
+HistoryStore::HistoryStore()
+    : directory("."), budget(DEFAULT_HISTORY_BUDGET_MB * 1024 * 1024), hotTotal(0), coldTotal(0), coldReadCount(0), spillFailed(false) {}
+
+HistoryStore::~HistoryStore() {
+    for (Segment& segment : segments) {
+        unmapSegment(segment);
+        if (segment.writer != nullptr) {
+            fclose(segment.writer);
+        }
+        remove(segment.path.c_str());
+    }
+}
+
+void HistoryStore::configure(const string& newDirectory, size_t budgetBytes) {
+    directory = newDirectory;
+    budget = budgetBytes;
+}
+
+void HistoryStore::append(const string& roomName, uint64_t sequence, string_view line) {
+    auto inserted = roomIndexes.try_emplace(roomName, static_cast<uint32_t>(rooms.size()));
+    if (inserted.second) {
+        rooms.push_back(RoomHistory{ roomName, {} });
+    }
+    uint32_t roomIndex = inserted.first->second;
+    RoomHistory& room = rooms[roomIndex];
+    if (!room.blocks.empty() && sequence <= room.blocks.back().lastSequence) {
+        return;
+    }
+
+    if (room.blocks.empty() || room.blocks.back().sealed) {
+        Block& block = room.blocks.emplace_back();
+        block.firstSequence = sequence;
+        block.lineCount = 0;
+        block.sealed = false;
+        block.compressedLength = 0;
+        block.hot = make_unique<HotBlock>();
+        block.hot->lruPosition = lru.insert(lru.begin(), BlockRef{ roomIndex, static_cast<uint32_t>(room.blocks.size() - 1) });
+    }
+
+    uint32_t blockIndex = static_cast<uint32_t>(room.blocks.size() - 1);
+    Block& block = room.blocks.back();
+    HotBlock& hot = *block.hot;
+    hot.sequences.push_back(sequence);
+    hot.text.append(line);
+    hot.ends.push_back(static_cast<uint32_t>(hot.text.size()));
+    hot.accounted += line.size() + HOT_LINE_OVERHEAD;
+    hotTotal += line.size() + HOT_LINE_OVERHEAD;
+    block.lastSequence = sequence;
+    block.lineCount++;
+    block.sealed = block.lineCount == HISTORY_BLOCK_LINES;
+    touch(roomIndex, blockIndex);
+    enforceBudget();
+}
+
+uint64_t HistoryStore::nextSequence(const string& roomName) const {
+    auto found = roomIndexes.find(roomName);
+    if (found == roomIndexes.end() || rooms[found->second].blocks.empty()) {
+        return 0;
+    }
+    return rooms[found->second].blocks.back().lastSequence + 1;
+}
+
+bool HistoryStore::find(const string& roomName, uint64_t sequence, string& line) {
+    auto found = roomIndexes.find(roomName);
+    if (found == roomIndexes.end()) {
+        return false;
+    }
+    RoomHistory& room = rooms[found->second];
+    auto block = lower_bound(room.blocks.begin(), room.blocks.end(), sequence,
+                             [](const Block& b, uint64_t s) { return b.lastSequence < s; });
+    if (block == room.blocks.end() || block->firstSequence > sequence) {
+        return false;
+    }
+    HotBlock* hot = load(found->second, static_cast<uint32_t>(block - room.blocks.begin()));
+    if (hot == nullptr) {
+        return false;
+    }
+    auto position = lower_bound(hot->sequences.begin(), hot->sequences.end(), sequence);
+    bool present = position != hot->sequences.end() && *position == sequence;
+    if (present) {
+        line = string(hot->line(position - hot->sequences.begin()));
+    }
+    enforceBudget();
+    return present;
+}
+
+void HistoryStore::recent(const string& roomName, size_t count, vector<HistoryLine>& lines) {
+    auto found = roomIndexes.find(roomName);
+    if (found == roomIndexes.end()) {
+        return;
+    }
+    size_t first = lines.size();
+    RoomHistory& room = rooms[found->second];
+    for (size_t b = room.blocks.size(); b-- > 0 && lines.size() - first < count;) {
+        HotBlock* hot = load(found->second, static_cast<uint32_t>(b));
+        if (hot == nullptr) {
+            break;
+        }
+        for (size_t i = hot->sequences.size(); i-- > 0 && lines.size() - first < count;) {
+            lines.push_back(HistoryLine{ hot->sequences[i], string(hot->line(i)) });
+        }
+    }
+    reverse(lines.begin() + first, lines.end());
+    enforceBudget();
+}
+
+HistoryStore::HotBlock* HistoryStore::load(uint32_t roomIndex, uint32_t blockIndex) {
+    Block& block = rooms[roomIndex].blocks[blockIndex];
+    if (block.hot) {
+        touch(roomIndex, blockIndex);
+        return block.hot.get();
+    }
+
+    Segment& segment = segments[block.segment];
+    const char* view = mapSegment(segment, block.offset + block.compressedLength);
+    string raw;
+    if (view == nullptr || !LzDecompress(string_view(view + block.offset, block.compressedLength), block.rawLength, raw)) {
+        cerr << "History block of room '" << rooms[roomIndex].name << "' at " << segment.path << ":" << block.offset << " cannot be read." << endl;
+        return nullptr;
+    }
+
+    auto hot = make_unique<HotBlock>();
+    size_t offset = 0;
+    uint64_t sequence = block.firstSequence;
+    for (uint32_t i = 0; i < block.lineCount; ++i) {
+        uint64_t delta, length;
+        if (!readVarint(raw, offset, delta) || !readVarint(raw, offset, length) || length > raw.size() - offset) {
+            return nullptr;
+        }
+        sequence += delta;
+        hot->sequences.push_back(sequence);
+        hot->text.append(raw, offset, length);
+        hot->ends.push_back(static_cast<uint32_t>(hot->text.size()));
+        offset += length;
+    }
+    hot->accounted = hot->text.size() + hot->sequences.size() * HOT_LINE_OVERHEAD;
+    hotTotal += hot->accounted;
+    hot->lruPosition = lru.insert(lru.begin(), BlockRef{ roomIndex, blockIndex });
+    block.hot = move(hot);
+    coldReadCount++;
+    return block.hot.get();
+}
+
+void HistoryStore::touch(uint32_t roomIndex, uint32_t blockIndex) {
+    HotBlock& hot = *rooms[roomIndex].blocks[blockIndex].hot;
+    lru.splice(lru.begin(), lru, hot.lruPosition);
+}
+
+// After a failed spill the disk is not tried again: history stays in memory, over
+// budget, for the rest of the run.
+void HistoryStore::enforceBudget() {
+    while (hotTotal > budget && !lru.empty() && !spillFailed) {
+        BlockRef victim = lru.back();
+        Block& block = rooms[victim.room].blocks[victim.block];
+        if (!spill(block)) {
+            cerr << "Cannot spill room history to '" << directory << "'; keeping it in memory over budget." << endl;
+            spillFailed = true;
+            return;
+        }
+        lru.pop_back();
+        hotTotal -= block.hot->accounted;
+        block.hot.reset();
+        block.sealed = true;
+    }
+}
+
+bool HistoryStore::spill(Block& block) {
+    if (block.compressedLength != 0) {
+        return true;
+    }
+
+    const HotBlock& hot = *block.hot;
+    string raw;
+    raw.reserve(hot.text.size() + hot.sequences.size() * 3);
+    uint64_t previous = block.firstSequence;
+    for (size_t i = 0; i < hot.sequences.size(); ++i) {
+        string_view line = hot.line(i);
+        appendVarint(raw, hot.sequences[i] - previous);
+        appendVarint(raw, line.size());
+        raw.append(line);
+        previous = hot.sequences[i];
+    }
+    string compressed;
+    LzCompress(raw, compressed);
+
+    if (segments.empty() || segments.back().writer == nullptr || segments.back().length + compressed.size() > HISTORY_SEGMENT_BYTES) {
+        if (!segments.empty() && segments.back().writer != nullptr) {
+            fclose(segments.back().writer);
+            segments.back().writer = nullptr;
+        }
+        Segment segment = {};
+        segment.path = directory + "/chat-history-" + to_string(segments.size()) + ".seg";
+        segment.writer = fopen(segment.path.c_str(), "wb");
+        segment.file = INVALID_HANDLE_VALUE;
+        if (segment.writer == nullptr) {
+            return false;
+        }
+        segments.push_back(segment);
+    }
+
+    Segment& segment = segments.back();
+    if (fwrite(compressed.data(), 1, compressed.size(), segment.writer) != compressed.size() || fflush(segment.writer) != 0) {
+        // Part of the block may have reached the file past segment.length, where the next
+        // block would be written. Nothing more goes into this segment; the blocks already
+        // in it are still read by their offsets.
+        fclose(segment.writer);
+        segment.writer = nullptr;
+        return false;
+    }
+    block.segment = static_cast<uint32_t>(segments.size() - 1);
+    block.offset = segment.length;
+    block.compressedLength = static_cast<uint32_t>(compressed.size());
+    block.rawLength = static_cast<uint32_t>(raw.size());
+    segment.length += compressed.size();
+    coldTotal += compressed.size();
+    return true;
+}
+
+// The segment still being written to grows after it was mapped; it is mapped again
+// when a block past the end of the current view is read.
+const char* HistoryStore::mapSegment(Segment& segment, uint64_t end) {
+    if (segment.view != nullptr && segment.mappedLength >= end) {
+        return segment.view;
+    }
+    unmapSegment(segment);
+
+    segment.file = CreateFileA(segment.path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    LARGE_INTEGER fileSize;
+    if (segment.file == INVALID_HANDLE_VALUE || !GetFileSizeEx(segment.file, &fileSize) || static_cast<uint64_t>(fileSize.QuadPart) < end) {
+        unmapSegment(segment);
+        return nullptr;
+    }
+    segment.mapping = CreateFileMappingA(segment.file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    segment.view = segment.mapping == nullptr ? nullptr : static_cast<const char*>(MapViewOfFile(segment.mapping, FILE_MAP_READ, 0, 0, 0));
+    if (segment.view == nullptr) {
+        unmapSegment(segment);
+        return nullptr;
+    }
+    segment.mappedLength = static_cast<uint64_t>(fileSize.QuadPart);
+    return segment.view;
+}
+
+void HistoryStore::unmapSegment(Segment& segment) {
+    if (segment.view != nullptr) {
+        UnmapViewOfFile(segment.view);
+        segment.view = nullptr;
+    }
+    if (segment.mapping != nullptr) {
+        CloseHandle(segment.mapping);
+        segment.mapping = nullptr;
+    }
+    if (segment.file != INVALID_HANDLE_VALUE) {
+        CloseHandle(segment.file);
+        segment.file = INVALID_HANDLE_VALUE;
+    }
+    segment.mappedLength = 0;
+}
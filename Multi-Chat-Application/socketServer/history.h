@@ -0,0 +1,108 @@
+#ifndef SOCKETSERVER_HISTORY_H
+#define SOCKETSERVER_HISTORY_H
+
+#include "socketutil.h"
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+// Memory the hot tier may use before the least recently used blocks are spilled.
+const size_t DEFAULT_HISTORY_BUDGET_MB = 64;
+// Chat lines replayed to a member when it joins a room.
+const size_t DEFAULT_JOIN_HISTORY = 20;
+
+// Lines per block. A room's newest block stays open for appends until it fills or is
+// spilled; either way the next line starts a new one.
+const size_t HISTORY_BLOCK_LINES = 256;
+// Segment files are appended until they reach this size, then a new one is started.
+const size_t HISTORY_SEGMENT_BYTES = 64 * 1024 * 1024;
+
+struct HistoryLine {
+    uint64_t sequence;
+    string line;
+};
+
+// Every chat line each room has seen, by room name, so it outlives the room's ring and
+// the room itself. Lines are kept in blocks, hot or cold. Hot blocks are plain text in
+// memory on one LRU list across all rooms; appending to a block or reading it moves it
+// to the front. When the hot blocks outgrow the budget, the least recently used are
+// compressed (lz.h) and appended to a segment file, and only their location stays in
+// memory, so a room nobody talks in costs a few dozen bytes per block. Reading a cold
+// block maps its segment and brings the block back hot. A block that was spilled once
+// keeps its place on disk, so spilling it again only frees the memory.
+// Segment files are scratch space for this process and are deleted when it exits.
+// Event loop only.
+class HistoryStore {
+public:
+    HistoryStore();
+    ~HistoryStore();
+
+    void configure(const string& directory, size_t budgetBytes);
+
+    // Sequences must grow within a room.
+    void append(const string& roomName, uint64_t sequence, string_view line);
+    // One past the room's last line, or 0 for a room with no history.
+    uint64_t nextSequence(const string& roomName) const;
+
+    bool find(const string& roomName, uint64_t sequence, string& line);
+    // The newest count lines, oldest first.
+    void recent(const string& roomName, size_t count, vector<HistoryLine>& lines);
+
+    size_t hotBytes() const { return hotTotal; }
+    uint64_t coldBytes() const { return coldTotal; }
+    uint64_t coldReads() const { return coldReadCount; }
+
+private:
+    struct HotBlock;
+    struct Block {
+        uint64_t firstSequence;
+        uint64_t lastSequence;
+        uint32_t lineCount;
+        bool sealed;
+        // Where the compressed block is on disk, once it has been spilled.
+        uint32_t segment;
+        uint64_t offset;
+        uint32_t compressedLength;
+        uint32_t rawLength;
+        unique_ptr<HotBlock> hot;
+    };
+    struct RoomHistory {
+        string name;
+        vector<Block> blocks;
+    };
+    struct BlockRef {
+        uint32_t room;
+        uint32_t block;
+    };
+    struct Segment {
+        string path;
+        FILE* writer;
+        uint64_t length;
+        HANDLE file;
+        HANDLE mapping;
+        const char* view;
+        uint64_t mappedLength;
+    };
+
+    HotBlock* load(uint32_t roomIndex, uint32_t blockIndex);
+    void touch(uint32_t roomIndex, uint32_t blockIndex);
+    void enforceBudget();
+    bool spill(Block& block);
+    const char* mapSegment(Segment& segment, uint64_t end);
+    void unmapSegment(Segment& segment);
+
+    string directory;
+    size_t budget;
+    unordered_map<string, uint32_t> roomIndexes;
+    vector<RoomHistory> rooms;
+    list<BlockRef> lru;
+    vector<Segment> segments;
+    size_t hotTotal;
+    uint64_t coldTotal;
+    uint64_t coldReadCount;
+    bool spillFailed;
+};
+
+#endif //SOCKETSERVER_HISTORY_H
@@ -0,0 +1,29 @@
+#include "overload.h"
+
+LoadShedder::LoadShedder(const LoadWatermarks& watermarks) : watermarks(watermarks), active(false), trigger("") {}
+
+bool LoadShedder::update(const LoadSample& sample) {
+    if (!active) {
+        if (watermarks.queuedOutputBytes != 0 && sample.queuedOutputBytes >= watermarks.queuedOutputBytes) {
+            trigger = "queued output";
+        } else if (watermarks.backlogMessages != 0 && sample.deepestBacklog >= watermarks.backlogMessages) {
+            trigger = "room backlog";
+        } else if (watermarks.busyFraction > 0 && sample.busyFraction >= watermarks.busyFraction) {
+            trigger = "event loop busy";
+        } else {
+            return false;
+        }
+        active = true;
+        return true;
+    }
+
+    bool recovered = (watermarks.queuedOutputBytes == 0 || sample.queuedOutputBytes < watermarks.queuedOutputBytes / 4 * 3) &&
+                     (watermarks.backlogMessages == 0 || sample.deepestBacklog < watermarks.backlogMessages / 4 * 3) &&
+                     (watermarks.busyFraction <= 0 || sample.busyFraction < watermarks.busyFraction * 0.75);
+    if (!recovered) {
+        return false;
+    }
+    active = false;
+    trigger = "";
+    return true;
+}
@@ -0,0 +1,50 @@
+#ifndef SOCKETSERVER_OVERLOAD_H
+#define SOCKETSERVER_OVERLOAD_H
+
+#include "socketutil.h"
+#include <cstdint>
+
+// Admission limits. New connections past either one are told SERVER_BUSY and closed
+// straight away instead of being queued behind everyone else. 0 turns a limit off.
+const uint32_t DEFAULT_MAX_CONNECTIONS = 10000;
+const uint32_t DEFAULT_MAX_NEGOTIATING = 500;
+
+// How long a refused client is asked to wait before trying again.
+const uint32_t SERVER_BUSY_RETRY_SECONDS = 5;
+
+// One look at how hard the server is working, taken every LOAD_SAMPLE_INTERVAL_MS.
+struct LoadSample {
+    size_t queuedOutputBytes;  // memory: bytes waiting in per-connection output buffers
+    uint64_t deepestBacklog;   // queue depth: most room messages any member is behind
+    double busyFraction;       // CPU: share of the interval the event loop was not waiting in WSAPoll
+};
+
+struct LoadWatermarks {
+    size_t queuedOutputBytes = 64 * 1024 * 1024;
+    uint64_t backlogMessages = 768;
+    double busyFraction = 0.9;
+};
+
+const int LOAD_SAMPLE_INTERVAL_MS = 1000;
+
+// Decides when to shed load. Shedding starts as soon as any measurement reaches its
+// watermark and stops only once every one of them is back under three quarters of it,
+// so a server hovering around a watermark does not flap in and out.
+class LoadShedder {
+public:
+    explicit LoadShedder(const LoadWatermarks& watermarks = LoadWatermarks());
+
+    // Returns true if the sample started or stopped shedding.
+    bool update(const LoadSample& sample);
+    bool shedding() const { return active; }
+    // Which watermark started the current shedding.
+    const char* reason() const { return trigger; }
+
+    LoadWatermarks watermarks;
+
+private:
+    bool active;
+    const char* trigger;
+};
+
+#endif //SOCKETSERVER_OVERLOAD_H
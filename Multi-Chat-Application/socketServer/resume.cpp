@@ -0,0 +1,80 @@
+#include "resume.h"
+#include "connection.h"
+
+SessionStore::SessionStore() : random(random_device()()) {}
+
+uint64_t SessionStore::issue(uint32_t connectionIndex) {
+    uint64_t token;
+    do {
+        token = random();
+    } while (token == 0 || owners.count(token) != 0 || detached.count(token) != 0);
+    owners[token] = connectionIndex;
+    return token;
+}
+
+uint32_t SessionStore::owner(uint64_t token) const {
+    auto it = owners.find(token);
+    return it == owners.end() ? INVALID_INDEX : it->second;
+}
+
+void SessionStore::forget(uint64_t token) {
+    owners.erase(token);
+}
+
+void SessionStore::detach(uint64_t token, const DetachedSession& session) {
+    owners.erase(token);
+    detached[token] = session;
+}
+
+bool SessionStore::reclaim(uint64_t token, uint32_t connectionIndex, DetachedSession& session) {
+    auto it = detached.find(token);
+    if (it == detached.end()) {
+        return false;
+    }
+    session = it->second;
+    detached.erase(it);
+    owners[token] = connectionIndex;
+    return true;
+}
+
+vector<DetachedSession> SessionStore::takeExpired(chrono::steady_clock::time_point now) {
+    vector<DetachedSession> expired;
+    for (auto it = detached.begin(); it != detached.end();) {
+        if (it->second.expiresAt <= now) {
+            expired.push_back(it->second);
+            it = detached.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return expired;
+}
+
+string FormatResumeToken(uint64_t token) {
+    static const char digits[] = "0123456789abcdef";
+    string text(16, '0');
+    for (int i = 15; i >= 0; --i) {
+        text[i] = digits[token & 0xF];
+        token >>= 4;
+    }
+    return text;
+}
+
+bool ParseResumeToken(string_view text, uint64_t& token) {
+    if (text.size() != 16) {
+        return false;
+    }
+    token = 0;
+    for (char c : text) {
+        int digit;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else {
+            return false;
+        }
+        token = (token << 4) | static_cast<uint64_t>(digit);
+    }
+    return token != 0;
+}
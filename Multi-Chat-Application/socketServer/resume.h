@@ -0,0 +1,51 @@
+#ifndef SOCKETSERVER_RESUME_H
+#define SOCKETSERVER_RESUME_H
+
+#include "socketutil.h"
+#include <chrono>
+#include <cstdint>
+#include <random>
+#include <string_view>
+#include <unordered_map>
+
+// How long a dropped chat session keeps its nickname and room seat. 0 turns resume off.
+const uint32_t DEFAULT_RESUME_GRACE_SECONDS = 60;
+
+// What a chat session needs to pick up where it left off after its connection drops.
+// The nickname stays interned under nicknameId, so nobody else can take it meanwhile.
+struct DetachedSession {
+    uint32_t nicknameId;
+    uint32_t roomId;
+    uint64_t joinSequence;
+    uint64_t ackedSequence;
+    chrono::steady_clock::time_point expiresAt;
+};
+
+// Resume tokens, issued once a nickname is accepted. A live session's token maps to its
+// connection; a detached one's maps to the parked session until it is reclaimed by a
+// RESUME on a new connection or its grace period runs out.
+class SessionStore {
+public:
+    SessionStore();
+
+    uint64_t issue(uint32_t connectionIndex);
+    uint32_t owner(uint64_t token) const;
+    void forget(uint64_t token);
+
+    void detach(uint64_t token, const DetachedSession& session);
+    bool reclaim(uint64_t token, uint32_t connectionIndex, DetachedSession& session);
+    vector<DetachedSession> takeExpired(chrono::steady_clock::time_point now);
+    size_t detachedCount() const { return detached.size(); }
+    const unordered_map<uint64_t, DetachedSession>& detachedSessions() const { return detached; }
+
+private:
+    mt19937_64 random;
+    unordered_map<uint64_t, uint32_t> owners;
+    unordered_map<uint64_t, DetachedSession> detached;
+};
+
+// Tokens go over the wire as 16 hex digits.
+string FormatResumeToken(uint64_t token);
+bool ParseResumeToken(string_view text, uint64_t& token);
+
+#endif //SOCKETSERVER_RESUME_H
@@ -0,0 +1,127 @@
+#include "room.h"
+
+uint64_t MessageRing::publish(const string& text, uint32_t senderNicknameId, const SharedMessage& senderNickname, uint32_t traceId) {
+    if (slots.size() < ROOM_RING_CAPACITY) {
+        slots.push_back(RingMessage());
+    }
+
+    RingMessage& message = slots[head % ROOM_RING_CAPACITY];
+    message.senderNicknameId = senderNicknameId;
+    message.traceId = traceId;
+    message.text = make_shared<const string>("SEQ:" + to_string(head) + ":" + text);
+    message.compressed.reset();
+    message.senderNickname = senderNickname;
+    message.publishedAt = chrono::steady_clock::now();
+    return head++;
+}
+
+// Slots below first's position stay empty, so the slot a sequence maps to is the same
+// as in the ring that was saved, and the ring only counts as full once it has wrapped.
+void MessageRing::restart(uint64_t first) {
+    clear();
+    slots.resize(first % ROOM_RING_CAPACITY);
+    head = first;
+    trimmed = first;
+}
+
+void MessageRing::restore(const SharedMessage& text, uint32_t senderNicknameId, const SharedMessage& senderNickname) {
+    if (slots.size() < ROOM_RING_CAPACITY) {
+        slots.push_back(RingMessage());
+    }
+
+    RingMessage& message = slots[head % ROOM_RING_CAPACITY];
+    message.senderNicknameId = senderNicknameId;
+    message.traceId = 0;
+    message.text = text;
+    message.compressed.reset();
+    message.senderNickname = senderNickname;
+    message.publishedAt = chrono::steady_clock::now();
+    head++;
+}
+
+void MessageRing::clear() {
+    vector<RingMessage>().swap(slots);
+    head = 0;
+    trimmed = 0;
+    clears++;
+}
+
+void MessageRing::trimThrough(uint64_t sequence) {
+    sequence = min(sequence, head);
+    for (uint64_t s = max(trimmed, oldestReplayable()); s < sequence; ++s) {
+        slots[s % ROOM_RING_CAPACITY].text.reset();
+        slots[s % ROOM_RING_CAPACITY].compressed.reset();
+    }
+    trimmed = max(trimmed, sequence);
+}
+
+RoomTable::RoomTable() {
+    create(LOBBY_ROOM_NAME, 0, "Lobby");
+}
+
+uint32_t RoomTable::create(const string& name, uint32_t memberCap, const string& topic) {
+    if (names.find(name) != INVALID_INDEX) {
+        return INVALID_INDEX;
+    }
+
+    uint32_t roomId = names.intern(name);
+    if (roomId >= rooms.size()) {
+        rooms.resize(roomId + 1);
+    }
+
+    Room& room = rooms[roomId];
+    room.topic = topic;
+    room.memberCap = memberCap;
+    room.createdAt = time(nullptr);
+    room.detachedMembers = 0;
+    room.digestJoins = 0;
+    room.digestLeaves = 0;
+    room.members.clear();
+    return roomId;
+}
+
+bool RoomTable::closeIfEmpty(uint32_t roomId) {
+    if (roomId == LOBBY_ROOM_ID || !isLive(roomId) || !rooms[roomId].members.empty() || rooms[roomId].detachedMembers != 0) {
+        return false;
+    }
+
+    Room& room = rooms[roomId];
+    room.topic.clear();
+    vector<uint32_t>().swap(room.members);
+    room.ring.clear();
+    names.release(roomId);
+    return true;
+}
+
+bool RoomTable::isFull(uint32_t roomId) const {
+    const Room& room = rooms[roomId];
+    return room.memberCap != 0 && room.members.size() + room.detachedMembers >= room.memberCap;
+}
+
+uint32_t RoomTable::addMember(uint32_t roomId, uint32_t connectionIndex) {
+    vector<uint32_t>& members = rooms[roomId].members;
+    members.push_back(connectionIndex);
+    return static_cast<uint32_t>(members.size() - 1);
+}
+
+uint32_t RoomTable::removeMember(uint32_t roomId, uint32_t memberSlot) {
+    vector<uint32_t>& members = rooms[roomId].members;
+    if (memberSlot >= members.size()) {
+        return INVALID_INDEX;
+    }
+
+    uint32_t movedConnection = INVALID_INDEX;
+    if (memberSlot != members.size() - 1) {
+        members[memberSlot] = members.back();
+        movedConnection = members[memberSlot];
+    }
+    members.pop_back();
+    return movedConnection;
+}
+
+bool isValidRoomName(const string& name) {
+    if (name.empty() || name.length() > MAX_ROOM_NAME_LENGTH || name == LOBBY_ROOM_NAME) {
+        return false;
+    }
+    return name.find_first_of(":,") == string::npos;
+}
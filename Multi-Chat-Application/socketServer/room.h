@@ -0,0 +1,122 @@
+#ifndef SOCKETSERVER_ROOM_H
+#define SOCKETSERVER_ROOM_H
+
+#include "connection.h"
+#include "protocol.h"
+#include <chrono>
+#include <ctime>
+
+const uint32_t LOBBY_ROOM_ID = 0;
+const size_t MAX_ROOM_NAME_LENGTH = 32;
+const size_t MAX_ROOM_TOPIC_LENGTH = 200;
+
+const size_t ROOM_RING_CAPACITY = 1024;
+
+// Rooms of at least this many members announce joins and leaves as a periodic digest.
+const uint32_t DEFAULT_PRESENCE_DIGEST_MEMBERS = 100;
+
+struct RingMessage {
+    uint32_t senderNicknameId;
+    uint32_t traceId;  // non-zero while the message is being traced
+    SharedMessage text;
+    // The text as a compressed frame, made when the first member that negotiated
+    // compression is sent it and shared by the rest; the text itself if that would not
+    // be smaller. A cache, so it is filled in through const references too.
+    mutable SharedMessage compressed;
+    // The sender's nickname itself, null for server messages. The id is only good while
+    // the nickname is held; once its owner is gone it can be given to someone else.
+    SharedMessage senderNickname;
+    chrono::steady_clock::time_point publishedAt;
+};
+
+// Single-writer ring of the messages broadcast to a room, numbered by sequence. Each
+// member keeps its own cursor into it, so a message is stored once however many
+// members still have to be sent it. The ring grows to ROOM_RING_CAPACITY messages and
+// then overwrites the oldest; a member whose cursor is about to be overwritten has
+// been lapped and must be resynced before the next publish. Overwriting a slot only
+// drops the ring's reference, so sends still in flight keep their bytes. Messages are
+// stored with their SEQ envelope and tagged with the sender's nickname id rather than
+// its connection, so a resumed session still skips its own messages, and with the
+// nickname itself, for a snapshot to record who sent them. Once every member
+// has acknowledged a message its text is released early; the slot stays until reused.
+class MessageRing {
+public:
+    MessageRing() : head(0), trimmed(0), clears(0) {}
+
+    uint64_t publish(const string& text, uint32_t senderNicknameId, const SharedMessage& senderNickname, uint32_t traceId = 0);
+    void clear();
+    void trimThrough(uint64_t sequence);
+
+    // Warm restart: the ring starts over at sequence first and is refilled with the
+    // messages a snapshot held, already in their envelopes, in sequence order.
+    void restart(uint64_t first);
+    void restore(const SharedMessage& text, uint32_t senderNicknameId, const SharedMessage& senderNickname);
+
+    uint64_t headSequence() const { return head; }
+    // Changes whenever the ring is cleared or restarted, so sequences seen before can
+    // be told apart from the same sequences reused.
+    uint32_t generation() const { return clears; }
+    bool isLapping(uint64_t cursor) const { return slots.size() == ROOM_RING_CAPACITY && head - cursor >= ROOM_RING_CAPACITY; }
+    const RingMessage& at(uint64_t sequence) const { return slots[sequence % ROOM_RING_CAPACITY]; }
+
+    // Oldest sequence a cursor can be placed at: still held, not trimmed, and not about
+    // to be lapped by the next publish.
+    uint64_t oldestReplayable() const {
+        uint64_t oldest = slots.size() < ROOM_RING_CAPACITY ? head - slots.size() : head - ROOM_RING_CAPACITY + 1;
+        return max(oldest, trimmed);
+    }
+
+private:
+    vector<RingMessage> slots;
+    uint64_t head;
+    uint64_t trimmed;
+    uint32_t clears;
+};
+
+struct Room {
+    string topic;
+    uint32_t memberCap;
+    time_t createdAt;
+    uint32_t detachedMembers;
+    vector<uint32_t> members;
+    MessageRing ring;
+    // Joins and leaves not yet announced in a presence digest.
+    uint32_t digestJoins;
+    uint32_t digestLeaves;
+};
+
+// Rooms are interned by name once, when they are created or joined; everything after
+// that works on the dense room id. A room lives until its last member leaves, except
+// the lobby, which always exists as id 0. Members whose connection dropped but whose
+// session can still be resumed keep their seat and keep the room open.
+class RoomTable {
+public:
+    RoomTable();
+
+    uint32_t create(const string& name, uint32_t memberCap, const string& topic);
+    bool closeIfEmpty(uint32_t roomId);
+
+    uint32_t find(const string& name) const { return names.find(name); }
+    const string& name(uint32_t roomId) const { return names.lookup(roomId); }
+    bool isLive(uint32_t roomId) const { return roomId < rooms.size() && !names.lookup(roomId).empty(); }
+    bool isFull(uint32_t roomId) const;
+
+    Room& operator[](uint32_t roomId) { return rooms[roomId]; }
+    const Room& operator[](uint32_t roomId) const { return rooms[roomId]; }
+    uint32_t idCount() const { return static_cast<uint32_t>(rooms.size()); }
+    size_t size() const { return names.size(); }
+
+    // Membership is an unordered vector; a member remembers its position so leaving
+    // is a swap-remove. removeMember returns the connection moved into the vacated
+    // position, or INVALID_INDEX, so the caller can update that member's position.
+    uint32_t addMember(uint32_t roomId, uint32_t connectionIndex);
+    uint32_t removeMember(uint32_t roomId, uint32_t memberSlot);
+
+private:
+    StringInterner names;
+    vector<Room> rooms;
+};
+
+bool isValidRoomName(const string& name);
+
+#endif //SOCKETSERVER_ROOM_H
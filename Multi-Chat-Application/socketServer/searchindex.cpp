@@ -0,0 +1,257 @@
+#include "searchindex.h"
+#include <algorithm>
+
+namespace {
+
+// Lines the worker applies per hold of the index lock.
+const size_t SEARCH_APPLY_CHUNK = 512;
+
+bool isTermByte(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+void appendVarint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+// Membership tests against one posting list for a descending run of sequences: the
+// last decoded block is kept, since consecutive candidates usually fall in it.
+class PostingProbe {
+public:
+    explicit PostingProbe(const PostingList& list) : list(&list), block(SIZE_MAX) {}
+
+    bool contains(uint64_t sequence) {
+        size_t low = 0;
+        size_t high = list->blockCount();
+        while (low < high) {
+            size_t middle = (low + high) / 2;
+            if (list->blockStart(middle) <= sequence) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        if (low == 0) {
+            return false;
+        }
+        if (low - 1 != block) {
+            block = low - 1;
+            list->decodeBlock(block, decoded);
+        }
+        return binary_search(decoded.begin(), decoded.end(), sequence);
+    }
+
+private:
+    const PostingList* list;
+    size_t block;
+    vector<uint64_t> decoded;
+};
+
+}
+
+void TokenizeSearchText(string_view text, vector<string>& terms) {
+    size_t i = 0;
+    while (i < text.size()) {
+        while (i < text.size() && !isTermByte(static_cast<unsigned char>(text[i]))) {
+            ++i;
+        }
+        size_t start = i;
+        while (i < text.size() && isTermByte(static_cast<unsigned char>(text[i]))) {
+            ++i;
+        }
+        if (i > start && i - start <= MAX_SEARCH_TERM_LENGTH) {
+            string term(text.substr(start, i - start));
+            for (char& c : term) {
+                if (c >= 'A' && c <= 'Z') {
+                    c = static_cast<char>(c - 'A' + 'a');
+                }
+            }
+            terms.push_back(move(term));
+        }
+    }
+}
+
+void PostingList::append(uint64_t sequence) {
+    if (count % POSTING_BLOCK_SIZE == 0) {
+        starts.push_back(sequence);
+        offsets.push_back(static_cast<uint32_t>(bytes.size()));
+    } else {
+        appendVarint(bytes, sequence - last);
+    }
+    last = sequence;
+    count++;
+}
+
+void PostingList::decodeBlock(size_t block, vector<uint64_t>& sequences) const {
+    sequences.clear();
+    uint64_t sequence = starts[block];
+    sequences.push_back(sequence);
+    size_t offset = offsets[block];
+    size_t end = block + 1 < offsets.size() ? offsets[block + 1] : bytes.size();
+    while (offset < end) {
+        uint64_t delta = 0;
+        int shift = 0;
+        uint8_t byte;
+        do {
+            byte = static_cast<uint8_t>(bytes[offset++]);
+            delta |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        sequence += delta;
+        sequences.push_back(sequence);
+    }
+}
+
+SearchIndex::SearchIndex() : working(false), stopping(false), indexed(0) {
+    worker = thread(&SearchIndex::run, this);
+}
+
+SearchIndex::~SearchIndex() {
+    {
+        lock_guard<mutex> lock(queueMutex);
+        stopping = true;
+    }
+    queueChanged.notify_all();
+    worker.join();
+}
+
+void SearchIndex::add(const string& roomName, uint64_t sequence, string_view line, size_t textOffset) {
+    staging.push_back(PendingLine{ roomName, sequence, string(line), textOffset });
+}
+
+void SearchIndex::publish() {
+    if (staging.empty()) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(queueMutex);
+        if (queued.empty()) {
+            queued.swap(staging);
+        } else {
+            move(staging.begin(), staging.end(), back_inserter(queued));
+            staging.clear();
+        }
+    }
+    queueChanged.notify_one();
+}
+
+void SearchIndex::waitIdle() {
+    publish();
+    unique_lock<mutex> lock(queueMutex);
+    queueChanged.wait(lock, [this] { return queued.empty() && !working; });
+}
+
+void SearchIndex::run() {
+    vector<PendingLine> batch;
+    vector<TokenizedLine> tokenized;
+    while (true) {
+        {
+            unique_lock<mutex> lock(queueMutex);
+            working = false;
+            queueChanged.notify_all();
+            queueChanged.wait(lock, [this] { return stopping || !queued.empty(); });
+            if (queued.empty()) {
+                return;
+            }
+            batch.clear();
+            batch.swap(queued);
+            working = true;
+        }
+
+        for (size_t first = 0; first < batch.size(); first += SEARCH_APPLY_CHUNK) {
+            size_t last = min(batch.size(), first + SEARCH_APPLY_CHUNK);
+            tokenized.resize(last - first);
+            for (size_t i = first; i < last; ++i) {
+                TokenizedLine& line = tokenized[i - first];
+                line.pending = &batch[i];
+                line.terms.clear();
+                TokenizeSearchText(string_view(batch[i].line).substr(batch[i].textOffset), line.terms);
+                sort(line.terms.begin(), line.terms.end());
+                line.terms.erase(unique(line.terms.begin(), line.terms.end()), line.terms.end());
+            }
+
+            lock_guard<mutex> lock(indexMutex);
+            for (TokenizedLine& line : tokenized) {
+                apply(line);
+            }
+        }
+    }
+}
+
+void SearchIndex::apply(TokenizedLine& tokenized) {
+    PendingLine& pending = *tokenized.pending;
+    Partition& partition = partitions[pending.roomName];
+    for (const string& term : tokenized.terms) {
+        partition.postings[term].append(pending.sequence);
+    }
+    indexed++;
+}
+
+uint64_t SearchIndex::search(const string& roomName, const vector<string>& terms, uint64_t before, size_t limit, vector<uint64_t>& sequences) {
+    lock_guard<mutex> lock(indexMutex);
+    auto partition = partitions.find(roomName);
+    if (partition == partitions.end() || terms.empty() || limit == 0) {
+        return 0;
+    }
+
+    // Walk the rarest term's list newest first and test the others for each candidate.
+    vector<const PostingList*> lists;
+    for (const string& term : terms) {
+        auto postings = partition->second.postings.find(term);
+        if (postings == partition->second.postings.end()) {
+            return 0;
+        }
+        lists.push_back(&postings->second);
+    }
+    sort(lists.begin(), lists.end(), [](const PostingList* a, const PostingList* b) { return a->size() < b->size(); });
+    vector<PostingProbe> probes;
+    for (size_t i = 1; i < lists.size(); ++i) {
+        probes.emplace_back(*lists[i]);
+    }
+
+    const PostingList& rarest = *lists[0];
+    vector<uint64_t> block;
+    for (size_t b = rarest.blockCount(); b-- > 0;) {
+        if (before != 0 && rarest.blockStart(b) >= before) {
+            continue;
+        }
+        rarest.decodeBlock(b, block);
+        for (auto candidate = block.rbegin(); candidate != block.rend(); ++candidate) {
+            if (before != 0 && *candidate >= before) {
+                continue;
+            }
+            bool matches = true;
+            for (PostingProbe& probe : probes) {
+                matches = matches && probe.contains(*candidate);
+            }
+            if (!matches) {
+                continue;
+            }
+            if (sequences.size() == limit) {
+                return sequences.back();
+            }
+            sequences.push_back(*candidate);
+        }
+    }
+    return 0;
+}
+
+uint64_t SearchIndex::indexedCount() const {
+    lock_guard<mutex> lock(indexMutex);
+    return indexed;
+}
+
+size_t SearchIndex::bytesUsed() const {
+    lock_guard<mutex> lock(indexMutex);
+    size_t bytes = 0;
+    for (const auto& [roomName, partition] : partitions) {
+        for (const auto& [term, postings] : partition.postings) {
+            bytes += term.capacity() + sizeof(term) + sizeof(postings) + postings.bytesUsed();
+        }
+    }
+    return bytes;
+}
@@ -0,0 +1,104 @@
+#ifndef SOCKETSERVER_SEARCHINDEX_H
+#define SOCKETSERVER_SEARCHINDEX_H
+
+#include "socketutil.h"
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+// Results per SEARCH page, and the most terms a query may combine.
+const size_t SEARCH_PAGE_SIZE = 20;
+const size_t MAX_SEARCH_TERMS = 8;
+
+// Splits text into search terms: runs of letters and digits, ASCII folded to lower
+// case. Bytes above 0x7F count as letters so UTF-8 words stay whole. Terms longer than
+// MAX_SEARCH_TERM_LENGTH are not indexed.
+const size_t MAX_SEARCH_TERM_LENGTH = 40;
+void TokenizeSearchText(string_view text, vector<string>& terms);
+
+// The sequences of the messages containing one term, ascending. They are stored in
+// blocks of POSTING_BLOCK_SIZE: each block's first sequence is kept whole so a lookup
+// can binary-search to a block, and the rest are varint deltas, a byte or two each.
+const size_t POSTING_BLOCK_SIZE = 128;
+
+class PostingList {
+public:
+    PostingList() : last(0), count(0) {}
+
+    void append(uint64_t sequence);
+    size_t size() const { return count; }
+    size_t blockCount() const { return starts.size(); }
+    uint64_t blockStart(size_t block) const { return starts[block]; }
+    void decodeBlock(size_t block, vector<uint64_t>& sequences) const;
+    size_t bytesUsed() const { return bytes.capacity() + starts.capacity() * sizeof(uint64_t) + offsets.capacity() * sizeof(uint32_t); }
+
+private:
+    vector<uint64_t> starts;
+    vector<uint32_t> offsets;  // where each block's deltas begin in bytes
+    string bytes;
+    uint64_t last;
+    size_t count;
+};
+
+// Full-text index over the chat lines of every room, one partition per room name. It
+// holds sequences only; the lines themselves are looked up in the room history.
+// Indexing runs on a background thread: the event loop only appends each line to a
+// staging batch, and hands the batch over once per loop iteration. The worker
+// tokenizes without holding the index lock and then applies a bounded chunk at a time,
+// so a search from the event loop never waits behind a long update. A line becomes
+// searchable a moment after it is broadcast. A room that is closed and reopened carries
+// on from its last sequence, so its partition simply keeps growing.
+class SearchIndex {
+public:
+    SearchIndex();
+    ~SearchIndex();
+
+    // Event loop only. textOffset is where the sender's text starts in line.
+    void add(const string& roomName, uint64_t sequence, string_view line, size_t textOffset);
+    void publish();
+
+    // Newest matches for every term first, with sequences below before (0: from the
+    // newest). Returns the before for the next page, or 0 when there are no more.
+    uint64_t search(const string& roomName, const vector<string>& terms, uint64_t before, size_t limit, vector<uint64_t>& sequences);
+
+    uint64_t indexedCount() const;
+    size_t bytesUsed() const;
+
+    // Waits until everything published so far is searchable. For benchmarks.
+    void waitIdle();
+
+private:
+    struct PendingLine {
+        string roomName;
+        uint64_t sequence;
+        string line;
+        size_t textOffset;
+    };
+    struct TokenizedLine {
+        PendingLine* pending;
+        vector<string> terms;
+    };
+    struct Partition {
+        unordered_map<string, PostingList> postings;
+    };
+
+    void run();
+    void apply(TokenizedLine& tokenized);
+
+    vector<PendingLine> staging;
+
+    mutex queueMutex;
+    condition_variable queueChanged;
+    vector<PendingLine> queued;
+    bool working;
+    bool stopping;
+
+    mutable mutex indexMutex;
+    unordered_map<string, Partition> partitions;
+    uint64_t indexed;
+
+    thread worker;
+};
+
+#endif //SOCKETSERVER_SEARCHINDEX_H
@@ -1,27 +1,141 @@
-#include "socketutil.h"
-
-struct ClientState {
-    string nickname;
-    int currentRoomNumber;
+#include "capture.h"
+#include "connection.h"
+#include "contentfilter.h"
+#include "framecompress.h"
+#include "history.h"
+#include "linescan.h"
+#include "overload.h"
+#include "protocol.h"
+#include "resume.h"
+#include "room.h"
+#include "searchindex.h"
+#include "session.h"
+#include "snapshot.h"
+#include "trace.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+
+const size_t MAX_PENDING_OUTPUT = 256 * 1024;
+
+// Turn sizes of the two output lanes (see flushPendingOutput): replies get four bytes
+// out for every one of room traffic while both are waiting.
+const size_t CONTROL_LANE_QUANTUM = 16 * 1024;
+const size_t BULK_LANE_QUANTUM = 4 * 1024;
+// Probe echoes one connection may have waiting behind its room backlog.
+const size_t MAX_PENDING_PROBES = 64;
+
+// Where the server listens when no --listen is given.
+const char* const DEFAULT_LISTEN_ENDPOINT = "127.0.0.1:8580";
+
+const int SESSION_EXPIRY_CHECK_INTERVAL_MS = 1000;
+const int DELIVERY_REVIEW_INTERVAL_MS = 1000;
+const int DELIVERY_REPORT_INTERVAL_SECONDS = 10;
+const int PRESENCE_DIGEST_INTERVAL_SECONDS = 5;
+const int SNAPSHOT_CHECK_INTERVAL_MS = 1000;
+const int CAPTURE_FLUSH_INTERVAL_MS = 1000;
+const int FILTER_CHECK_INTERVAL_MS = 1000;
+const int TRACE_DUMP_CHECK_INTERVAL_MS = 100;
+
+ConnectionTable connections;
+RoomTable rooms;
+SessionStore sessions;
+
+// Shared memory is only offered on the listeners marked here, and each offer carries a
+// fresh nonce.
+vector<bool> loopbackListeners;
+mt19937_64 sharedNonces(random_device{}());
+uint32_t resumeGraceSeconds = DEFAULT_RESUME_GRACE_SECONDS;
+
+// Room traffic since the last delivery review, and since the last lag report.
+bool deliveryChanged = false;
+uint64_t publishedSinceReport = 0;
+chrono::steady_clock::time_point lastDeliveryReview;
+chrono::steady_clock::time_point lastDeliveryReport;
+
+// Rooms at or above these sizes digest or drop join/leave announcements (0: never).
+uint32_t presenceDigestMembers = DEFAULT_PRESENCE_DIGEST_MEMBERS;
+uint32_t presenceSilentMembers = 0;
+bool presenceDigestPending = false;
+chrono::steady_clock::time_point presenceDigestDue;
+
+// Admission control and load shedding. Connections still negotiating a nickname are
+// counted separately, since a flood of them costs memory without anyone chatting.
+uint32_t maxConnections = DEFAULT_MAX_CONNECTIONS;
+uint32_t maxNegotiating = DEFAULT_MAX_NEGOTIATING;
+uint32_t negotiatingConnections = 0;
+uint64_t refusedSinceSample = 0;
+LoadShedder loadShedder;
+chrono::steady_clock::duration loopBusyTime{};
+chrono::steady_clock::time_point lastLoadSample = chrono::steady_clock::now();
+
+// Warm restart. With --snapshot, the state is read back from that file at startup and
+// written to it every snapshotIntervalSeconds on a background thread.
+string snapshotPath;
+uint32_t snapshotIntervalSeconds = DEFAULT_SNAPSHOT_INTERVAL_SECONDS;
+SnapshotWriter snapshotWriter;
+chrono::steady_clock::time_point nextSnapshotAt;
+chrono::steady_clock::duration lastCaptureTime{};
+
+// What earlier captures took from each room's ring, by room id, so the next one only
+// copies the messages published since.
+struct RoomCapture {
+    uint32_t ringGeneration;
+    uint64_t capturedThrough;
+    vector<SharedSnapshotChunk> chunks;
 };
-
-map<SOCKET, ClientState> clientStates;
-mutex clientStatesMutex;
+vector<RoomCapture> roomCaptures;
+
+// Sampled per-message tracing, switched on and dumped by admin connections: those
+// accepted on the listeners from firstAdminListener on.
+MessageTracer tracer;
+string traceFile = DEFAULT_TRACE_FILE;
+uint32_t activeTraceId = 0;
+chrono::steady_clock::time_point loopWokeAt;
+size_t firstAdminListener = SIZE_MAX;
+// A dump is written in the background; the admin who asked for it is told when it is
+// done, if the slot still holds the same socket by then.
+TraceDumpWriter traceDumpWriter;
+uint32_t traceDumpRequester = INVALID_INDEX;
+SOCKET traceDumpRequesterSocket = INVALID_SOCKET;
+
+// With --capture, everything clients send is recorded for ChatReplay. Connections are
+// captured under their slot index, which is not reused until they are gone.
+CaptureWriter capture;
+chrono::steady_clock::time_point lastCaptureFlush;
+
+// Chat lines are kept in the room history and indexed for COMMAND:SEARCH on the index's
+// own thread.
+HistoryStore history;
+SearchIndex searchIndex;
+size_t joinHistoryLines = DEFAULT_JOIN_HISTORY;
+
+// Clients that negotiated COMPRESS are sent output of at least compressionThreshold
+// bytes as compressed frames (0: nobody is). The byte counts, before and after, are
+// logged with the delivery report.
+size_t compressionThreshold = DEFAULT_COMPRESSION_THRESHOLD;
+uint64_t compressedPlainBytes = 0;
+uint64_t compressedWireBytes = 0;
+
+// With --filter, chat and direct messages go through the rules in that file before
+// they are sent anywhere. The file is checked for changes every FILTER_CHECK_INTERVAL_MS
+// and recompiled on filterLoader's thread; the loop swaps the new filter in.
+string filterPath;
+unique_ptr<ContentFilter> contentFilter;
+ContentFilterLoader filterLoader;
+filesystem::file_time_type filterFileTime;
+chrono::steady_clock::time_point nextFilterCheckAt;
 
 struct AcceptedSocket {
     SOCKET acceptedSocketFD;
-    sockaddr_in address;
+    sockaddr_storage address;
     int errorCode;
     bool accepted;
 };
 
 string trim(const string& str) {
-    size_t first = str.find_first_not_of(" \n\r\t");
-    if (string::npos == first) {
-        return "";
-    }
-    size_t last = str.find_last_not_of(" \n\r\t");
-    return str.substr(first, (last - first + 1));
+    return string(TrimLine(str));
 }
 
 AcceptedSocket AcceptIncomeingConnection(SOCKET serverSocketFD) {
@@ -29,13 +143,15 @@ AcceptedSocket AcceptIncomeingConnection(SOCKET serverSocketFD) {
     result.accepted = false;
     result.errorCode = 0;
 
-    sockaddr_in clientAddress;
+    sockaddr_storage clientAddress;
     int clientAddressSize = sizeof(clientAddress);
     result.acceptedSocketFD = accept(serverSocketFD, reinterpret_cast<sockaddr*>(&clientAddress), &clientAddressSize);
 
     if (result.acceptedSocketFD == INVALID_SOCKET) {
         result.errorCode = WSAGetLastError();
-        cerr << "accept failed with error: " << result.errorCode << endl;
+        if (result.errorCode != WSAEWOULDBLOCK) {
+            cerr << "accept failed with error: " << result.errorCode << endl;
+        }
         return result;
     }
 
@@ -44,330 +160,2048 @@ AcceptedSocket AcceptIncomeingConnection(SOCKET serverSocketFD) {
     return result;
 }
 
-void broadcastMessage(const string& message, SOCKET senderSocketFD, int targetRoomNumber) {
-    lock_guard<mutex> lock(clientStatesMutex);
+// Socket I/O, or ring I/O for a client attached through shared memory. Both return the
+// byte count or SOCKET_ERROR with WSAEWOULDBLOCK when nothing can move, so the callers
+// treat the two alike. The client is sent a doorbell only if it is asleep waiting.
+int connectionSend(Connection& client, const char* data, size_t length) {
+    if (client.shared == nullptr) {
+        return send(client.socketFD, data, static_cast<int>(length), 0);
+    }
+    SharedRing& ring = client.shared->outbound();
+    size_t written = ring.write(data, length);
+    if (written != 0 && ring.takeConsumerWaiting()) {
+        RingDoorbell(client.socketFD);
+    }
+    if (written == 0) {
+        WSASetLastError(WSAEWOULDBLOCK);
+        return SOCKET_ERROR;
+    }
+    return static_cast<int>(written);
+}
+
+int connectionRecv(Connection& client, char* data, size_t capacity) {
+    if (client.shared == nullptr) {
+        return recv(client.socketFD, data, static_cast<int>(capacity), 0);
+    }
+    SharedRing& ring = client.shared->inbound();
+    size_t received = ring.read(data, capacity);
+    if (received != 0 && ring.takeProducerWaiting()) {
+        RingDoorbell(client.socketFD);
+    }
+    if (received == 0) {
+        WSASetLastError(WSAEWOULDBLOCK);
+        return SOCKET_ERROR;
+    }
+    return static_cast<int>(received);
+}
+
+bool hasRingBacklog(const Connection& client) {
+    return client.roomSlot != INVALID_INDEX && client.roomCursor < rooms[client.roomId].ring.headSequence();
+}
+
+void queueOutput(Connection& client, const char* data, size_t length) {
+    if (client.pendingOutput == nullptr) {
+        client.pendingOutput = new string(data, length);
+        client.outputOffset = 0;
+        return;
+    }
+
+    if (client.pendingOutput->length() - client.outputOffset + length > MAX_PENDING_OUTPUT) {
+        cerr << "Client " << client.socketFD << " is not reading its messages; dropping connection." << endl;
+        client.closing = true;
+        return;
+    }
+    client.pendingOutput->append(data, length);
+}
+
+// What a member is sent for a ring message: for members that negotiated compression,
+// the compressed frame, made by the first of them to need it and shared by the rest.
+const SharedMessage& ringPayload(const Connection& client, const RingMessage& message) {
+    if (!client.compressed || message.text->length() < compressionThreshold) {
+        return message.text;
+    }
+    if (!message.compressed) {
+        string frame;
+        message.compressed = CompressFrame(*message.text, frame) ? make_shared<const string>(move(frame)) : message.text;
+    }
+    return message.compressed;
+}
 
-    for (const auto& pair : clientStates) {
-        SOCKET targetSocket = pair.first;
-        const ClientState& state = pair.second;
+void countPayloadSent(const RingMessage& message, const SharedMessage& payload) {
+    if (payload != message.text) {
+        compressedPlainBytes += message.text->length();
+        compressedWireBytes += payload->length();
+    }
+}
+
+// Puts data ahead of the unsent private output, at the end of the turn being sent. With
+// finishesFrame, it completes the ring message the client is partway through and is
+// sent before anything else.
+void queueOutputFirst(Connection& client, const string& data, bool finishesFrame) {
+    if (data.empty() || client.closing) {
+        return;
+    }
+    if (client.pendingOutput == nullptr) {
+        queueOutput(client, data.c_str(), data.length());
+    } else if (client.pendingOutput->length() - client.outputOffset + data.length() > MAX_PENDING_OUTPUT) {
+        cerr << "Client " << client.socketFD << " is not reading its messages; dropping connection." << endl;
+        client.closing = true;
+        return;
+    } else {
+        client.pendingOutput->insert(client.outputCut, data);
+    }
+    if (finishesFrame) {
+        client.outputCut += static_cast<uint32_t>(data.length());
+    }
+}
 
-        if (state.currentRoomNumber == targetRoomNumber && targetSocket != senderSocketFD) {
-            int bytesSent = send(targetSocket, message.c_str(), message.length(), 0);
-            if (bytesSent == SOCKET_ERROR) {
-                cerr << "send to client " << targetSocket << " in room " << targetRoomNumber << " failed with error: " << WSAGetLastError() << endl;
+// Moves the room messages this client has not been sent yet into its private output,
+// so that whatever is queued next goes out after them.
+void spillRingBacklog(uint32_t clientIndex) {
+    Connection& client = connections[clientIndex];
+    const MessageRing& ring = rooms[client.roomId].ring;
+    bool finishesFrame = client.ringOffset > 0;
+    string backlog;
+    while (client.roomCursor < ring.headSequence()) {
+        const RingMessage& message = ring.at(client.roomCursor);
+        if (message.senderNicknameId != client.nicknameId) {
+            const SharedMessage& payload = ringPayload(client, message);
+            backlog.append(payload->c_str() + client.ringOffset, payload->length() - client.ringOffset);
+            countPayloadSent(message, payload);
+            if (message.traceId != 0) {
+                tracer.record(message.traceId, TRACE_QUEUED, client.socketFD);
             }
         }
+        client.roomCursor++;
+        client.ringOffset = 0;
     }
+    queueOutputFirst(client, backlog, finishesFrame);
 }
 
-string getUsersInRoom(int roomNumber, const string& excludeNickname) {
-    string userList = "";
-    lock_guard<mutex> lock(clientStatesMutex);
-    vector<string> nicknamesInRoom;
+// Private output goes out ahead of room messages still waiting in the ring, so a reply
+// is not held up by a busy room.
+void sendToClient(uint32_t clientIndex, const string& message) {
+    Connection& client = connections[clientIndex];
+    if (client.closing) {
+        return;
+    }
+
+    string frame;
+    bool compressed = client.compressed && message.length() >= compressionThreshold && CompressFrame(message, frame);
+    const string& data = compressed ? frame : message;
+    if (compressed) {
+        compressedPlainBytes += message.length();
+        compressedWireBytes += frame.length();
+    }
 
-    for (const auto& pair : clientStates) {
-        const ClientState& state = pair.second;
-        if (state.currentRoomNumber == roomNumber && state.nickname != excludeNickname) {
-            nicknamesInRoom.push_back(state.nickname);
+    if (client.pendingOutput == nullptr && client.ringOffset == 0) {
+        int bytesSent = connectionSend(client, data.c_str(), data.length());
+        if (bytesSent == SOCKET_ERROR) {
+            int errorCode = WSAGetLastError();
+            if (errorCode != WSAEWOULDBLOCK) {
+                cerr << "send to client " << client.socketFD << " failed with error: " << errorCode << endl;
+                client.closing = true;
+                return;
+            }
+            bytesSent = 0;
         }
+        if (static_cast<size_t>(bytesSent) < data.length()) {
+            queueOutput(client, data.c_str() + bytesSent, data.length() - bytesSent);
+            client.outputCut = static_cast<uint32_t>(data.length() - bytesSent);
+        }
+        return;
     }
 
-    for (size_t i = 0; i < nicknamesInRoom.size(); ++i) {
-        userList += nicknamesInRoom[i];
-        if (i < nicknamesInRoom.size() - 1) {
-            userList += ",";
+    queueOutput(client, data.c_str(), data.length());
+}
+
+// Sends room messages straight out of the ring, from the client's cursor up to the
+// head, for one turn of the bulk lane. Stops at the first short send, returning false;
+// the cursor and offset record where to resume when the socket is writable again.
+bool drainRoomRing(uint32_t clientIndex) {
+    Connection& client = connections[clientIndex];
+    const MessageRing& ring = rooms[client.roomId].ring;
+    while (!client.closing && client.roomCursor < ring.headSequence()) {
+        if (client.laneSent >= BULK_LANE_QUANTUM && client.ringOffset == 0) {
+            client.laneSent = 0;
+            client.bulkTurn = false;
+            return true;
+        }
+        const RingMessage& message = ring.at(client.roomCursor);
+        if (message.senderNicknameId == client.nicknameId) {
+            client.roomCursor++;
+            continue;
+        }
+
+        const SharedMessage& payload = ringPayload(client, message);
+        size_t remaining = payload->length() - client.ringOffset;
+        int bytesSent = connectionSend(client, payload->c_str() + client.ringOffset, remaining);
+        if (bytesSent == SOCKET_ERROR) {
+            int errorCode = WSAGetLastError();
+            if (errorCode != WSAEWOULDBLOCK) {
+                cerr << "send to client " << client.socketFD << " failed with error: " << errorCode << endl;
+                client.closing = true;
+            }
+            return false;
+        }
+        client.laneSent += bytesSent;
+        if (static_cast<size_t>(bytesSent) < remaining) {
+            client.ringOffset += bytesSent;
+            return false;
         }
+        if (message.traceId != 0) {
+            tracer.record(message.traceId, TRACE_SENT, client.socketFD);
+        }
+        countPayloadSent(message, payload);
+        client.roomCursor++;
+        client.ringOffset = 0;
     }
-    return userList;
+    return !client.closing;
 }
 
-bool handleClientCommand(SOCKET clientSocketFD, const string& commandMessage, const string& clientNickname) {
-    string trimmedCommand = trim(commandMessage);
+// Sends the held-back probe echoes whose room messages have all gone out, or all of
+// them once the client is out of the room.
+void releaseProbes(uint32_t clientIndex) {
+    Connection& client = connections[clientIndex];
+    vector<PendingProbe>& probes = *client.probes;
+    size_t released = 0;
+    while (released < probes.size() && (client.roomSlot == INVALID_INDEX || (client.roomCursor >= probes[released].sequence && client.ringOffset == 0))) {
+        sendToClient(clientIndex, probes[released].echo);
+        released++;
+    }
+    probes.erase(probes.begin(), probes.begin() + released);
+    if (probes.empty()) {
+        delete client.probes;
+        client.probes = nullptr;
+    }
+}
 
-    if (trimmedCommand.rfind("COMMAND:JOIN:", 0) == 0) {
-        string roomNumberStr = trim(trimmedCommand.substr(13));
-        int newRoomNumber;
+// The next publish would overwrite the message at this client's cursor. Finish the
+// message it is partway through, skip it to the head and tell it what it missed.
+void resyncLappedMember(uint32_t clientIndex) {
+    Connection& client = connections[clientIndex];
+    const MessageRing& ring = rooms[client.roomId].ring;
+    if (client.ringOffset > 0) {
+        const SharedMessage& payload = ringPayload(client, ring.at(client.roomCursor));
+        queueOutputFirst(client, payload->substr(client.ringOffset), true);
+        client.roomCursor++;
+        client.ringOffset = 0;
+    }
 
-        try {
-            newRoomNumber = stoi(roomNumberStr);
-            if (newRoomNumber <= 0) {
-                string response = "ERROR: Room number must be a positive integer.\n";
-                send(clientSocketFD, response.c_str(), response.length(), 0);
-                return true;
-            }
-        } catch (const invalid_argument& e) {
-            string response = "ERROR: Invalid room number format. Please enter a number.\n";
-            send(clientSocketFD, response.c_str(), response.length(), 0);
-            return true;
-        } catch (const out_of_range& e) {
-            string response = "ERROR: Room number out of valid range.\n";
-            send(clientSocketFD, response.c_str(), response.length(), 0);
-            return true;
+    uint64_t skipped = ring.headSequence() - client.roomCursor;
+    client.roomCursor = ring.headSequence();
+    cout << "Client " << client.socketFD << " fell " << skipped << " messages behind in room '" << rooms.name(client.roomId) << "'; resyncing." << endl;
+    sendToClient(clientIndex, "INFO: You fell behind; " + to_string(skipped) + " messages in room '" + rooms.name(client.roomId) + "' were skipped.\n");
+    if (client.probes != nullptr) {
+        releaseProbes(clientIndex);
+    }
+}
+
+// The first frame boundary at least budget bytes past offset, itself a boundary. A
+// compressed frame ends where its header says; any other frame at its newline.
+size_t controlCut(const string& output, size_t offset, size_t budget) {
+    size_t cut = offset;
+    while (cut < output.length() && cut - offset < budget) {
+        size_t frameSize = 0;
+        if (output[cut] == COMPRESSED_FRAME_MARKER) {
+            frameSize = CompressedFrameSize(string_view(output).substr(cut));
+        } else {
+            const char* newline = FindNewline(output.c_str() + cut, output.c_str() + output.length());
+            frameSize = newline == nullptr ? 0 : newline + 1 - (output.c_str() + cut);
+        }
+        if (frameSize == 0) {
+            return output.length();
+        }
+        cut += frameSize;
+    }
+    return min(cut, output.length());
+}
+
+// Sends the private output for one turn of the control lane. Returns false when it
+// stopped on the socket.
+bool sendControlOutput(uint32_t clientIndex) {
+    Connection& client = connections[clientIndex];
+    string& output = *client.pendingOutput;
+    if (client.outputOffset == client.outputCut) {
+        client.outputCut = static_cast<uint32_t>(controlCut(output, client.outputOffset, CONTROL_LANE_QUANTUM - client.laneSent));
+    }
+
+    size_t length = client.outputCut - client.outputOffset;
+    int bytesSent = connectionSend(client, output.c_str() + client.outputOffset, length);
+    if (bytesSent == SOCKET_ERROR) {
+        int errorCode = WSAGetLastError();
+        if (errorCode != WSAEWOULDBLOCK) {
+            cerr << "send to client " << client.socketFD << " failed with error: " << errorCode << endl;
+            client.closing = true;
         }
+        return false;
+    }
 
-        unique_lock<mutex> lock(clientStatesMutex);
-        auto it = clientStates.find(clientSocketFD);
-        int oldRoomNumber = 0;
-        if (it != clientStates.end()) {
-            oldRoomNumber = it->second.currentRoomNumber;
-            if (oldRoomNumber != newRoomNumber) {
-                it->second.currentRoomNumber = newRoomNumber;
+    client.outputOffset += bytesSent;
+    client.laneSent += bytesSent;
+    if (client.outputOffset == output.length()) {
+        delete client.pendingOutput;
+        client.pendingOutput = nullptr;
+        client.outputOffset = 0;
+        client.outputCut = 0;
+    } else if (client.outputOffset > output.length() / 2) {
+        output.erase(0, client.outputOffset);
+        client.outputCut -= client.outputOffset;
+        client.outputOffset = 0;
+    }
+    if (static_cast<size_t>(bytesSent) < length) {
+        return false;
+    }
+    if (client.laneSent >= CONTROL_LANE_QUANTUM) {
+        client.laneSent = 0;
+        client.bulkTurn = true;
+    }
+    return true;
+}
 
-                lock.unlock();
+// Output leaves in two lanes: control, the private output sendToClient queues (replies,
+// errors, direct messages, search results), and bulk, the room ring from the member's
+// cursor. When both have something waiting they take turns of CONTROL_LANE_QUANTUM and
+// BULK_LANE_QUANTUM bytes, so a command's reply waits behind at most one bulk turn
+// however busy the room is. Turns end on frame boundaries, never inside a line.
+void flushPendingOutput(uint32_t clientIndex) {
+    Connection& client = connections[clientIndex];
+    while (!client.closing) {
+        bool controlWaiting = client.pendingOutput != nullptr;
+        bool bulkWaiting = hasRingBacklog(client);
+        bool bulkNext;
+        if (client.ringOffset > 0) {
+            bulkNext = true;
+        } else if (client.outputOffset < client.outputCut) {
+            bulkNext = false;
+        } else if (controlWaiting && bulkWaiting) {
+            bulkNext = client.bulkTurn;
+        } else if (controlWaiting || bulkWaiting) {
+            bulkNext = bulkWaiting;
+            client.laneSent = 0;
+        } else {
+            return;
+        }
 
-                if (oldRoomNumber != 0) {
-                    string leaveMsg = clientNickname + " has left room number '" + to_string(oldRoomNumber) + "'.\n";
-                    broadcastMessage(leaveMsg, clientSocketFD, oldRoomNumber);
-                }
+        bool finishedTurn = bulkNext ? drainRoomRing(clientIndex) : sendControlOutput(clientIndex);
+        if (bulkNext && client.probes != nullptr) {
+            releaseProbes(clientIndex);
+        }
+        if (!finishedTurn) {
+            return;
+        }
+    }
+}
 
-                string joinMsg = clientNickname + " has joined room number '" + to_string(newRoomNumber) + "'.\n";
-                broadcastMessage(joinMsg, clientSocketFD, newRoomNumber);
+// Publishes once into the room's ring; each member is then sent as much as its socket
+// takes, and the rest waits in the ring at that member's cursor.
+void broadcastMessage(const string& message, uint32_t senderIndex, uint32_t targetRoomId) {
+    MessageRing& ring = rooms[targetRoomId].ring;
+    const vector<uint32_t>& members = rooms[targetRoomId].members;
+    for (size_t i = 0; i < members.size(); ++i) {
+        if (ring.isLapping(connections[members[i]].roomCursor)) {
+            resyncLappedMember(members[i]);
+        }
+    }
 
-            } else {
-                string response = "INFO: You are already in room number '" + to_string(newRoomNumber) + "'.\n";
-                send(clientSocketFD, response.c_str(), response.length(), 0);
-            }
+    uint32_t senderNicknameId = senderIndex == INVALID_INDEX ? INVALID_INDEX : connections[senderIndex].nicknameId;
+    ring.publish(message, senderNicknameId, senderNicknameId == INVALID_INDEX ? SharedMessage() : connections.sharedNickname(senderNicknameId), activeTraceId);
+    deliveryChanged = true;
+    publishedSinceReport++;
+    if (activeTraceId != 0 && senderIndex != INVALID_INDEX) {
+        tracer.record(activeTraceId, TRACE_FANOUT_START, connections[senderIndex].socketFD);
+    }
+    for (size_t i = 0; i < members.size(); ++i) {
+        if (connections[members[i]].pendingOutput == nullptr) {
+            flushPendingOutput(members[i]);
         }
-        string response = "ROOM_JOINED:" + to_string(newRoomNumber) + "\n";
-        send(clientSocketFD, response.c_str(), response.length(), 0);
+    }
+    if (activeTraceId != 0) {
+        tracer.record(activeTraceId, TRACE_FANOUT_END, senderIndex == INVALID_INDEX ? INVALID_SOCKET : connections[senderIndex].socketFD,
+                      chrono::steady_clock::now(), static_cast<uint32_t>(members.size()));
+    }
+}
+
+string getUsersInRoom(uint32_t roomId, uint32_t excludeIndex) {
+    string userList = "";
 
-        string userList = getUsersInRoom(newRoomNumber, clientNickname);
-        string userListMsg = "USER_LIST:" + to_string(newRoomNumber) + ":" + userList + "\n";
-        send(clientSocketFD, userListMsg.c_str(), userListMsg.length(), 0);
+    const vector<uint32_t>& members = rooms[roomId].members;
+    for (size_t i = 0; i < members.size(); ++i) {
+        if (members[i] == excludeIndex) {
+            continue;
+        }
+        if (!userList.empty()) {
+            userList += ",";
+        }
+        userList += connections.nicknames.lookup(connections[members[i]].nicknameId);
+    }
+    return userList;
+}
 
-        cout << "Client " << clientNickname << " moved from room '" << oldRoomNumber << "' to '" << newRoomNumber << "'." << endl;
-        return true;
+void joinRoom(uint32_t clientIndex, uint32_t roomId) {
+    Connection& client = connections[clientIndex];
+    client.roomId = roomId;
+    client.roomSlot = rooms.addMember(roomId, clientIndex);
+    client.roomCursor = rooms[roomId].ring.headSequence();
+    client.roomJoinSequence = client.roomCursor;
+    client.ackedSequence = client.roomCursor;
+    client.ringOffset = 0;
+}
+
+void leaveRoom(uint32_t clientIndex) {
+    Connection& client = connections[clientIndex];
+    if (client.roomSlot == INVALID_INDEX) {
+        return;
+    }
+    if (hasRingBacklog(client)) {
+        spillRingBacklog(clientIndex);
+    }
+    if (client.probes != nullptr) {
+        releaseProbes(clientIndex);
     }
-    else if (trimmedCommand == "COMMAND:LEAVE") {
-        unique_lock<mutex> lock(clientStatesMutex);
-        auto it = clientStates.find(clientSocketFD);
-        if (it != clientStates.end()) {
-            int oldRoomNumber = it->second.currentRoomNumber;
-            if (oldRoomNumber != 0) {
-                it->second.currentRoomNumber = 0;
 
-                lock.unlock();
+    uint32_t movedIndex = rooms.removeMember(client.roomId, client.roomSlot);
+    if (movedIndex != INVALID_INDEX) {
+        connections[movedIndex].roomSlot = client.roomSlot;
+    }
+    client.roomSlot = INVALID_INDEX;
 
-                string leaveMsg = clientNickname + " has left room number '" + to_string(oldRoomNumber) + "'.\n";
-                broadcastMessage(leaveMsg, clientSocketFD, oldRoomNumber);
+    string roomName = rooms.name(client.roomId);
+    if (rooms.closeIfEmpty(client.roomId)) {
+        cout << "Room '" << roomName << "' closed (no members left). Open rooms: " << rooms.size() - 1 << endl;
+    }
+}
 
-                string response = "ROOM_LEFT:" + to_string(oldRoomNumber) + "\n";
-                send(clientSocketFD, response.c_str(), response.length(), 0);
+// Every join or leave line goes to every other member, so a reconnect wave through a
+// big room costs members * churn sends. Big rooms only count the changes and get one
+// digest line per PRESENCE_DIGEST_INTERVAL_SECONDS instead; the biggest get nothing,
+// and neither does any room while the server is shedding load.
+void announcePresence(const string& nickname, uint32_t roomId, bool joined, uint32_t excludeIndex) {
+    Room& room = rooms[roomId];
+    size_t roomSize = room.members.size() + room.detachedMembers;
+    if (loadShedder.shedding() || (presenceSilentMembers != 0 && roomSize >= presenceSilentMembers)) {
+        return;
+    }
+    if (presenceDigestMembers != 0 && roomSize >= presenceDigestMembers) {
+        (joined ? room.digestJoins : room.digestLeaves)++;
+        if (!presenceDigestPending) {
+            presenceDigestPending = true;
+            presenceDigestDue = chrono::steady_clock::now() + chrono::seconds(PRESENCE_DIGEST_INTERVAL_SECONDS);
+        }
+        return;
+    }
 
-                string userListLobby = getUsersInRoom(0, clientNickname);
-                string userListLobbyMsg = "USER_LIST:0:" + userListLobby + "\n";
-                send(clientSocketFD, userListLobbyMsg.c_str(), userListLobbyMsg.length(), 0);
+    string presenceMsg = nickname + (joined ? " has joined room '" : " has left room '") + rooms.name(roomId) + "'.\n";
+    broadcastMessage(presenceMsg, excludeIndex, roomId);
+}
 
-                cout << "Client " << clientNickname << " left room '" << oldRoomNumber << "' and moved to lobby (room 0)." << endl;
-            } else {
-                string response = "INFO: You are already in the lobby.\n";
-                send(clientSocketFD, response.c_str(), response.length(), 0);
-            }
+void sendPresenceDigests() {
+    for (uint32_t roomId = 0; roomId < rooms.idCount(); ++roomId) {
+        if (!rooms.isLive(roomId)) {
+            continue;
         }
-        return true;
+        Room& room = rooms[roomId];
+        if (room.digestJoins == 0 && room.digestLeaves == 0) {
+            continue;
+        }
+        string digest = "Room '" + rooms.name(roomId) + "': +" + to_string(room.digestJoins) + " joined, -" + to_string(room.digestLeaves) +
+                        " left in the last " + to_string(PRESENCE_DIGEST_INTERVAL_SECONDS) + " seconds.\n";
+        room.digestJoins = 0;
+        room.digestLeaves = 0;
+        broadcastMessage(digest, INVALID_INDEX, roomId);
+    }
+    presenceDigestPending = false;
+}
+
+void moveToRoom(uint32_t clientIndex, uint32_t newRoomId) {
+    const string& clientNickname = connections.nicknames.lookup(connections[clientIndex].nicknameId);
+    uint32_t oldRoomId = connections[clientIndex].roomId;
+
+    if (oldRoomId != LOBBY_ROOM_ID) {
+        announcePresence(clientNickname, oldRoomId, false, clientIndex);
     }
+    leaveRoom(clientIndex);
 
-    return false;
+    joinRoom(clientIndex, newRoomId);
+    if (newRoomId != LOBBY_ROOM_ID) {
+        announcePresence(clientNickname, newRoomId, true, clientIndex);
+    }
 }
 
+void sendRoomInfo(uint32_t clientIndex, uint32_t roomId) {
+    const Room& room = rooms[roomId];
+    sendToClient(clientIndex, "ROOM_INFO:" + rooms.name(roomId) + ":" + to_string(room.members.size()) + ":" + to_string(room.memberCap) + ":" + to_string(static_cast<long long>(room.createdAt)) + ":" + room.topic + "\n");
+}
 
-void HandlingSocket(AcceptedSocket acceptedSocket) {
-    string clientNickname = "";
-    int currentClientRoomNumber = 0;
+// A room's chat lines outlive its ring in the history, which also serves search results.
+void archiveChatLine(uint32_t roomId, uint64_t sequence, string_view line, size_t textOffset) {
+    history.append(rooms.name(roomId), sequence, line);
+    searchIndex.add(rooms.name(roomId), sequence, line, textOffset);
+}
 
-    string nicknameRequest = "NICK_REQUIRED\n";
-    send(acceptedSocket.acceptedSocketFD, nicknameRequest.c_str(), nicknameRequest.length(), 0);
+void sendRoomJoined(uint32_t clientIndex, uint32_t roomId) {
+    sendToClient(clientIndex, "ROOM_JOINED:" + rooms.name(roomId) + "\n");
+    sendRoomInfo(clientIndex, roomId);
 
-    bool nicknameSet = false;
-    while (!nicknameSet) {
-        char buffer[1024];
-        memset(buffer, 0, sizeof(buffer));
-        int bytesReceived = recv(acceptedSocket.acceptedSocketFD, buffer, sizeof(buffer) - 1, 0);
+    string userList = getUsersInRoom(roomId, clientIndex);
+    sendToClient(clientIndex, "USER_LIST:" + rooms.name(roomId) + ":" + userList + "\n");
 
-        if (bytesReceived <= 0) {
-            cout << "Client " << acceptedSocket.acceptedSocketFD << " disconnected during nickname negotiation." << endl;
-            goto cleanup_socket;
+    vector<HistoryLine> lines;
+    history.recent(rooms.name(roomId), joinHistoryLines, lines);
+    if (!lines.empty()) {
+        string replay;
+        for (const HistoryLine& line : lines) {
+            replay += "HISTORY:" + rooms.name(roomId) + ":" + to_string(line.sequence) + ":" + line.line + "\n";
         }
+        sendToClient(clientIndex, replay);
+    }
+}
 
-        string receivedMessage = trim(buffer);
+void handleJoinCommand(uint32_t clientIndex, const string& arguments) {
+    const string& clientNickname = connections.nicknames.lookup(connections[clientIndex].nicknameId);
+    string roomName = trim(arguments);
+    if (roomName == LOBBY_ROOM_NAME) {
+        sendToClient(clientIndex, "ERROR: Use COMMAND:LEAVE to return to the lobby.\n");
+        return;
+    }
 
-        if (receivedMessage.rfind("NICK ", 0) == 0) {
-            string proposedNickname = trim(receivedMessage.substr(5));
+    uint32_t newRoomId = rooms.find(roomName);
+    if (newRoomId == INVALID_INDEX) {
+        sendToClient(clientIndex, "ERROR: Room '" + roomName + "' does not exist. Create it first.\n");
+        return;
+    }
 
-            if (proposedNickname.empty() || proposedNickname.length() > 20) {
-                string response = "NICK_REJECTED: Nickname invalid (empty or too long).\n";
-                send(acceptedSocket.acceptedSocketFD, response.c_str(), response.length(), 0);
-                continue;
-            }
+    uint32_t oldRoomId = connections[clientIndex].roomId;
+    string oldRoomName = rooms.name(oldRoomId);
+    if (oldRoomId == newRoomId) {
+        sendToClient(clientIndex, "INFO: You are already in room '" + roomName + "'.\n");
+    } else if (rooms.isFull(newRoomId)) {
+        sendToClient(clientIndex, "ERROR: Room '" + roomName + "' is full (" + to_string(rooms[newRoomId].memberCap) + " members).\n");
+        return;
+    } else {
+        moveToRoom(clientIndex, newRoomId);
+    }
+    sendRoomJoined(clientIndex, newRoomId);
 
-            string tempNickname = proposedNickname;
-            int tempRoomNumber = 0;
-
-            bool nicknameTaken = false;
-            {
-                lock_guard<mutex> lock(clientStatesMutex);
-                for (const auto& pair : clientStates) {
-                    if (pair.second.nickname == proposedNickname) {
-                        nicknameTaken = true;
-                        break;
-                    }
-                }
+    cout << "Client " << clientNickname << " moved from room '" << oldRoomName << "' to '" << roomName << "'." << endl;
+}
 
-                if (!nicknameTaken) {
-                    clientNickname = proposedNickname;
-                    currentClientRoomNumber = tempRoomNumber;
-                    clientStates[acceptedSocket.acceptedSocketFD] = {clientNickname, currentClientRoomNumber};
-                    nicknameSet = true;
-                }
-            }
+void handleCreateCommand(uint32_t clientIndex, const string& arguments) {
+    const string& clientNickname = connections.nicknames.lookup(connections[clientIndex].nicknameId);
+    size_t nameEnd = arguments.find(':');
+    string roomName = trim(arguments.substr(0, nameEnd));
+    string memberCapStr = "";
+    string topic = "";
+    if (nameEnd != string::npos) {
+        size_t capEnd = arguments.find(':', nameEnd + 1);
+        memberCapStr = trim(arguments.substr(nameEnd + 1, capEnd == string::npos ? string::npos : capEnd - nameEnd - 1));
+        if (capEnd != string::npos) {
+            topic = trim(arguments.substr(capEnd + 1));
+        }
+    }
 
-            if (nicknameTaken) {
-                string response = "NICK_REJECTED: Nickname '" + tempNickname + "' is already taken.\n";
-                send(acceptedSocket.acceptedSocketFD, response.c_str(), response.length(), 0);
-            } else {
-                string response = "NICK_ACCEPTED\n";
-                send(acceptedSocket.acceptedSocketFD, response.c_str(), response.length(), 0);
-                cout << "Client " << acceptedSocket.acceptedSocketFD << " set nickname to '" << clientNickname << "' and is in lobby (room " << currentClientRoomNumber << ")." << endl;
+    if (!isValidRoomName(roomName)) {
+        sendToClient(clientIndex, "ERROR: Room names must be 1-" + to_string(MAX_ROOM_NAME_LENGTH) + " characters, without ':' or ',', and not '" + LOBBY_ROOM_NAME + "'.\n");
+        return;
+    }
 
-                string userList = getUsersInRoom(currentClientRoomNumber, clientNickname);
-                string userListMsg = "USER_LIST:" + to_string(currentClientRoomNumber) + ":" + userList + "\n";
-                send(acceptedSocket.acceptedSocketFD, userListMsg.c_str(), userListMsg.length(), 0);
-            }
-        } else {
-            string response = "ERROR: Please send your nickname using 'NICK <your_name>'.\n";
-            send(acceptedSocket.acceptedSocketFD, response.c_str(), response.length(), 0);
+    unsigned long memberCap = 0;
+    if (!memberCapStr.empty()) {
+        try {
+            memberCap = stoul(memberCapStr);
+        } catch (const exception& e) {
+            sendToClient(clientIndex, "ERROR: Member cap must be a number (0 for no limit).\n");
+            return;
         }
+        if (memberCap > 0xFFFFFFFFul) {
+            sendToClient(clientIndex, "ERROR: Member cap out of valid range.\n");
+            return;
+        }
+    }
+    if (topic.length() > MAX_ROOM_TOPIC_LENGTH) {
+        topic.resize(MAX_ROOM_TOPIC_LENGTH);
     }
 
-    char buffer[1024];
-    while (true) {
-        memset(buffer, 0, sizeof(buffer));
-        int bytesReceived = recv(acceptedSocket.acceptedSocketFD, buffer, sizeof(buffer) - 1, 0);
+    uint32_t newRoomId = rooms.create(roomName, static_cast<uint32_t>(memberCap), topic);
+    if (newRoomId == INVALID_INDEX) {
+        sendToClient(clientIndex, "ERROR: Room '" + roomName + "' already exists. Join it instead.\n");
+        return;
+    }
+    // Sequences carry on from the room's history, so a reopened room's lines follow its old ones.
+    rooms[newRoomId].ring.restart(history.nextSequence(roomName));
+    cout << "Room '" << roomName << "' created by " << clientNickname << ". Open rooms: " << rooms.size() - 1 << endl;
 
-        if (bytesReceived == SOCKET_ERROR) {
-            int error_code = WSAGetLastError();
-            if (error_code == WSAECONNRESET || error_code == WSAENOTSOCK) {
-                cout << "Client " << acceptedSocket.acceptedSocketFD << " ('" << clientNickname << "') disconnected unexpectedly (Error: " << error_code << ")." << endl;
-            } else {
-                cerr << "recv failed for client " << acceptedSocket.acceptedSocketFD << " ('" << clientNickname << "') with error: " << error_code << endl;
-            }
-            break;
-        } else if (bytesReceived == 0) {
-            cout << "Client " << acceptedSocket.acceptedSocketFD << " ('" << clientNickname << "') disconnected gracefully." << endl;
-            break;
+    moveToRoom(clientIndex, newRoomId);
+    sendRoomJoined(clientIndex, newRoomId);
+}
+
+void handleTopicCommand(uint32_t clientIndex, const string& arguments) {
+    const string& clientNickname = connections.nicknames.lookup(connections[clientIndex].nicknameId);
+    uint32_t roomId = connections[clientIndex].roomId;
+    if (roomId == LOBBY_ROOM_ID) {
+        sendToClient(clientIndex, "ERROR: The lobby has no topic. Join a room first.\n");
+        return;
+    }
+
+    string topic = trim(arguments);
+    if (topic.length() > MAX_ROOM_TOPIC_LENGTH) {
+        topic.resize(MAX_ROOM_TOPIC_LENGTH);
+    }
+    rooms[roomId].topic = topic;
+
+    string topicMsg = "TOPIC:" + rooms.name(roomId) + ":" + clientNickname + ":" + topic + "\n";
+    broadcastMessage(topicMsg, INVALID_INDEX, roomId);
+}
+
+void handleRoomsCommand(uint32_t clientIndex) {
+    string roomList = "";
+    for (uint32_t roomId = 0; roomId < rooms.idCount(); ++roomId) {
+        if (roomId == LOBBY_ROOM_ID || !rooms.isLive(roomId)) {
+            continue;
         }
+        if (!roomList.empty()) {
+            roomList += ",";
+        }
+        roomList += rooms.name(roomId) + "(" + to_string(rooms[roomId].members.size());
+        if (rooms[roomId].memberCap != 0) {
+            roomList += "/" + to_string(rooms[roomId].memberCap);
+        }
+        roomList += ")";
+    }
+    sendToClient(clientIndex, "ROOM_LIST:" + roomList + "\n");
+}
+
+// Runs a chat or direct message through the content filter, masking it in place. False
+// if it is blocked, in which case the sender has been told.
+bool passesContentFilter(uint32_t clientIndex, string& text, const string& destination, bool direct) {
+    if (contentFilter == nullptr) {
+        return true;
+    }
+    FilterVerdict verdict = contentFilter->apply(text);
+    if (verdict.actions == 0) {
+        return true;
+    }
+
+    const string& clientNickname = connections.nicknames.lookup(connections[clientIndex].nicknameId);
+    const char* preposition = direct ? "' to '" : "' in room '";
+    if (verdict.actions & FILTER_BLOCK) {
+        cout << "Blocked a message from '" << clientNickname << preposition << destination << "': it contains '" << contentFilter->pattern(verdict.blockedBy) << "'." << endl;
+        sendToClient(clientIndex, "ERROR: Your message was blocked by the content filter.\n");
+        return false;
+    }
+    if (verdict.actions & FILTER_FLAG) {
+        cout << "Flagged a message from '" << clientNickname << preposition << destination << "': it contains '" << contentFilter->pattern(verdict.flaggedBy) << "'." << endl;
+    }
+    return true;
+}
 
-        string receivedMessage = trim(buffer);
+void handleMsgCommand(uint32_t clientIndex, const string& arguments) {
+    const string& clientNickname = connections.nicknames.lookup(connections[clientIndex].nicknameId);
+    size_t separator = arguments.find(':');
+    if (separator == string::npos) {
+        sendToClient(clientIndex, "ERROR: Use COMMAND:MSG:<nickname>:<message> to send a direct message.\n");
+        return;
+    }
 
-        {
-            lock_guard<mutex> lock(clientStatesMutex);
-            auto it = clientStates.find(acceptedSocket.acceptedSocketFD);
-            if (it != clientStates.end()) {
-                currentClientRoomNumber = it->second.currentRoomNumber;
-            } else {
-                cerr << "Error: Client " << clientNickname << " not found in clientStates map during chat loop." << endl;
-                break;
-            }
+    string recipientNickname = trim(arguments.substr(0, separator));
+    string text = trim(arguments.substr(separator + 1));
+    if (text.empty()) {
+        sendToClient(clientIndex, "ERROR: Direct message text cannot be empty.\n");
+        return;
+    }
+
+    uint32_t recipientIndex = connections.findByNickname(recipientNickname);
+    if (recipientIndex == INVALID_INDEX || connections[recipientIndex].closing) {
+        sendToClient(clientIndex, "ERROR: User '" + recipientNickname + "' is not online.\n");
+        return;
+    }
+    if (recipientIndex == clientIndex) {
+        sendToClient(clientIndex, "ERROR: You cannot send a direct message to yourself.\n");
+        return;
+    }
+    if (!passesContentFilter(clientIndex, text, recipientNickname, true)) {
+        return;
+    }
+
+    sendToClient(recipientIndex, "DM_FROM:" + clientNickname + ":" + text + "\n");
+    sendToClient(clientIndex, "DM_SENT:" + recipientNickname + ":" + text + "\n");
+    cout << "Direct message from '" << clientNickname << "' to '" << recipientNickname << "'." << endl;
+}
+
+void handleLeaveCommand(uint32_t clientIndex) {
+    const string& clientNickname = connections.nicknames.lookup(connections[clientIndex].nicknameId);
+    uint32_t oldRoomId = connections[clientIndex].roomId;
+    if (oldRoomId == LOBBY_ROOM_ID) {
+        sendToClient(clientIndex, "INFO: You are already in the lobby.\n");
+        return;
+    }
+
+    string oldRoomName = rooms.name(oldRoomId);
+    moveToRoom(clientIndex, LOBBY_ROOM_ID);
+
+    sendToClient(clientIndex, "ROOM_LEFT:" + oldRoomName + "\n");
+
+    string userListLobby = getUsersInRoom(LOBBY_ROOM_ID, clientIndex);
+    sendToClient(clientIndex, "USER_LIST:" + string(LOBBY_ROOM_NAME) + ":" + userListLobby + "\n");
+
+    cout << "Client " << clientNickname << " left room '" << oldRoomName << "' and moved to lobby (room 0)." << endl;
+}
+
+// Latency probes measure room latency, not reply latency: the echo is held back until
+// the room messages published before the probe have been sent, so the round trip
+// includes whatever room traffic is queued ahead of it.
+void handleProbeCommand(uint32_t clientIndex, const string& token) {
+    Connection& client = connections[clientIndex];
+    string echo = "PROBE:" + token + "\n";
+    if (!hasRingBacklog(client)) {
+        sendToClient(clientIndex, echo);
+        return;
+    }
+    if (client.probes == nullptr) {
+        client.probes = new vector<PendingProbe>();
+    } else if (client.probes->size() == MAX_PENDING_PROBES) {
+        sendToClient(clientIndex, "ERROR: Too many probes waiting for an answer.\n");
+        return;
+    }
+    client.probes->push_back({ rooms[client.roomId].ring.headSequence(), move(echo) });
+}
+
+void handleSearchCommand(uint32_t clientIndex, const string& arguments) {
+    size_t separator = arguments.find(':');
+    if (separator == string::npos) {
+        sendToClient(clientIndex, "ERROR: Use COMMAND:SEARCH:<room>:<terms>[:BEFORE=<sequence>] to search the messages of the room you are in.\n");
+        return;
+    }
+    string roomName = trim(arguments.substr(0, separator));
+    string query = arguments.substr(separator + 1);
+    // Only members see a room's messages, so only the room the caller is in is searched;
+    // a room that is full to others keeps its history to its members.
+    const Connection& client = connections[clientIndex];
+    if (client.roomSlot == INVALID_INDEX || roomName != rooms.name(client.roomId)) {
+        sendToClient(clientIndex, "ERROR: You can only search the room you are in.\n");
+        return;
+    }
+
+    uint64_t before = 0;
+    size_t marker = query.rfind(SEARCH_BEFORE_MARKER);
+    if (marker != string::npos) {
+        string page = trim(query.substr(marker + strlen(SEARCH_BEFORE_MARKER)));
+        if (page.empty() || page.find_first_not_of("0123456789") != string::npos) {
+            sendToClient(clientIndex, "ERROR: Use COMMAND:SEARCH:<room>:<terms>[:BEFORE=<sequence>] to search the messages of the room you are in.\n");
+            return;
         }
+        before = strtoull(page.c_str(), nullptr, 10);
+        query.erase(marker);
+    }
 
-        if (receivedMessage.rfind("COMMAND:", 0) == 0) {
-            handleClientCommand(acceptedSocket.acceptedSocketFD, receivedMessage, clientNickname);
-        } else {
-            cout << "Received from client " << acceptedSocket.acceptedSocketFD << " ('" << clientNickname << "') in room '" << currentClientRoomNumber << "': " << receivedMessage << endl;
+    vector<string> terms;
+    TokenizeSearchText(query, terms);
+    sort(terms.begin(), terms.end());
+    terms.erase(unique(terms.begin(), terms.end()), terms.end());
+    if (terms.empty() || terms.size() > MAX_SEARCH_TERMS) {
+        sendToClient(clientIndex, "ERROR: Search for between 1 and " + to_string(MAX_SEARCH_TERMS) + " words.\n");
+        return;
+    }
 
-            string messageToBroadcast = clientNickname + ": " + receivedMessage + "\n";
-            broadcastMessage(messageToBroadcast, acceptedSocket.acceptedSocketFD, currentClientRoomNumber);
+    vector<uint64_t> sequences;
+    uint64_t next = searchIndex.search(roomName, terms, before, SEARCH_PAGE_SIZE, sequences);
+    string results;
+    size_t found = 0;
+    string line;
+    for (uint64_t sequence : sequences) {
+        if (history.find(roomName, sequence, line)) {
+            results += "SEARCH_RESULT:" + roomName + ":" + to_string(sequence) + ":" + line + "\n";
+            found++;
         }
     }
+    results += "SEARCH_END:" + roomName + ":" + to_string(found) + ":" + (next == 0 ? string() : to_string(next)) + "\n";
+    sendToClient(clientIndex, results);
+}
+
+// The client never receives its own messages, so being acknowledged up to one of them
+// also covers it and any run of its own that follows.
+uint64_t skipOwnMessages(const Connection& client, uint64_t acked) {
+    const MessageRing& ring = rooms[client.roomId].ring;
+    while (acked < client.roomCursor && acked >= ring.oldestReplayable() && ring.at(acked).senderNicknameId == client.nicknameId) {
+        acked++;
+    }
+    return acked;
+}
 
-cleanup_socket:
-    string disconnectedNickname = clientNickname;
-    int disconnectedRoomNumber = currentClientRoomNumber;
-    bool wasInRoom = false;
+// COMMAND:ACK:<next sequence> says the client has every room message below it. Acks are
+// cumulative, so only the highest counts; nothing can be acknowledged past what was sent.
+void handleAckCommand(uint32_t clientIndex, const string& arguments) {
+    Connection& client = connections[clientIndex];
+    uint64_t acked = strtoull(arguments.c_str(), nullptr, 10);
+    acked = skipOwnMessages(client, min(max(acked, client.ackedSequence), client.roomCursor));
+    if (acked != client.ackedSequence) {
+        client.ackedSequence = acked;
+        deliveryChanged = true;
+    }
+}
 
-    {
-        lock_guard<mutex> lock(clientStatesMutex);
-        auto it = clientStates.find(acceptedSocket.acceptedSocketFD);
-        if (it != clientStates.end()) {
-            disconnectedNickname = it->second.nickname;
-            disconnectedRoomNumber = it->second.currentRoomNumber;
-            if (disconnectedRoomNumber != 0) {
-                wasInRoom = true;
+// Once a second while rooms have traffic: release message texts every member has
+// acknowledged, and every DELIVERY_REPORT_INTERVAL_SECONDS log how far behind the
+// slowest recipient is. Rooms with detached members keep everything for the resume.
+void reviewDelivery(chrono::steady_clock::time_point now) {
+    size_t members = 0;
+    size_t membersBehind = 0;
+    uint64_t worstBehind = 0;
+    int64_t worstAgeMs = 0;
+    uint32_t worstIndex = INVALID_INDEX;
+
+    for (uint32_t roomId = 0; roomId < rooms.idCount(); ++roomId) {
+        if (!rooms.isLive(roomId) || rooms[roomId].members.empty()) {
+            continue;
+        }
+        MessageRing& ring = rooms[roomId].ring;
+        uint64_t minimumAcked = ring.headSequence();
+        for (uint32_t memberIndex : rooms[roomId].members) {
+            Connection& member = connections[memberIndex];
+            member.ackedSequence = skipOwnMessages(member, member.ackedSequence);
+            minimumAcked = min(minimumAcked, member.ackedSequence);
+            members++;
+
+            uint64_t behind = ring.headSequence() - member.ackedSequence;
+            if (behind == 0) {
+                continue;
             }
-            clientStates.erase(it);
-            cout << "Client " << acceptedSocket.acceptedSocketFD << " ('" << disconnectedNickname << "') removed from lists. Total clients: " << clientStates.size() << endl;
-        } else {
-            cout << "Client " << acceptedSocket.acceptedSocketFD << " (nickname not set/removed earlier) removed from lists. Total clients: " << clientStates.size() << endl;
+            membersBehind++;
+            int64_t ageMs = 0;
+            if (member.ackedSequence >= ring.oldestReplayable()) {
+                ageMs = chrono::duration_cast<chrono::milliseconds>(now - ring.at(member.ackedSequence).publishedAt).count();
+            }
+            if (ageMs > worstAgeMs || (ageMs == worstAgeMs && behind > worstBehind)) {
+                worstAgeMs = ageMs;
+                worstBehind = behind;
+                worstIndex = memberIndex;
+            }
+        }
+        if (rooms[roomId].detachedMembers == 0) {
+            ring.trimThrough(minimumAcked);
+        }
+    }
+
+    if (now - lastDeliveryReport < chrono::seconds(DELIVERY_REPORT_INTERVAL_SECONDS) || publishedSinceReport == 0) {
+        return;
+    }
+    cout << "Delivery: " << publishedSinceReport << " room messages in the last " << DELIVERY_REPORT_INTERVAL_SECONDS << " s; "
+         << membersBehind << " of " << members << " members have unacknowledged messages";
+    if (worstIndex != INVALID_INDEX) {
+        const Connection& worst = connections[worstIndex];
+        cout << "; slowest is '" << connections.nicknames.lookup(worst.nicknameId) << "' in room '" << rooms.name(worst.roomId)
+             << "', " << worstBehind << " messages / " << worstAgeMs << " ms behind";
+    }
+    cout << "." << endl;
+    if (compressedPlainBytes != 0) {
+        cout << "Compression: " << compressedPlainBytes / 1024 << " KB of output went out as " << compressedWireBytes / 1024 << " KB ("
+             << 100 - compressedWireBytes * 100 / compressedPlainBytes << "% saved)." << endl;
+        compressedPlainBytes = 0;
+        compressedWireBytes = 0;
+    }
+    publishedSinceReport = 0;
+    lastDeliveryReport = now;
+}
+
+// Admin only. COMMAND:TRACE:<n> traces one chat line in every n from now on, 0 stops;
+// COMMAND:TRACE:DUMP writes what the trace buffer holds as Chrome trace JSON, in the
+// background; checkTraceDump replies once the file is written.
+void handleTraceCommand(uint32_t clientIndex, const string& arguments) {
+    Connection& client = connections[clientIndex];
+    if (!client.admin) {
+        sendToClient(clientIndex, "ERROR: Unknown command.\n");
+        return;
+    }
+
+    if (arguments == "DUMP") {
+        if (!traceDumpWriter.start(traceFile, tracer.copyEvents())) {
+            sendToClient(clientIndex, "ERROR: A trace dump is already being written.\n");
+            return;
         }
+        traceDumpRequester = clientIndex;
+        traceDumpRequesterSocket = client.socketFD;
+        return;
     }
 
-    if (!disconnectedNickname.empty() && wasInRoom) {
-        broadcastMessage(disconnectedNickname + " has left room number '" + to_string(disconnectedRoomNumber) + "'.\n", acceptedSocket.acceptedSocketFD, disconnectedRoomNumber);
+    if (arguments.empty() || arguments.find_first_not_of("0123456789") != string::npos) {
+        sendToClient(clientIndex, "ERROR: Use COMMAND:TRACE:<one in n messages> or COMMAND:TRACE:DUMP.\n");
+        return;
     }
+    uint32_t every = static_cast<uint32_t>(strtoul(arguments.c_str(), nullptr, 10));
+    tracer.setSampleEvery(every);
+    string state = every == 0 ? "Message tracing is off." : "Tracing one message in " + to_string(every) + ".";
+    cout << state << " (set by '" << connections.nicknames.lookup(client.nicknameId) << "')" << endl;
+    sendToClient(clientIndex, "INFO: " + state + "\n");
+}
 
-    shutdown(acceptedSocket.acceptedSocketFD, SD_SEND);
-    closesocket(acceptedSocket.acceptedSocketFD);
+// An explicit quit ends the session for good instead of leaving it resumable.
+void handleQuitCommand(uint32_t clientIndex) {
+    Connection& client = connections[clientIndex];
+    sessions.forget(client.resumeToken);
+    client.resumeToken = 0;
+    client.closing = true;
 }
 
-void AcceptingNewConnection(SOCKET serverSocketFD) {
-    cout << "Server thread for accepting new connections started." << endl;
-    while (true) {
-        AcceptedSocket acceptedSocket = AcceptIncomeingConnection(serverSocketFD);
+// Parks a chat session whose connection dropped. The nickname stays reserved and the
+// room keeps the seat, so a RESUME within the grace period gets both back; the rest of
+// the room never sees the member leave and rejoin.
+void detachSession(uint32_t clientIndex) {
+    Connection& client = connections[clientIndex];
+    string nickname = connections.nicknames.lookup(client.nicknameId);
+
+    DetachedSession session;
+    session.roomId = client.roomId;
+    session.joinSequence = client.roomJoinSequence;
+    session.ackedSequence = client.ackedSequence;
+    session.expiresAt = chrono::steady_clock::now() + chrono::seconds(resumeGraceSeconds);
+    if (client.roomId != LOBBY_ROOM_ID) {
+        rooms[client.roomId].detachedMembers++;
+    }
 
-        if (acceptedSocket.accepted) {
-            cout << "New client accepted. Socket FD: " << acceptedSocket.acceptedSocketFD << endl;
-            thread clientHandlerThread(HandlingSocket, acceptedSocket);
-            clientHandlerThread.detach();
-        } else {
-            this_thread::sleep_for(chrono::milliseconds(100));
+    client.roomCursor = rooms[client.roomId].ring.headSequence();
+    client.ringOffset = 0;
+    leaveRoom(clientIndex);
+    session.nicknameId = connections.detachNickname(clientIndex);
+    sessions.detach(client.resumeToken, session);
+    client.resumeToken = 0;
+    client.phase = PHASE_CLOSED;
+
+    cout << "Client " << client.socketFD << " ('" << nickname << "') detached; session held for " << resumeGraceSeconds << " seconds." << endl;
+}
+
+void expireDetachedSessions() {
+    for (const DetachedSession& session : sessions.takeExpired(chrono::steady_clock::now())) {
+        string nickname = connections.nicknames.lookup(session.nicknameId);
+        if (session.roomId != LOBBY_ROOM_ID) {
+            string roomName = rooms.name(session.roomId);
+            rooms[session.roomId].detachedMembers--;
+            announcePresence(nickname, session.roomId, false, INVALID_INDEX);
+            if (rooms.closeIfEmpty(session.roomId)) {
+                cout << "Room '" << roomName << "' closed (no members left). Open rooms: " << rooms.size() - 1 << endl;
+            }
         }
+        connections.nicknames.release(session.nicknameId);
+        cout << "Session of '" << nickname << "' was not resumed in time and has ended." << endl;
     }
 }
 
-int main() {
-    WSADATA wsaData;
-    int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
-    if (iResult != 0) {
-        cerr << "WSAStartup failed: " << iResult << endl;
-        return 1;
+// RESUME <token> [<next sequence>], sent instead of NICK after a reconnect. The session
+// gets its nickname and room back in one step, then the room ring replays everything
+// from the client's next sequence (or its last acknowledgement) that is still held.
+void handleResumeMessage(uint32_t clientIndex, string_view arguments) {
+    size_t separator = arguments.find(' ');
+    uint64_t token = 0;
+    if (!ParseResumeToken(arguments.substr(0, separator), token)) {
+        sendToClient(clientIndex, "RESUME_REJECTED: Use 'RESUME <token> [<next sequence>]'.\n");
+        return;
+    }
+    bool hasSequence = separator != string_view::npos;
+    uint64_t nextSequence = hasSequence ? strtoull(string(arguments.substr(separator + 1)).c_str(), nullptr, 10) : 0;
+
+    uint32_t previousOwner = sessions.owner(token);
+    if (previousOwner != INVALID_INDEX && previousOwner != clientIndex && connections.isLive(previousOwner) &&
+        connections[previousOwner].phase == PHASE_CHAT) {
+        cout << "Client " << connections[previousOwner].socketFD << " is being replaced by a resumed connection." << endl;
+        detachSession(previousOwner);
+        connections[previousOwner].closing = true;
     }
 
-    SOCKET serverSocketFD = CreateTCPIPv4Socket();
-    if (serverSocketFD == INVALID_SOCKET) {
-        cerr << "Failed to create server socket. Error: " << WSAGetLastError() << endl;
-        WSACleanup();
-        return 1;
+    DetachedSession session;
+    if (!sessions.reclaim(token, clientIndex, session)) {
+        sendToClient(clientIndex, "RESUME_REJECTED: Session expired or unknown.\n");
+        return;
     }
 
-    sockaddr_in address = CreateIPv4Address("127.0.0.1", 8580);
+    Connection& client = connections[clientIndex];
+    connections.adoptNickname(clientIndex, session.nicknameId);
+    client.phase = PHASE_CHAT;
+    negotiatingConnections--;
+    client.resumeToken = token;
+    uint32_t roomId = session.roomId;
+    if (roomId != LOBBY_ROOM_ID) {
+        rooms[roomId].detachedMembers--;
+    }
+    joinRoom(clientIndex, roomId);
+    client.roomJoinSequence = session.joinSequence;
+    if (!hasSequence) {
+        nextSequence = session.ackedSequence;
+    }
 
-    int binding = bind(serverSocketFD, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
-    if (binding == SOCKET_ERROR) {
-        cerr << "bind failed with error: " << WSAGetLastError() << endl;
-        closesocket(serverSocketFD);
-        WSACleanup();
-        return 1;
+    const string& nickname = connections.nicknames.lookup(client.nicknameId);
+    sendToClient(clientIndex, "RESUMED:" + nickname + ":" + rooms.name(roomId) + "\n");
+    if (roomId != LOBBY_ROOM_ID) {
+        sendRoomInfo(clientIndex, roomId);
+    }
+    sendToClient(clientIndex, "USER_LIST:" + rooms.name(roomId) + ":" + getUsersInRoom(roomId, clientIndex) + "\n");
+
+    const MessageRing& ring = rooms[roomId].ring;
+    uint64_t resumeFrom = min(max(nextSequence, session.joinSequence), ring.headSequence());
+    if (resumeFrom < ring.oldestReplayable()) {
+        uint64_t skipped = ring.oldestReplayable() - resumeFrom;
+        sendToClient(clientIndex, "INFO: " + to_string(skipped) + " older messages in room '" + rooms.name(roomId) + "' could not be replayed.\n");
+        resumeFrom = ring.oldestReplayable();
     }
+    client.roomCursor = resumeFrom;
+    client.ackedSequence = max(session.ackedSequence, resumeFrom);
 
-    int listening = listen(serverSocketFD, SOMAXCONN);
-    if (listening == SOCKET_ERROR) {
-        cerr << "listen failed with error: " << WSAGetLastError() << endl;
-        closesocket(serverSocketFD);
-        WSACleanup();
-        return 1;
+    cout << "Client " << client.socketFD << " resumed the session of '" << nickname << "' in room '" << rooms.name(roomId) << "'; replaying " << ring.headSequence() - resumeFrom << " messages." << endl;
+}
+
+// SHM_OFFER, from a client that wants to attach shared memory. Only connections through
+// a loopback or unix: listener come from this machine and can share a mapping with it.
+// The nonce goes into the segment's header, so SHM_ATTACH can only name a segment the
+// client at the other end of this connection wrote, never another process's.
+void offerSharedChannel(uint32_t clientIndex) {
+    Connection& client = connections[clientIndex];
+    if (!client.loopback || client.shared != nullptr) {
+        sendToClient(clientIndex, "ERROR: Shared memory is not available on this connection.\n");
+        return;
+    }
+    do {
+        client.sharedNonce = sharedNonces();
+    } while (client.sharedNonce == 0);
+    char nonce[17];
+    snprintf(nonce, sizeof(nonce), "%016llx", static_cast<unsigned long long>(client.sharedNonce));
+    sendToClient(clientIndex, string("SHM_NONCE:") + nonce + "\n");
+}
+
+// SHM_ATTACH <segment>, after SHM_NONCE. The reply is the last line to go over the
+// socket; from then on both directions use the client's rings and the socket only
+// carries doorbells. The client sends nothing else until it has the reply, so no
+// request can be left behind on the socket.
+void attachSharedChannel(uint32_t clientIndex, const string& segmentName) {
+    Connection& client = connections[clientIndex];
+    if (!client.loopback || client.sharedNonce == 0 || client.shared != nullptr || client.pendingOutput != nullptr) {
+        sendToClient(clientIndex, "ERROR: Shared memory cannot be attached now.\n");
+        return;
+    }
+    uint64_t nonce = client.sharedNonce;
+    client.sharedNonce = 0;
+    SharedChannel* channel = new SharedChannel();
+    if (!channel->open(segmentName, nonce)) {
+        delete channel;
+        sendToClient(clientIndex, "ERROR: Cannot open shared memory '" + segmentName + "'.\n");
+        return;
     }
-    cout << "Server is listening on port 8580..." << endl;
 
-    thread acceptConnectionsThread(AcceptingNewConnection, serverSocketFD);
-    acceptConnectionsThread.detach();
+    sendToClient(clientIndex, "SHM_ATTACHED\n");
+    if (client.closing || client.pendingOutput != nullptr) {
+        delete channel;
+        client.closing = true;
+        return;
+    }
+    client.shared = channel;
+    cout << "Client " << client.socketFD << " attached through shared memory '" << segmentName << "'." << endl;
+}
 
-    cout << "Main server thread is running. Press Ctrl+C to stop server." << endl;
+// COMPRESS <codec>, before the nickname. Only the built-in codec is offered, and not
+// over shared memory, where there is no bandwidth to save.
+void negotiateCompression(uint32_t clientIndex, const string& codec) {
+    Connection& client = connections[clientIndex];
+    if (compressionThreshold == 0 || codec != CHAT_COMPRESSION_CODEC || client.shared != nullptr) {
+        sendToClient(clientIndex, "ERROR: Compression '" + codec + "' is not available.\n");
+        return;
+    }
+    sendToClient(clientIndex, "COMPRESSING:" + codec + ":" + to_string(compressionThreshold) + "\n");
+    client.compressed = true;
+}
 
-    while (true) {
-        this_thread::sleep_for(chrono::seconds(1));
+void handleNicknameMessage(uint32_t clientIndex, const Frame& frame) {
+    Connection& client = connections[clientIndex];
+
+    if (frame.kind == FRAME_RESUME) {
+        handleResumeMessage(clientIndex, frame.payload);
+        return;
+    }
+    if (frame.kind == FRAME_SHM_OFFER) {
+        offerSharedChannel(clientIndex);
+        return;
+    }
+    if (frame.kind == FRAME_SHM_ATTACH) {
+        attachSharedChannel(clientIndex, string(TrimLine(frame.payload)));
+        return;
+    }
+    if (frame.kind == FRAME_COMPRESS) {
+        negotiateCompression(clientIndex, string(TrimLine(frame.payload)));
+        return;
+    }
+    if (frame.kind != FRAME_NICK) {
+        sendToClient(clientIndex, "ERROR: Please send your nickname using 'NICK <your_name>'.\n");
+        return;
     }
 
-    closesocket(serverSocketFD);
-    WSACleanup();
-    return 0;
-}
\ No newline at end of file
+    string proposedNickname = string(TrimLine(frame.payload));
+    if (proposedNickname.empty() || proposedNickname.length() > 20) {
+        sendToClient(clientIndex, "NICK_REJECTED: Nickname invalid (empty or too long).\n");
+        return;
+    }
+
+    if (connections.nicknames.find(proposedNickname) != INVALID_INDEX) {
+        sendToClient(clientIndex, "NICK_REJECTED: Nickname '" + proposedNickname + "' is already taken.\n");
+        return;
+    }
+
+    connections.setNickname(clientIndex, proposedNickname);
+    client.phase = PHASE_CHAT;
+    negotiatingConnections--;
+    joinRoom(clientIndex, LOBBY_ROOM_ID);
+
+    sendToClient(clientIndex, "NICK_ACCEPTED\n");
+    if (resumeGraceSeconds != 0) {
+        client.resumeToken = sessions.issue(clientIndex);
+        sendToClient(clientIndex, "SESSION:" + FormatResumeToken(client.resumeToken) + "\n");
+    }
+    cout << "Client " << client.socketFD << " set nickname to '" << proposedNickname << "' and is in lobby (room " << client.roomId << ")." << endl;
+
+    string userList = getUsersInRoom(client.roomId, clientIndex);
+    sendToClient(clientIndex, "USER_LIST:" + rooms.name(client.roomId) + ":" + userList + "\n");
+}
+
+// Chat-phase dispatch. Anything that is not a client command, including server frame
+// tags a client happens to type, is chat text for the room.
+template <FrameKind Kind>
+struct ChatFrameHandler {
+    static void handle(uint32_t clientIndex, const Frame& frame, string_view line) {
+        if (line.rfind("COMMAND:", 0) == 0) {
+            sendToClient(clientIndex, "ERROR: Unknown command.\n");
+            return;
+        }
+
+        const Connection& client = connections[clientIndex];
+        if (client.roomId == LOBBY_ROOM_ID && loadShedder.shedding()) {
+            sendToClient(clientIndex, "INFO: The server is busy; lobby chat is paused. Rooms still work.\n");
+            return;
+        }
+        const string& clientNickname = connections.nicknames.lookup(client.nicknameId);
+        cout << "Received from client " << client.socketFD << " ('" << clientNickname << "') in room '" << rooms.name(client.roomId) << "': " << line << endl;
+
+        uint32_t roomId = client.roomId;
+        string text(line);
+        if (!passesContentFilter(clientIndex, text, rooms.name(roomId), false)) {
+            return;
+        }
+        string messageToBroadcast = clientNickname + ": " + text + "\n";
+        broadcastMessage(messageToBroadcast, clientIndex, roomId);
+        archiveChatLine(roomId, rooms[roomId].ring.headSequence() - 1,
+                        string_view(messageToBroadcast).substr(0, messageToBroadcast.length() - 1), clientNickname.length() + 2);
+    }
+};
+
+template <>
+struct ChatFrameHandler<FRAME_COMMAND_JOIN> {
+    static void handle(uint32_t clientIndex, const Frame& frame, string_view line) {
+        handleJoinCommand(clientIndex, string(frame.payload));
+    }
+};
+
+template <>
+struct ChatFrameHandler<FRAME_COMMAND_CREATE> {
+    static void handle(uint32_t clientIndex, const Frame& frame, string_view line) {
+        handleCreateCommand(clientIndex, string(frame.payload));
+    }
+};
+
+template <>
+struct ChatFrameHandler<FRAME_COMMAND_TOPIC> {
+    static void handle(uint32_t clientIndex, const Frame& frame, string_view line) {
+        handleTopicCommand(clientIndex, string(frame.payload));
+    }
+};
+
+template <>
+struct ChatFrameHandler<FRAME_COMMAND_ROOMS> {
+    static void handle(uint32_t clientIndex, const Frame& frame, string_view line) {
+        handleRoomsCommand(clientIndex);
+    }
+};
+
+template <>
+struct ChatFrameHandler<FRAME_COMMAND_MSG> {
+    static void handle(uint32_t clientIndex, const Frame& frame, string_view line) {
+        handleMsgCommand(clientIndex, string(frame.payload));
+    }
+};
+
+template <>
+struct ChatFrameHandler<FRAME_COMMAND_LEAVE> {
+    static void handle(uint32_t clientIndex, const Frame& frame, string_view line) {
+        handleLeaveCommand(clientIndex);
+    }
+};
+
+template <>
+struct ChatFrameHandler<FRAME_COMMAND_PROBE> {
+    static void handle(uint32_t clientIndex, const Frame& frame, string_view line) {
+        handleProbeCommand(clientIndex, string(frame.payload));
+    }
+};
+
+template <>
+struct ChatFrameHandler<FRAME_COMMAND_SEARCH> {
+    static void handle(uint32_t clientIndex, const Frame& frame, string_view line) {
+        handleSearchCommand(clientIndex, string(frame.payload));
+    }
+};
+
+template <>
+struct ChatFrameHandler<FRAME_COMMAND_ACK> {
+    static void handle(uint32_t clientIndex, const Frame& frame, string_view line) {
+        handleAckCommand(clientIndex, string(frame.payload));
+    }
+};
+
+template <>
+struct ChatFrameHandler<FRAME_COMMAND_TRACE> {
+    static void handle(uint32_t clientIndex, const Frame& frame, string_view line) {
+        handleTraceCommand(clientIndex, string(frame.payload));
+    }
+};
+
+template <>
+struct ChatFrameHandler<FRAME_COMMAND_QUIT> {
+    static void handle(uint32_t clientIndex, const Frame& frame, string_view line) {
+        handleQuitCommand(clientIndex);
+    }
+};
+
+constexpr auto chatFrameHandlers = makeFrameDispatchTable<ChatFrameHandler>();
+
+void handleChatMessage(uint32_t clientIndex, string_view receivedMessage) {
+    Frame frame = classifyFrame(receivedMessage);
+    if (frame.kind == FRAME_TEXT && tracer.sampleEvery() != 0) {
+        activeTraceId = tracer.sample();
+        if (activeTraceId != 0) {
+            tracer.record(activeTraceId, TRACE_RECEIVED, connections[clientIndex].socketFD, loopWokeAt);
+            tracer.record(activeTraceId, TRACE_PARSED, connections[clientIndex].socketFD);
+        }
+    }
+    chatFrameHandlers[frame.kind](clientIndex, frame, receivedMessage);
+    activeTraceId = 0;
+}
+
+void CloseConnection(uint32_t clientIndex) {
+    Connection& client = connections[clientIndex];
+    SOCKET socketFD = client.socketFD;
+    string disconnectedNickname = connections.nicknames.lookup(client.nicknameId);
+    if (client.phase == PHASE_NICKNAME) {
+        negotiatingConnections--;
+    }
+    if (client.phase == PHASE_CHAT && client.resumeToken != 0) {
+        detachSession(clientIndex);
+    }
+    uint32_t disconnectedRoomId = client.roomId;
+    bool wasInRoom = client.phase == PHASE_CHAT && disconnectedRoomId != LOBBY_ROOM_ID;
+
+    if (wasInRoom) {
+        announcePresence(disconnectedNickname, disconnectedRoomId, false, clientIndex);
+    }
+    leaveRoom(clientIndex);
+
+    if (capture.isOpen()) {
+        capture.disconnect(clientIndex);
+    }
+    connections.remove(clientIndex);
+    if (!disconnectedNickname.empty()) {
+        cout << "Client " << socketFD << " ('" << disconnectedNickname << "') removed from lists. Total clients: " << connections.size() << endl;
+    } else {
+        cout << "Client " << socketFD << " (nickname not set) removed from lists. Total clients: " << connections.size() << endl;
+    }
+
+    shutdown(socketFD, SD_SEND);
+    closesocket(socketFD);
+}
+
+// One coroutine per connection: nickname negotiation, then the chat loop, then teardown.
+// Every co_await hands control back to RunEventLoop until the socket is ready again.
+SessionTask HandlingSocket(uint32_t clientIndex) {
+    sendToClient(clientIndex, "NICK_REQUIRED\n");
+
+    while (connections[clientIndex].phase == PHASE_NICKNAME) {
+        optional<string_view> frame = co_await readFrame(connections, clientIndex);
+        if (!frame) {
+            break;
+        }
+        handleNicknameMessage(clientIndex, classifyFrame(*frame));
+        if (!co_await outputDrained(connections, clientIndex)) {
+            break;
+        }
+    }
+
+    while (connections[clientIndex].phase == PHASE_CHAT) {
+        optional<string_view> frame = co_await readFrame(connections, clientIndex);
+        if (!frame) {
+            break;
+        }
+        handleChatMessage(clientIndex, *frame);
+        if (!co_await outputDrained(connections, clientIndex)) {
+            break;
+        }
+    }
+
+    CloseConnection(clientIndex);
+}
+
+void resumeSession(uint32_t clientIndex) {
+    coroutine_handle<> session = connections[clientIndex].session;
+    connections[clientIndex].session = nullptr;
+    if (session) {
+        session.resume();
+    }
+}
+
+void ReadFromClient(uint32_t clientIndex) {
+    Connection& client = connections[clientIndex];
+    if (client.pendingInput == nullptr) {
+        client.pendingInput = connections.recvBuffers.acquire();
+    }
+
+    RecvBuffer* buffer = client.pendingInput;
+    if (buffer->start > 0) {
+        memmove(buffer->data, buffer->data + buffer->start, buffer->length - buffer->start);
+        buffer->length -= buffer->start;
+        buffer->start = 0;
+    }
+    if (buffer->length == RECV_BUFFER_SIZE) {
+        return;
+    }
+
+    int bytesReceived = connectionRecv(client, buffer->data + buffer->length, RECV_BUFFER_SIZE - buffer->length);
+
+    const string& clientNickname = connections.nicknames.lookup(client.nicknameId);
+    if (bytesReceived == SOCKET_ERROR) {
+        int error_code = WSAGetLastError();
+        if (error_code == WSAEWOULDBLOCK) {
+            return;
+        }
+        if (client.phase == PHASE_NICKNAME) {
+            cout << "Client " << client.socketFD << " disconnected during nickname negotiation." << endl;
+        } else if (error_code == WSAECONNRESET || error_code == WSAENOTSOCK) {
+            cout << "Client " << client.socketFD << " ('" << clientNickname << "') disconnected unexpectedly (Error: " << error_code << ")." << endl;
+        } else {
+            cerr << "recv failed for client " << client.socketFD << " ('" << clientNickname << "') with error: " << error_code << endl;
+        }
+        client.closing = true;
+    } else if (bytesReceived == 0) {
+        if (client.phase == PHASE_NICKNAME) {
+            cout << "Client " << client.socketFD << " disconnected during nickname negotiation." << endl;
+        } else {
+            cout << "Client " << client.socketFD << " ('" << clientNickname << "') disconnected gracefully." << endl;
+        }
+        client.closing = true;
+    } else {
+        if (capture.isOpen()) {
+            capture.data(clientIndex, buffer->data + buffer->length, bytesReceived);
+        }
+        buffer->length += bytesReceived;
+    }
+
+    if (client.waitingFor == WAIT_FRAME && (client.closing || HasBufferedLine(client))) {
+        resumeSession(clientIndex);
+    }
+
+    Connection& after = connections[clientIndex];
+    if (after.pendingInput != nullptr && after.pendingInput->start == after.pendingInput->length) {
+        connections.recvBuffers.release(after.pendingInput);
+        after.pendingInput = nullptr;
+    }
+}
+
+// Why a new connection cannot be taken right now, or nullptr if it can.
+const char* admissionRefusal() {
+    if (maxConnections != 0 && connections.size() >= maxConnections) {
+        return "too many connections";
+    }
+    if (maxNegotiating != 0 && negotiatingConnections >= maxNegotiating) {
+        return "too many connections negotiating a nickname";
+    }
+    if (loadShedder.shedding()) {
+        return "shedding load";
+    }
+    return nullptr;
+}
+
+// A refused connection gets one line and is closed at once, before it costs a slot,
+// a coroutine or a receive buffer. The line fits any socket's send buffer.
+void refuseConnection(SOCKET socketFD, const char* reason) {
+    string busy = "SERVER_BUSY:" + to_string(SERVER_BUSY_RETRY_SECONDS) + ":" + reason + "\n";
+    send(socketFD, busy.c_str(), static_cast<int>(busy.length()), 0);
+    shutdown(socketFD, SD_SEND);
+    closesocket(socketFD);
+    refusedSinceSample++;
+}
+
+// Rings have no readiness of their own. Before each poll an attached client either has
+// work waiting in its rings, or gets its waiting flags raised and sleeps on the doorbell.
+bool sharedConnectionReady(Connection& client) {
+    SharedChannel& channel = *client.shared;
+    bool wantsInput = client.waitingFor == WAIT_FRAME;
+    bool wantsOutput = client.pendingOutput != nullptr || hasRingBacklog(client);
+    if ((wantsInput && channel.inbound().readable()) || (wantsOutput && channel.outbound().writable())) {
+        return true;
+    }
+    return (wantsInput && channel.inbound().armConsumer()) || (wantsOutput && channel.outbound().armProducer());
+}
+
+// The doorbell socket reporting EOF means the client has gone, but whatever it wrote to
+// the ring before it went (a COMMAND:QUIT, say) is still read first.
+void serviceSharedConnection(uint32_t clientIndex, short revents) {
+    bool peerOpen = revents == 0 || DrainDoorbell(connections[clientIndex].socketFD);
+
+    Connection& client = connections[clientIndex];
+    if ((client.pendingOutput != nullptr || hasRingBacklog(client)) && client.shared->outbound().writable()) {
+        flushPendingOutput(clientIndex);
+        if (client.waitingFor == WAIT_DRAIN && (client.closing || PendingOutputBytes(client) <= SESSION_DRAIN_WATERMARK)) {
+            resumeSession(clientIndex);
+        }
+    }
+    if (connections.isLive(clientIndex) && !connections[clientIndex].closing && connections[clientIndex].waitingFor == WAIT_FRAME &&
+        connections[clientIndex].shared->inbound().readable()) {
+        ReadFromClient(clientIndex);
+    }
+    if (!peerOpen && connections.isLive(clientIndex) && !connections[clientIndex].closing) {
+        cout << "Client " << connections[clientIndex].socketFD << " ('" << connections.nicknames.lookup(connections[clientIndex].nicknameId)
+             << "') closed its shared-memory channel." << endl;
+        connections[clientIndex].closing = true;
+    }
+}
+
+// Admin connections skip admission control; they are how an operator looks into a
+// server that is refusing everyone else.
+void AcceptingNewConnection(SOCKET serverSocketFD, bool admin, bool loopback) {
+    while (true) {
+        AcceptedSocket acceptedSocket = AcceptIncomeingConnection(serverSocketFD);
+        if (!acceptedSocket.accepted) {
+            break;
+        }
+
+        const char* refusal = admin ? nullptr : admissionRefusal();
+        if (refusal != nullptr) {
+            refuseConnection(acceptedSocket.acceptedSocketFD, refusal);
+            continue;
+        }
+
+        u_long nonBlocking = 1;
+        ioctlsocket(acceptedSocket.acceptedSocketFD, FIONBIO, &nonBlocking);
+
+        // Replies are mostly single short lines; Nagle would hold one back behind the
+        // ACK of whatever went out before it.
+        if (acceptedSocket.address.ss_family != AF_UNIX) {
+            BOOL noDelay = TRUE;
+            setsockopt(acceptedSocket.acceptedSocketFD, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+        }
+
+        uint32_t clientIndex = connections.add(acceptedSocket.acceptedSocketFD);
+        connections[clientIndex].admin = admin;
+        connections[clientIndex].loopback = loopback;
+        negotiatingConnections++;
+        if (capture.isOpen()) {
+            capture.connect(clientIndex);
+        }
+        cout << "New client accepted. Socket FD: " << acceptedSocket.acceptedSocketFD << endl;
+        HandlingSocket(clientIndex);
+    }
+}
+
+// Once a LOAD_SAMPLE_INTERVAL_MS: how much output is queued, how far behind the slowest
+// room member is and how busy the loop has been, fed to the shedder.
+void sampleLoad(chrono::steady_clock::time_point now) {
+    LoadSample sample = {};
+    for (uint32_t i = 0; i < connections.slotCount(); ++i) {
+        if (!connections.isLive(i)) {
+            continue;
+        }
+        const Connection& client = connections[i];
+        sample.queuedOutputBytes += PendingOutputBytes(client);
+        if (client.roomSlot != INVALID_INDEX) {
+            sample.deepestBacklog = max(sample.deepestBacklog, rooms[client.roomId].ring.headSequence() - client.roomCursor);
+        }
+    }
+    auto elapsed = now - lastLoadSample;
+    sample.busyFraction = elapsed.count() > 0 ? static_cast<double>(loopBusyTime.count()) / elapsed.count() : 0;
+    loopBusyTime = {};
+    lastLoadSample = now;
+
+    if (refusedSinceSample != 0) {
+        cout << "Refused " << refusedSinceSample << " new connections as busy in the last " << chrono::duration_cast<chrono::milliseconds>(elapsed).count() << " ms." << endl;
+        refusedSinceSample = 0;
+    }
+    if (loadShedder.update(sample)) {
+        if (loadShedder.shedding()) {
+            cout << "Shedding load (" << loadShedder.reason() << ": " << sample.queuedOutputBytes << " bytes queued, " << sample.deepestBacklog
+                 << " messages deepest backlog, " << static_cast<int>(sample.busyFraction * 100) << "% busy): lobby chat and presence notices are paused, new connections are refused." << endl;
+        } else {
+            cout << "Load is back to normal; no longer shedding." << endl;
+        }
+    }
+}
+
+// Closing a connection can mark others as closing (a failed send during its leave
+// broadcast), so keep sweeping until a pass finds nothing left to close.
+void closeFinishedConnections() {
+    bool closedAny = true;
+    while (closedAny) {
+        closedAny = false;
+        for (uint32_t i = 0; i < connections.slotCount(); ++i) {
+            if (connections.isLive(i) && connections[i].closing && connections[i].waitingFor != WAIT_NONE) {
+                resumeSession(i);
+                closedAny = true;
+            }
+        }
+    }
+}
+
+// Runs on the event loop, so it only copies what it must: names, counters, one reference
+// per session and one per ring message published since the last capture. The text is
+// immutable and shared with the rings, which keeps the capture consistent however the
+// rooms move on while it is written.
+ServerSnapshot captureSnapshot() {
+    ServerSnapshot snapshot;
+    roomCaptures.resize(rooms.idCount());
+    vector<uint32_t> roomIndex(rooms.idCount(), INVALID_INDEX);
+    for (uint32_t roomId = 0; roomId < rooms.idCount(); ++roomId) {
+        RoomCapture& captured = roomCaptures[roomId];
+        if (!rooms.isLive(roomId)) {
+            vector<SharedSnapshotChunk>().swap(captured.chunks);
+            continue;
+        }
+        roomIndex[roomId] = static_cast<uint32_t>(snapshot.rooms.size());
+        const Room& room = rooms[roomId];
+        const MessageRing& ring = room.ring;
+        SnapshotRoom& saved = snapshot.rooms.emplace_back();
+        saved.name = rooms.name(roomId);
+        saved.topic = room.topic;
+        saved.memberCap = room.memberCap;
+        saved.createdAt = static_cast<int64_t>(room.createdAt);
+        saved.firstSequence = ring.oldestReplayable();
+
+        if (captured.ringGeneration != ring.generation() || captured.capturedThrough > ring.headSequence()) {
+            captured.chunks.clear();
+            captured.ringGeneration = ring.generation();
+            captured.capturedThrough = 0;
+        }
+        size_t stale = 0;
+        while (stale < captured.chunks.size() && captured.chunks[stale]->firstSequence + captured.chunks[stale]->messages.size() <= saved.firstSequence) {
+            stale++;
+        }
+        captured.chunks.erase(captured.chunks.begin(), captured.chunks.begin() + stale);
+
+        uint64_t from = max(captured.capturedThrough, saved.firstSequence);
+        if (from < ring.headSequence()) {
+            auto chunk = make_shared<SnapshotChunk>();
+            chunk->firstSequence = from;
+            chunk->messages.reserve(ring.headSequence() - from);
+            for (uint64_t sequence = from; sequence < ring.headSequence(); ++sequence) {
+                const RingMessage& message = ring.at(sequence);
+                chunk->messages.push_back({ message.senderNickname, message.text });
+            }
+            captured.chunks.push_back(move(chunk));
+        }
+        captured.capturedThrough = ring.headSequence();
+        saved.chunks = captured.chunks;
+    }
+
+    for (uint32_t i = 0; i < connections.slotCount(); ++i) {
+        if (!connections.isLive(i) || connections[i].phase != PHASE_CHAT || connections[i].resumeToken == 0) {
+            continue;
+        }
+        const Connection& client = connections[i];
+        snapshot.sessions.push_back({ client.resumeToken, connections.sharedNickname(client.nicknameId), roomIndex[client.roomId],
+                                      client.roomJoinSequence, client.ackedSequence });
+    }
+    for (const auto& [token, session] : sessions.detachedSessions()) {
+        snapshot.sessions.push_back({ token, connections.sharedNickname(session.nicknameId), roomIndex[session.roomId],
+                                      session.joinSequence, session.ackedSequence });
+    }
+    return snapshot;
+}
+
+void writeSnapshot(chrono::steady_clock::time_point now) {
+    bool ok;
+    size_t bytes;
+    chrono::steady_clock::duration writeTime;
+    if (snapshotWriter.takeResult(ok, bytes, writeTime)) {
+        if (ok) {
+            cout << "Snapshot written to '" << snapshotPath << "': " << bytes << " bytes; captured in "
+                 << chrono::duration_cast<chrono::microseconds>(lastCaptureTime).count() << " us, written in the background in "
+                 << chrono::duration_cast<chrono::milliseconds>(writeTime).count() << " ms." << endl;
+        } else {
+            cerr << "Snapshot to '" << snapshotPath << "' failed; the previous one is kept." << endl;
+        }
+    }
+    if (now < nextSnapshotAt || snapshotWriter.writing()) {
+        return;
+    }
+
+    ServerSnapshot snapshot = captureSnapshot();
+    lastCaptureTime = chrono::steady_clock::now() - now;
+    snapshotWriter.start(snapshotPath, move(snapshot));
+    nextSnapshotAt = now + chrono::seconds(snapshotIntervalSeconds);
+}
+
+void checkTraceDump() {
+    bool ok;
+    size_t messageCount;
+    chrono::steady_clock::duration writeTime;
+    if (!traceDumpWriter.takeResult(ok, messageCount, writeTime)) {
+        return;
+    }
+
+    string reply;
+    if (ok) {
+        cout << "Wrote " << messageCount << " traced messages to '" << traceFile << "' in "
+             << chrono::duration_cast<chrono::milliseconds>(writeTime).count() << " ms." << endl;
+        reply = "INFO: Wrote " + to_string(messageCount) + " traced messages to '" + traceFile + "'.\n";
+    } else {
+        cerr << "Cannot write trace file '" << traceFile << "'." << endl;
+        reply = "ERROR: Cannot write trace file '" + traceFile + "'.\n";
+    }
+    if (connections.isLive(traceDumpRequester) && connections[traceDumpRequester].socketFD == traceDumpRequesterSocket) {
+        sendToClient(traceDumpRequester, reply);
+    }
+    traceDumpRequester = INVALID_INDEX;
+}
+
+// Starts a background reload when the rules file has a new modification time, and
+// swaps in whatever an earlier reload finished compiling. A file that fails to compile
+// leaves the rules in force as they were.
+void checkContentFilter(chrono::steady_clock::time_point now) {
+    unique_ptr<ContentFilter> reloaded;
+    string error;
+    chrono::steady_clock::duration loadTime;
+    if (filterLoader.takeResult(reloaded, error, loadTime)) {
+        if (reloaded != nullptr) {
+            contentFilter = move(reloaded);
+            cout << "Content filter reloaded from '" << filterPath << "': " << contentFilter->patternCount() << " patterns, "
+                 << contentFilter->tableBytes() / 1024 << " KB of tables, compiled in the background in "
+                 << chrono::duration_cast<chrono::milliseconds>(loadTime).count() << " ms." << endl;
+        } else {
+            cerr << "Content filter '" << filterPath << "' not reloaded (" << error << "); the previous rules stay in force." << endl;
+        }
+    }
+    if (now < nextFilterCheckAt || filterLoader.loading()) {
+        return;
+    }
+    nextFilterCheckAt = now + chrono::milliseconds(FILTER_CHECK_INTERVAL_MS);
+
+    error_code statusError;
+    filesystem::file_time_type modified = filesystem::last_write_time(filterPath, statusError);
+    if (!statusError && modified != filterFileTime) {
+        filterFileTime = modified;
+        filterLoader.start(filterPath);
+    }
+}
+
+// Puts a restored chat line back into the history and the search index. The ring holds
+// it in its SEQ envelope; presence lines, which also carry a sender, are left out.
+void archiveRestoredMessage(uint32_t roomId, uint64_t sequence, const string& nickname, const string& text) {
+    size_t lineStart = text.find(':', text.find(':') + 1) + 1;
+    string_view line = string_view(text).substr(lineStart);
+    if (!line.empty() && line.back() == '\n') {
+        line.remove_suffix(1);
+    }
+    if (line.length() > nickname.length() + 1 && line.compare(0, nickname.length() + 2, nickname + ": ") == 0) {
+        archiveChatLine(roomId, sequence, line, nickname.length() + 2);
+    }
+}
+
+// Brings back rooms, their history and every session from the last snapshot. Sessions
+// that were live come back detached, each with a fresh grace period to RESUME in; rooms
+// that end up with nobody to resume them close again straight away.
+void restoreSnapshot() {
+    auto started = chrono::steady_clock::now();
+    ServerSnapshot snapshot;
+    string error;
+    if (!LoadSnapshotFile(snapshotPath, snapshot, error)) {
+        cout << "No snapshot restored from '" << snapshotPath << "' (" << error << "); starting empty." << endl;
+        return;
+    }
+
+    vector<uint32_t> roomIds;
+    for (size_t i = 0; i < snapshot.rooms.size(); ++i) {
+        const SnapshotRoom& saved = snapshot.rooms[i];
+        uint32_t roomId = i == 0 ? LOBBY_ROOM_ID : rooms.create(saved.name, saved.memberCap, saved.topic);
+        if (roomId != INVALID_INDEX && roomId != LOBBY_ROOM_ID) {
+            rooms[roomId].createdAt = static_cast<time_t>(saved.createdAt);
+        }
+        roomIds.push_back(roomId);
+    }
+
+    unordered_map<string, uint32_t> nicknameIds;
+    size_t restoredSessions = 0;
+    auto expiresAt = chrono::steady_clock::now() + chrono::seconds(resumeGraceSeconds);
+    for (const SnapshotSession& saved : snapshot.sessions) {
+        uint32_t roomId = roomIds[saved.room];
+        if (resumeGraceSeconds == 0 || roomId == INVALID_INDEX || nicknameIds.count(*saved.nickname) != 0) {
+            continue;
+        }
+        DetachedSession session;
+        session.nicknameId = connections.nicknames.intern(*saved.nickname);
+        session.roomId = roomId;
+        session.joinSequence = saved.joinSequence;
+        session.ackedSequence = saved.ackedSequence;
+        session.expiresAt = expiresAt;
+        nicknameIds[*saved.nickname] = session.nicknameId;
+        if (roomId != LOBBY_ROOM_ID) {
+            rooms[roomId].detachedMembers++;
+        }
+        sessions.detach(saved.token, session);
+        restoredSessions++;
+    }
+
+    size_t restoredMessages = 0;
+    for (size_t i = 0; i < snapshot.rooms.size(); ++i) {
+        if (roomIds[i] == INVALID_INDEX) {
+            continue;
+        }
+        MessageRing& ring = rooms[roomIds[i]].ring;
+        ring.restart(snapshot.rooms[i].firstSequence);
+        for (const SharedSnapshotChunk& chunk : snapshot.rooms[i].chunks) {
+            for (const SnapshotMessage& message : chunk->messages) {
+                uint32_t sender = INVALID_INDEX;
+                if (message.sender) {
+                    auto restored = nicknameIds.find(*message.sender);
+                    sender = restored == nicknameIds.end() ? INVALID_INDEX : restored->second;
+                    archiveRestoredMessage(roomIds[i], ring.headSequence(), *message.sender, *message.text);
+                }
+                ring.restore(message.text, sender, message.sender);
+            }
+            restoredMessages += chunk->messages.size();
+        }
+        rooms.closeIfEmpty(roomIds[i]);
+    }
+
+    cout << "Restored snapshot '" << snapshotPath << "' in " << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count()
+         << " ms: " << rooms.size() - 1 << " rooms, " << restoredMessages << " messages, " << restoredSessions
+         << " sessions held for " << resumeGraceSeconds << " seconds." << endl;
+}
+
+// Every listener feeds the same connection table and rooms; the first listeners.size()
+// poll entries are the listening sockets, the rest are connections.
+void RunEventLoop(const vector<SOCKET>& listeners) {
+    vector<WSAPOLLFD> pollFDs;
+    vector<uint32_t> pollClients;
+    cout << "Server event loop started." << endl;
+
+    while (true) {
+        pollFDs.clear();
+        pollClients.clear();
+        bool sharedWorkPending = false;
+
+        for (SOCKET listenerFD : listeners) {
+            WSAPOLLFD listener;
+            listener.fd = listenerFD;
+            listener.events = POLLRDNORM;
+            listener.revents = 0;
+            pollFDs.push_back(listener);
+        }
+
+        for (uint32_t i = 0; i < connections.slotCount(); ++i) {
+            if (!connections.isLive(i)) {
+                continue;
+            }
+            WSAPOLLFD entry;
+            entry.fd = connections[i].socketFD;
+            entry.events = 0;
+            if (connections[i].shared != nullptr) {
+                entry.events = POLLRDNORM;
+                sharedWorkPending = sharedConnectionReady(connections[i]) || sharedWorkPending;
+            } else {
+                if (connections[i].waitingFor == WAIT_FRAME) {
+                    entry.events |= POLLRDNORM;
+                }
+                if (connections[i].pendingOutput != nullptr || hasRingBacklog(connections[i])) {
+                    entry.events |= POLLWRNORM;
+                }
+            }
+            entry.revents = 0;
+            pollFDs.push_back(entry);
+            pollClients.push_back(i);
+        }
+
+        int timeout = sharedWorkPending ? 0 : -1;
+        if (sessions.detachedCount() != 0 && (timeout < 0 || timeout > SESSION_EXPIRY_CHECK_INTERVAL_MS)) {
+            timeout = SESSION_EXPIRY_CHECK_INTERVAL_MS;
+        }
+        if (deliveryChanged && (timeout < 0 || timeout > DELIVERY_REVIEW_INTERVAL_MS)) {
+            timeout = DELIVERY_REVIEW_INTERVAL_MS;
+        }
+        if (presenceDigestPending) {
+            auto untilDigest = chrono::duration_cast<chrono::milliseconds>(presenceDigestDue - chrono::steady_clock::now()).count();
+            untilDigest = max<long long>(untilDigest, 0);
+            if (timeout < 0 || timeout > untilDigest) {
+                timeout = static_cast<int>(untilDigest);
+            }
+        }
+        if (loadShedder.shedding() && (timeout < 0 || timeout > LOAD_SAMPLE_INTERVAL_MS)) {
+            timeout = LOAD_SAMPLE_INTERVAL_MS;
+        }
+        if (!snapshotPath.empty() && snapshotIntervalSeconds != 0 && (timeout < 0 || timeout > SNAPSHOT_CHECK_INTERVAL_MS)) {
+            timeout = SNAPSHOT_CHECK_INTERVAL_MS;
+        }
+        if (capture.bufferedBytes() != 0 && (timeout < 0 || timeout > CAPTURE_FLUSH_INTERVAL_MS)) {
+            timeout = CAPTURE_FLUSH_INTERVAL_MS;
+        }
+        if (!filterPath.empty() && (timeout < 0 || timeout > FILTER_CHECK_INTERVAL_MS)) {
+            timeout = FILTER_CHECK_INTERVAL_MS;
+        }
+        if (traceDumpRequester != INVALID_INDEX && (timeout < 0 || timeout > TRACE_DUMP_CHECK_INTERVAL_MS)) {
+            timeout = TRACE_DUMP_CHECK_INTERVAL_MS;
+        }
+        int ready = WSAPoll(pollFDs.data(), static_cast<ULONG>(pollFDs.size()), timeout);
+        auto pollReturnedAt = chrono::steady_clock::now();
+        loopWokeAt = pollReturnedAt;
+        if (ready == SOCKET_ERROR) {
+            cerr << "WSAPoll failed with error: " << WSAGetLastError() << endl;
+            this_thread::sleep_for(chrono::milliseconds(100));
+            continue;
+        }
+
+        for (size_t k = listeners.size(); k < pollFDs.size(); ++k) {
+            uint32_t clientIndex = pollClients[k - listeners.size()];
+            short revents = pollFDs[k].revents;
+            if (!connections.isLive(clientIndex) || connections[clientIndex].closing) {
+                continue;
+            }
+            if (connections[clientIndex].shared != nullptr) {
+                serviceSharedConnection(clientIndex, revents);
+                continue;
+            }
+            if (revents == 0) {
+                continue;
+            }
+            if (revents & POLLWRNORM) {
+                flushPendingOutput(clientIndex);
+                Connection& client = connections[clientIndex];
+                if (client.waitingFor == WAIT_DRAIN && (client.closing || PendingOutputBytes(client) <= SESSION_DRAIN_WATERMARK)) {
+                    resumeSession(clientIndex);
+                }
+            }
+            if (!connections.isLive(clientIndex) || connections[clientIndex].closing) {
+                continue;
+            }
+            if (revents & (POLLRDNORM | POLLHUP | POLLERR)) {
+                ReadFromClient(clientIndex);
+            } else if (revents & POLLNVAL) {
+                connections[clientIndex].closing = true;
+            }
+        }
+
+        for (size_t k = 0; k < listeners.size(); ++k) {
+            if (pollFDs[k].revents & POLLRDNORM) {
+                AcceptingNewConnection(listeners[k], k >= firstAdminListener, loopbackListeners[k]);
+            }
+        }
+
+        if (sessions.detachedCount() != 0) {
+            expireDetachedSessions();
+        }
+        auto now = chrono::steady_clock::now();
+        if (deliveryChanged && now - lastDeliveryReview >= chrono::milliseconds(DELIVERY_REVIEW_INTERVAL_MS)) {
+            deliveryChanged = false;
+            lastDeliveryReview = now;
+            reviewDelivery(now);
+        }
+        if (presenceDigestPending && now >= presenceDigestDue) {
+            sendPresenceDigests();
+        }
+        if (!snapshotPath.empty() && snapshotIntervalSeconds != 0) {
+            writeSnapshot(now);
+        }
+        if (capture.bufferedBytes() != 0 && now - lastCaptureFlush >= chrono::milliseconds(CAPTURE_FLUSH_INTERVAL_MS)) {
+            capture.flush();
+            lastCaptureFlush = now;
+        }
+        if (!filterPath.empty()) {
+            checkContentFilter(now);
+        }
+        if (traceDumpRequester != INVALID_INDEX) {
+            checkTraceDump();
+        }
+        searchIndex.publish();
+
+        closeFinishedConnections();
+
+        now = chrono::steady_clock::now();
+        loopBusyTime += now - pollReturnedAt;
+        if (now - lastLoadSample >= chrono::milliseconds(LOAD_SAMPLE_INTERVAL_MS)) {
+            sampleLoad(now);
+        }
+    }
+}
+
+// Binds and listens on one endpoint. An IPv6 listener takes IPv6 only, so [::] and
+// 0.0.0.0 can both be given; a Unix socket path left over from an earlier run is removed.
+SOCKET OpenListener(const SocketEndpoint& endpoint) {
+    sockaddr_storage address;
+    int addressLength = CreateEndpointAddress(endpoint, address);
+    if (addressLength == 0) {
+        cerr << "Invalid listen address " << FormatEndpoint(endpoint) << endl;
+        return INVALID_SOCKET;
+    }
+
+    SOCKET listenerFD = CreateStreamSocket(endpoint);
+    if (listenerFD == INVALID_SOCKET) {
+        cerr << "Failed to create server socket for " << FormatEndpoint(endpoint) << ". Error: " << WSAGetLastError() << endl;
+        return INVALID_SOCKET;
+    }
+    if (endpoint.family == AF_INET6) {
+        DWORD ipv6Only = 1;
+        setsockopt(listenerFD, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<const char*>(&ipv6Only), sizeof(ipv6Only));
+    } else if (endpoint.family == AF_UNIX) {
+        remove(endpoint.host.c_str());
+    }
+
+    if (bind(listenerFD, reinterpret_cast<const sockaddr*>(&address), addressLength) == SOCKET_ERROR) {
+        cerr << "bind to " << FormatEndpoint(endpoint) << " failed with error: " << WSAGetLastError() << endl;
+        closesocket(listenerFD);
+        return INVALID_SOCKET;
+    }
+    if (listen(listenerFD, SOMAXCONN) == SOCKET_ERROR) {
+        cerr << "listen on " << FormatEndpoint(endpoint) << " failed with error: " << WSAGetLastError() << endl;
+        closesocket(listenerFD);
+        return INVALID_SOCKET;
+    }
+
+    u_long nonBlocking = 1;
+    ioctlsocket(listenerFD, FIONBIO, &nonBlocking);
+    return listenerFD;
+}
+
+int main(int argc, char* argv[]) {
+    vector<SocketEndpoint> endpoints;
+    vector<SocketEndpoint> adminEndpoints;
+    string capturePath;
+    string historyDirectory = ".";
+    size_t historyBudgetMB = DEFAULT_HISTORY_BUDGET_MB;
+    for (int i = 1; i < argc; ++i) {
+        string option = argv[i];
+        if ((option == "--listen" || option == "--admin-listen") && i + 1 < argc) {
+            SocketEndpoint endpoint;
+            if (!ParseEndpoint(argv[++i], endpoint)) {
+                cerr << "Cannot parse listen address '" << argv[i] << "'; use 127.0.0.1:8580, [::1]:8580 or unix:<path>." << endl;
+                return 1;
+            }
+            (option == "--listen" ? endpoints : adminEndpoints).push_back(endpoint);
+        } else if (option == "--resume-grace" && i + 1 < argc) {
+            resumeGraceSeconds = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (option == "--presence-digest" && i + 1 < argc) {
+            presenceDigestMembers = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (option == "--presence-silent" && i + 1 < argc) {
+            presenceSilentMembers = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (option == "--max-connections" && i + 1 < argc) {
+            maxConnections = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (option == "--max-negotiating" && i + 1 < argc) {
+            maxNegotiating = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (option == "--shed-queued-bytes" && i + 1 < argc) {
+            loadShedder.watermarks.queuedOutputBytes = strtoull(argv[++i], nullptr, 10);
+        } else if (option == "--shed-backlog" && i + 1 < argc) {
+            loadShedder.watermarks.backlogMessages = strtoull(argv[++i], nullptr, 10);
+        } else if (option == "--shed-busy-percent" && i + 1 < argc) {
+            loadShedder.watermarks.busyFraction = strtoul(argv[++i], nullptr, 10) / 100.0;
+        } else if (option == "--snapshot" && i + 1 < argc) {
+            snapshotPath = argv[++i];
+        } else if (option == "--snapshot-interval" && i + 1 < argc) {
+            snapshotIntervalSeconds = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (option == "--trace" && i + 1 < argc) {
+            tracer.setSampleEvery(static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10)));
+        } else if (option == "--trace-file" && i + 1 < argc) {
+            traceFile = argv[++i];
+        } else if (option == "--capture" && i + 1 < argc) {
+            capturePath = argv[++i];
+        } else if (option == "--history-budget" && i + 1 < argc) {
+            historyBudgetMB = strtoul(argv[++i], nullptr, 10);
+        } else if (option == "--history-dir" && i + 1 < argc) {
+            historyDirectory = argv[++i];
+        } else if (option == "--join-history" && i + 1 < argc) {
+            joinHistoryLines = strtoul(argv[++i], nullptr, 10);
+        } else if (option == "--compress-threshold" && i + 1 < argc) {
+            compressionThreshold = strtoul(argv[++i], nullptr, 10);
+        } else if (option == "--filter" && i + 1 < argc) {
+            filterPath = argv[++i];
+        } else {
+            cerr << "Usage: ChatServer [--listen <address:port | [ipv6]:port | unix:path>]... [--resume-grace <seconds>]" << endl;
+            cerr << "                  [--presence-digest <members>] [--presence-silent <members>]" << endl;
+            cerr << "                  [--max-connections <n>] [--max-negotiating <n>]" << endl;
+            cerr << "                  [--shed-queued-bytes <bytes>] [--shed-backlog <messages>] [--shed-busy-percent <percent>]" << endl;
+            cerr << "                  [--snapshot <file>] [--snapshot-interval <seconds>]" << endl;
+            cerr << "                  [--admin-listen <address>]... [--trace <one in n messages>] [--trace-file <file>]" << endl;
+            cerr << "                  [--capture <file>]" << endl;
+            cerr << "                  [--history-budget <MB in memory>] [--history-dir <directory>] [--join-history <lines>]" << endl;
+            cerr << "                  [--compress-threshold <bytes>] [--filter <rules file>]" << endl;
+            cerr << "                  (0 disables any of them)" << endl;
+            return 1;
+        }
+    }
+
+    if (!capturePath.empty()) {
+        if (!capture.open(capturePath)) {
+            cerr << "Cannot open capture file '" << capturePath << "'." << endl;
+            return 1;
+        }
+        cout << "Capturing client traffic to '" << capturePath << "'." << endl;
+    }
+    history.configure(historyDirectory, historyBudgetMB * 1024 * 1024);
+    if (!filterPath.empty()) {
+        string error;
+        contentFilter = make_unique<ContentFilter>();
+        if (!LoadContentFilterFile(filterPath, *contentFilter, error)) {
+            cerr << "Cannot load content filter '" << filterPath << "': " << error << "." << endl;
+            return 1;
+        }
+        error_code statusError;
+        filterFileTime = filesystem::last_write_time(filterPath, statusError);
+        cout << "Content filter: " << contentFilter->patternCount() << " patterns from '" << filterPath << "' in "
+             << contentFilter->stateCount() << " states (" << contentFilter->tableBytes() / 1024 << " KB); reloaded when the file changes." << endl;
+    }
+
+    WSADATA wsaData;
+    int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (iResult != 0) {
+        cerr << "WSAStartup failed: " << iResult << endl;
+        return 1;
+    }
+
+    if (endpoints.empty()) {
+        SocketEndpoint defaultEndpoint;
+        ParseEndpoint(DEFAULT_LISTEN_ENDPOINT, defaultEndpoint);
+        endpoints.push_back(defaultEndpoint);
+    }
+
+    firstAdminListener = endpoints.size();
+    endpoints.insert(endpoints.end(), adminEndpoints.begin(), adminEndpoints.end());
+    vector<SOCKET> listeners;
+    for (const SocketEndpoint& endpoint : endpoints) {
+        SOCKET listenerFD = OpenListener(endpoint);
+        if (listenerFD == INVALID_SOCKET) {
+            for (SOCKET opened : listeners) {
+                closesocket(opened);
+            }
+            WSACleanup();
+            return 1;
+        }
+        bool admin = listeners.size() >= firstAdminListener;
+        listeners.push_back(listenerFD);
+        loopbackListeners.push_back(IsLoopbackEndpoint(endpoint));
+        cout << (admin ? "Admin connections are accepted on " : "Server is listening on ") << FormatEndpoint(endpoint) << "..." << endl;
+    }
+    if (tracer.sampleEvery() != 0) {
+        cout << "Tracing one message in " << tracer.sampleEvery() << "; admin COMMAND:TRACE:DUMP writes '" << traceFile << "'." << endl;
+    }
+    if (compressionThreshold != 0) {
+        cout << "Clients may negotiate " << CHAT_COMPRESSION_CODEC << " compression for output of " << compressionThreshold << " bytes or more." << endl;
+    }
+
+    if (!snapshotPath.empty()) {
+        restoreSnapshot();
+        nextSnapshotAt = chrono::steady_clock::now() + chrono::seconds(snapshotIntervalSeconds);
+    }
+
+    cout << "Press Ctrl+C to stop server." << endl;
+    RunEventLoop(listeners);
+
+    for (SOCKET listenerFD : listeners) {
+        closesocket(listenerFD);
+    }
+    WSACleanup();
+    return 0;
+}
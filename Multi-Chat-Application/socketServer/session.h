@@ -0,0 +1,95 @@
+#ifndef SOCKETSERVER_SESSION_H
+#define SOCKETSERVER_SESSION_H
+
+#include "connection.h"
+#include <exception>
+#include <optional>
+
+const size_t SESSION_DRAIN_WATERMARK = 64 * 1024;
+
+// Fire-and-forget coroutine that runs one connection from accept to close. It starts
+// eagerly, parks on the awaitables below, and frees its own frame when it returns.
+struct SessionTask {
+    struct promise_type {
+        SessionTask get_return_object() { return SessionTask(); }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+};
+
+// Resumes with the next complete line from the connection, or nullopt once the
+// connection is closing. The view points into the receive buffer and stays valid
+// until the session awaits again.
+class FrameAwaiter {
+public:
+    FrameAwaiter(ConnectionTable& table, uint32_t index) : table(table), index(index), hasLine(false) {}
+
+    bool await_ready() {
+        if (table[index].closing) {
+            return true;
+        }
+        hasLine = TakeBufferedLine(table[index], line);
+        return hasLine;
+    }
+
+    void await_suspend(coroutine_handle<> handle) {
+        table[index].session = handle;
+        table[index].waitingFor = WAIT_FRAME;
+    }
+
+    optional<string_view> await_resume() {
+        Connection& connection = table[index];
+        connection.waitingFor = WAIT_NONE;
+        if (connection.closing) {
+            return nullopt;
+        }
+        if (!hasLine) {
+            hasLine = TakeBufferedLine(connection, line);
+        }
+        return hasLine ? optional<string_view>(line) : nullopt;
+    }
+
+private:
+    ConnectionTable& table;
+    uint32_t index;
+    string_view line;
+    bool hasLine;
+};
+
+// Suspends while more than SESSION_DRAIN_WATERMARK bytes are queued for the peer, so a
+// client that sends commands but never reads the replies stops being read from.
+// Resumes with false if the connection closed in the meantime.
+class DrainAwaiter {
+public:
+    DrainAwaiter(ConnectionTable& table, uint32_t index) : table(table), index(index) {}
+
+    bool await_ready() {
+        return table[index].closing || PendingOutputBytes(table[index]) <= SESSION_DRAIN_WATERMARK;
+    }
+
+    void await_suspend(coroutine_handle<> handle) {
+        table[index].session = handle;
+        table[index].waitingFor = WAIT_DRAIN;
+    }
+
+    bool await_resume() {
+        table[index].waitingFor = WAIT_NONE;
+        return !table[index].closing;
+    }
+
+private:
+    ConnectionTable& table;
+    uint32_t index;
+};
+
+inline FrameAwaiter readFrame(ConnectionTable& table, uint32_t index) {
+    return FrameAwaiter(table, index);
+}
+
+inline DrainAwaiter outputDrained(ConnectionTable& table, uint32_t index) {
+    return DrainAwaiter(table, index);
+}
+
+#endif //SOCKETSERVER_SESSION_H
@@ -0,0 +1,323 @@
+#include "snapshot.h"
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+
+namespace {
+
+const char SNAPSHOT_MAGIC[8] = { 'C', 'H', 'A', 'T', 'S', 'N', 'A', 'P' };
+const uint32_t SNAPSHOT_VERSION = 1;
+const size_t SNAPSHOT_WRITE_BUFFER = 1024 * 1024;
+const uint32_t NO_SNAPSHOT_NICKNAME = UINT32_MAX;
+
+uint64_t checksumStep(uint64_t hash, const char* data, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ static_cast<uint8_t>(data[i])) * 1099511628211ull;
+    }
+    return hash;
+}
+
+const uint64_t CHECKSUM_START = 14695981039346656037ull;
+
+class SnapshotOutput {
+public:
+    explicit SnapshotOutput(FILE* file) : file(file), checksum(CHECKSUM_START), length(0), failed(false) {}
+
+    void bytes(const void* data, size_t size) {
+        checksum = checksumStep(checksum, static_cast<const char*>(data), size);
+        length += size;
+        failed = failed || fwrite(data, 1, size, file) != size;
+    }
+    void u32(uint32_t value) { bytes(&value, sizeof(value)); }
+    void u64(uint64_t value) { bytes(&value, sizeof(value)); }
+    void text(const string& value) {
+        u32(static_cast<uint32_t>(value.length()));
+        bytes(value.data(), value.length());
+    }
+    bool finish() {
+        uint64_t sum = checksum;
+        bytes(&sum, sizeof(sum));
+        return !failed;
+    }
+    size_t written() const { return length; }
+
+private:
+    FILE* file;
+    uint64_t checksum;
+    size_t length;
+    bool failed;
+};
+
+// Bounds-checked reads over the mapped file. Any read past the end sets failed and
+// returns zeroes, so the parser checks once per record instead of once per field.
+class SnapshotInput {
+public:
+    SnapshotInput(const char* data, size_t size) : data(data), size(size), offset(0), failed(false) {}
+
+    const char* take(size_t count) {
+        if (failed || count > size - offset) {
+            failed = true;
+            return nullptr;
+        }
+        const char* start = data + offset;
+        offset += count;
+        return start;
+    }
+    uint32_t u32() {
+        uint32_t value = 0;
+        if (const char* bytes = take(sizeof(value))) {
+            memcpy(&value, bytes, sizeof(value));
+        }
+        return value;
+    }
+    uint64_t u64() {
+        uint64_t value = 0;
+        if (const char* bytes = take(sizeof(value))) {
+            memcpy(&value, bytes, sizeof(value));
+        }
+        return value;
+    }
+    string_view text() {
+        uint32_t length = u32();
+        const char* bytes = take(length);
+        return bytes == nullptr ? string_view() : string_view(bytes, length);
+    }
+    bool ok() const { return !failed; }
+    size_t position() const { return offset; }
+
+private:
+    const char* data;
+    size_t size;
+    size_t offset;
+    bool failed;
+};
+
+bool parseSnapshot(const char* data, size_t size, ServerSnapshot& snapshot, string& error) {
+    if (size < sizeof(SNAPSHOT_MAGIC) + sizeof(uint32_t) + sizeof(uint64_t) || memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        error = "not a snapshot file";
+        return false;
+    }
+    uint64_t expected;
+    memcpy(&expected, data + size - sizeof(expected), sizeof(expected));
+    if (checksumStep(CHECKSUM_START, data, size - sizeof(expected)) != expected) {
+        error = "checksum mismatch";
+        return false;
+    }
+
+    SnapshotInput input(data + sizeof(SNAPSHOT_MAGIC), size - sizeof(SNAPSHOT_MAGIC) - sizeof(expected));
+    if (input.u32() != SNAPSHOT_VERSION) {
+        error = "unsupported format version";
+        return false;
+    }
+
+    vector<SharedMessage> nicknames;
+    uint32_t nicknameCount = input.u32();
+    for (uint32_t i = 0; i < nicknameCount && input.ok(); ++i) {
+        nicknames.push_back(make_shared<const string>(input.text()));
+    }
+
+    uint32_t roomCount = input.u32();
+    for (uint32_t i = 0; i < roomCount && input.ok(); ++i) {
+        SnapshotRoom room;
+        room.name = string(input.text());
+        room.topic = string(input.text());
+        room.memberCap = input.u32();
+        room.createdAt = static_cast<int64_t>(input.u64());
+        room.firstSequence = input.u64();
+        auto chunk = make_shared<SnapshotChunk>();
+        chunk->firstSequence = room.firstSequence;
+        uint32_t messageCount = input.u32();
+        for (uint32_t m = 0; m < messageCount && input.ok(); ++m) {
+            uint32_t sender = input.u32();
+            string_view text = input.text();
+            if (sender != NO_SNAPSHOT_NICKNAME && sender >= nicknameCount) {
+                error = "message sender out of range";
+                return false;
+            }
+            chunk->messages.push_back({ sender == NO_SNAPSHOT_NICKNAME ? SharedMessage() : nicknames[sender], make_shared<const string>(text) });
+        }
+        room.chunks.push_back(move(chunk));
+        snapshot.rooms.push_back(move(room));
+    }
+
+    uint32_t sessionCount = input.u32();
+    for (uint32_t i = 0; i < sessionCount && input.ok(); ++i) {
+        SnapshotSession session;
+        session.token = input.u64();
+        uint32_t nickname = input.u32();
+        session.room = input.u32();
+        session.joinSequence = input.u64();
+        session.ackedSequence = input.u64();
+        if (nickname >= nicknameCount || session.room >= roomCount) {
+            error = "session out of range";
+            return false;
+        }
+        session.nickname = nicknames[nickname];
+        snapshot.sessions.push_back(session);
+    }
+
+    if (!input.ok() || snapshot.rooms.empty()) {
+        error = "truncated";
+        return false;
+    }
+    return true;
+}
+
+}
+
+bool WriteSnapshotFile(const string& path, const ServerSnapshot& snapshot, size_t& bytesWritten) {
+    string temporaryPath = path + ".tmp";
+    FILE* file = fopen(temporaryPath.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    setvbuf(file, nullptr, _IOFBF, SNAPSHOT_WRITE_BUFFER);
+
+    SnapshotOutput output(file);
+    output.bytes(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    output.u32(SNAPSHOT_VERSION);
+
+    // The same nickname can come as several strings, one per time it was claimed.
+    vector<const string*> nicknames;
+    unordered_map<string_view, uint32_t> nicknameIndex;
+    auto nicknameNumber = [&](const SharedMessage& nickname) {
+        if (!nickname) {
+            return NO_SNAPSHOT_NICKNAME;
+        }
+        auto inserted = nicknameIndex.try_emplace(*nickname, static_cast<uint32_t>(nicknames.size()));
+        if (inserted.second) {
+            nicknames.push_back(nickname.get());
+        }
+        return inserted.first->second;
+    };
+    // Messages before a room's firstSequence are left out of the file.
+    auto forEachMessage = [](const SnapshotRoom& room, auto&& visit) {
+        for (const SharedSnapshotChunk& chunk : room.chunks) {
+            uint64_t sequence = chunk->firstSequence;
+            for (const SnapshotMessage& message : chunk->messages) {
+                if (sequence++ >= room.firstSequence) {
+                    visit(message);
+                }
+            }
+        }
+    };
+    vector<uint32_t> messageCounts;
+    for (const SnapshotRoom& room : snapshot.rooms) {
+        uint32_t count = 0;
+        forEachMessage(room, [&](const SnapshotMessage& message) {
+            nicknameNumber(message.sender);
+            count++;
+        });
+        messageCounts.push_back(count);
+    }
+    for (const SnapshotSession& session : snapshot.sessions) {
+        nicknameNumber(session.nickname);
+    }
+
+    output.u32(static_cast<uint32_t>(nicknames.size()));
+    for (const string* nickname : nicknames) {
+        output.text(*nickname);
+    }
+
+    output.u32(static_cast<uint32_t>(snapshot.rooms.size()));
+    for (size_t i = 0; i < snapshot.rooms.size(); ++i) {
+        const SnapshotRoom& room = snapshot.rooms[i];
+        output.text(room.name);
+        output.text(room.topic);
+        output.u32(room.memberCap);
+        output.u64(static_cast<uint64_t>(room.createdAt));
+        output.u64(room.firstSequence);
+        output.u32(messageCounts[i]);
+        forEachMessage(room, [&](const SnapshotMessage& message) {
+            output.u32(nicknameNumber(message.sender));
+            output.text(*message.text);
+        });
+    }
+
+    output.u32(static_cast<uint32_t>(snapshot.sessions.size()));
+    for (const SnapshotSession& session : snapshot.sessions) {
+        output.u64(session.token);
+        output.u32(nicknameNumber(session.nickname));
+        output.u32(session.room);
+        output.u64(session.joinSequence);
+        output.u64(session.ackedSequence);
+    }
+
+    bool ok = output.finish();
+    ok = fflush(file) == 0 && ok;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || !MoveFileExA(temporaryPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        remove(temporaryPath.c_str());
+        return false;
+    }
+    bytesWritten = output.written();
+    return true;
+}
+
+bool LoadSnapshotFile(const string& path, ServerSnapshot& snapshot, string& error) {
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        error = "cannot open (error " + to_string(GetLastError()) + ")";
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+        CloseHandle(file);
+        error = "empty file";
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    const char* view = mapping == nullptr ? nullptr : static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    bool ok = false;
+    if (view == nullptr) {
+        error = "cannot map (error " + to_string(GetLastError()) + ")";
+    } else {
+        ok = parseSnapshot(view, static_cast<size_t>(fileSize.QuadPart), snapshot, error);
+        UnmapViewOfFile(view);
+    }
+    if (mapping != nullptr) {
+        CloseHandle(mapping);
+    }
+    CloseHandle(file);
+    return ok;
+}
+
+SnapshotWriter::~SnapshotWriter() {
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+bool SnapshotWriter::start(const string& path, ServerSnapshot&& snapshot) {
+    if (writing()) {
+        return false;
+    }
+    if (worker.joinable()) {
+        worker.join();
+    }
+
+    busy.store(true, memory_order_release);
+    finished = false;
+    worker = thread([this, path, captured = move(snapshot)]() {
+        auto started = chrono::steady_clock::now();
+        size_t bytes = 0;
+        succeeded = WriteSnapshotFile(path, captured, bytes);
+        bytesWritten = bytes;
+        writeTime = chrono::steady_clock::now() - started;
+        finished = true;
+        busy.store(false, memory_order_release);
+    });
+    return true;
+}
+
+bool SnapshotWriter::takeResult(bool& ok, size_t& bytes, chrono::steady_clock::duration& elapsed) {
+    if (writing() || !finished) {
+        return false;
+    }
+    finished = false;
+    ok = succeeded;
+    bytes = bytesWritten;
+    elapsed = writeTime;
+    return true;
+}
@@ -0,0 +1,91 @@
+#ifndef SOCKETSERVER_SNAPSHOT_H
+#define SOCKETSERVER_SNAPSHOT_H
+
+#include "connection.h"
+#include "socketutil.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// How often the server writes a snapshot when --snapshot is given.
+const uint32_t DEFAULT_SNAPSHOT_INTERVAL_SECONDS = 30;
+
+// The state a restarted server needs for its clients to resume: rooms with the history
+// their rings still hold, and every session that could send RESUME. Room 0 is always
+// the lobby. Nicknames and message text are shared with the live server, so a capture
+// copies references to them rather than the strings.
+struct SnapshotMessage {
+    SharedMessage sender;     // the sender's nickname, or null for server messages
+    SharedMessage text;       // with its SEQ envelope, as the ring holds it
+};
+
+// A run of consecutive ring messages. Chunks never change once made, so the event loop
+// keeps the ones it captured and hands the same chunks to every later snapshot while
+// their messages are still in the ring; a capture only copies what was published since
+// the one before.
+struct SnapshotChunk {
+    uint64_t firstSequence;
+    vector<SnapshotMessage> messages;
+};
+typedef shared_ptr<const SnapshotChunk> SharedSnapshotChunk;
+
+struct SnapshotRoom {
+    string name;
+    string topic;
+    uint32_t memberCap;
+    int64_t createdAt;
+    // The ring's oldest replayable message; the chunks may start before it, and the
+    // messages before it are left out. The ring's head follows the last message.
+    uint64_t firstSequence;
+    vector<SharedSnapshotChunk> chunks;
+};
+
+struct SnapshotSession {
+    uint64_t token;
+    SharedMessage nickname;
+    uint32_t room;            // index into rooms
+    uint64_t joinSequence;
+    uint64_t ackedSequence;
+};
+
+struct ServerSnapshot {
+    vector<SnapshotRoom> rooms;
+    vector<SnapshotSession> sessions;
+};
+
+// Binary file: a "CHATSNAP" header with a format version, a table of nicknames that
+// messages and sessions refer to by index, the rooms and sessions with length-prefixed
+// strings, and an FNV-1a checksum of everything before it. The file is written next to
+// its final path and renamed over it, so a crash mid-write leaves the previous snapshot
+// in place. A loaded snapshot has one chunk per room, starting at firstSequence.
+bool WriteSnapshotFile(const string& path, const ServerSnapshot& snapshot, size_t& bytesWritten);
+
+// Maps the file read-only and parses it in place. False, with the reason, if the file
+// is missing, truncated, from another format version or fails its checksum.
+bool LoadSnapshotFile(const string& path, ServerSnapshot& snapshot, string& error);
+
+// Writes snapshots on a background thread. The event loop captures the state, which
+// only copies references, and hands the capture over; building the nickname table,
+// serializing and disk I/O happen off the loop. A capture offered while a write is still running is
+// refused rather than queued.
+class SnapshotWriter {
+public:
+    SnapshotWriter() : busy(false), finished(false), succeeded(false), bytesWritten(0) {}
+    ~SnapshotWriter();
+
+    bool writing() const { return busy.load(memory_order_acquire); }
+    bool start(const string& path, ServerSnapshot&& snapshot);
+
+    // Once per finished write: whether it succeeded, its size and how long it took.
+    bool takeResult(bool& ok, size_t& bytes, chrono::steady_clock::duration& elapsed);
+
+private:
+    thread worker;
+    atomic<bool> busy;
+    bool finished;
+    bool succeeded;
+    size_t bytesWritten;
+    chrono::steady_clock::duration writeTime;
+};
+
+#endif //SOCKETSERVER_SNAPSHOT_H
@@ -0,0 +1,171 @@
+#include "trace.h"
+#include <cstdio>
+#include <unordered_map>
+
+namespace {
+
+struct TracedMessage {
+    uint32_t sender = 0;
+    uint32_t members = 0;
+    bool seen[TRACE_FANOUT_END + 1] = {};
+    chrono::steady_clock::time_point at[TRACE_FANOUT_END + 1];
+    vector<const TraceEvent*> recipients;
+};
+
+const char* recipientSpanName(TracePoint point) {
+    switch (point) {
+        case TRACE_SENT: return "delivered";
+        default: return "queued behind unread output";
+    }
+}
+
+class TraceWriter {
+public:
+    TraceWriter(FILE* file, chrono::steady_clock::time_point origin) : file(file), origin(origin), first(true) {}
+
+    void span(const char* name, uint32_t track, chrono::steady_clock::time_point start, chrono::steady_clock::time_point end,
+              uint32_t traceId, uint32_t members) {
+        double startUs = chrono::duration<double, micro>(start - origin).count();
+        double durationUs = chrono::duration<double, micro>(end - start).count();
+        fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"message\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"trace\":%u",
+                first ? "" : ",", name, track, startUs, durationUs, traceId);
+        if (members != 0) {
+            fprintf(file, ",\"members\":%u", members);
+        }
+        fputs("}}", file);
+        first = false;
+    }
+
+private:
+    FILE* file;
+    chrono::steady_clock::time_point origin;
+    bool first;
+};
+
+}
+
+MessageTracer::MessageTracer(size_t capacity) : events(capacity), recorded(0), every(0), countdown(0), nextTraceId(1) {}
+
+void MessageTracer::setSampleEvery(uint32_t newEvery) {
+    every = newEvery;
+    countdown = newEvery;
+}
+
+uint32_t MessageTracer::sample() {
+    if (every == 0 || --countdown != 0) {
+        return 0;
+    }
+    countdown = every;
+    uint32_t traceId = nextTraceId++;
+    if (nextTraceId == 0) {
+        nextTraceId = 1;
+    }
+    return traceId;
+}
+
+void MessageTracer::record(uint32_t traceId, TracePoint point, uint64_t connection, chrono::steady_clock::time_point at, uint32_t members) {
+    TraceEvent& event = events[recorded % events.size()];
+    event.traceId = traceId;
+    event.point = point;
+    event.connection = static_cast<uint32_t>(connection);
+    event.members = members;
+    event.at = at;
+    recorded++;
+}
+
+vector<TraceEvent> MessageTracer::copyEvents() const {
+    vector<TraceEvent> copy;
+    copy.reserve(eventCount());
+    for (uint64_t i = recorded - eventCount(); i < recorded; ++i) {
+        copy.push_back(events[i % events.size()]);
+    }
+    return copy;
+}
+
+bool ExportChromeTrace(const vector<TraceEvent>& events, const string& path, size_t& messageCount) {
+    unordered_map<uint32_t, TracedMessage> messages;
+    vector<uint32_t> order;
+    for (const TraceEvent& event : events) {
+        auto inserted = messages.try_emplace(event.traceId);
+        TracedMessage& message = inserted.first->second;
+        if (inserted.second) {
+            order.push_back(event.traceId);
+        }
+        if (event.point <= TRACE_FANOUT_END) {
+            message.seen[event.point] = true;
+            message.at[event.point] = event.at;
+            if (event.point == TRACE_RECEIVED) {
+                message.sender = event.connection;
+            } else if (event.point == TRACE_FANOUT_END) {
+                message.members = event.members;
+            }
+        } else {
+            message.recipients.push_back(&event);
+        }
+    }
+
+    FILE* file = fopen(path.c_str(), "w");
+    if (file == nullptr) {
+        return false;
+    }
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", file);
+    TraceWriter writer(file, events.empty() ? chrono::steady_clock::time_point() : events.front().at);
+
+    // Stamps from before the buffer wrapped are gone; a message is exported only if its
+    // whole path through the server up to the end of the fan-out is still there.
+    messageCount = 0;
+    for (uint32_t traceId : order) {
+        const TracedMessage& message = messages[traceId];
+        if (!message.seen[TRACE_RECEIVED] || !message.seen[TRACE_PARSED] || !message.seen[TRACE_FANOUT_START] || !message.seen[TRACE_FANOUT_END]) {
+            continue;
+        }
+        writer.span("waiting to be read", message.sender, message.at[TRACE_RECEIVED], message.at[TRACE_PARSED], traceId, 0);
+        writer.span("handling", message.sender, message.at[TRACE_PARSED], message.at[TRACE_FANOUT_START], traceId, 0);
+        writer.span("fan-out", message.sender, message.at[TRACE_FANOUT_START], message.at[TRACE_FANOUT_END], traceId, message.members);
+        for (const TraceEvent* recipient : message.recipients) {
+            writer.span(recipientSpanName(recipient->point), recipient->connection, message.at[TRACE_FANOUT_START], recipient->at, traceId, 0);
+        }
+        messageCount++;
+    }
+    fputs("\n]}\n", file);
+    return fclose(file) == 0;
+}
+
+TraceDumpWriter::~TraceDumpWriter() {
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+bool TraceDumpWriter::start(const string& path, vector<TraceEvent>&& events) {
+    if (writing()) {
+        return false;
+    }
+    if (worker.joinable()) {
+        worker.join();
+    }
+
+    busy.store(true, memory_order_release);
+    finished = false;
+    worker = thread([this, path, captured = move(events)]() {
+        auto started = chrono::steady_clock::now();
+        size_t messageCount = 0;
+        succeeded = ExportChromeTrace(captured, path, messageCount);
+        messagesWritten = messageCount;
+        writeTime = chrono::steady_clock::now() - started;
+        finished = true;
+        busy.store(false, memory_order_release);
+    });
+    return true;
+}
+
+bool TraceDumpWriter::takeResult(bool& ok, size_t& messageCount, chrono::steady_clock::duration& elapsed) {
+    if (writing() || !finished) {
+        return false;
+    }
+    finished = false;
+    ok = succeeded;
+    messageCount = messagesWritten;
+    elapsed = writeTime;
+    return true;
+}
@@ -0,0 +1,92 @@
+#ifndef SOCKETSERVER_TRACE_H
+#define SOCKETSERVER_TRACE_H
+
+#include "socketutil.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Trace events kept for export; older ones are overwritten.
+const size_t DEFAULT_TRACE_EVENTS = 1 << 16;
+
+// Where the admin TRACE:DUMP command writes unless --trace-file says otherwise.
+const char* const DEFAULT_TRACE_FILE = "chat-trace.json";
+
+// The points a sampled chat line is stamped at on its way through the server. Each
+// recipient adds one of the last two: its copy went out in full, or was queued behind
+// output the client had not read yet.
+enum TracePoint : uint8_t {
+    TRACE_RECEIVED,      // the event loop woke up with the line's bytes readable
+    TRACE_PARSED,        // line framed and classified
+    TRACE_FANOUT_START,  // published to the room ring
+    TRACE_FANOUT_END,    // every member sent what its socket would take
+    TRACE_SENT,
+    TRACE_QUEUED
+};
+
+struct TraceEvent {
+    uint32_t traceId;
+    TracePoint point;
+    uint32_t connection;  // socket of the sender or the recipient
+    uint32_t members;     // room members at TRACE_FANOUT_END, 0 otherwise
+    chrono::steady_clock::time_point at;
+};
+
+// Samples one chat line in every N and keeps the stamps in a fixed ring. The event loop
+// is the only thread that records or exports, so the buffer is never locked or shared;
+// a sampled-out line costs one countdown, and a ring message that is not traced one
+// test of its trace id. N can be changed at any time; 0 turns tracing off.
+class MessageTracer {
+public:
+    explicit MessageTracer(size_t capacity = DEFAULT_TRACE_EVENTS);
+
+    void setSampleEvery(uint32_t every);
+    uint32_t sampleEvery() const { return every; }
+
+    // A new trace id if this line is sampled, 0 otherwise.
+    uint32_t sample();
+    void record(uint32_t traceId, TracePoint point, uint64_t connection, chrono::steady_clock::time_point at, uint32_t members = 0);
+    void record(uint32_t traceId, TracePoint point, uint64_t connection) { record(traceId, point, connection, chrono::steady_clock::now()); }
+
+    size_t eventCount() const { return min<uint64_t>(recorded, events.size()); }
+    // The events still in the buffer, oldest first.
+    vector<TraceEvent> copyEvents() const;
+
+private:
+    vector<TraceEvent> events;
+    uint64_t recorded;
+    uint32_t every;
+    uint32_t countdown;
+    uint32_t nextTraceId;
+};
+
+// Chrome/Perfetto trace JSON: per message, spans for queueing, handling and fan-out on
+// the sender's track and one span per recipient on the recipient's track. The events are
+// oldest first, as copyEvents returns them.
+bool ExportChromeTrace(const vector<TraceEvent>& events, const string& path, size_t& messageCount);
+
+// Writes a trace dump on a background thread, so the file I/O does not stall the event
+// loop it is measuring. The loop copies the events and hands them over; a dump asked
+// for while one is still being written is refused rather than queued.
+class TraceDumpWriter {
+public:
+    TraceDumpWriter() : busy(false), finished(false), succeeded(false), messagesWritten(0) {}
+    ~TraceDumpWriter();
+
+    bool writing() const { return busy.load(memory_order_acquire); }
+    bool start(const string& path, vector<TraceEvent>&& events);
+
+    // Once per finished dump: whether it succeeded, how many messages it held and how
+    // long it took.
+    bool takeResult(bool& ok, size_t& messageCount, chrono::steady_clock::duration& elapsed);
+
+private:
+    thread worker;
+    atomic<bool> busy;
+    bool finished;
+    bool succeeded;
+    size_t messagesWritten;
+    chrono::steady_clock::duration writeTime;
+};
+
+#endif //SOCKETSERVER_TRACE_H
@@ -0,0 +1,128 @@
+#include "capture.h"
+#include <cstring>
+
+namespace {
+
+const char CAPTURE_MAGIC[8] = { 'C', 'H', 'A', 'T', 'C', 'A', 'P', '1' };
+const size_t CAPTURE_BUFFER_LIMIT = 64 * 1024;
+
+void appendVarint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+bool readVarint(const string& in, size_t& offset, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && offset < in.size(); shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(in[offset++]);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+}
+
+bool CaptureWriter::open(const string& path) {
+    close();
+    file = fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    buffer.assign(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    records = 0;
+    lastRecordAt = chrono::steady_clock::now();
+    return true;
+}
+
+void CaptureWriter::close() {
+    if (file == nullptr) {
+        return;
+    }
+    flush();
+    fclose(file);
+    file = nullptr;
+}
+
+void CaptureWriter::append(CaptureRecordType type, uint32_t stream, const char* bytes, size_t length) {
+    if (file == nullptr) {
+        return;
+    }
+    auto now = chrono::steady_clock::now();
+    appendVarint(buffer, static_cast<uint64_t>(chrono::duration_cast<chrono::microseconds>(now - lastRecordAt).count()));
+    lastRecordAt = now;
+    buffer.push_back(static_cast<char>(type));
+    appendVarint(buffer, stream);
+    if (type == CAPTURE_DATA) {
+        appendVarint(buffer, length);
+        buffer.append(bytes, length);
+    }
+    records++;
+    if (buffer.size() >= CAPTURE_BUFFER_LIMIT) {
+        flush();
+    }
+}
+
+void CaptureWriter::flush() {
+    if (file == nullptr || buffer.empty()) {
+        return;
+    }
+    fwrite(buffer.data(), 1, buffer.size(), file);
+    fflush(file);
+    buffer.clear();
+}
+
+bool ReadCaptureFile(const string& path, vector<CaptureRecord>& records, string& error) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        error = "cannot open";
+        return false;
+    }
+    string contents;
+    char chunk[64 * 1024];
+    size_t bytesRead;
+    while ((bytesRead = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        contents.append(chunk, bytesRead);
+    }
+    fclose(file);
+
+    if (contents.size() < sizeof(CAPTURE_MAGIC) || memcmp(contents.data(), CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0) {
+        error = "not a capture file";
+        return false;
+    }
+
+    size_t offset = sizeof(CAPTURE_MAGIC);
+    uint64_t at = 0;
+    while (offset < contents.size()) {
+        uint64_t delta, stream, length = 0;
+        if (!readVarint(contents, offset, delta) || offset >= contents.size()) {
+            break;
+        }
+        uint8_t type = static_cast<uint8_t>(contents[offset++]);
+        if (!readVarint(contents, offset, stream)) {
+            break;
+        }
+        if (type < CAPTURE_CONNECT || type > CAPTURE_DISCONNECT) {
+            error = "unknown record type at offset " + to_string(offset);
+            return false;
+        }
+        if (type == CAPTURE_DATA && (!readVarint(contents, offset, length) || length > contents.size() - offset)) {
+            break;
+        }
+
+        at += delta;
+        CaptureRecord record;
+        record.type = static_cast<CaptureRecordType>(type);
+        record.stream = static_cast<uint32_t>(stream);
+        record.atMicroseconds = at;
+        record.data.assign(contents, offset, length);
+        offset += length;
+        records.push_back(move(record));
+    }
+    return true;
+}
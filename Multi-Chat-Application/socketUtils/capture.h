@@ -0,0 +1,61 @@
+#ifndef SOCKETUTIL_CAPTURE_H
+#define SOCKETUTIL_CAPTURE_H
+
+#include "socketutil.h"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+// Traffic captures: what clients sent a server, connection by connection, with timing,
+// so the same traffic can be replayed against another build (ChatReplay).
+//
+// File layout: the magic "CHATCAP1", then records. Every record is a varint of
+// microseconds since the previous record, a type byte and a varint stream id; DATA
+// records add a varint length and the bytes exactly as recv() returned them. A stream
+// id names one connection from its CONNECT to its DISCONNECT and may be reused after.
+enum CaptureRecordType : uint8_t {
+    CAPTURE_CONNECT = 1,
+    CAPTURE_DATA = 2,
+    CAPTURE_DISCONNECT = 3
+};
+
+struct CaptureRecord {
+    CaptureRecordType type;
+    uint32_t stream;
+    uint64_t atMicroseconds;  // since the start of the capture
+    string data;
+};
+
+// Appends records to a capture file through a memory buffer. The owner calls flush()
+// now and then so an idle server does not sit on unwritten records.
+class CaptureWriter {
+public:
+    CaptureWriter() : file(nullptr), records(0) {}
+    ~CaptureWriter() { close(); }
+
+    bool open(const string& path);
+    void close();
+    bool isOpen() const { return file != nullptr; }
+
+    void connect(uint32_t stream) { append(CAPTURE_CONNECT, stream, nullptr, 0); }
+    void data(uint32_t stream, const char* bytes, size_t length) { append(CAPTURE_DATA, stream, bytes, length); }
+    void disconnect(uint32_t stream) { append(CAPTURE_DISCONNECT, stream, nullptr, 0); }
+
+    size_t bufferedBytes() const { return buffer.size(); }
+    uint64_t recordCount() const { return records; }
+    void flush();
+
+private:
+    void append(CaptureRecordType type, uint32_t stream, const char* bytes, size_t length);
+
+    FILE* file;
+    string buffer;
+    uint64_t records;
+    chrono::steady_clock::time_point lastRecordAt;
+};
+
+// Reads a whole capture. False, with the reason, if the file is not a capture; a
+// truncated last record (a capture cut off by a crash) is dropped silently.
+bool ReadCaptureFile(const string& path, vector<CaptureRecord>& records, string& error);
+
+#endif //SOCKETUTIL_CAPTURE_H
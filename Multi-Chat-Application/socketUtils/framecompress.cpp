@@ -0,0 +1,101 @@
+#include "framecompress.h"
+
+namespace {
+
+// Most common last: where a four-byte prefix occurs twice, matches are looked up at the
+// later occurrence. The server lines are copied from server.cpp; the rest are everyday
+// chat words, each with the spaces around it.
+const char CHAT_DICTIONARY_TEXT[] =
+    "SEARCH_END:SEARCH_RESULT:ROOM_LIST:TOPIC:DM_SENT:DM_FROM:ROOM_LEFT:"
+    "INFO: You fell behind; messages in room ' were skipped.\n"
+    "ERROR: Unknown command.\nERROR: Room '' does not exist.\nERROR: User '"
+    "INFO: The server is busy; lobby chat is paused. Rooms still work.\n"
+    "Room '': +0 joined, -0 left in the last 5 seconds.\n"
+    "NICK_ACCEPTED\nSESSION:RESUMED:ROOM_JOINED:ROOM_INFO:"
+    " please  thank you  thanks  sorry  maybe  never  again  other  first  still  right  where  when "
+    " because  something  anyone  everyone  people  today  tomorrow  tonight  morning  working  looking "
+    " going  doing  getting  time  good  great  nice  cool  sure  okay  yeah  haha  lol  how  why  who "
+    " I'm  I'll  I've  don't  can't  didn't  doesn't  isn't  it's  that's  there's  what's  you're "
+    " would  could  should  about  there  their  think  know  just  like  have  with  what  this  that "
+    " your  from  they  will  then  them  been  were  some  here  well  back  want  need  also  only "
+    " the  and  for  you  not  but  are  was  all  can  out  get  one  now  see  yes  no  is  in  it  to "
+    "USER_LIST:0:HISTORY:' has left room '' has joined room ''.\nSEQ:";
+
+void appendVarint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+// PARTIAL when the input ends inside the varint, INVALID when it runs too long.
+CompressedFrameStatus readVarint(string_view in, size_t& offset, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (offset == in.size()) {
+            return COMPRESSED_FRAME_PARTIAL;
+        }
+        uint8_t byte = static_cast<uint8_t>(in[offset++]);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return COMPRESSED_FRAME_COMPLETE;
+        }
+    }
+    return COMPRESSED_FRAME_INVALID;
+}
+
+}
+
+const LzDictionary& ChatDictionary() {
+    static const LzDictionary dictionary(string(CHAT_DICTIONARY_TEXT, sizeof(CHAT_DICTIONARY_TEXT) - 1));
+    return dictionary;
+}
+
+bool CompressFrame(string_view lines, string& output) {
+    string block;
+    LzCompress(lines, block, &ChatDictionary());
+
+    size_t start = output.size();
+    output.push_back(COMPRESSED_FRAME_MARKER);
+    appendVarint(output, lines.size());
+    appendVarint(output, block.size());
+    if (output.size() - start + block.size() >= lines.size()) {
+        output.resize(start);
+        return false;
+    }
+    output += block;
+    return true;
+}
+
+CompressedFrameStatus ReadCompressedFrame(string_view input, size_t& consumed, string& lines) {
+    size_t offset = 1;
+    uint64_t rawLength, blockLength;
+    CompressedFrameStatus status = readVarint(input, offset, rawLength);
+    if (status == COMPRESSED_FRAME_COMPLETE) {
+        status = readVarint(input, offset, blockLength);
+    }
+    if (status != COMPRESSED_FRAME_COMPLETE) {
+        return status;
+    }
+    if (rawLength > MAX_COMPRESSED_FRAME_LINES_BYTES || blockLength > rawLength + rawLength / 255 + 16) {
+        return COMPRESSED_FRAME_INVALID;
+    }
+    if (input.size() - offset < blockLength) {
+        return COMPRESSED_FRAME_PARTIAL;
+    }
+    if (!LzDecompress(input.substr(offset, blockLength), rawLength, lines, &ChatDictionary())) {
+        return COMPRESSED_FRAME_INVALID;
+    }
+    consumed = offset + blockLength;
+    return COMPRESSED_FRAME_COMPLETE;
+}
+
+size_t CompressedFrameSize(string_view input) {
+    size_t offset = 1;
+    uint64_t rawLength, blockLength;
+    if (readVarint(input, offset, rawLength) != COMPRESSED_FRAME_COMPLETE || readVarint(input, offset, blockLength) != COMPRESSED_FRAME_COMPLETE) {
+        return 0;
+    }
+    return offset + blockLength;
+}
@@ -0,0 +1,50 @@
+#ifndef SOCKETUTIL_FRAMECOMPRESS_H
+#define SOCKETUTIL_FRAMECOMPRESS_H
+
+#include "lz.h"
+#include "socketutil.h"
+#include <cstdint>
+#include <string_view>
+
+// Compressed server output, for clients that asked for it with COMPRESS <codec> before
+// their nickname (see protocol.h). Every line the server sends starts with a frame tag,
+// so a line starting with COMPRESSED_FRAME_MARKER is a compressed frame instead: the
+// marker, the decompressed length and the compressed length as varints, then an LZ
+// block (lz.h) compressed against the built-in chat dictionary. It decompresses to one
+// or more whole lines, newlines included. Nothing is compressed towards the server.
+const char COMPRESSED_FRAME_MARKER = '\x01';
+
+// The codec name covers the dictionary: changing a byte of it needs a new name.
+const char* const CHAT_COMPRESSION_CODEC = "lz-chat1";
+
+// Server output shorter than this goes out as it is. Below it the frame header eats
+// most of what the dictionary saves, and the CPU is better spent elsewhere.
+const size_t DEFAULT_COMPRESSION_THRESHOLD = 40;
+
+// Frames claiming to decompress to more than this are rejected as malformed.
+const size_t MAX_COMPRESSED_FRAME_LINES_BYTES = 1024 * 1024;
+
+// Protocol tags, server boilerplate and common chat words, the text a short line most
+// likely has in common with lines that came before it.
+const LzDictionary& ChatDictionary();
+
+// Appends lines as one compressed frame. False, with output untouched, if the frame
+// would not be smaller than the lines are.
+bool CompressFrame(string_view lines, string& output);
+
+enum CompressedFrameStatus : uint8_t {
+    COMPRESSED_FRAME_COMPLETE = 0,
+    COMPRESSED_FRAME_PARTIAL = 1,
+    COMPRESSED_FRAME_INVALID = 2
+};
+
+// Reads the compressed frame input starts with, marker included. When it is complete,
+// consumed is its size on the wire and its lines are appended to lines; PARTIAL means
+// more bytes are needed.
+CompressedFrameStatus ReadCompressedFrame(string_view input, size_t& consumed, string& lines);
+
+// The size on the wire of the compressed frame input starts with, read from its header
+// without decompressing it. 0 if the header is incomplete or malformed.
+size_t CompressedFrameSize(string_view input);
+
+#endif //SOCKETUTIL_FRAMECOMPRESS_H
@@ -0,0 +1,151 @@
+#include "linescan.h"
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__)
+#define LINESCAN_AVX2 1
+#include <immintrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LINESCAN_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace {
+
+inline bool isLineSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+inline unsigned lowestSetBit(uint32_t mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+inline unsigned highestSetBit(uint32_t mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse(&index, mask);
+    return index;
+#else
+    return 31u - static_cast<unsigned>(__builtin_clz(mask));
+#endif
+}
+
+#if LINESCAN_SSE2
+// One bit per byte of the 16 at p that is not line whitespace.
+inline uint32_t contentMask(const char* p) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i spaces = _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(block, _mm_set1_epi8('\t')));
+    __m128i breaks = _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(block, _mm_set1_epi8('\n')));
+    return ~static_cast<uint32_t>(_mm_movemask_epi8(_mm_or_si128(spaces, breaks))) & 0xFFFFu;
+}
+#endif
+
+const char* skipLeadingSpace(const char* begin, const char* end) {
+#if LINESCAN_SSE2
+    while (end - begin >= 16) {
+        uint32_t content = contentMask(begin);
+        if (content != 0) {
+            return begin + lowestSetBit(content);
+        }
+        begin += 16;
+    }
+#endif
+    while (begin < end && isLineSpace(*begin)) {
+        ++begin;
+    }
+    return begin;
+}
+
+const char* skipTrailingSpace(const char* begin, const char* end) {
+#if LINESCAN_SSE2
+    while (end - begin >= 16) {
+        uint32_t content = contentMask(end - 16);
+        if (content != 0) {
+            return end - 16 + highestSetBit(content) + 1;
+        }
+        end -= 16;
+    }
+#endif
+    while (end > begin && isLineSpace(end[-1])) {
+        --end;
+    }
+    return end;
+}
+
+}  // namespace
+
+const char* FindNewline(const char* begin, const char* end) {
+#if LINESCAN_AVX2
+    const __m256i newline32 = _mm256_set1_epi8('\n');
+    while (end - begin >= 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+        uint32_t hits = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline32)));
+        if (hits != 0) {
+            return begin + lowestSetBit(hits);
+        }
+        begin += 32;
+    }
+#endif
+#if LINESCAN_SSE2
+    const __m128i newline16 = _mm_set1_epi8('\n');
+    while (end - begin >= 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+        uint32_t hits = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline16)));
+        if (hits != 0) {
+            return begin + lowestSetBit(hits);
+        }
+        begin += 16;
+    }
+#endif
+    if (begin >= end) {
+        return nullptr;
+    }
+    return static_cast<const char*>(memchr(begin, '\n', static_cast<size_t>(end - begin)));
+}
+
+string_view TrimLine(string_view line) {
+    const char* begin = line.data();
+    const char* end = begin + line.size();
+
+    // Most chat lines have at most a '\r' to strip, so check the ends before
+    // handing runs of padding to the vector loops.
+    if (begin < end && isLineSpace(*begin)) {
+        begin = skipLeadingSpace(begin, end);
+    }
+    if (end > begin && isLineSpace(end[-1])) {
+        end = skipTrailingSpace(begin, end);
+    }
+    return string_view(begin, static_cast<size_t>(end - begin));
+}
+
+bool LineScanner::next(string_view& line) {
+    const char* newline = FindNewline(cursor, end);
+    if (newline == nullptr) {
+        return false;
+    }
+    line = TrimLine(string_view(cursor, static_cast<size_t>(newline - cursor)));
+    cursor = newline + 1;
+    return true;
+}
+
+const char* LineScanInstructionSet() {
+#if LINESCAN_AVX2
+    return "AVX2";
+#elif LINESCAN_SSE2
+    return "SSE2";
+#else
+    return "scalar";
+#endif
+}
@@ -0,0 +1,37 @@
+#ifndef SOCKETUTIL_LINESCAN_H
+#define SOCKETUTIL_LINESCAN_H
+
+#include "socketutil.h"
+#include <cstddef>
+#include <string_view>
+
+// Byte scanning for the newline text protocol. The scanners use AVX2 when the build
+// targets it (CHAT_ENABLE_AVX2), SSE2 on any x86/x64 build, and plain loops otherwise.
+// Nothing here copies: every result is a view into the caller's buffer.
+
+// First '\n' in [begin, end), or nullptr.
+const char* FindNewline(const char* begin, const char* end);
+
+// The line with leading and trailing spaces, tabs, '\r' and '\n' removed.
+string_view TrimLine(string_view line);
+
+// Splits a receive buffer into complete lines. Each line is returned without its
+// '\n' and trimmed; consumed() is how far complete lines reach, so the caller can
+// drop that prefix and keep the partial tail for the next read.
+class LineScanner {
+public:
+    LineScanner(const char* data, size_t length) : cursor(data), start(data), end(data + length) {}
+
+    bool next(string_view& line);
+    size_t consumed() const { return static_cast<size_t>(cursor - start); }
+
+private:
+    const char* cursor;
+    const char* start;
+    const char* end;
+};
+
+// Name of the instruction set the scanners were compiled for, for logs and benchmarks.
+const char* LineScanInstructionSet();
+
+#endif //SOCKETUTIL_LINESCAN_H
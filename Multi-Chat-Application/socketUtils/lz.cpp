@@ -0,0 +1,183 @@
+#include "lz.h"
+#include <cstdint>
+#include <cstring>
+
+namespace {
+
+const size_t MIN_MATCH = 4;
+const size_t MAX_OFFSET = 65535;
+const int HASH_BITS = 12;
+// Blocks shorter than this hash into a table of SMALL_HASH_BITS, so clearing the table
+// does not cost more than compressing a chat line.
+const size_t SMALL_BLOCK = 1024;
+const int SMALL_HASH_BITS = 9;
+// Matches may not start in the last bytes of a block, so the decoder always ends on
+// literals, as in LZ4.
+const size_t LAST_LITERALS = 5;
+
+uint32_t read32(const char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+uint32_t hashAt(const char* p) {
+    return (read32(p) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+void appendLength(string& output, size_t length) {
+    while (length >= 255) {
+        output.push_back(static_cast<char>(255));
+        length -= 255;
+    }
+    output.push_back(static_cast<char>(length));
+}
+
+void appendSequence(string& output, const char* literals, size_t literalCount, size_t offset, size_t matchLength) {
+    size_t matchCode = matchLength == 0 ? 0 : matchLength - MIN_MATCH;
+    uint8_t token = static_cast<uint8_t>((min<size_t>(literalCount, 15) << 4) | min<size_t>(matchCode, 15));
+    output.push_back(static_cast<char>(token));
+    if (literalCount >= 15) {
+        appendLength(output, literalCount - 15);
+    }
+    output.append(literals, literalCount);
+    if (matchLength == 0) {
+        return;
+    }
+    output.push_back(static_cast<char>(offset & 0xFF));
+    output.push_back(static_cast<char>(offset >> 8));
+    if (matchCode >= 15) {
+        appendLength(output, matchCode - 15);
+    }
+}
+
+bool readLength(const char*& in, const char* end, size_t& length) {
+    uint8_t byte;
+    do {
+        if (in == end) {
+            return false;
+        }
+        byte = static_cast<uint8_t>(*in++);
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+}
+
+LzDictionary::LzDictionary(string text) : content(move(text)), table(size_t(1) << HASH_BITS, UINT32_MAX) {
+    if (content.size() > MAX_OFFSET) {
+        content.erase(0, content.size() - MAX_OFFSET);
+    }
+    for (size_t position = 0; position + MIN_MATCH <= content.size(); ++position) {
+        table[hashAt(content.data() + position)] = static_cast<uint32_t>(position);
+    }
+}
+
+void LzCompress(string_view input, string& output, const LzDictionary* dictionary) {
+    const char* base = input.data();
+    size_t size = input.size();
+    size_t literalStart = 0;
+    if (size >= MIN_MATCH + LAST_LITERALS) {
+        int tableShift = size < SMALL_BLOCK ? HASH_BITS - SMALL_HASH_BITS : 0;
+        uint32_t table[1 << HASH_BITS];
+        memset(table, 0xFF, sizeof(table) >> tableShift);
+        string_view prefix = dictionary == nullptr ? string_view() : dictionary->text();
+        size_t matchLimit = size - LAST_LITERALS;
+        size_t position = 0;
+        while (position + MIN_MATCH <= matchLimit) {
+            uint32_t hash = hashAt(base + position);
+            uint32_t candidate = table[hash >> tableShift];
+            table[hash >> tableShift] = static_cast<uint32_t>(position);
+
+            // The block's own history first; failing that, the dictionary.
+            size_t offset = 0;
+            size_t length = 0;
+            if (candidate != UINT32_MAX && position - candidate <= MAX_OFFSET && read32(base + candidate) == read32(base + position)) {
+                offset = position - candidate;
+                length = MIN_MATCH;
+                while (position + length < matchLimit && base[candidate + length] == base[position + length]) {
+                    ++length;
+                }
+            } else if (dictionary != nullptr) {
+                uint32_t entry = dictionary->position(hash);
+                if (entry != UINT32_MAX && prefix.size() - entry + position <= MAX_OFFSET && read32(prefix.data() + entry) == read32(base + position)) {
+                    offset = prefix.size() - entry + position;
+                    length = MIN_MATCH;
+                    while (position + length < matchLimit && entry + length < prefix.size() && prefix[entry + length] == base[position + length]) {
+                        ++length;
+                    }
+                }
+            }
+            if (length == 0) {
+                ++position;
+                continue;
+            }
+
+            appendSequence(output, base + literalStart, position - literalStart, offset, length);
+            position += length;
+            literalStart = position;
+        }
+    }
+    appendSequence(output, base + literalStart, size - literalStart, 0, 0);
+}
+
+bool LzDecompress(string_view input, size_t originalSize, string& output, const LzDictionary* dictionary) {
+    string_view prefix = dictionary == nullptr ? string_view() : dictionary->text();
+    size_t start = output.size();
+    output.resize(start + originalSize);
+    char* outStart = output.data() + start;
+    char* out = outStart;
+    char* outEnd = out + originalSize;
+    const char* in = input.data();
+    const char* end = in + input.size();
+
+    while (in < end) {
+        uint8_t token = static_cast<uint8_t>(*in++);
+        size_t literalCount = token >> 4;
+        if (literalCount == 15 && !readLength(in, end, literalCount)) {
+            break;
+        }
+        if (literalCount > static_cast<size_t>(end - in) || literalCount > static_cast<size_t>(outEnd - out)) {
+            break;
+        }
+        memcpy(out, in, literalCount);
+        in += literalCount;
+        out += literalCount;
+        if (in == end) {
+            if (out == outEnd) {
+                return true;
+            }
+            break;
+        }
+
+        if (end - in < 2) {
+            break;
+        }
+        size_t offset = static_cast<uint8_t>(in[0]) | (static_cast<size_t>(static_cast<uint8_t>(in[1])) << 8);
+        in += 2;
+        size_t matchLength = token & 0x0F;
+        if (matchLength == 15 && !readLength(in, end, matchLength)) {
+            break;
+        }
+        matchLength += MIN_MATCH;
+        size_t produced = static_cast<size_t>(out - outStart);
+        if (offset == 0 || offset > produced + prefix.size() || matchLength > static_cast<size_t>(outEnd - out)) {
+            break;
+        }
+        // A match reaching back past the block starts in the dictionary and may run on
+        // into the block's first bytes.
+        size_t fromDictionary = 0;
+        if (offset > produced) {
+            fromDictionary = min(matchLength, offset - produced);
+            memcpy(out, prefix.data() + prefix.size() - (offset - produced), fromDictionary);
+        }
+        // Byte by byte: a match may overlap the bytes it is producing.
+        for (size_t i = fromDictionary; i < matchLength; ++i) {
+            out[i] = outStart[produced + i - offset];
+        }
+        out += matchLength;
+    }
+    output.resize(start);
+    return false;
+}
@@ -0,0 +1,39 @@
+#ifndef SOCKETUTIL_LZ_H
+#define SOCKETUTIL_LZ_H
+
+#include "socketutil.h"
+#include <cstdint>
+#include <string_view>
+
+// A small LZ77 block codec in the LZ4 block layout: each sequence is a token byte
+// (literal count in the high nibble, match length - 4 in the low one, 15 meaning more
+// length bytes follow), the literals, and a two-byte little-endian match offset. The
+// last sequence has literals only. Matches are found greedily through a hash of the
+// next four bytes, so compressing costs a few ns per byte and decompressing is mostly
+// memcpy. Ratios are modest; the point is to be cheap enough for the event loop.
+
+// Text both ends know in advance. Matches may reach back into it as if it came right
+// before the block, which is what gives a 60-byte chat line anything to match against.
+// The hash table over it is built once here, not on every block. Up to 64 KB; a block
+// compressed with a dictionary can only be decompressed with the same one.
+class LzDictionary {
+public:
+    explicit LzDictionary(string text);
+
+    string_view text() const { return content; }
+    // Last position in the text whose next four bytes hash to hash, or UINT32_MAX.
+    uint32_t position(uint32_t hash) const { return table[hash]; }
+
+private:
+    string content;
+    vector<uint32_t> table;
+};
+
+// Appends the compressed form of input to output.
+void LzCompress(string_view input, string& output, const LzDictionary* dictionary = nullptr);
+
+// Appends the decompressed block to output. False if the block is malformed or does
+// not decompress to exactly originalSize bytes.
+bool LzDecompress(string_view input, size_t originalSize, string& output, const LzDictionary* dictionary = nullptr);
+
+#endif //SOCKETUTIL_LZ_H
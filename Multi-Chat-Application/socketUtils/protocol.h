@@ -0,0 +1,232 @@
+#ifndef SOCKETUTIL_PROTOCOL_H
+#define SOCKETUTIL_PROTOCOL_H
+
+#include "socketutil.h"
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+
+// The chat protocol, shared by client and server. One line per frame type: the enum
+// name, the tag as it appears on the wire, and what follows the tag (':' or ' ' start a
+// payload, '\0' means the frame is just the tag). Adding a frame type starts here; the
+// classifier and both dispatch tables are generated from this list at compile time.
+#define CHAT_PROTOCOL_FRAMES(X)                          \
+    X(NICK,            "NICK",            ' ')           \
+    X(RESUME,          "RESUME",          ' ')           \
+    X(SHM_OFFER,       "SHM_OFFER",       '\0')          \
+    X(SHM_ATTACH,      "SHM_ATTACH",      ' ')           \
+    X(COMPRESS,        "COMPRESS",        ' ')           \
+    X(COMMAND_JOIN,    "COMMAND:JOIN",    ':')           \
+    X(COMMAND_CREATE,  "COMMAND:CREATE",  ':')           \
+    X(COMMAND_TOPIC,   "COMMAND:TOPIC",   ':')           \
+    X(COMMAND_ROOMS,   "COMMAND:ROOMS",   '\0')          \
+    X(COMMAND_MSG,     "COMMAND:MSG",     ':')           \
+    X(COMMAND_LEAVE,   "COMMAND:LEAVE",   '\0')          \
+    X(COMMAND_PROBE,   "COMMAND:PROBE",   ':')           \
+    X(COMMAND_QUIT,    "COMMAND:QUIT",    '\0')          \
+    X(COMMAND_ACK,     "COMMAND:ACK",     ':')           \
+    X(COMMAND_TRACE,   "COMMAND:TRACE",   ':')           \
+    X(COMMAND_SEARCH,  "COMMAND:SEARCH",  ':')           \
+    X(NICK_REQUIRED,   "NICK_REQUIRED",   '\0')          \
+    X(NICK_REJECTED,   "NICK_REJECTED",   ':')           \
+    X(NICK_ACCEPTED,   "NICK_ACCEPTED",   '\0')          \
+    X(SESSION,         "SESSION",         ':')           \
+    X(RESUMED,         "RESUMED",         ':')           \
+    X(RESUME_REJECTED, "RESUME_REJECTED", ':')           \
+    X(SHM_NONCE,       "SHM_NONCE",       ':')           \
+    X(SHM_ATTACHED,    "SHM_ATTACHED",    '\0')          \
+    X(COMPRESSING,     "COMPRESSING",     ':')           \
+    X(SEQ,             "SEQ",             ':')           \
+    X(ROOM_JOINED,     "ROOM_JOINED",     ':')           \
+    X(ROOM_LEFT,       "ROOM_LEFT",       ':')           \
+    X(ROOM_INFO,       "ROOM_INFO",       ':')           \
+    X(ROOM_LIST,       "ROOM_LIST",       ':')           \
+    X(USER_LIST,       "USER_LIST",       ':')           \
+    X(TOPIC,           "TOPIC",           ':')           \
+    X(DM_FROM,         "DM_FROM",         ':')           \
+    X(DM_SENT,         "DM_SENT",         ':')           \
+    X(PROBE,           "PROBE",           ':')           \
+    X(SEARCH_RESULT,   "SEARCH_RESULT",   ':')           \
+    X(HISTORY,         "HISTORY",         ':')           \
+    X(SEARCH_END,      "SEARCH_END",      ':')           \
+    X(SERVER_BUSY,     "SERVER_BUSY",     ':')           \
+    X(SERVER_INFO,     "INFO",            ':')           \
+    X(SERVER_ERROR,    "ERROR",           ':')
+
+enum FrameKind : uint8_t {
+#define CHAT_PROTOCOL_ENUM(kind, tag, separator) FRAME_##kind,
+    CHAT_PROTOCOL_FRAMES(CHAT_PROTOCOL_ENUM)
+#undef CHAT_PROTOCOL_ENUM
+    FRAME_TEXT,
+    FRAME_KIND_COUNT
+};
+
+struct Frame {
+    FrameKind kind;
+    string_view payload;
+};
+
+// Room messages arrive wrapped as SEQ:<sequence>:<line>, numbered per room. Clients
+// acknowledge them cumulatively with COMMAND:ACK:<next sequence>, batched. A client
+// that reconnects sends RESUME <token> [<next sequence>] instead of NICK and is replayed
+// whatever it missed, from its last acknowledgement if it sends no sequence.
+// A server that cannot take a connection sends SERVER_BUSY:<retry seconds>:<reason>
+// instead of NICK_REQUIRED and closes it; clients wait at least that long to retry.
+// A client connected through a loopback or unix: listener may send SHM_OFFER before its
+// nickname. The reply, SHM_NONCE:<nonce>, goes into the segment's header, and then
+// SHM_ATTACH <segment> names it; after SHM_ATTACHED every line travels through
+// shared-memory rings (see sharedring.h). ERROR at either step means staying put.
+// A client may also send COMPRESS <codec> before its nickname. After the reply,
+// COMPRESSING:<codec>:<threshold bytes>, server output of at least that size may arrive
+// as compressed frames (see framecompress.h); ERROR means it all stays plain.
+// COMMAND:TRACE is only answered on admin connections (ChatServer --admin-listen).
+// COMMAND:SEARCH:<room>:<terms>[:BEFORE=<sequence>] finds the room's messages holding
+// every term, newest first, as SEARCH_RESULT:<room>:<sequence>:<line> frames and then
+// SEARCH_END:<room>:<count>:<before sequence for the next page, empty on the last>.
+// After ROOM_JOINED and USER_LIST, the room's latest chat lines follow, oldest first,
+// as HISTORY:<room>:<sequence>:<line>. They are not acknowledged.
+
+// Every client is in the lobby after its nickname is accepted; it is the room whose
+// name appears in USER_LIST frames before any ROOM_JOINED.
+const char* const LOBBY_ROOM_NAME = "0";
+
+// Ends a COMMAND:SEARCH that asks for a later page, followed by the sequence SEARCH_END
+// gave. Search terms may contain colons and numbers, so the cursor is marked.
+const char* const SEARCH_BEFORE_MARKER = ":BEFORE=";
+
+namespace protocol_detail {
+
+struct FrameSpec {
+    string_view tag;
+    char separator;
+};
+
+constexpr FrameSpec FRAME_SPECS[] = {
+#define CHAT_PROTOCOL_SPEC(kind, tag, separator) { tag, separator },
+    CHAT_PROTOCOL_FRAMES(CHAT_PROTOCOL_SPEC)
+#undef CHAT_PROTOCOL_SPEC
+};
+
+constexpr size_t TAG_SLOT_COUNT = 128;
+constexpr string_view COMMAND_NAMESPACE = "COMMAND";
+
+constexpr uint32_t hashStep(uint32_t hash, char c) {
+    return (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+}
+
+constexpr uint32_t hashStart(uint32_t seed) {
+    return 2166136261u ^ seed;
+}
+
+constexpr size_t hashSlot(uint32_t hash) {
+    return (hash ^ (hash >> 15)) & (TAG_SLOT_COUNT - 1);
+}
+
+constexpr size_t tagSlot(string_view tag, uint32_t seed) {
+    uint32_t hash = hashStart(seed);
+    for (char c : tag) {
+        hash = hashStep(hash, c);
+    }
+    return hashSlot(hash);
+}
+
+constexpr bool isPerfectSeed(uint32_t seed) {
+    bool used[TAG_SLOT_COUNT] = {};
+    for (const FrameSpec& spec : FRAME_SPECS) {
+        size_t slot = tagSlot(spec.tag, seed);
+        if (used[slot]) {
+            return false;
+        }
+        used[slot] = true;
+    }
+    return true;
+}
+
+constexpr uint32_t findPerfectSeed() {
+    for (uint32_t seed = 0; seed < 4096; ++seed) {
+        if (isPerfectSeed(seed)) {
+            return seed;
+        }
+    }
+    return 0xFFFFFFFFu;
+}
+
+constexpr uint32_t TAG_SEED = findPerfectSeed();
+static_assert(TAG_SEED != 0xFFFFFFFFu, "no collision-free seed for the protocol tag table; grow TAG_SLOT_COUNT");
+
+constexpr array<uint8_t, TAG_SLOT_COUNT> buildTagSlots() {
+    array<uint8_t, TAG_SLOT_COUNT> slots = {};
+    for (size_t i = 0; i < TAG_SLOT_COUNT; ++i) {
+        slots[i] = FRAME_TEXT;
+    }
+    for (size_t kind = 0; kind < FRAME_TEXT; ++kind) {
+        slots[tagSlot(FRAME_SPECS[kind].tag, TAG_SEED)] = static_cast<uint8_t>(kind);
+    }
+    return slots;
+}
+
+constexpr array<uint8_t, TAG_SLOT_COUNT> TAG_SLOTS = buildTagSlots();
+
+constexpr bool isTagChar(char c) {
+    return (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+}  // namespace protocol_detail
+
+// Classifies one line (without its trailing newline) in a single pass over the tag and
+// one table probe. The payload views into the line; nothing is copied or allocated.
+// Lines that do not start with a known tag are FRAME_TEXT with the whole line as payload.
+constexpr Frame classifyFrame(string_view line) {
+    using namespace protocol_detail;
+
+    uint32_t hash = hashStart(TAG_SEED);
+    size_t length = 0;
+    while (length < line.size() && isTagChar(line[length])) {
+        hash = hashStep(hash, line[length++]);
+    }
+    if (length == COMMAND_NAMESPACE.size() && length < line.size() && line[length] == ':' &&
+        line.substr(0, length) == COMMAND_NAMESPACE) {
+        hash = hashStep(hash, line[length++]);
+        while (length < line.size() && isTagChar(line[length])) {
+            hash = hashStep(hash, line[length++]);
+        }
+    }
+
+    Frame text = { FRAME_TEXT, line };
+    if (length == 0) {
+        return text;
+    }
+
+    uint8_t kind = TAG_SLOTS[hashSlot(hash)];
+    if (kind == FRAME_TEXT || FRAME_SPECS[kind].tag != line.substr(0, length)) {
+        return text;
+    }
+
+    char separator = FRAME_SPECS[kind].separator;
+    if (separator == '\0') {
+        return length == line.size() ? Frame{ static_cast<FrameKind>(kind), string_view() } : text;
+    }
+    if (length < line.size() && line[length] == separator) {
+        return Frame{ static_cast<FrameKind>(kind), line.substr(length + 1) };
+    }
+    return text;
+}
+
+constexpr string_view frameTag(FrameKind kind) {
+    return kind < FRAME_TEXT ? protocol_detail::FRAME_SPECS[kind].tag : string_view();
+}
+
+// Builds a table of Handler<Kind>::handle for every FrameKind. Each side declares a
+// primary Handler template for frames it does not expect and specializes the rest.
+template <template <FrameKind> class Handler, size_t... Kinds>
+constexpr auto makeFrameDispatchTable(index_sequence<Kinds...>) {
+    return array<decltype(&Handler<FRAME_TEXT>::handle), FRAME_KIND_COUNT>{ { &Handler<static_cast<FrameKind>(Kinds)>::handle... } };
+}
+
+template <template <FrameKind> class Handler>
+constexpr auto makeFrameDispatchTable() {
+    return makeFrameDispatchTable<Handler>(make_index_sequence<FRAME_KIND_COUNT>());
+}
+
+#endif //SOCKETUTIL_PROTOCOL_H
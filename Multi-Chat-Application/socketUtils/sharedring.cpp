@@ -0,0 +1,182 @@
+#include "sharedring.h"
+#include <cctype>
+#include <cstring>
+#include <new>
+#include <random>
+
+namespace {
+
+const size_t RING_STRIDE = sizeof(SharedRingHeader) + SHARED_RING_CAPACITY;
+const size_t SEGMENT_SIZE = sizeof(SharedChannelHeader) + 2 * RING_STRIDE;
+
+}
+
+// A peer that scribbles over the header can only confuse its own channel: counts that
+// do not make sense read as an empty (or full) ring, and every index is masked.
+size_t SharedRing::write(const char* bytes, size_t length) {
+    uint64_t head = header->head.load(memory_order_relaxed);
+    uint64_t used = head - header->tail.load(memory_order_acquire);
+    if (used >= SHARED_RING_CAPACITY) {
+        return 0;
+    }
+    size_t count = min<size_t>(length, SHARED_RING_CAPACITY - used);
+    size_t offset = head & (SHARED_RING_CAPACITY - 1);
+    size_t first = min(count, SHARED_RING_CAPACITY - offset);
+    memcpy(data + offset, bytes, first);
+    memcpy(data, bytes + first, count - first);
+    header->head.store(head + count, memory_order_seq_cst);
+    return count;
+}
+
+size_t SharedRing::read(char* bytes, size_t capacity) {
+    uint64_t tail = header->tail.load(memory_order_relaxed);
+    uint64_t available = header->head.load(memory_order_acquire) - tail;
+    if (available == 0 || available > SHARED_RING_CAPACITY) {
+        return 0;
+    }
+    size_t count = min<size_t>(capacity, available);
+    size_t offset = tail & (SHARED_RING_CAPACITY - 1);
+    size_t first = min(count, SHARED_RING_CAPACITY - offset);
+    memcpy(bytes, data + offset, first);
+    memcpy(bytes + first, data, count - first);
+    header->tail.store(tail + count, memory_order_seq_cst);
+    return count;
+}
+
+bool SharedRing::readable() const {
+    uint64_t available = header->head.load(memory_order_seq_cst) - header->tail.load(memory_order_relaxed);
+    return available != 0 && available <= SHARED_RING_CAPACITY;
+}
+
+bool SharedRing::writable() const {
+    return header->head.load(memory_order_relaxed) - header->tail.load(memory_order_seq_cst) < SHARED_RING_CAPACITY;
+}
+
+// The flag store and the re-check are both sequentially consistent, as are the other
+// side's position store and flag exchange, so one of the two always sees the other.
+bool SharedRing::armConsumer() {
+    header->consumerWaiting.store(1, memory_order_seq_cst);
+    if (readable()) {
+        header->consumerWaiting.store(0, memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+bool SharedRing::armProducer() {
+    header->producerWaiting.store(1, memory_order_seq_cst);
+    if (writable()) {
+        header->producerWaiting.store(0, memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+bool SharedRing::takeConsumerWaiting() {
+    return header->consumerWaiting.load(memory_order_seq_cst) != 0 && header->consumerWaiting.exchange(0) != 0;
+}
+
+bool SharedRing::takeProducerWaiting() {
+    return header->producerWaiting.load(memory_order_seq_cst) != 0 && header->producerWaiting.exchange(0) != 0;
+}
+
+SharedChannel::~SharedChannel() {
+    if (view != nullptr) {
+        UnmapViewOfFile(view);
+    }
+    if (mapping != nullptr) {
+        CloseHandle(mapping);
+    }
+}
+
+bool SharedChannel::create(const string& name) {
+    mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, static_cast<DWORD>(static_cast<uint64_t>(SEGMENT_SIZE) >> 32),
+                                 static_cast<DWORD>(SEGMENT_SIZE), name.c_str());
+    if (mapping == nullptr) {
+        return false;
+    }
+    if (GetLastError() == ERROR_ALREADY_EXISTS) {
+        CloseHandle(mapping);
+        mapping = nullptr;
+        return false;
+    }
+    segmentName = name;
+    if (!map()) {
+        return false;
+    }
+    SharedChannelHeader* header = new (view) SharedChannelHeader();
+    header->magic = SHARED_CHANNEL_MAGIC;
+    header->version = SHARED_CHANNEL_VERSION;
+    header->segmentSize = SEGMENT_SIZE;
+    header->nonce.store(0, memory_order_relaxed);
+    new (view + sizeof(SharedChannelHeader)) SharedRingHeader();
+    new (view + sizeof(SharedChannelHeader) + RING_STRIDE) SharedRingHeader();
+    attachRings(false);
+    return true;
+}
+
+void SharedChannel::seal(uint64_t nonce) {
+    reinterpret_cast<SharedChannelHeader*>(view)->nonce.store(nonce, memory_order_release);
+}
+
+bool SharedChannel::open(const string& name, uint64_t nonce) {
+    size_t prefixLength = strlen(SHARED_CHANNEL_PREFIX);
+    if (nonce == 0 || name.rfind(SHARED_CHANNEL_PREFIX, 0) != 0 || name.length() != prefixLength + 16 ||
+        !all_of(name.begin() + prefixLength, name.end(), [](char c) { return isxdigit(static_cast<uint8_t>(c)) != 0; })) {
+        return false;
+    }
+    mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+    if (mapping == nullptr) {
+        return false;
+    }
+    segmentName = name;
+    if (!map()) {
+        return false;
+    }
+    const SharedChannelHeader* header = reinterpret_cast<const SharedChannelHeader*>(view);
+    if (header->magic != SHARED_CHANNEL_MAGIC || header->version != SHARED_CHANNEL_VERSION || header->segmentSize != SEGMENT_SIZE ||
+        header->nonce.load(memory_order_acquire) != nonce) {
+        return false;
+    }
+    attachRings(true);
+    return true;
+}
+
+bool SharedChannel::map() {
+    view = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, SEGMENT_SIZE));
+    if (view == nullptr) {
+        return false;
+    }
+    MEMORY_BASIC_INFORMATION region;
+    return VirtualQuery(view, &region, sizeof(region)) != 0 && region.RegionSize >= SEGMENT_SIZE;
+}
+
+void SharedChannel::attachRings(bool serverEnd) {
+    char* rings = view + sizeof(SharedChannelHeader);
+    serverSide = serverEnd;
+    toServer = SharedRing(reinterpret_cast<SharedRingHeader*>(rings), rings + sizeof(SharedRingHeader));
+    toClient = SharedRing(reinterpret_cast<SharedRingHeader*>(rings + RING_STRIDE), rings + RING_STRIDE + sizeof(SharedRingHeader));
+}
+
+string MakeSharedChannelName() {
+    static mt19937_64 random(random_device{}());
+    char suffix[17];
+    snprintf(suffix, sizeof(suffix), "%016llx", static_cast<unsigned long long>(random()));
+    return SHARED_CHANNEL_PREFIX + string(suffix);
+}
+
+void RingDoorbell(SOCKET socketFD) {
+    char bell = 0;
+    send(socketFD, &bell, 1, 0);
+}
+
+bool DrainDoorbell(SOCKET socketFD) {
+    char scratch[256];
+    while (true) {
+        int bytesReceived = recv(socketFD, scratch, sizeof(scratch), 0);
+        if (bytesReceived > 0) {
+            continue;
+        }
+        return bytesReceived == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK;
+    }
+}
@@ -0,0 +1,108 @@
+#ifndef SOCKETUTIL_SHAREDRING_H
+#define SOCKETUTIL_SHAREDRING_H
+
+#include "socketutil.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Bytes each direction of a shared-memory channel can hold. A power of two.
+const size_t SHARED_RING_CAPACITY = 1024 * 1024;
+
+// Every segment name starts with this; the server opens no other mapping.
+const char* const SHARED_CHANNEL_PREFIX = "Local\\ChatChannel-";
+const uint32_t SHARED_CHANNEL_MAGIC = 0x4D485343;  // "CSHM"
+const uint32_t SHARED_CHANNEL_VERSION = 2;
+
+// At the very start of a segment, ahead of the rings. The client fills it in; the
+// server checks all of it before it writes a byte, so that a name in SHM_ATTACH can
+// only get it to attach to a segment made for this connection.
+struct SharedChannelHeader {
+    alignas(64) uint32_t magic;
+    uint32_t version;
+    uint64_t segmentSize;
+    atomic<uint64_t> nonce;  // from the server's SHM_NONCE; 0 until then
+};
+
+// Control block of one ring, at the start of its part of the mapping. head and tail
+// are byte counts that only grow; the producer owns head, the consumer owns tail, and
+// they sit on separate cache lines so the two sides do not share one.
+struct SharedRingHeader {
+    alignas(64) atomic<uint64_t> head;
+    atomic<uint32_t> producerWaiting;
+    alignas(64) atomic<uint64_t> tail;
+    atomic<uint32_t> consumerWaiting;
+};
+
+// Single-producer, single-consumer byte ring in shared memory. A side that finds
+// nothing to do raises its waiting flag with arm(), re-checks the ring and only then
+// sleeps on the doorbell; the other side rings the doorbell only when it finds the
+// flag raised. While both sides keep up, the channel makes no system calls at all.
+class SharedRing {
+public:
+    SharedRing() : header(nullptr), data(nullptr) {}
+    SharedRing(SharedRingHeader* header, char* data) : header(header), data(data) {}
+
+    // Copies as much as fits, or as much as is there; returns the byte count.
+    size_t write(const char* bytes, size_t length);
+    size_t read(char* bytes, size_t capacity);
+
+    bool readable() const;
+    bool writable() const;
+
+    // Raise the flag before sleeping. Returns true, with the flag lowered again, if the
+    // ring became ready in the meantime and the caller should not sleep after all.
+    bool armConsumer();
+    bool armProducer();
+    // After a write or read: true once if the other side is asleep and needs the doorbell.
+    bool takeConsumerWaiting();
+    bool takeProducerWaiting();
+
+private:
+    SharedRingHeader* header;
+    char* data;
+};
+
+// Two rings in one named, pagefile-backed mapping, after a SharedChannelHeader: client
+// to server, then server to client. The client creates it, writes the nonce the server
+// gave it with seal() and names it in SHM_ATTACH; the server opens it by that name,
+// expecting that nonce. Each side writes to outbound() and reads from inbound().
+class SharedChannel {
+public:
+    SharedChannel() : mapping(nullptr), view(nullptr), serverSide(false) {}
+    ~SharedChannel();
+    SharedChannel(const SharedChannel&) = delete;
+    SharedChannel& operator=(const SharedChannel&) = delete;
+
+    bool create(const string& name);
+    void seal(uint64_t nonce);
+    // False, having written nothing, if the name lacks SHARED_CHANNEL_PREFIX or the
+    // header is not the one this connection's client was asked to write.
+    bool open(const string& name, uint64_t nonce);
+    const string& name() const { return segmentName; }
+
+    SharedRing& inbound() { return serverSide ? toServer : toClient; }
+    SharedRing& outbound() { return serverSide ? toClient : toServer; }
+
+private:
+    bool map();
+    void attachRings(bool serverEnd);
+
+    HANDLE mapping;
+    char* view;
+    bool serverSide;
+    string segmentName;
+    SharedRing toServer;
+    SharedRing toClient;
+};
+
+// A fresh segment name for this process.
+string MakeSharedChannelName();
+
+// Once a channel is attached, the connection's socket is only a doorbell: any bytes on
+// it mean "look at the rings again", and it still reports when the peer goes away.
+void RingDoorbell(SOCKET socketFD);
+// Reads and discards pending doorbell bytes. False once the peer has closed the socket.
+bool DrainDoorbell(SOCKET socketFD);
+
+#endif //SOCKETUTIL_SHAREDRING_H
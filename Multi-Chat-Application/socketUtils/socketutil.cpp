@@ -1,4 +1,6 @@
 #include "socketutil.h"
+#include <cstdlib>
+#include <cstring>
 
 
 SOCKET CreateTCPIPv4Socket() {
@@ -17,4 +19,122 @@ sockaddr_in CreateIPv4Address(const string& ip, int port) {
     return address;
 }
 
+sockaddr_in6 CreateIPv6Address(const string& ip, int port) {
+    sockaddr_in6 address = {};
+    address.sin6_family = AF_INET6;
+    address.sin6_port = htons(port);
+    if (ip.empty()) {
+        address.sin6_addr = in6addr_any;
+    } else {
+        InetPtonA(AF_INET6, ip.c_str(), &address.sin6_addr);
+    }
+    return address;
+}
+
+bool ParseEndpoint(const string& text, SocketEndpoint& endpoint) {
+    endpoint = SocketEndpoint();
+    if (text.rfind("unix:", 0) == 0) {
+        endpoint.family = AF_UNIX;
+        endpoint.host = text.substr(5);
+        return !endpoint.host.empty();
+    }
+
+    size_t portSeparator = text.rfind(':');
+    if (portSeparator == string::npos || portSeparator + 1 == text.length()) {
+        return false;
+    }
+    string host = text.substr(0, portSeparator);
+    if (!host.empty() && host.front() == '[') {
+        if (host.back() != ']') {
+            return false;
+        }
+        endpoint.family = AF_INET6;
+        host = host.substr(1, host.length() - 2);
+        if (host == "::") {
+            host.clear();
+        }
+    } else if (host.find(':') != string::npos) {
+        return false;
+    }
+    endpoint.host = host;
+
+    char* end = nullptr;
+    long port = strtol(text.c_str() + portSeparator + 1, &end, 10);
+    if (*end != '\0' || port < 0 || port > 65535) {
+        return false;
+    }
+    endpoint.port = static_cast<int>(port);
+    return true;
+}
+
+string FormatEndpoint(const SocketEndpoint& endpoint) {
+    if (endpoint.family == AF_UNIX) {
+        return "unix:" + endpoint.host;
+    }
+    if (endpoint.family == AF_INET6) {
+        return "[" + (endpoint.host.empty() ? string("::") : endpoint.host) + "]:" + to_string(endpoint.port);
+    }
+    return (endpoint.host.empty() ? string("0.0.0.0") : endpoint.host) + ":" + to_string(endpoint.port);
+}
 
+SocketEndpoint EndpointForHost(const string& host, int port) {
+    SocketEndpoint endpoint;
+    endpoint.port = port;
+    if (host.rfind("unix:", 0) == 0) {
+        endpoint.family = AF_UNIX;
+        endpoint.host = host.substr(5);
+    } else if (host.find(':') != string::npos) {
+        endpoint.family = AF_INET6;
+        endpoint.host = host.front() == '[' && host.back() == ']' ? host.substr(1, host.length() - 2) : host;
+    } else {
+        endpoint.host = host;
+    }
+    return endpoint;
+}
+
+SOCKET CreateStreamSocket(const SocketEndpoint& endpoint) {
+    return socket(endpoint.family, SOCK_STREAM, endpoint.family == AF_UNIX ? 0 : IPPROTO_TCP);
+}
+
+int CreateEndpointAddress(const SocketEndpoint& endpoint, sockaddr_storage& address) {
+    address = {};
+    if (endpoint.family == AF_UNIX) {
+        sockaddr_un& local = reinterpret_cast<sockaddr_un&>(address);
+        if (endpoint.host.empty() || endpoint.host.length() >= sizeof(local.sun_path)) {
+            return 0;
+        }
+        local.sun_family = AF_UNIX;
+        memcpy(local.sun_path, endpoint.host.c_str(), endpoint.host.length() + 1);
+        return static_cast<int>(sizeof(sockaddr_un));
+    }
+    if (endpoint.family == AF_INET6) {
+        sockaddr_in6& ipv6 = reinterpret_cast<sockaddr_in6&>(address);
+        ipv6 = CreateIPv6Address("", endpoint.port);
+        if (!endpoint.host.empty() && InetPtonA(AF_INET6, endpoint.host.c_str(), &ipv6.sin6_addr) != 1) {
+            return 0;
+        }
+        return static_cast<int>(sizeof(sockaddr_in6));
+    }
+    sockaddr_in& ipv4 = reinterpret_cast<sockaddr_in&>(address);
+    ipv4 = CreateIPv4Address("", endpoint.port);
+    if (!endpoint.host.empty() && InetPtonA(AF_INET, endpoint.host.c_str(), &ipv4.sin_addr) != 1) {
+        return 0;
+    }
+    return static_cast<int>(sizeof(sockaddr_in));
+}
+
+bool IsLoopbackEndpoint(const SocketEndpoint& endpoint) {
+    if (endpoint.family == AF_UNIX) {
+        return true;
+    }
+    sockaddr_storage address;
+    if (endpoint.host.empty() || CreateEndpointAddress(endpoint, address) == 0) {
+        return false;
+    }
+    if (endpoint.family == AF_INET6) {
+        const in6_addr& ipv6 = reinterpret_cast<const sockaddr_in6&>(address).sin6_addr;
+        return memcmp(&ipv6, &in6addr_loopback, sizeof(ipv6)) == 0;
+    }
+    const uint8_t* ipv4 = reinterpret_cast<const uint8_t*>(&reinterpret_cast<const sockaddr_in&>(address).sin_addr);
+    return ipv4[0] == 127;
+}
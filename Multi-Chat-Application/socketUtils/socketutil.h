@@ -6,6 +6,7 @@
 #include <string>
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <afunix.h>
 #include <thread>
 #include <vector>
 #include <mutex>
@@ -21,4 +22,32 @@ SOCKET CreateTCPIPv4Socket();
 
 sockaddr_in CreateIPv4Address(const string& ip, int port);
 
+sockaddr_in6 CreateIPv6Address(const string& ip, int port);
+
+// A place to listen on or connect to: an IPv4 or IPv6 address and port, or the path of
+// a Unix domain socket. Local bots and gateways use the latter to skip the TCP stack.
+struct SocketEndpoint {
+    int family = AF_INET;  // AF_INET, AF_INET6 or AF_UNIX
+    string host;           // IP address (empty: any), or the socket path for AF_UNIX
+    int port = 0;
+};
+
+// Endpoints are written 127.0.0.1:8580, :8580 (any IPv4 address), [::1]:8580,
+// [::]:8580 (any IPv6 address) or unix:<path>.
+bool ParseEndpoint(const string& text, SocketEndpoint& endpoint);
+string FormatEndpoint(const SocketEndpoint& endpoint);
+
+// A host as a client names it: an IPv4 address, an IPv6 address or unix:<path>.
+SocketEndpoint EndpointForHost(const string& host, int port);
+
+// A stream socket of the endpoint's family: TCP for IP endpoints.
+SOCKET CreateStreamSocket(const SocketEndpoint& endpoint);
+
+// Fills address for the endpoint and returns its length, or 0 if the host is invalid.
+int CreateEndpointAddress(const SocketEndpoint& endpoint, sockaddr_storage& address);
+
+// True for unix: endpoints and loopback addresses, which only this machine can reach.
+// Wildcard addresses are not loopback: they take connections from anywhere.
+bool IsLoopbackEndpoint(const SocketEndpoint& endpoint);
+
 #endif //SOCKETUTIL_SOCKETUTIL_H
\ No newline at end of file